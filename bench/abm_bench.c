@@ -0,0 +1,90 @@
+// Agent-based engine stepping benchmark.
+//
+// Builds a town of the given size from dat/town.dat, seeds an outbreak and
+// times the first days of it for several thread counts.  Prints memory use
+// per agent, and the number of infected at the end of each run, which
+// should not depend on the number of threads.
+//
+// Build from the repository root with:
+//   gcc -std=c99 -O2 -pthread -o abm_bench bench/abm_bench.c -lm
+// Usage:
+//   abm_bench [n_agents] [max_threads]
+
+#include "../src/epi_lib/single_source.c"
+
+#include <time.h>
+
+#define BENCH_SEED 12345
+#define BENCH_DAYS 100
+#define BENCH_INITIAL 100
+
+static double wall_time(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+// Bytes of agent, household and workplace data
+static double abm_bytes(const Abm *abm) {
+  size_t n_workers = abm->workplace_start[abm->n_workplaces];
+  return (double)abm->n_agents * (2 * sizeof(uint8) + sizeof(uint32)) +
+    (double)(abm->n_households + 1) * sizeof(uint32) +
+    (double)(abm->n_workplaces + 1) * sizeof(uint32) +
+    (double)n_workers * sizeof(uint32) +
+    (double)abm->n_workplaces * sizeof(float) +
+    (double)abm->n_tasks * sizeof(AbmTally);
+}
+
+int main(int argc, char **argv) {
+  uint64 n_agents = argc > 1 ? (uint64)atoll(argv[1]) : 1000000;
+  size_t max_threads = argc > 2 ? (size_t)atol(argv[2]) : available_cpus();
+  if (n_agents == 0 || n_agents > ABM_MAX_AGENTS || max_threads == 0) {
+    fprintf(stderr, "usage: abm_bench [n_agents] [max_threads]\n");
+    return 1;
+  }
+
+  Disease *dis = NULL;
+  Population *base = NULL;
+  if (create_disease_from_file(&dis, "dat/disease.dat") !=
+    EPI_ERROR_SUCCESS ||
+    create_pop_from_file(&base, "dat/town.dat", dis->max_duration) !=
+    EPI_ERROR_SUCCESS) {
+    fprintf(stderr, "run from the repository root\n");
+    return 1;
+  }
+  base->n_total = n_agents;
+  base->n_susceptible = n_agents;
+
+  printf("%llu agents, %d days\n", (unsigned long long)n_agents, BENCH_DAYS);
+  printf("%8s %12s %14s %12s\n", "threads", "ms/step", "bytes/agent",
+    "infected");
+
+  for (size_t n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+    Abm *abm = NULL;
+    if (create_abm(&abm, base, dis, "dat/town.dat", BENCH_SEED, n_threads) !=
+      EPI_ERROR_SUCCESS) {
+      fprintf(stderr, "failed to create agents\n");
+      return 1;
+    }
+    infect_abm(abm, BENCH_INITIAL);
+
+    double t0 = wall_time();
+    for (int d = 0; d < BENCH_DAYS; d++) {
+      if (evolve_abm(abm, false) != EPI_ERROR_SUCCESS) {
+        fprintf(stderr, "step failed\n");
+        return 1;
+      }
+    }
+    double t = wall_time() - t0;
+
+    printf("%8zu %12.3f %14.2f %12llu\n", n_threads, 1e3 * t / BENCH_DAYS,
+      abm_bytes(abm) / (double)n_agents,
+      (unsigned long long)(abm->summary.n_infected +
+      abm->summary.n_recovered + abm->summary.n_dead));
+    free_abm(&abm);
+  }
+
+  free_pop(&base);
+  free_disease(&dis);
+  return 0;
+}
@@ -0,0 +1,404 @@
+// End-to-end throughput benchmark of the compartment engine.
+//
+// Runs whole episodes the way the reinforcement learning environment does,
+// resetting one model for each episode and stepping it day by day with no
+// control measures, reading the observations after every step, until the
+// episode finishes.  Three scenarios are timed:
+//   default     - outbreak on day 0, vaccine on day 550, run to eradication
+//   no_outbreak - control case of environment.env: no outbreak, 1000 days
+//   random_mix  - episodes drawn like environment.env.reset: no outbreak
+//                 half of the time, outbreak on days 0-300 otherwise, and
+//                 vaccine 400-700 days after the outbreak
+// For each, prints simulated days per second and the distribution of
+// episode latency, including the reset.  With --json, prints the results as
+// a single JSON object instead, for tracking regressions.
+//
+// With --advance, episodes skip quiet days with
+// epi_model_advance_until_event instead of stepping through them, and days
+// per second count the skipped days.
+//
+// If the library is built with EPI_PROFILE, also prints the time spent in
+// each phase of a step and the number of draws by sampling method, and
+// --trace writes a Chrome trace of the first timed phases.
+//
+// Build with CMake (see CMakeLists.txt), which links against epi_lib, or
+// from the repository root with:
+//   gcc -std=c99 -O2 -pthread -Isrc/epi_lib -o epi_bench bench/epi_bench.c
+//     src/epi_lib/single_source.c -lm
+// Usage:
+//   epi_bench [--json] [--advance] [--episodes n] [--seed s] [--data dir]
+//     [--trace fname]
+
+#include "batch.h"
+
+#include <time.h>
+
+#ifndef EPI_BENCH_DATA_DIR
+#define EPI_BENCH_DATA_DIR "dat"
+#endif
+
+#ifndef EPI_BENCH_BUILD
+#define EPI_BENCH_BUILD "unknown"
+#endif
+
+#define BENCH_EPISODES 200
+#define BENCH_WARMUP 5
+#define BENCH_SEED 12345
+#define BENCH_PATH_SIZE 4096
+// Timed phases kept for --trace
+#define BENCH_TRACE_EVENTS 1000000
+
+typedef enum {
+  BENCH_DEFAULT,
+  BENCH_NO_OUTBREAK,
+  BENCH_RANDOM_MIX,
+  N_BENCH_SCENARIOS
+} BenchScenario;
+
+static const char *scenario_names[N_BENCH_SCENARIOS] =
+  {"default", "no_outbreak", "random_mix"};
+
+static const char *phase_names[N_EPI_PHASES] = {"step", "vaccination",
+  "transitions", "infection_rate", "infection", "observables", "recording"};
+
+// Timings of one scenario
+typedef struct {
+  size_t n_episodes;
+  uint64 n_days;
+  double seconds;
+  // Episode latency in seconds, sorted
+  double *latency;
+  // Work done in the timed episodes, for profiling builds
+  EpiProfile profile;
+} BenchResult;
+
+static double wall_time(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// Value at quantile q of n sorted values
+static double sorted_quantile(const double *x, size_t n, double q) {
+  size_t i = (size_t)(q * (double)(n - 1) + 0.5);
+  return x[i];
+}
+
+// Work done between two profiles of the same model
+static void profile_difference(EpiProfile *out, const EpiProfile *before,
+  const EpiProfile *after) {
+
+  *out = *after;
+  out->n_steps -= before->n_steps;
+  out->n_poisson_draws -= before->n_poisson_draws;
+  out->n_gaussian_draws -= before->n_gaussian_draws;
+  out->n_monte_carlo_draws -= before->n_monte_carlo_draws;
+  out->n_poisson_retries -= before->n_poisson_retries;
+  out->n_gaussian_retries -= before->n_gaussian_retries;
+  for (int p = 0; p < N_EPI_PHASES; p++) {
+    out->phase_ticks[p] -= before->phase_ticks[p];
+    out->phase_calls[p] -= before->phase_calls[p];
+  }
+}
+
+// Mean time in ns per step spent in a phase
+static double phase_ns_per_step(const EpiProfile *prof, EpiPhase phase) {
+  if (prof->n_steps == 0 || prof->ticks_per_second <= 0.0) {
+    return 0.0;
+  }
+  return 1e9 * (double)prof->phase_ticks[phase] / prof->ticks_per_second /
+    (double)prof->n_steps;
+}
+
+// Scenario of episode i
+static void bench_episode(EpiScenario *out, const EpiBatchConfig *config,
+  BenchScenario which, uint64 seed, size_t i) {
+
+  EpiRng rng;
+  rng_seed(&rng, rng_hash(seed, i));
+
+  if (which == BENCH_RANDOM_MIX) {
+    draw_episode(out, config, &rng);
+    return;
+  }
+
+  *out = config->scenario;
+  out->seed = rng_next(&rng);
+  if (which == BENCH_NO_OUTBREAK) {
+    out->t_initial = -1;
+    out->t_max = config->no_outbreak_days;
+  }
+}
+
+// Reset the model to a scenario and step it to the end of the episode,
+// like environment.env, skipping quiet days at once if advance.  Writes the
+// number of days stepped.
+static EpiError run_episode(uint64 *n_days, EpiModel model,
+  const EpiScenario *scenario, bool advance) {
+
+  PASS_ERROR(epi_reset_model(model, scenario));
+
+  EpiInput input;
+  memset(&input, 0, sizeof(EpiInput));
+  EpiObservable obs;
+  float rl_obs[N_EPI_OBSERVATIONS];
+  PASS_ERROR(epi_get_observables(&obs, model));
+
+  *n_days = 0;
+  while (!obs.finished) {
+    size_t n = 1;
+    if (advance) {
+      double cost;
+      PASS_ERROR(epi_model_advance_until_event(&n, &cost, model, &input,
+        (size_t)-1));
+    } else {
+      PASS_ERROR(epi_model_step(model, &input));
+    }
+    PASS_ERROR(epi_get_observables(&obs, model));
+    PASS_ERROR(epi_rl_observation(rl_obs, &obs));
+    *n_days += n;
+  }
+  return EPI_ERROR_SUCCESS;
+}
+
+static EpiError run_scenario(BenchResult *out, EpiModel model,
+  const EpiBatchConfig *config, BenchScenario which, size_t n_episodes,
+  uint64 seed, bool advance) {
+
+  out->n_episodes = n_episodes;
+  out->n_days = 0;
+  out->seconds = 0.0;
+  out->latency = (double *)malloc(n_episodes * sizeof(double));
+  if (out->latency == NULL) {
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+
+  // Warm up caches and branch predictors on episodes that are not timed
+  EpiScenario scenario;
+  uint64 n_days;
+  for (size_t i = 0; i < BENCH_WARMUP; i++) {
+    bench_episode(&scenario, config, which, seed, n_episodes + i);
+    PASS_ERROR(run_episode(&n_days, model, &scenario, advance));
+  }
+
+  EpiProfile before;
+  PASS_ERROR(epi_get_profile(&before, model));
+
+  for (size_t i = 0; i < n_episodes; i++) {
+    bench_episode(&scenario, config, which, seed, i);
+    double t0 = wall_time();
+    PASS_ERROR(run_episode(&n_days, model, &scenario, advance));
+    double t = wall_time() - t0;
+    out->latency[i] = t;
+    out->seconds += t;
+    out->n_days += n_days;
+  }
+
+  EpiProfile after;
+  PASS_ERROR(epi_get_profile(&after, model));
+  profile_difference(&out->profile, &before, &after);
+
+  qsort(out->latency, n_episodes, sizeof(double), compare_doubles);
+  return EPI_ERROR_SUCCESS;
+}
+
+static void print_text(const BenchResult *results, double construct_time,
+  bool advance) {
+  printf("epi_bench (%s build%s), model construction %.2f ms\n",
+    EPI_BENCH_BUILD, advance ? ", advance" : "", 1e3 * construct_time);
+  printf("%-12s %9s %10s %12s %10s %10s %10s %10s\n", "scenario",
+    "episodes", "days/ep", "days/s", "mean ms", "p50 ms", "p99 ms",
+    "max ms");
+  for (int s = 0; s < N_BENCH_SCENARIOS; s++) {
+    const BenchResult *r = &results[s];
+    size_t n = r->n_episodes;
+    printf("%-12s %9zu %10.1f %12.0f %10.3f %10.3f %10.3f %10.3f\n",
+      scenario_names[s], n, (double)r->n_days / (double)n,
+      (double)r->n_days / r->seconds, 1e3 * r->seconds / (double)n,
+      1e3 * sorted_quantile(r->latency, n, 0.5),
+      1e3 * sorted_quantile(r->latency, n, 0.99),
+      1e3 * r->latency[n - 1]);
+  }
+
+  if (!results[0].profile.enabled) {
+    return;
+  }
+
+  printf("\nns per step by phase, and draws per step by method\n");
+  printf("%-12s", "scenario");
+  for (int p = 0; p < N_EPI_PHASES; p++) {
+    printf(" %*s", p == EPI_PHASE_INFECTION_RATE ? 14 : 11, phase_names[p]);
+  }
+  printf(" %9s %9s %9s\n", "poisson", "gaussian", "monte_c");
+  for (int s = 0; s < N_BENCH_SCENARIOS; s++) {
+    const EpiProfile *prof = &results[s].profile;
+    double n_steps = prof->n_steps > 0 ? (double)prof->n_steps : 1.0;
+    printf("%-12s", scenario_names[s]);
+    for (int p = 0; p < N_EPI_PHASES; p++) {
+      printf(" %*.1f", p == EPI_PHASE_INFECTION_RATE ? 14 : 11,
+        phase_ns_per_step(prof, (EpiPhase)p));
+    }
+    printf(" %9.2f %9.2f %9.2f\n", (double)prof->n_poisson_draws / n_steps,
+      (double)prof->n_gaussian_draws / n_steps,
+      (double)prof->n_monte_carlo_draws / n_steps);
+  }
+}
+
+static void print_json(const BenchResult *results, double construct_time,
+  uint64 seed, bool advance) {
+
+  printf("{\n");
+  printf("  \"benchmark\": \"epi_bench\",\n");
+  printf("  \"build\": \"%s\",\n", EPI_BENCH_BUILD);
+  printf("  \"seed\": %llu,\n", (unsigned long long)seed);
+  printf("  \"advance\": %s,\n", advance ? "true" : "false");
+  printf("  \"construct_ms\": %.4f,\n", 1e3 * construct_time);
+  printf("  \"scenarios\": [\n");
+  for (int s = 0; s < N_BENCH_SCENARIOS; s++) {
+    const BenchResult *r = &results[s];
+    size_t n = r->n_episodes;
+    printf("    {\n");
+    printf("      \"name\": \"%s\",\n", scenario_names[s]);
+    printf("      \"episodes\": %zu,\n", n);
+    printf("      \"days\": %llu,\n", (unsigned long long)r->n_days);
+    printf("      \"seconds\": %.6f,\n", r->seconds);
+    printf("      \"days_per_sec\": %.1f,\n",
+      (double)r->n_days / r->seconds);
+    printf("      \"episode_ms\": {\"mean\": %.4f, \"min\": %.4f, "
+      "\"p50\": %.4f, \"p90\": %.4f, \"p99\": %.4f, \"max\": %.4f}",
+      1e3 * r->seconds / (double)n, 1e3 * r->latency[0],
+      1e3 * sorted_quantile(r->latency, n, 0.5),
+      1e3 * sorted_quantile(r->latency, n, 0.9),
+      1e3 * sorted_quantile(r->latency, n, 0.99),
+      1e3 * r->latency[n - 1]);
+    if (r->profile.enabled) {
+      const EpiProfile *prof = &r->profile;
+      printf(",\n      \"profile\": {\n");
+      printf("        \"steps\": %llu,\n",
+        (unsigned long long)prof->n_steps);
+      printf("        \"draws\": {\"poisson\": %llu, \"gaussian\": %llu, "
+        "\"monte_carlo\": %llu},\n",
+        (unsigned long long)prof->n_poisson_draws,
+        (unsigned long long)prof->n_gaussian_draws,
+        (unsigned long long)prof->n_monte_carlo_draws);
+      printf("        \"retries\": {\"poisson\": %llu, "
+        "\"gaussian\": %llu},\n",
+        (unsigned long long)prof->n_poisson_retries,
+        (unsigned long long)prof->n_gaussian_retries);
+      printf("        \"ns_per_step\": {");
+      for (int p = 0; p < N_EPI_PHASES; p++) {
+        printf("%s\"%s\": %.1f", p > 0 ? ", " : "", phase_names[p],
+          phase_ns_per_step(prof, (EpiPhase)p));
+      }
+      printf("}\n");
+      printf("      }");
+    }
+    printf("\n");
+    printf("    }%s\n", s + 1 < N_BENCH_SCENARIOS ? "," : "");
+  }
+  printf("  ]\n");
+  printf("}\n");
+}
+
+int main(int argc, char **argv) {
+  bool json = false;
+  bool advance = false;
+  size_t n_episodes = BENCH_EPISODES;
+  uint64 seed = BENCH_SEED;
+  const char *data_dir = EPI_BENCH_DATA_DIR;
+  const char *trace_fname = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--json") == 0) {
+      json = true;
+    } else if (strcmp(argv[i], "--advance") == 0) {
+      advance = true;
+    } else if (strcmp(argv[i], "--episodes") == 0 && i + 1 < argc) {
+      n_episodes = (size_t)atol(argv[++i]);
+    } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+      seed = (uint64)strtoull(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--data") == 0 && i + 1 < argc) {
+      data_dir = argv[++i];
+    } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+      trace_fname = argv[++i];
+    } else {
+      n_episodes = 0;
+      break;
+    }
+  }
+  if (n_episodes == 0) {
+    fprintf(stderr,
+      "usage: epi_bench [--json] [--advance] [--episodes n] [--seed s] "
+      "[--data dir] [--trace fname]\n");
+    return 1;
+  }
+
+  char dis_fname[BENCH_PATH_SIZE];
+  char pop_fname[BENCH_PATH_SIZE];
+  snprintf(dis_fname, BENCH_PATH_SIZE, "%s/disease.dat", data_dir);
+  snprintf(pop_fname, BENCH_PATH_SIZE, "%s/population.dat", data_dir);
+
+  // Same as environment.env and epi_model.EpiScenario
+  EpiBatchConfig config;
+  memset(&config, 0, sizeof(EpiBatchConfig));
+  config.scenario.t_initial = 0;
+  config.scenario.n_initial = 10;
+  config.scenario.t_vaccine = 550;
+  config.scenario.t_max = -1;
+  config.scenario.dis_fname = dis_fname;
+  config.scenario.pop_fname = pop_fname;
+  config.scenario.sampler = EPI_SAMPLER_APPROX;
+  config.scenario.engine = EPI_ENGINE_COMPARTMENT;
+  config.scenario.n_threads = 1;
+  config.p_no_outbreak = 0.5f;
+  config.no_outbreak_days = 1000;
+  config.t_initial_min = 0;
+  config.t_initial_max = 300;
+  config.vaccine_delay_min = 400;
+  config.vaccine_delay_max = 700;
+
+  // Constructed once, and reset for every episode, like environment.env
+  EpiModel model = NULL;
+  double t0 = wall_time();
+  EpiError err = epi_construct_model(&model, &config.scenario);
+  double construct_time = wall_time() - t0;
+  if (err == EPI_ERROR_SUCCESS && trace_fname != NULL) {
+    err = epi_start_trace(model, BENCH_TRACE_EVENTS);
+  }
+
+  BenchResult results[N_BENCH_SCENARIOS];
+  memset(results, 0, sizeof(results));
+  for (int s = 0; s < N_BENCH_SCENARIOS && err == EPI_ERROR_SUCCESS; s++) {
+    err = run_scenario(&results[s], model, &config, (BenchScenario)s,
+      n_episodes, seed, advance);
+  }
+
+  if (err == EPI_ERROR_SUCCESS && trace_fname != NULL) {
+    err = epi_write_trace(model, trace_fname);
+  }
+
+  if (err == EPI_ERROR_SUCCESS) {
+    if (json) {
+      print_json(results, construct_time, seed, advance);
+    } else {
+      print_text(results, construct_time, advance);
+    }
+  } else {
+    EpiErrorInfo info;
+    epi_last_error(&info);
+    fprintf(stderr, "epi_bench: error %d: %s %s\n", (int)err, info.fname,
+      info.message);
+  }
+
+  for (int s = 0; s < N_BENCH_SCENARIOS; s++) {
+    free(results[s].latency);
+  }
+  epi_free_model(&model);
+  return err == EPI_ERROR_SUCCESS ? 0 : 1;
+}
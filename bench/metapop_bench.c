@@ -0,0 +1,123 @@
+// Metapopulation stepping benchmark.
+//
+// Builds a synthetic country of many regions, each with travel to a few
+// random other regions, and times a full epidemic for several thread
+// counts.  The death toll is printed for each run, and should not depend
+// on the number of threads.
+//
+// Build from the repository root with:
+//   gcc -std=c99 -O2 -pthread -o metapop_bench bench/metapop_bench.c -lm
+// Usage:
+//   metapop_bench [n_regions] [edges_per_region] [max_threads]
+
+#include "../src/epi_lib/single_source.c"
+
+#include <time.h>
+
+#define BENCH_SEED 12345
+#define BENCH_DAYS 200
+
+static double wall_time(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+// Random region sizes, spread over a few orders of magnitude, and random
+// travel between regions
+static EpiError bench_metapop(MetaPop **out, const Disease *dis,
+  const Population *base, size_t n_regions, size_t edges_per_region,
+  size_t n_threads) {
+
+  size_t n_edges = n_regions * edges_per_region;
+  uint64 *n_total = (uint64 *)malloc(2 * n_regions * sizeof(uint64));
+  size_t *from = (size_t *)malloc(2 * n_edges * sizeof(size_t));
+  float *fraction = (float *)malloc(n_edges * sizeof(float));
+  if (n_total == NULL || from == NULL || fraction == NULL) {
+    free(n_total);
+    free(from);
+    free(fraction);
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+  uint64 *n_beds = &n_total[n_regions];
+  size_t *to = &from[n_edges];
+
+  EpiRng rng;
+  rng_seed(&rng, BENCH_SEED);
+  for (size_t i = 0; i < n_regions; i++) {
+    n_total[i] = (uint64)(1e4 * exp(6.0 * rng_uniform(&rng)));
+    n_beds[i] = n_total[i] / 1000;
+    for (size_t k = 0; k < edges_per_region; k++) {
+      size_t e = i * edges_per_region + k;
+      size_t j = (size_t)(rng_uniform(&rng) * (double)(n_regions - 1));
+      from[e] = i;
+      to[e] = j >= i ? j + 1 : j;
+      fraction[e] = (float)(0.02 * rng_uniform(&rng));
+    }
+  }
+
+  EpiError err = create_metapop(out, dis, base, n_regions, n_total, n_beds,
+    n_edges, from, to, fraction, EPI_SAMPLER_APPROX, BENCH_SEED, n_threads);
+  free(n_total);
+  free(from);
+  free(fraction);
+  return err;
+}
+
+int main(int argc, char **argv) {
+  size_t n_regions = argc > 1 ? (size_t)atol(argv[1]) : 3000;
+  size_t edges_per_region = argc > 2 ? (size_t)atol(argv[2]) : 10;
+  size_t max_threads = argc > 3 ? (size_t)atol(argv[3]) : available_cpus();
+  if (n_regions < 2 || max_threads == 0) {
+    fprintf(stderr, "usage: metapop_bench [n_regions] [edges_per_region] "
+      "[max_threads]\n");
+    return 1;
+  }
+
+  Disease *dis = NULL;
+  Population *base = NULL;
+  if (create_disease_from_file(&dis, "dat/disease.dat") !=
+    EPI_ERROR_SUCCESS ||
+    create_pop_from_file(&base, "dat/population.dat", dis->max_duration) !=
+    EPI_ERROR_SUCCESS) {
+    fprintf(stderr, "run from the repository root\n");
+    return 1;
+  }
+
+  printf("%zu regions, %zu edges per region, %d days\n",
+    n_regions, edges_per_region, BENCH_DAYS);
+  printf("%8s %12s %12s %14s\n", "threads", "steps/s", "regions/s", "dead");
+
+  EpiInput *policies = (EpiInput *)calloc(n_regions, sizeof(EpiInput));
+  for (size_t n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+    MetaPop *mp = NULL;
+    if (policies == NULL || bench_metapop(&mp, dis, base, n_regions,
+      edges_per_region, n_threads) != EPI_ERROR_SUCCESS) {
+      fprintf(stderr, "failed to create metapopulation\n");
+      return 1;
+    }
+    infect_pop(mp->regions[0], 100);
+
+    double t0 = wall_time();
+    for (int d = 0; d < BENCH_DAYS; d++) {
+      if (evolve_metapop(mp, policies, false) != EPI_ERROR_SUCCESS) {
+        fprintf(stderr, "step failed\n");
+        return 1;
+      }
+    }
+    double t = wall_time() - t0;
+
+    uint64 n_dead = 0;
+    for (size_t i = 0; i < n_regions; i++) {
+      n_dead += mp->regions[i]->n_dead;
+    }
+    printf("%8zu %12.1f %12.3e %14llu\n", n_threads, BENCH_DAYS / t,
+      BENCH_DAYS * (double)n_regions / t, (unsigned long long)n_dead);
+    free_metapop(&mp);
+  }
+
+  free(policies);
+  free_pop(&base);
+  free_disease(&dis);
+  return 0;
+}
@@ -0,0 +1,436 @@
+// Sampler micro-benchmark and statistical accuracy harness.
+//
+// Sweeps the (n, p) grid hit by the disease model and, for each sampler,
+// reports the cost per draw and how far the sampled distribution is from
+// the exact binomial (or Poisson) distribution.  The *_batch samplers go
+// through sample_dbin_batch(), as the disease model does, drawing
+// BENCH_BATCH lanes at a time and timing the cost per lane:
+//   mean_z   - deviation of the sample mean from n * p, in standard errors
+//   var_rat  - ratio of sample variance to n * p * (1 - p)
+//   chi2_p   - p-value of a chi-square goodness of fit test
+//   ks_d     - Kolmogorov-Smirnov distance between sample and exact CDF
+//   ks_p     - asymptotic p-value of the KS distance
+//
+// Build from the repository root with the single command:
+//   gcc -std=c99 -O3 -fno-math-errno -fno-trapping-math -pthread
+//     -o sampler_bench bench/sampler_bench.c -lm
+// Usage:
+//   sampler_bench [n_draws] [seed]
+
+#include "../src/epi_lib/single_source.c"
+
+#include <time.h>
+
+// Minimum expected count per bin in the chi-square test
+#define CHI2_MIN_EXPECTED 5.0
+
+// Width of the tabulated distribution, in standard deviations each side
+#define TABLE_WIDTH 12.0
+
+// Lanes per call to sample_dbin_batch()
+#define BENCH_BATCH 256
+
+typedef enum {
+  BENCH_APPROX_BIN,
+  BENCH_EXACT_BIN,
+  BENCH_APPROX_DBIN,
+  BENCH_EXACT_DBIN,
+  BENCH_APPROX_DBIN_BATCH,
+  BENCH_EXACT_DBIN_BATCH,
+  BENCH_POISSON,
+  N_BENCH
+} BenchSampler;
+
+static const char *bench_names[N_BENCH] =
+  {"approx_bin", "exact_bin", "approx_dbin", "exact_dbin",
+   "approx_dbin_batch", "exact_dbin_batch", "poisson"};
+
+// Results of the last batched draw, handed out one lane at a time
+typedef struct {
+  uint64 nx[BENCH_BATCH];
+  uint64 ny[BENCH_BATCH];
+  float p_x[BENCH_BATCH];
+  float p_y[BENCH_BATCH];
+  uint64 n[BENCH_BATCH];
+  size_t next;
+} BenchBatch;
+
+// Exact distribution, tabulated on [lo, lo + size)
+typedef struct {
+  uint64 lo;
+  size_t size;
+  double *pmf;
+  double *cdf;
+  double mean;
+  double var;
+} Table;
+
+// Written by the timing loop so that its draws are not optimized away
+static volatile uint64 bench_sink;
+
+static double now_seconds(void) {
+  return (double)clock() / (double)CLOCKS_PER_SEC;
+}
+
+// Sampling regime used by approx_bin_draw() for this (n, p)
+static const char *approx_regime(double p, uint64 n) {
+  double q = p > 0.5 ? 1.0 - p : p;
+  double ev = q * (double)n;
+  if (ev == 0.0) {
+    return "zero";
+  }
+  if (q <= POISSON_CUTOFF) {
+    return "poisson";
+  }
+  if (sqrt(ev * (1.0 - q)) <= ev * GAUSSIAN_CUTOFF) {
+    return "gaussian";
+  }
+  return "monte_carlo";
+}
+
+// Log of probability mass function
+static double log_pmf(BenchSampler s, uint64 k, double p, uint64 n) {
+  double kd = (double)k;
+  if (s == BENCH_POISSON) {
+    double rate = p * (double)n;
+    return kd * log(rate) - rate - lgamma(kd + 1.0);
+  }
+  double nd = (double)n;
+  return lgamma(nd + 1.0) - lgamma(kd + 1.0) - lgamma(nd - kd + 1.0)
+    + kd * log(p) + (nd - kd) * log1p(-p);
+}
+
+static int make_table(Table *t, BenchSampler s, double p, uint64 n) {
+  t->mean = p * (double)n;
+  t->var = s == BENCH_POISSON ? t->mean : t->mean * (1.0 - p);
+
+  double sd = sqrt(t->var);
+  double lo = floor(t->mean - TABLE_WIDTH * sd - 10.0);
+  double hi = ceil(t->mean + TABLE_WIDTH * sd + 10.0);
+  if (lo < 0.0) {
+    lo = 0.0;
+  }
+  if (s != BENCH_POISSON && hi > (double)n) {
+    hi = (double)n;
+  }
+
+  t->lo = (uint64)lo;
+  t->size = (size_t)(hi - lo) + 1;
+  t->pmf = (double *)malloc(t->size * sizeof(double));
+  t->cdf = (double *)malloc(t->size * sizeof(double));
+  if (t->pmf == NULL || t->cdf == NULL) {
+    free(t->pmf);
+    free(t->cdf);
+    return 1;
+  }
+
+  double c = 0.0;
+  for (size_t i = 0; i < t->size; i++) {
+    t->pmf[i] = exp(log_pmf(s, t->lo + i, p, n));
+    c += t->pmf[i];
+    t->cdf[i] = c;
+  }
+  return 0;
+}
+
+static void free_table(Table *t) {
+  free(t->pmf);
+  free(t->cdf);
+}
+
+// Regularized upper incomplete gamma function Q(a, x)
+static double gamma_q(double a, double x) {
+  if (x <= 0.0) {
+    return 1.0;
+  }
+  double gln = lgamma(a);
+
+  // Series representation of P(a, x)
+  if (x < a + 1.0) {
+    double ap = a;
+    double sum = 1.0 / a;
+    double del = sum;
+    for (int i = 0; i < 1000; i++) {
+      ap += 1.0;
+      del *= x / ap;
+      sum += del;
+      if (fabs(del) < fabs(sum) * 1e-15) {
+        break;
+      }
+    }
+    return 1.0 - sum * exp(-x + a * log(x) - gln);
+  }
+
+  // Continued fraction representation of Q(a, x)
+  double b = x + 1.0 - a;
+  double c = 1.0 / 1e-300;
+  double d = 1.0 / b;
+  double h = d;
+  for (int i = 1; i < 1000; i++) {
+    double an = -i * (i - a);
+    b += 2.0;
+    d = an * d + b;
+    if (fabs(d) < 1e-300) {
+      d = 1e-300;
+    }
+    c = b + an / c;
+    if (fabs(c) < 1e-300) {
+      c = 1e-300;
+    }
+    d = 1.0 / d;
+    double del = d * c;
+    h *= del;
+    if (fabs(del - 1.0) < 1e-15) {
+      break;
+    }
+  }
+  return exp(-x + a * log(x) - gln) * h;
+}
+
+// Asymptotic Kolmogorov distribution, P(D > d) for sample size m
+static double ks_pvalue(double d, size_t m) {
+  double en = sqrt((double)m);
+  double lambda = (en + 0.12 + 0.11 / en) * d;
+  if (lambda < 0.2) {
+    return 1.0;
+  }
+  double sum = 0.0;
+  double sign = 1.0;
+  for (int j = 1; j <= 100; j++) {
+    double term = sign * exp(-2.0 * j * j * lambda * lambda);
+    sum += term;
+    if (fabs(term) < 1e-12) {
+      break;
+    }
+    sign = -sign;
+  }
+  double pv = 2.0 * sum;
+  return pv < 0.0 ? 0.0 : (pv > 1.0 ? 1.0 : pv);
+}
+
+// Refill the batch with fresh draws of (p / 2, p / 2, n) in every lane
+static EpiError refill_batch(BenchBatch *b, EpiSampler method, double p,
+  uint64 n, EpiRng *rng) {
+  for (size_t i = 0; i < BENCH_BATCH; i++) {
+    b->p_x[i] = 0.5f * (float)p;
+    b->p_y[i] = 0.5f * (float)p;
+    b->n[i] = n;
+  }
+
+  Sampler smp;
+  smp.rng = *rng;
+  smp.method = method;
+  PASS_ERROR(sample_dbin_batch(&smp, b->nx, b->ny, b->p_x, b->p_y, b->n,
+    BENCH_BATCH));
+  *rng = smp.rng;
+  b->next = 0;
+  return EPI_ERROR_SUCCESS;
+}
+
+// One draw with the given sampler.  For the double draws, p is split evenly
+// between outcome x and outcome y, and nx + ny is returned, which has
+// distribution B(n, p).  Batch samplers take the next lane of b, drawing a
+// new batch once it is used up.
+static EpiError draw(BenchSampler s, uint64 *k, double p, uint64 n,
+  BenchBatch *b, EpiRng *rng) {
+  uint64 nx, ny;
+  switch (s) {
+    case BENCH_APPROX_BIN:
+      return approx_bin_draw(k, (float)p, n, rng);
+    case BENCH_EXACT_BIN:
+      return exact_bin_draw(k, p, n, rng);
+    case BENCH_APPROX_DBIN:
+      PASS_ERROR(approx_dbin_draw(&nx, &ny, 0.5f * (float)p, 0.5f * (float)p,
+        n, rng));
+      *k = nx + ny;
+      return EPI_ERROR_SUCCESS;
+    case BENCH_EXACT_DBIN:
+      PASS_ERROR(exact_dbin_draw(&nx, &ny, 0.5f * (float)p, 0.5f * (float)p,
+        n, rng));
+      *k = nx + ny;
+      return EPI_ERROR_SUCCESS;
+    case BENCH_APPROX_DBIN_BATCH:
+    case BENCH_EXACT_DBIN_BATCH:
+      if (b->next == BENCH_BATCH) {
+        PASS_ERROR(refill_batch(b, s == BENCH_APPROX_DBIN_BATCH ?
+          EPI_SAMPLER_APPROX : EPI_SAMPLER_EXACT, p, n, rng));
+      }
+      *k = b->nx[b->next] + b->ny[b->next];
+      b->next++;
+      return EPI_ERROR_SUCCESS;
+    case BENCH_POISSON:
+      return poisson_draw(k, (float)(p * (double)n), rng);
+    default:
+      return EPI_ERROR_INVALID_ARGS;
+  }
+}
+
+static void run_case(BenchSampler s, double p, uint64 n, size_t n_draws,
+  EpiRng *rng) {
+
+  Table t;
+  if (make_table(&t, s, p, n)) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  uint64 *hist = (uint64 *)calloc(t.size, sizeof(uint64));
+  if (hist == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  size_t n_outside = 0;
+  double sum = 0.0;
+  double sum2 = 0.0;
+
+  // Batches are drawn for this (n, p) only
+  static BenchBatch batch;
+  batch.next = BENCH_BATCH;
+
+  // Timing pass, without bookkeeping
+  double t0 = now_seconds();
+  uint64 sink = 0;
+  for (size_t i = 0; i < n_draws; i++) {
+    uint64 k;
+    if (draw(s, &k, p, n, &batch, rng) != EPI_ERROR_SUCCESS) {
+      fprintf(stderr, "%s failed at n = %llu, p = %g\n", bench_names[s],
+        (unsigned long long)n, p);
+      exit(1);
+    }
+    sink += k;
+  }
+  double ns_per_draw = 1e9 * (now_seconds() - t0) / (double)n_draws;
+
+  // Accuracy pass
+  for (size_t i = 0; i < n_draws; i++) {
+    uint64 k;
+    if (draw(s, &k, p, n, &batch, rng) != EPI_ERROR_SUCCESS) {
+      fprintf(stderr, "%s failed at n = %llu, p = %g\n", bench_names[s],
+        (unsigned long long)n, p);
+      exit(1);
+    }
+    double kd = (double)k;
+    sum += kd;
+    sum2 += kd * kd;
+    if (k < t.lo || k - t.lo >= t.size) {
+      n_outside++;
+    } else {
+      hist[k - t.lo]++;
+    }
+  }
+
+  double m = (double)n_draws;
+  double mean = sum / m;
+  double var = sum2 / m - mean * mean;
+  double mean_z = t.var > 0.0 ? (mean - t.mean) / sqrt(t.var / m) : 0.0;
+  double var_ratio = t.var > 0.0 ? var / t.var : 1.0;
+
+  // Chi-square test, merging neighbouring bins until each has enough
+  // expected draws.  Draws outside the table land in the last bin, and a
+  // last bin that is still too small is merged into the one before it.
+  double chi2 = 0.0;
+  size_t dof = 0;
+  double expected = 0.0;
+  double observed = 0.0;
+  double prev_expected = 0.0;
+  double prev_observed = 0.0;
+  for (size_t i = 0; i < t.size; i++) {
+    expected += t.pmf[i] * m;
+    observed += (double)hist[i];
+    if (expected >= CHI2_MIN_EXPECTED) {
+      if (dof > 0) {
+        chi2 += (prev_observed - prev_expected) *
+          (prev_observed - prev_expected) / prev_expected;
+      }
+      prev_expected = expected;
+      prev_observed = observed;
+      dof++;
+      expected = 0.0;
+      observed = 0.0;
+    }
+  }
+  expected += (1.0 - t.cdf[t.size - 1]) * m;
+  observed += (double)n_outside;
+  if (expected >= CHI2_MIN_EXPECTED || dof == 0) {
+    if (dof > 0) {
+      chi2 += (prev_observed - prev_expected) *
+        (prev_observed - prev_expected) / prev_expected;
+    }
+    prev_expected = expected;
+    prev_observed = observed;
+    dof++;
+  } else {
+    prev_expected += expected;
+    prev_observed += observed;
+  }
+  if (prev_expected > 0.0) {
+    chi2 += (prev_observed - prev_expected) *
+      (prev_observed - prev_expected) / prev_expected;
+  }
+  double chi2_p = dof > 1 ? gamma_q(0.5 * (double)(dof - 1), 0.5 * chi2) : 1.0;
+
+  // Kolmogorov-Smirnov distance against the exact CDF
+  double ks_d = 0.0;
+  double c = 0.0;
+  for (size_t i = 0; i < t.size; i++) {
+    c += (double)hist[i] / m;
+    double d = fabs(c - t.cdf[i]);
+    if (d > ks_d) {
+      ks_d = d;
+    }
+  }
+
+  bool approx = s == BENCH_APPROX_BIN || s == BENCH_APPROX_DBIN ||
+    s == BENCH_APPROX_DBIN_BATCH;
+  printf("%-17s %12llu %10.3g %-12s %10.1f %9.2f %8.4f %9.3g %9.3g %9.3g\n",
+    bench_names[s], (unsigned long long)n, p,
+    approx ? approx_regime(p, n) : "-",
+    ns_per_draw, mean_z, var_ratio, chi2_p, ks_d, ks_pvalue(ks_d, n_draws));
+
+  // Keep the timing loop from being optimized away
+  bench_sink += sink;
+
+  free(hist);
+  free_table(&t);
+}
+
+int main(int argc, char **argv) {
+  size_t n_draws = argc > 1 ? (size_t)strtoull(argv[1], NULL, 10) : 100000;
+  uint64 seed = argc > 2 ? strtoull(argv[2], NULL, 10) : 1;
+  if (n_draws == 0) {
+    fprintf(stderr, "usage: %s [n_draws] [seed]\n", argv[0]);
+    return 1;
+  }
+
+  // Population sizes and probabilities hit by the disease model: bins range
+  // from a handful of people up to the whole population, and per-day
+  // probabilities from the infection rate (tiny) to recovery (up to 1)
+  static const uint64 ns[] =
+    {5, 20, 100, 1000, 100000, 10000000, 300000000ULL};
+  static const double ps[] =
+    {1e-9, 1e-7, 1e-5, 1e-3, 0.01, 0.05, 0.1, 0.2, 0.3, 0.5};
+
+  EpiRng rng;
+  rng_seed(&rng, seed);
+
+  printf("# %zu draws per case, seed %llu\n", n_draws,
+    (unsigned long long)seed);
+  printf("%-17s %12s %10s %-12s %10s %9s %8s %9s %9s %9s\n",
+    "sampler", "n", "p", "regime", "ns/draw", "mean_z", "var_rat", "chi2_p",
+    "ks_d", "ks_p");
+
+  for (size_t s = 0; s < N_BENCH; s++) {
+    for (size_t i = 0; i < sizeof(ns) / sizeof(ns[0]); i++) {
+      for (size_t j = 0; j < sizeof(ps) / sizeof(ps[0]); j++) {
+        // Poisson draws are only used for small p, and the distribution
+        // is degenerate when the expected count underflows
+        if (s == BENCH_POISSON && ps[j] > POISSON_CUTOFF) {
+          continue;
+        }
+        run_case((BenchSampler)s, ps[j], ns[i], n_draws, &rng);
+      }
+    }
+  }
+
+  return 0;
+}
@@ -4,23 +4,6 @@ import numpy as np
 
 import epi_model as em
 
-# Get observable information from model output
-def observations(output, n_obs):
-    obs = np.zeros(n_obs, dtype = np.float32)
-    n_total = float(output.n_susceptible + output.n_infected \
-            + output.n_recovered + output.n_vaccinated + output.n_dead)
-    # ratio of susceptible to total
-    obs[0] = float(output.n_susceptible) / n_total
-    # ratio of infected to total
-    obs[1] = float(output.n_infected) / n_total
-    # ratio of dead to total
-    obs[2] = float(output.n_dead) / n_total
-    # ratio of critical to hospital beds
-    obs[3] = float(output.n_critical) / output.hosp_capacity
-    # availability of vaccine
-    obs[4] = float(output.vaccine_available)
-    return obs
-
 class env:
     # Number of observations
     # For now, keep track of:
@@ -46,6 +29,7 @@ class env:
         self.t_vaccine = t_vaccine
 
         self.benchmark = benchmark
+        self.world = None
         self.reset()
 
     # Reset the world
@@ -53,7 +37,6 @@ class env:
     def reset(self):
         if self.benchmark:
             sc = em.EpiScenario()
-            self.world = em.EpiModel(sc)
         else:
             sc = em.EpiScenario()
             # Control case: no outbreak occurs
@@ -68,10 +51,15 @@ class env:
             x = np.random.random()
             sc.t_vaccine = sc.t_initial + \
                 (1.0-x)*self.t_vaccine[0] + x*self.t_vaccine[1]
+
+        # Build the world once, then rewind it without reading data files
+        if self.world is None:
             self.world = em.EpiModel(sc)
+        else:
+            self.world.reset(sc)
 
-        output = self.world.get_observables()
-        obs = observations(output, self.n_obs)
+        obs = np.empty(self.n_obs, dtype = np.float32)
+        self.world.observe(obs)
         return obs
 
     # Step the world forward based on action, generating output
@@ -88,20 +76,44 @@ class env:
         input.dist_home_symp = bool(action & int('0010', 2))
         input.dist_home_all = bool(action & int('0100', 2))
 
-        # Take a one-day step
-        self.world.step(input)
-
-        # Get observations and other info
-        output = self.world.get_observables()
-        obs = observations(output, self.n_obs)
+        # Take a one-day step, and get observations and other info, computed
+        # in the model library
+        obs = np.empty(self.n_obs, dtype = np.float32)
+        output = self.world.step_observe(input, obs)
 
         # Reward: negative of cost function
-        reward = -output.cost_function
+        reward = -float(output["cost_function"])
 
         # done: either maximum time reached, or disease eradicated
-        done = output.finished
+        done = bool(output["finished"])
 
-        # info: just return the output structure, for now
-        info = output
+        # info: a copy of the model output, for now
+        info = output.copy()
 
         return obs, reward, done, info
+
+class vec_env:
+    # Many environments stepped together in C, with the same observations,
+    # actions and scenario randomization as env.  Finished episodes restart
+    # automatically; where done is set, the observation is the first one of
+    # the next episode.
+
+    n_obs = em.N_OBSERVATIONS
+    n_actions = 8
+
+    def __init__(self, n_envs, p_no_outbreak = 0.5, start_day = (0,300),
+            t_vaccine = (400,700), n_threads = 0, seed = None):
+        self.n_envs = n_envs
+        self.world = em.EpiVecEnv(n_envs, p_no_outbreak = p_no_outbreak,
+            start_day = start_day, vaccine_delay = t_vaccine,
+            n_threads = n_threads, seed = seed)
+
+    # Reset every world, returns observations of shape (n_envs, n_obs)
+    def reset(self):
+        return self.world.reset()
+
+    # Step every world forward, one action per world
+    # Returns arrays of observations, rewards and done flags
+    def step(self, actions):
+        assert(np.all(np.asarray(actions) < self.n_actions))
+        return self.world.step(actions)
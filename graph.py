@@ -6,24 +6,26 @@ sc = em.EpiScenario()
 model = em.EpiModel(sc)
 print("  success!")
 
-day = []
-n_susceptible = []
-n_infected = []
-n_recovered = []
-n_dead = []
-n_vaccinated = []
+# No mitigation measures: run the whole scenario in one call
+trajectory = model.run()
+day = trajectory["day"]
+n_susceptible = trajectory["n_susceptible"]
+n_infected = trajectory["n_infected"]
+n_recovered = trajectory["n_recovered"]
+n_dead = trajectory["n_dead"]
+n_vaccinated = trajectory["n_vaccinated"]
 
-input = em.EpiInput()
-output = model.get_observables()
-while not output.finished:
-    model.step(input)
-    output = model.get_observables()
-    day.append(output.day)
-    n_susceptible.append(output.n_susceptible)
-    n_infected.append(output.n_infected)
-    n_recovered.append(output.n_recovered)
-    n_dead.append(output.n_dead)
-    n_vaccinated.append(output.n_vaccinated)
+# Deterministic mean-field trajectory for the same scenario, for comparison
+print("Constructing mean-field model")
+sc_mf = em.EpiScenario()
+sc_mf.mean_field = True
+model_mf = em.EpiModel(sc_mf)
+print("  success!")
+
+trajectory_mf = model_mf.run()
+day_mf = trajectory_mf["day"]
+n_infected_mf = trajectory_mf["n_infected"]
+n_dead_mf = trajectory_mf["n_dead"]
 
 fig, (p1, p2) = plt.subplots(1, 2)
 fig.set_figheight(4)
@@ -38,6 +40,10 @@ p1.plot(day, n_infected, label = "active")
 p1.plot(day, n_recovered, label = "recovered")
 p1.plot(day, n_dead, label = "dead")
 p1.plot(day, n_vaccinated, label = "vaccinated")
+p1.plot(day_mf, n_infected_mf, linestyle = "--",
+        label = "active (mean field)")
+p1.plot(day_mf, n_dead_mf, linestyle = "--", label = "dead (mean field)")
+p1.legend()
 
 from environment import env
 import agent
@@ -48,14 +54,11 @@ player.load()
 
 done = False
 score = 0.0
-obs = world.reset()
 
-day = []
-n_susceptible = []
-n_infected = []
-n_recovered = []
-n_dead = []
-n_vaccinated = []
+# Record every step of the episode to a trajectory file
+recorder = em.Recorder("mitigation.traj")
+world.world.record(recorder)
+obs = world.reset()
 
 while not done:
     action = player.act(obs)
@@ -63,12 +66,16 @@ while not done:
     score += reward
     obs = next
 
-    day.append(output.day)
-    n_susceptible.append(output.n_susceptible)
-    n_infected.append(output.n_infected)
-    n_recovered.append(output.n_recovered)
-    n_dead.append(output.n_dead)
-    n_vaccinated.append(output.n_vaccinated)
+world.world.record(None)
+recorder.close()
+
+trajectory = em.TrajectoryFile("mitigation.traj")
+day = trajectory["day"]
+n_susceptible = trajectory["n_susceptible"]
+n_infected = trajectory["n_infected"]
+n_recovered = trajectory["n_recovered"]
+n_dead = trajectory["n_dead"]
+n_vaccinated = trajectory["n_vaccinated"]
 
 p2.set_xlabel("time, days")
 p2.set_yscale("log")
@@ -2,5 +2,8 @@ from setuptools import Extension, setup
 from Cython.Build import cythonize
 
 setup(
-    ext_modules = cythonize([Extension("epi_model", ["src/epi_model.pyx"])])
+    ext_modules = cythonize([Extension("epi_model", ["src/epi_model.pyx"],
+        extra_compile_args = ["-pthread", "-fno-math-errno",
+            "-fno-trapping-math"],
+        extra_link_args = ["-pthread"])])
 )
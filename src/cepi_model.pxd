@@ -4,7 +4,8 @@
 cdef extern from "stdbool.h":
     ctypedef bint bool
 
-cdef extern from "./epi_lib/epi_api.h":
+# Functions don't touch Python objects, and may be called without the GIL
+cdef extern from "./epi_lib/epi_api.h" nogil:
 
     # Opaque handle to model
     ctypedef struct _EpiModel:
@@ -12,6 +13,30 @@ cdef extern from "./epi_lib/epi_api.h":
 
     ctypedef _EpiModel* EpiModel
 
+    # Opaque handle to batch of models
+    ctypedef struct _EpiBatch:
+        pass
+
+    ctypedef _EpiBatch* EpiBatch
+
+    # Opaque handle to pool of worker threads
+    ctypedef struct ThreadPool:
+        pass
+
+    ctypedef ThreadPool* EpiThreadPool
+
+    # Opaque handle to trajectory file recorder
+    ctypedef struct _EpiRecorder:
+        pass
+
+    ctypedef _EpiRecorder* EpiRecorder
+
+    # Opaque handle to streaming statistics of many runs
+    ctypedef struct _EpiStats:
+        pass
+
+    ctypedef _EpiStats* EpiStats
+
     # Error return values
     ctypedef enum EpiError:
         EPI_ERROR_SUCCESS
@@ -25,6 +50,41 @@ cdef extern from "./epi_lib/epi_api.h":
         EPI_ERROR_INVALID_SCENARIO
         N_EPI_ERROR
 
+    # Details of an error from reading a data file
+    ctypedef struct EpiErrorInfo:
+        EpiError err
+        char fname[256]
+        size_t line
+        size_t column
+        char message[256]
+
+    # Binomial sampling methods
+    ctypedef enum EpiSampler:
+        EPI_SAMPLER_APPROX
+        EPI_SAMPLER_EXACT
+        N_EPI_SAMPLER
+
+    # Simulation engines
+    ctypedef enum EpiEngine:
+        EPI_ENGINE_COMPARTMENT
+        EPI_ENGINE_AGENT
+        N_EPI_ENGINE
+
+    ctypedef unsigned long long uint64
+    ctypedef unsigned int uint32_t
+
+    # Action bit flags for batched environments
+    enum:
+        EPI_ACTION_DIST_RECOMMEND
+        EPI_ACTION_DIST_HOME_SYMP
+        EPI_ACTION_DIST_HOME_ALL
+        EPI_ACTION_SCHOOLS_CLOSED
+        N_EPI_ACTIONS
+
+    # Observations per model in batched environments
+    enum:
+        N_EPI_OBSERVATIONS
+
     # Model parameters and data
     ctypedef struct EpiScenario:
         # Day of initial infection, negative = never
@@ -40,6 +100,18 @@ cdef extern from "./epi_lib/epi_api.h":
         char *dis_fname
         # Population data file name
         char *pop_fname
+        # Age structure data file name, NULL = homogeneous population
+        char *age_fname
+        # Random number generator seed
+        uint64 seed
+        # Sampling method for random draws
+        EpiSampler sampler
+        # Deterministic mean-field mode
+        bool mean_field
+        # Simulation engine
+        EpiEngine engine
+        # Number of threads, 0 = one per CPU
+        size_t n_threads
 
     # Control measures that can be put in place
     ctypedef struct EpiInput:
@@ -49,9 +121,22 @@ cdef extern from "./epi_lib/epi_api.h":
         bool dist_home_symp
         # Home quarantine orders, except for essential tasks
         bool dist_home_all
+        # Schools closed, age-structured models only
+        bool schools_closed
+        # Travel restrictions, metapopulation models only
+        bool travel_restrict
         # TODO: hospital capacity expansion and testing policies
 
-    ctypedef unsigned long long uint64
+    # Policy in place over a range of days, t_start <= day < t_end
+    ctypedef struct EpiScheduleEntry:
+        size_t t_start
+        size_t t_end
+        EpiInput input
+
+    # Policy schedule; where entries overlap, the last one applies
+    ctypedef struct EpiSchedule:
+        size_t n_entries
+        const EpiScheduleEntry *entries
 
     # Observable output from model
     # TODO: for now, the player can see the real situation. Add a testing model.
@@ -72,10 +157,96 @@ cdef extern from "./epi_lib/epi_api.h":
 
         float cost_function
 
+    # Day bins of a model's population: day of disease d is in bin
+    # (head + d) % n_bins
+    ctypedef struct EpiDayBins:
+        size_t n_bins
+        size_t head
+        const uint64 *n_total_active
+        const uint64 *n_asymptomatic
+        const uint64 *n_symptomatic
+        const uint64 *n_critical
+
+    # Phases of a model step, timed by profiling builds of the library
+    ctypedef enum EpiPhase:
+        EPI_PHASE_STEP
+        EPI_PHASE_VACCINATION
+        EPI_PHASE_TRANSITIONS
+        EPI_PHASE_INFECTION_RATE
+        EPI_PHASE_INFECTION
+        EPI_PHASE_OBSERVABLES
+        EPI_PHASE_RECORDING
+        N_EPI_PHASES
+
+    # Work done by a model, only collected if the library is built with
+    # EPI_PROFILE
+    ctypedef struct EpiProfile:
+        bool enabled
+        uint64 n_steps
+        uint64 n_poisson_draws
+        uint64 n_gaussian_draws
+        uint64 n_monte_carlo_draws
+        uint64 n_poisson_retries
+        uint64 n_gaussian_retries
+        # One per EpiPhase, N_EPI_PHASES
+        uint64 phase_ticks[7]
+        uint64 phase_calls[7]
+        double ticks_per_second
+
+    # Scenario randomization for batched environments
+    ctypedef struct EpiBatchConfig:
+        # Template for all episodes; t_initial, t_vaccine and seed are drawn
+        # for each episode
+        EpiScenario scenario
+        # Probability and duration of episodes without an outbreak
+        float p_no_outbreak
+        int no_outbreak_days
+        # Range of outbreak days, inclusive
+        int t_initial_min
+        int t_initial_max
+        # Range of days from outbreak to vaccine availability, inclusive
+        int vaccine_delay_min
+        int vaccine_delay_max
+
+    # Observables summarized by statistics over many runs
+    ctypedef enum EpiField:
+        EPI_FIELD_SUSCEPTIBLE
+        EPI_FIELD_INFECTED
+        EPI_FIELD_CRITICAL
+        EPI_FIELD_RECOVERED
+        EPI_FIELD_VACCINATED
+        EPI_FIELD_DEAD
+        EPI_FIELD_COST
+        N_EPI_FIELDS
+
+    # Distribution of one observable on one day
+    ctypedef struct EpiFieldStats:
+        double mean
+        double var
+        double min
+        double max
+
+    # Statistics of all observables on one day
+    ctypedef struct EpiStatsDay:
+        uint64 n
+        uint64 n_running
+        # One per EpiField, N_EPI_FIELDS
+        EpiFieldStats fields[7]
+
     # Create a single-population model from scenario description,
     # a disease data file and a population data file
     EpiError epi_construct_model(EpiModel *out, EpiScenario *sc)
 
+    # Return a model to its state on construction, for a new scenario with
+    # the same data files, without reading any files
+    EpiError epi_reset_model(EpiModel model, const EpiScenario *scenario)
+
+    # Drop all cached data files
+    EpiError epi_clear_cache()
+
+    # Details of the last error from reading a data file on the calling thread
+    EpiError epi_last_error(EpiErrorInfo *out)
+
     # Free resources associated with a model.  Sets model pointer to NULL.
     EpiError epi_free_model(EpiModel *out)
 
@@ -84,3 +255,132 @@ cdef extern from "./epi_lib/epi_api.h":
 
     # Get observable output from model
     EpiError epi_get_observables(EpiObservable *out, const EpiModel model)
+
+    # Write the N_EPI_OBSERVATIONS observations of batched environments for
+    # the given observables, or for the current state of a model, to out
+    EpiError epi_rl_observation(float *out, const EpiObservable *obs)
+    EpiError epi_get_rl_observation(float *out, const EpiModel model)
+
+    # Get the day bins of a model, which point into the model itself
+    EpiError epi_get_day_bins(EpiDayBins *out, const EpiModel model)
+
+    # Independent copy of a model in its current state, sharing disease data
+    EpiError epi_clone_model(EpiModel *out, const EpiModel model)
+
+    # Size in bytes of a snapshot of model state
+    EpiError epi_snapshot_size(size_t *out, const EpiModel model)
+
+    # Write snapshot of model state to a caller-owned buffer
+    EpiError epi_snapshot(void *buf, size_t size, const EpiModel model)
+
+    # Return model to the state saved in a snapshot
+    EpiError epi_restore(EpiModel model, const void *buf, size_t size)
+
+    # Step model forward by up to n_days days following a policy schedule,
+    # writing observables for each day to trajectory
+    EpiError epi_model_run(EpiObservable *trajectory, size_t *n_steps,
+        EpiModel model, const EpiSchedule *schedule, size_t n_days)
+
+    # Step model forward through days on which nothing happens, and then
+    # one more day, up to max_days days, summing the cost of each day
+    EpiError epi_model_advance_until_event(size_t *n_days, double *cost,
+        EpiModel model, const EpiInput *input, size_t max_days)
+
+    # Create a recorder writing to a new trajectory file.  Verbose
+    # recorders also record the day bins of the population.
+    EpiError epi_recorder_create(EpiRecorder *out, const char *fname,
+        bool verbose, size_t buffer_rows)
+
+    # Write any buffered rows, close the file and free the recorder.  Sets
+    # recorder pointer to NULL.
+    EpiError epi_recorder_free(EpiRecorder *rec)
+
+    # Write buffered rows to the file now
+    EpiError epi_recorder_flush(EpiRecorder rec)
+
+    # Record one row of observables, for recorders that are not verbose
+    EpiError epi_recorder_append(EpiRecorder rec, const EpiObservable *obs)
+
+    # Record the observables of a model after each step, NULL to stop
+    EpiError epi_model_set_recorder(EpiModel model, EpiRecorder rec)
+
+    # Get, or clear, the profile of a model
+    EpiError epi_get_profile(EpiProfile *out, const EpiModel model)
+    EpiError epi_reset_profile(EpiModel model)
+
+    # Trace the first max_events timed phases of a model from now on, and
+    # write the trace as Chrome trace-event JSON
+    EpiError epi_start_trace(EpiModel model, size_t max_events)
+    EpiError epi_write_trace(const EpiModel model, const char *fname)
+
+    # Create a pool of worker threads, 0 = one per CPU
+    EpiError epi_thread_pool_create(EpiThreadPool *out, size_t n_threads)
+
+    # Stop the threads of a pool and free it.  Sets pool pointer to NULL.
+    EpiError epi_thread_pool_free(EpiThreadPool *pool)
+
+    # Step each of many different models by one day, on the threads of pool
+    EpiError epi_step_models(EpiObservable *out, EpiModel *models,
+        const EpiInput *inputs, size_t n_models, EpiThreadPool pool)
+
+    # Create a batch of models with randomized scenarios
+    EpiError epi_batch_construct(EpiBatch *out, const EpiBatchConfig *config,
+        size_t n_envs, size_t n_threads, uint64 seed)
+
+    # Free a batch and all of its models.  Sets batch pointer to NULL.
+    EpiError epi_batch_free(EpiBatch *batch)
+
+    # Number of models in a batch
+    EpiError epi_batch_size(size_t *out, const EpiBatch batch)
+
+    # Start a new episode in every model
+    EpiError epi_batch_reset(EpiBatch batch)
+
+    # Step every model by one day, resetting models whose episode finished
+    EpiError epi_batch_step(EpiBatch batch, const uint32_t *actions,
+        float *obs, float *rewards, bool *dones)
+
+    # Current observations of every model
+    EpiError epi_batch_get_observables(float *obs, const EpiBatch batch)
+
+    # Create statistics for n_days days, with quantile sketches of the given
+    # compression, 0 = EPI_STATS_COMPRESSION
+    EpiError epi_stats_create(EpiStats *out, size_t n_days,
+        double compression)
+
+    # Free statistics.  Sets stats pointer to NULL.
+    EpiError epi_stats_free(EpiStats *stats)
+
+    # Number of days covered by statistics
+    EpiError epi_stats_days(size_t *out, const EpiStats stats)
+
+    # Record the observables of one run on one day
+    EpiError epi_stats_add(EpiStats stats, size_t day,
+        const EpiObservable *obs)
+
+    # Add everything recorded in other to stats
+    EpiError epi_stats_merge(EpiStats stats, EpiStats other)
+
+    # Get count, mean, variance and extremes of every field on one day
+    EpiError epi_stats_get(EpiStatsDay *out, const EpiStats stats,
+        size_t day)
+
+    # Estimate the q-quantile of a field on one day
+    EpiError epi_stats_quantile(double *out, EpiStats stats, size_t day,
+        EpiField field, double q)
+
+    # Size in bytes of serialized statistics
+    EpiError epi_stats_serialized_size(size_t *out, EpiStats stats)
+
+    # Write statistics to buf, which has room for size bytes
+    EpiError epi_stats_serialize(void *buf, size_t size, EpiStats stats)
+
+    # Create statistics from a buffer written by epi_stats_serialize()
+    EpiError epi_stats_deserialize(EpiStats *out, const void *buf,
+        size_t size)
+
+    # Run many replicates of randomized scenarios on n_threads threads, and
+    # add their observables to stats, for as many days as it covers
+    EpiError epi_run_ensemble(EpiStats stats, const EpiBatchConfig *config,
+        const EpiSchedule *schedule, size_t n_replicates, size_t n_threads,
+        uint64 seed)
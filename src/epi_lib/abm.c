@@ -0,0 +1,732 @@
+#include "abm.h"
+#include "bin_file.h"
+#include "files.h"
+
+// Defaults for household and workplace structure
+#define ABM_DEFAULT_HOUSEHOLD_SIZE 2.5f
+#define ABM_DEFAULT_WORKPLACE_SIZE 20.f
+#define ABM_DEFAULT_F_EMPLOYED 0.6f
+#define ABM_DEFAULT_SHARE_HOUSEHOLD 0.3f
+#define ABM_DEFAULT_SHARE_WORK 0.3f
+
+// Purposes of counter-based random draws, each with its own key per step
+typedef enum {
+  ABM_DRAW_VACCINE,
+  ABM_DRAW_PROGRESS,
+  ABM_DRAW_INFECT,
+  ABM_DRAW_SEED,
+  N_ABM_DRAW
+} AbmDraw;
+
+// Parameters of the current step, shared by all tasks
+typedef struct {
+  Abm *abm;
+  bool vaccine;
+
+  // Multiplier of death probability, from hospital availability
+  float death_factor;
+  // Fraction of critical cases in hospital
+  float hosp_rate;
+
+  // Intensity of contacts at work, relative to normal
+  float work_scale;
+
+  // Lookup tables by agent state, rebuilt every step:
+  // transmission factor, relative to symptomatic cases
+  float infectious[N_AGENT_STATES];
+  // presence at home, where hospitalized critical cases are away
+  float home[N_AGENT_STATES];
+  // community contact weight, without and with a workplace
+  float community[2][N_AGENT_STATES];
+  // attendance at work, by full state byte including the critical job flag
+  bool attends[256];
+
+  // Infectious fraction of community contacts, after the first phase
+  double community_ratio;
+
+  uint64 key[N_ABM_DRAW];
+} AbmStep;
+
+// Read household and workplace parameters
+static EpiError read_abm_params(Abm *abm, float *household_size,
+  float *workplace_size, float *f_employed, DataFile *df);
+
+// Read a float token, or use a default if it is missing
+static EpiError read_optional_float(float *f, DataFile *df, const char *name,
+  float def);
+
+// Build households, immunity and workplaces
+static EpiError build_agents(Abm *abm, const Population *base,
+  float household_size, float workplace_size, float f_employed, EpiRng *rng);
+
+// Poisson random number by inversion, for small means
+static uint64 small_poisson(double mean, EpiRng *rng);
+
+// Key for random draws of one purpose in the current step
+static uint64 step_key(const Abm *abm, AbmDraw draw);
+
+// Parallel phases of evolve_abm()
+static EpiError abm_progress_task(void *ctx, size_t t);
+static EpiError abm_work_task(void *ctx, size_t t);
+static EpiError abm_infect_task(void *ctx, size_t t);
+
+// Fill lookup tables of agent behavior and infectiousness under the
+// current step's policy
+static void build_step_tables(AbmStep *st);
+
+// Recalculate summary from task tallies
+static void update_abm_summary(Abm *abm);
+
+EpiError create_abm(Abm **out, const Population *base, const Disease *dis,
+  const char *pop_fname, uint64 seed, size_t n_threads) {
+
+  if (out == NULL || base == NULL || dis == NULL || pop_fname == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  if (base->n_total == 0 || base->n_total > ABM_MAX_AGENTS ||
+    base->n_susceptible > base->n_total ||
+    dis->max_duration == 0 || dis->max_duration > MAX_POP_DURATION) {
+    return EPI_ERROR_INVALID_DATA;
+  }
+
+  // Compiled population files do not keep the keys of the agent engine,
+  // which would otherwise silently fall back to their defaults
+  BinKind kind;
+  PASS_ERROR(bin_file_kind(&kind, pop_fname));
+  if (kind != BIN_NONE) {
+    set_last_error(EPI_ERROR_INVALID_DATA, pop_fname, 0, 0,
+      "agent engine needs a text population file");
+    return EPI_ERROR_INVALID_DATA;
+  }
+
+  DataFile *df = NULL;
+  PASS_ERROR(open_data_file(&df, pop_fname));
+
+  Abm *abm = (Abm *)calloc(1, sizeof(Abm));
+  if (abm == NULL) {
+    free_data_file(&df);
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+
+  float household_size, workplace_size, f_employed;
+  EpiError err = read_abm_params(abm, &household_size, &workplace_size,
+    &f_employed, df);
+  free_data_file(&df);
+  if (err != EPI_ERROR_SUCCESS) {
+    free(abm);
+    return err;
+  }
+
+  abm->disease = dis;
+  abm->n_agents = (size_t)base->n_total;
+
+  EpiRng rng;
+  rng_seed(&rng, seed);
+  abm->key = rng_next(&rng);
+
+  err = build_agents(abm, base, household_size, workplace_size, f_employed,
+    &rng);
+  if (err == EPI_ERROR_SUCCESS) {
+    size_t n_hh = (abm->n_households + ABM_TASK_HOUSEHOLDS - 1) /
+      ABM_TASK_HOUSEHOLDS;
+    size_t n_work = (abm->n_workplaces + ABM_TASK_WORKPLACES - 1) /
+      ABM_TASK_WORKPLACES;
+    abm->n_tasks = n_hh > n_work ? n_hh : n_work;
+    abm->tallies = (AbmTally *)calloc(abm->n_tasks, sizeof(AbmTally));
+    if (abm->tallies == NULL) {
+      err = EPI_ERROR_OUT_OF_MEMORY;
+    }
+  }
+  if (err == EPI_ERROR_SUCCESS) {
+    err = create_thread_pool(&abm->threads, n_threads);
+  }
+  if (err != EPI_ERROR_SUCCESS) {
+    free_abm(&abm);
+    return err;
+  }
+
+  // Summary has the base population's parameters, but no day bins
+  memcpy(&abm->summary, base, sizeof(Population));
+  abm->summary.n_total_active = NULL;
+  abm->summary.n_asymptomatic = NULL;
+  abm->summary.n_symptomatic = NULL;
+  abm->summary.n_critical = NULL;
+  abm->summary.draw_p_x = NULL;
+  abm->summary.draw_p_y = NULL;
+  abm->summary.draw_n = NULL;
+  abm->summary.draw_nx = NULL;
+  abm->summary.draw_ny = NULL;
+
+  *out = abm;
+  return EPI_ERROR_SUCCESS;
+}
+
+static EpiError read_abm_params(Abm *abm, float *household_size,
+  float *workplace_size, float *f_employed, DataFile *df) {
+  PASS_ERROR(read_optional_float(household_size, df, "HOUSEHOLD_SIZE",
+    ABM_DEFAULT_HOUSEHOLD_SIZE));
+  PASS_ERROR(read_optional_float(workplace_size, df, "WORKPLACE_SIZE",
+    ABM_DEFAULT_WORKPLACE_SIZE));
+  PASS_ERROR(read_optional_float(f_employed, df, "F_EMPLOYED",
+    ABM_DEFAULT_F_EMPLOYED));
+  PASS_ERROR(read_optional_float(&abm->share_household, df,
+    "SHARE_HOUSEHOLD", ABM_DEFAULT_SHARE_HOUSEHOLD));
+  PASS_ERROR(read_optional_float(&abm->share_work, df, "SHARE_WORK",
+    ABM_DEFAULT_SHARE_WORK));
+
+  if (*household_size < 1.f || *household_size > ABM_MAX_HOUSEHOLD ||
+    *workplace_size < 1.f || *f_employed > 1.f ||
+    abm->share_household + abm->share_work > 1.f) {
+    return invalid_data(df, NULL, "household or workplace out of range");
+  }
+  abm->share_community = 1.f - abm->share_household - abm->share_work;
+
+  return EPI_ERROR_SUCCESS;
+}
+
+static EpiError read_optional_float(float *f, DataFile *df, const char *name,
+  float def) {
+  EpiError err = read_float_token(f, df, name);
+  if (err == EPI_ERROR_MISSING_DATA) {
+    *f = def;
+    return EPI_ERROR_SUCCESS;
+  }
+  return err;
+}
+
+static EpiError build_agents(Abm *abm, const Population *base,
+  float household_size, float workplace_size, float f_employed, EpiRng *rng) {
+
+  size_t n = abm->n_agents;
+  abm->state = (uint8 *)calloc(2 * n, sizeof(uint8));
+  abm->workplace = (uint32 *)malloc(n * sizeof(uint32));
+  abm->household_start = (uint32 *)malloc((n + 1) * sizeof(uint32));
+  if (abm->state == NULL || abm->workplace == NULL ||
+    abm->household_start == NULL) {
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+  abm->day = &abm->state[n];
+
+  // Households: one person, plus a Poisson number of others
+  size_t n_households = 0;
+  size_t a = 0;
+  while (a < n) {
+    uint64 size = 1 + small_poisson(household_size - 1.0, rng);
+    if (size > ABM_MAX_HOUSEHOLD) {
+      size = ABM_MAX_HOUSEHOLD;
+    }
+    if (size > n - a) {
+      size = n - a;
+    }
+    abm->household_start[n_households++] = (uint32)a;
+    a += size;
+  }
+  abm->household_start[n_households] = (uint32)n;
+  abm->n_households = n_households;
+
+  uint32 *shrunk = (uint32 *)realloc(abm->household_start,
+    (n_households + 1) * sizeof(uint32));
+  if (shrunk != NULL) {
+    abm->household_start = shrunk;
+  }
+
+  // Exactly n_total - n_susceptible agents are immune from the start,
+  // chosen by selection sampling
+  uint64 n_immune = base->n_total - base->n_susceptible;
+  size_t n_workers = 0;
+  for (size_t i = 0; i < n; i++) {
+    uint8 state = AGENT_SUSCEPTIBLE;
+    if (n_immune > 0 && rng_uniform(rng) * (double)(n - i) < n_immune) {
+      state = AGENT_IMMUNE;
+      n_immune--;
+    }
+
+    abm->workplace[i] = AGENT_NO_WORKPLACE;
+    if (rng_uniform(rng) < f_employed) {
+      abm->workplace[i] = 0;
+      n_workers++;
+      if (rng_uniform(rng) < base->f_critical_jobs) {
+        state |= AGENT_CRITICAL_JOB;
+      }
+    }
+    abm->state[i] = state;
+  }
+
+  // Workers are spread uniformly over workplaces
+  size_t n_workplaces = (size_t)ceil((double)n_workers / workplace_size);
+  if (n_workplaces == 0) {
+    n_workplaces = 1;
+  }
+  abm->n_workplaces = n_workplaces;
+  abm->workplace_start = (uint32 *)calloc(n_workplaces + 1, sizeof(uint32));
+  abm->workplace_members = (uint32 *)malloc(
+    (n_workers + 1) * sizeof(uint32));
+  abm->work_force = (float *)calloc(n_workplaces, sizeof(float));
+  if (abm->workplace_start == NULL || abm->workplace_members == NULL ||
+    abm->work_force == NULL) {
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    if (abm->workplace[i] != AGENT_NO_WORKPLACE) {
+      size_t w = (size_t)(rng_uniform(rng) * (double)n_workplaces);
+      abm->workplace[i] = (uint32)w;
+      abm->workplace_start[w + 1]++;
+    }
+  }
+  for (size_t w = 0; w < n_workplaces; w++) {
+    abm->workplace_start[w + 1] += abm->workplace_start[w];
+  }
+
+  uint32 *fill = (uint32 *)malloc(n_workplaces * sizeof(uint32));
+  if (fill == NULL) {
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+  memcpy(fill, abm->workplace_start, n_workplaces * sizeof(uint32));
+  for (size_t i = 0; i < n; i++) {
+    if (abm->workplace[i] != AGENT_NO_WORKPLACE) {
+      abm->workplace_members[fill[abm->workplace[i]]++] = (uint32)i;
+    }
+  }
+  free(fill);
+
+  return EPI_ERROR_SUCCESS;
+}
+
+static uint64 small_poisson(double mean, EpiRng *rng) {
+  if (mean <= 0.0) {
+    return 0;
+  }
+
+  double limit = exp(-mean);
+  double p = rng_uniform(rng);
+  uint64 k = 0;
+  while (p > limit) {
+    p *= rng_uniform(rng);
+    k++;
+  }
+  return k;
+}
+
+EpiError copy_abm(Abm **out, const Abm *abm) {
+  if (out == NULL || abm == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  Abm *copy = (Abm *)malloc(sizeof(Abm));
+  if (copy == NULL) {
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+  memcpy(copy, abm, sizeof(Abm));
+
+  size_t n = abm->n_agents;
+  size_t n_workers = abm->workplace_start[abm->n_workplaces];
+  copy->state = (uint8 *)malloc(2 * n * sizeof(uint8));
+  copy->workplace = (uint32 *)malloc(n * sizeof(uint32));
+  copy->household_start = (uint32 *)malloc(
+    (abm->n_households + 1) * sizeof(uint32));
+  copy->workplace_start = (uint32 *)malloc(
+    (abm->n_workplaces + 1) * sizeof(uint32));
+  copy->workplace_members = (uint32 *)malloc(
+    (n_workers + 1) * sizeof(uint32));
+  copy->work_force = (float *)calloc(abm->n_workplaces, sizeof(float));
+  copy->tallies = (AbmTally *)calloc(abm->n_tasks, sizeof(AbmTally));
+  copy->threads = NULL;
+  EpiError err = EPI_ERROR_SUCCESS;
+  if (copy->state == NULL || copy->workplace == NULL ||
+    copy->household_start == NULL || copy->workplace_start == NULL ||
+    copy->workplace_members == NULL || copy->work_force == NULL ||
+    copy->tallies == NULL) {
+    err = EPI_ERROR_OUT_OF_MEMORY;
+  }
+  if (err == EPI_ERROR_SUCCESS) {
+    err = create_thread_pool(&copy->threads, thread_pool_size(abm->threads));
+  }
+  if (err != EPI_ERROR_SUCCESS) {
+    free_abm(&copy);
+    return err;
+  }
+
+  memcpy(copy->state, abm->state, 2 * n * sizeof(uint8));
+  copy->day = &copy->state[n];
+  memcpy(copy->workplace, abm->workplace, n * sizeof(uint32));
+  memcpy(copy->household_start, abm->household_start,
+    (abm->n_households + 1) * sizeof(uint32));
+  memcpy(copy->workplace_start, abm->workplace_start,
+    (abm->n_workplaces + 1) * sizeof(uint32));
+  memcpy(copy->workplace_members, abm->workplace_members,
+    n_workers * sizeof(uint32));
+
+  *out = copy;
+  return EPI_ERROR_SUCCESS;
+}
+
+size_t abm_state_size(const Abm *abm) {
+  return pop_state_size(&abm->summary) + sizeof(uint64) +
+    2 * abm->n_agents * sizeof(uint8);
+}
+
+size_t save_abm_state(uint8 *buf, const Abm *abm) {
+  size_t size = save_pop_state(buf, &abm->summary);
+  memcpy(&buf[size], &abm->step, sizeof(uint64));
+  size += sizeof(uint64);
+
+  // State and day of disease are contiguous, see build_agents()
+  memcpy(&buf[size], abm->state, 2 * abm->n_agents * sizeof(uint8));
+  return size + 2 * abm->n_agents * sizeof(uint8);
+}
+
+size_t load_abm_state(Abm *abm, const uint8 *buf) {
+  size_t size = load_pop_state(&abm->summary, buf);
+  memcpy(&abm->step, &buf[size], sizeof(uint64));
+  size += sizeof(uint64);
+
+  memcpy(abm->state, &buf[size], 2 * abm->n_agents * sizeof(uint8));
+  return size + 2 * abm->n_agents * sizeof(uint8);
+}
+
+EpiError free_abm(Abm **abm) {
+  if (abm == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  if (*abm == NULL) {
+    return EPI_ERROR_SUCCESS;
+  }
+
+  Abm *a = *abm;
+  free_thread_pool(&a->threads);
+  free(a->state);
+  free(a->workplace);
+  free(a->household_start);
+  free(a->workplace_start);
+  free(a->workplace_members);
+  free(a->work_force);
+  free(a->tallies);
+  free(a);
+  *abm = NULL;
+  return EPI_ERROR_SUCCESS;
+}
+
+void reseed_abm(Abm *abm, uint64 seed) {
+  // Same key as create_abm() derives from a seed
+  EpiRng rng;
+  rng_seed(&rng, seed);
+  abm->key = rng_next(&rng);
+}
+
+EpiError infect_abm(Abm *abm, uint64 n_cases) {
+  if (abm == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  // Selection sampling over susceptible agents
+  uint64 key = step_key(abm, ABM_DRAW_SEED);
+  uint64 n_left = abm->summary.n_susceptible;
+  if (n_cases > n_left) {
+    n_cases = n_left;
+  }
+
+  for (size_t i = 0; i < abm->n_agents && n_cases > 0; i++) {
+    if ((abm->state[i] & AGENT_STATE_MASK) != AGENT_SUSCEPTIBLE) {
+      continue;
+    }
+    if (rng_hash_uniform(key, i) * (double)n_left < (double)n_cases) {
+      abm->state[i] = (abm->state[i] & AGENT_CRITICAL_JOB) |
+        AGENT_ASYMPTOMATIC;
+      abm->day[i] = 0;
+      abm->summary.n_susceptible--;
+      abm->summary.n_infected++;
+      abm->summary.n_total_asymptomatic++;
+      n_cases--;
+    }
+    n_left--;
+  }
+
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError evolve_abm(Abm *abm, bool vaccine) {
+  if (abm == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  const Population *pop = &abm->summary;
+
+  AbmStep st;
+  memset(&st, 0, sizeof(AbmStep));
+  st.abm = abm;
+  st.vaccine = vaccine;
+
+  // Death rate modifier based on availability of hospital beds
+  st.hosp_rate = calc_hosp_rate(pop);
+  st.death_factor = (1.f - st.hosp_rate) +
+    st.hosp_rate * abm->disease->hosp_death_reduction;
+
+  build_step_tables(&st);
+
+  for (size_t d = 0; d < N_ABM_DRAW; d++) {
+    st.key[d] = step_key(abm, (AbmDraw)d);
+  }
+
+  abm->summary.n_dead_last = abm->summary.n_dead;
+
+  // Vaccination and disease progression of every agent
+  PASS_ERROR(thread_pool_run(abm->threads, abm->n_tasks, abm_progress_task,
+    &st));
+
+  // Community contacts, added up in task order
+  double contacts = 0.0;
+  double infectious = 0.0;
+  for (size_t t = 0; t < abm->n_tasks; t++) {
+    contacts += abm->tallies[t].community_contacts;
+    infectious += abm->tallies[t].community_infectious;
+  }
+  st.community_ratio = contacts > 0.0 ? infectious / contacts : 0.0;
+
+  // Force of infection at every workplace
+  PASS_ERROR(thread_pool_run(abm->threads, abm->n_tasks, abm_work_task,
+    &st));
+
+  // New infections
+  PASS_ERROR(thread_pool_run(abm->threads, abm->n_tasks, abm_infect_task,
+    &st));
+
+  update_abm_summary(abm);
+  abm->step++;
+  return EPI_ERROR_SUCCESS;
+}
+
+static uint64 step_key(const Abm *abm, AbmDraw draw) {
+  return rng_hash(abm->key, abm->step * N_ABM_DRAW + (uint64)draw);
+}
+
+static void build_step_tables(AbmStep *st) {
+  const Abm *abm = st->abm;
+  const Population *pop = &abm->summary;
+  const EpiInput *policy = &pop->policy;
+
+  // Contact activity relative to normal, as in calc_contact_pool()
+  float r_home = pop->cr_normal > 0.f ? pop->cr_home / pop->cr_normal : 1.f;
+  float r_dist = 0.5f * (1.f + r_home);
+  bool symp_stay_home = policy->dist_home_symp || policy->dist_home_all;
+  float normal = policy->dist_home_all ? r_home :
+    (policy->dist_recommend ? r_dist : 1.f);
+  float symp = symp_stay_home ? r_home : r_dist;
+  st->work_scale = policy->dist_home_all || policy->dist_recommend ?
+    r_dist : 1.f;
+
+  for (size_t s = 0; s < N_AGENT_STATES; s++) {
+    st->infectious[s] = 0.f;
+    st->home[s] = 1.f;
+    st->community[0][s] = normal;
+  }
+  st->infectious[AGENT_ASYMPTOMATIC] = abm->disease->asymp_trans_reduction;
+  st->infectious[AGENT_SYMPTOMATIC] = 1.f;
+  st->infectious[AGENT_CRITICAL] = 1.f;
+  st->home[AGENT_CRITICAL] = 1.f - st->hosp_rate;
+  st->home[AGENT_DEAD] = 0.f;
+  st->community[0][AGENT_SYMPTOMATIC] = symp;
+  st->community[0][AGENT_CRITICAL] = 0.f;
+  st->community[0][AGENT_DEAD] = 0.f;
+
+  // People without a workplace make their work contacts in the community
+  for (size_t s = 0; s < N_AGENT_STATES; s++) {
+    st->community[1][s] = st->community[0][s] * abm->share_community;
+    st->community[0][s] *= abm->share_community + abm->share_work;
+  }
+
+  for (size_t b = 0; b < 256; b++) {
+    uint8 s = (uint8)b & AGENT_STATE_MASK;
+    bool healthy = s != AGENT_CRITICAL && s != AGENT_DEAD &&
+      (s != AGENT_SYMPTOMATIC || !symp_stay_home);
+    st->attends[b] = healthy &&
+      (!policy->dist_home_all || (b & AGENT_CRITICAL_JOB));
+  }
+}
+
+static EpiError abm_progress_task(void *ctx, size_t t) {
+  AbmStep *st = (AbmStep *)ctx;
+  Abm *abm = st->abm;
+  const Disease *dis = abm->disease;
+  AbmTally *tally = &abm->tallies[t];
+  memset(tally, 0, sizeof(AbmTally));
+
+  size_t h0 = t * ABM_TASK_HOUSEHOLDS;
+  if (h0 >= abm->n_households) {
+    return EPI_ERROR_SUCCESS;
+  }
+  size_t h1 = h0 + ABM_TASK_HOUSEHOLDS;
+  if (h1 > abm->n_households) {
+    h1 = abm->n_households;
+  }
+
+  double p_vaccine = st->vaccine ?
+    abm->summary.daily_vaccination_capacity : 0.0;
+  uint8 last_day = (uint8)(dis->max_duration - 1);
+
+  for (size_t a = abm->household_start[h0]; a < abm->household_start[h1];
+    a++) {
+    uint8 flags = abm->state[a] & AGENT_CRITICAL_JOB;
+    uint8 state = abm->state[a] & AGENT_STATE_MASK;
+
+    if (state == AGENT_SUSCEPTIBLE) {
+      if (p_vaccine > 0.0 &&
+        rng_hash_uniform(st->key[ABM_DRAW_VACCINE], a) < p_vaccine) {
+        state = AGENT_VACCINATED;
+      }
+    } else if (state == AGENT_ASYMPTOMATIC || state == AGENT_SYMPTOMATIC ||
+      state == AGENT_CRITICAL) {
+
+      // For now, assume that everyone who reaches max_duration recovers
+      uint8 i = abm->day[a];
+      if (i == last_day) {
+        state = AGENT_RECOVERED;
+      } else {
+        // Recovery or worsening, with probabilities for the day of disease
+        // before this one
+        abm->day[a] = i + 1;
+        float p_x = dis->p_recovery[i];
+        float p_y;
+        uint8 worse;
+        if (state == AGENT_ASYMPTOMATIC) {
+          p_y = dis->p_symptoms[i];
+          worse = AGENT_SYMPTOMATIC;
+        } else if (state == AGENT_SYMPTOMATIC) {
+          p_y = dis->p_critical[i];
+          worse = AGENT_CRITICAL;
+        } else {
+          p_y = dis->p_death[i] * st->death_factor;
+          worse = AGENT_DEAD;
+        }
+
+        double u = rng_hash_uniform(st->key[ABM_DRAW_PROGRESS], a);
+        if (u < p_x) {
+          state = AGENT_RECOVERED;
+        } else if (u < (double)p_x + (double)p_y) {
+          state = worse;
+        }
+      }
+    }
+
+    abm->state[a] = flags | state;
+    tally->n_state[state]++;
+
+    float w = st->community[abm->workplace[a] != AGENT_NO_WORKPLACE][state];
+    tally->community_contacts += w;
+    tally->community_infectious += w * st->infectious[state] *
+      dis->p_transmit[abm->day[a]];
+  }
+
+  return EPI_ERROR_SUCCESS;
+}
+
+static EpiError abm_work_task(void *ctx, size_t t) {
+  AbmStep *st = (AbmStep *)ctx;
+  Abm *abm = st->abm;
+  const float *p_transmit = abm->disease->p_transmit;
+
+  size_t w0 = t * ABM_TASK_WORKPLACES;
+  size_t w1 = w0 + ABM_TASK_WORKPLACES;
+  if (w1 > abm->n_workplaces) {
+    w1 = abm->n_workplaces;
+  }
+
+  for (size_t w = w0; w < w1; w++) {
+    float present = 0.f;
+    float infectious = 0.f;
+    for (size_t k = abm->workplace_start[w]; k < abm->workplace_start[w + 1];
+      k++) {
+      uint32 a = abm->workplace_members[k];
+      uint8 state = abm->state[a];
+      if (st->attends[state]) {
+        present += 1.f;
+        infectious += st->infectious[state & AGENT_STATE_MASK] *
+          p_transmit[abm->day[a]];
+      }
+    }
+    abm->work_force[w] = present > 1.f ? abm->share_work * st->work_scale *
+      infectious / (present - 1.f) : 0.f;
+  }
+
+  return EPI_ERROR_SUCCESS;
+}
+
+static EpiError abm_infect_task(void *ctx, size_t t) {
+  AbmStep *st = (AbmStep *)ctx;
+  Abm *abm = st->abm;
+  AbmTally *tally = &abm->tallies[t];
+
+  size_t h0 = t * ABM_TASK_HOUSEHOLDS;
+  if (h0 >= abm->n_households) {
+    return EPI_ERROR_SUCCESS;
+  }
+  size_t h1 = h0 + ABM_TASK_HOUSEHOLDS;
+  if (h1 > abm->n_households) {
+    h1 = abm->n_households;
+  }
+
+  const float *p_transmit = abm->disease->p_transmit;
+  uint64 key = st->key[ABM_DRAW_INFECT];
+  for (size_t h = h0; h < h1; h++) {
+    size_t a0 = abm->household_start[h];
+    size_t a1 = abm->household_start[h + 1];
+
+    // Infectious contacts at home
+    float present = 0.f;
+    float infectious = 0.f;
+    for (size_t a = a0; a < a1; a++) {
+      uint8 state = abm->state[a] & AGENT_STATE_MASK;
+      present += st->home[state];
+      infectious += st->home[state] * st->infectious[state] *
+        p_transmit[abm->day[a]];
+    }
+    double home = present > 1.f ?
+      abm->share_household * infectious / (present - 1.f) : 0.0;
+
+    for (size_t a = a0; a < a1; a++) {
+      uint8 state = abm->state[a];
+      if ((state & AGENT_STATE_MASK) != AGENT_SUSCEPTIBLE) {
+        continue;
+      }
+
+      uint32 w = abm->workplace[a];
+      bool employed = w != AGENT_NO_WORKPLACE;
+      double x = home + st->community[employed][AGENT_SUSCEPTIBLE] *
+        st->community_ratio;
+      if (employed && st->attends[state]) {
+        x += abm->work_force[w];
+      }
+
+      if (x > 0.0 && rng_hash_uniform(key, a) < x) {
+        abm->state[a] = (state & AGENT_CRITICAL_JOB) | AGENT_ASYMPTOMATIC;
+        abm->day[a] = 0;
+        tally->n_state[AGENT_SUSCEPTIBLE]--;
+        tally->n_state[AGENT_ASYMPTOMATIC]++;
+      }
+    }
+  }
+
+  return EPI_ERROR_SUCCESS;
+}
+
+static void update_abm_summary(Abm *abm) {
+  uint64 n[N_AGENT_STATES] = {0};
+  for (size_t t = 0; t < abm->n_tasks; t++) {
+    for (size_t s = 0; s < N_AGENT_STATES; s++) {
+      n[s] += abm->tallies[t].n_state[s];
+    }
+  }
+
+  Population *pop = &abm->summary;
+  pop->n_susceptible = n[AGENT_SUSCEPTIBLE];
+  pop->n_total_asymptomatic = n[AGENT_ASYMPTOMATIC];
+  pop->n_total_symptomatic = n[AGENT_SYMPTOMATIC];
+  pop->n_total_critical = n[AGENT_CRITICAL];
+  pop->n_infected = n[AGENT_ASYMPTOMATIC] + n[AGENT_SYMPTOMATIC] +
+    n[AGENT_CRITICAL];
+  pop->n_recovered = n[AGENT_RECOVERED];
+  pop->n_dead = n[AGENT_DEAD];
+  pop->n_vaccinated = n[AGENT_VACCINATED];
+}
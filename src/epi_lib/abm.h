@@ -0,0 +1,147 @@
+#ifndef __ABM_H__
+#define __ABM_H__
+// Agent-based model: every person is simulated individually, for outbreaks
+// in towns and institutions where compartments are too coarse.
+//
+// Agents live in households, and some of them go to a workplace.  Each day,
+// a susceptible agent can be infected at home, at work, or in the wider
+// community, in proportion to the share of their contacts made in each
+// setting.  Disease progression uses the same curves as the compartment
+// model.
+//
+// Agents are stored as a structure of arrays, about 10 bytes per agent.
+// Members of a household are contiguous, so households are just ranges of
+// agent indices, and workplaces are lists of agent indices.  Random draws
+// come from a counter-based generator keyed by day, agent and purpose, so
+// results do not depend on the number of threads.
+
+#include "common.h"
+#include "disease.h"
+#include "population.h"
+#include "thread_pool.h"
+
+typedef enum {
+  AGENT_SUSCEPTIBLE,
+  AGENT_ASYMPTOMATIC,
+  AGENT_SYMPTOMATIC,
+  AGENT_CRITICAL,
+  AGENT_RECOVERED,
+  AGENT_DEAD,
+  AGENT_VACCINATED,
+  // Not susceptible from the start, and not counted as recovered
+  AGENT_IMMUNE,
+  N_AGENT_STATES
+} AgentState;
+
+// Agent state byte: state in the low bits, and a flag for critical jobs
+#define AGENT_STATE_MASK 0x0f
+#define AGENT_CRITICAL_JOB 0x80
+
+// Workplace index of agents without a workplace
+#define AGENT_NO_WORKPLACE UINT32_MAX
+
+// Largest number of agents, limited by 32-bit agent indices
+#define ABM_MAX_AGENTS ((uint64)UINT32_MAX - 1)
+
+// Households processed by each parallel task.  Fixed, so that partial sums
+// are added up in the same order for any number of threads.
+#define ABM_TASK_HOUSEHOLDS 1024
+#define ABM_TASK_WORKPLACES 256
+
+// Largest household size
+#define ABM_MAX_HOUSEHOLD 10
+
+// Per-task partial results of a step
+typedef struct {
+  uint64 n_state[N_AGENT_STATES];
+  // Community contact weight of everyone, and of infectious agents weighted
+  // by the probability of transmission
+  double community_contacts;
+  double community_infectious;
+} AbmTally;
+
+typedef struct {
+  size_t n_agents;
+  size_t n_households;
+  size_t n_workplaces;
+
+  // Per-agent data
+  uint8 *state;
+  uint8 *day;           // Day of disease, for infected agents
+  uint32 *workplace;
+
+  // Household h is agents household_start[h] to household_start[h+1] - 1
+  uint32 *household_start;
+
+  // Workplace w is agents workplace_members[workplace_start[w]] to
+  // workplace_members[workplace_start[w+1] - 1]
+  uint32 *workplace_start;
+  uint32 *workplace_members;
+
+  // Per-workplace force of infection on people who attend, for the
+  // current step
+  float *work_force;
+
+  // Shares of a person's baseline contacts made in each setting
+  float share_household;
+  float share_work;
+  float share_community;
+
+  const Disease *disease;
+
+  // Sum of all agents.  Holds the policy in place, the economic parameters
+  // and the hospital capacity, but no day bins.
+  Population summary;
+
+  // Random number key, and number of steps taken so far
+  uint64 key;
+  uint64 step;
+
+  size_t n_tasks;
+  AbmTally *tallies;
+
+  ThreadPool *threads;
+} Abm;
+
+// Create an agent-based model with the parameters and size of the base
+// population.  Household and workplace structure is read from the
+// population data file, using defaults for missing tokens:
+//   $HOUSEHOLD_SIZE    mean household size
+//   $WORKPLACE_SIZE    mean number of people at a workplace
+//   $F_EMPLOYED        fraction of people who go to a workplace
+//   $SHARE_HOUSEHOLD   share of contacts made at home
+//   $SHARE_WORK        share of contacts made at work, for people who work
+// Stepping uses n_threads threads, 0 = one per CPU.
+EpiError create_abm(Abm **out, const Population *base, const Disease *dis,
+  const char *pop_fname, uint64 seed, size_t n_threads);
+
+// Create a deep copy of an agent-based model, sharing its disease, with its
+// own threads
+EpiError copy_abm(Abm **out, const Abm *abm);
+
+// Frees agent-based model.  Nulls the pointer.  The disease is not freed.
+EpiError free_abm(Abm **abm);
+
+// Size in bytes of the state saved by save_abm_state()
+size_t abm_state_size(const Abm *abm);
+
+// Write the mutable state of an agent-based model to buf: the summary,
+// random number step, and state and day of disease of every agent.
+// Returns the number of bytes written.
+size_t save_abm_state(uint8 *buf, const Abm *abm);
+
+// Restore state written by save_abm_state() for the same agents.  Returns
+// the number of bytes read.
+size_t load_abm_state(Abm *abm, const uint8 *buf);
+
+// Draw random numbers from a new seed from now on.  Households, workplaces
+// and agent states are unchanged.
+void reseed_abm(Abm *abm, uint64 seed);
+
+// Infect randomly chosen susceptible agents
+EpiError infect_abm(Abm *abm, uint64 n_cases);
+
+// Evolve all agents forward by one day, under the policy in abm->summary
+EpiError evolve_abm(Abm *abm, bool vaccine);
+
+#endif
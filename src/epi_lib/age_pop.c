@@ -0,0 +1,492 @@
+#include "age_pop.h"
+#include "files.h"
+
+// Allocate an age-structured population with k strata and no people
+static EpiError allocate_age_pop(AgePop **out, size_t k);
+
+// Read age structure and contact matrices
+static EpiError read_age_params(AgePop *ap, float *fractions, DataFile *df);
+
+// Split n people over strata in proportion to weights, so that the parts
+// add up to n exactly
+static void split_people(uint64 *out, uint64 n, const double *weights,
+  size_t k);
+
+// Scale of each contact setting under a policy
+static void calc_layer_scales(float *scale, const Population *pop,
+  const EpiInput *policy);
+
+// Rebuild the combined contact matrix, if setting scales have changed
+static void update_mixing(AgePop *ap, const float *scale);
+
+// y = m x, for a matrix with rows of stride entries, padded with zeros
+static void mixing_matvec(float *restrict y, const float *restrict m,
+  const float *restrict x, size_t n_rows, size_t stride);
+
+// Share hospital beds between strata in proportion to critical cases, so
+// that every stratum sees the hospitalization rate of the whole population
+static void share_hospital_beds(AgePop *ap);
+
+// Recalculate sum of all strata
+static void update_summary(AgePop *ap);
+
+EpiError create_age_pop_from_file(AgePop **out, const Population *base,
+  const Disease *dis, const char *fname) {
+
+  if (out == NULL || base == NULL || dis == NULL || fname == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  DataFile *df = NULL;
+  PASS_ERROR(open_data_file(&df, fname));
+
+  size_t k = 0;
+  EpiError err = read_size_token(&k, df, "N_AGE_STRATA");
+  if (err == EPI_ERROR_SUCCESS &&
+    (k == 0 || (dis->n_strata > 0 && dis->n_strata != k))) {
+    err = invalid_data(df, "N_AGE_STRATA",
+      "number of strata does not match disease");
+  }
+  if (err != EPI_ERROR_SUCCESS) {
+    free_data_file(&df);
+    return err;
+  }
+
+  AgePop *ap = NULL;
+  err = allocate_age_pop(&ap, k);
+  if (err != EPI_ERROR_SUCCESS) {
+    free_data_file(&df);
+    return err;
+  }
+
+  float *fractions = (float *)calloc(k, sizeof(float));
+  double *weights = (double *)calloc(k, sizeof(double));
+  uint64 *n = (uint64 *)calloc(2 * k, sizeof(uint64));
+  if (fractions == NULL || weights == NULL || n == NULL) {
+    err = EPI_ERROR_OUT_OF_MEMORY;
+  }
+
+  if (err == EPI_ERROR_SUCCESS) {
+    err = read_age_params(ap, fractions, df);
+  }
+  free_data_file(&df);
+
+  // Split base population over strata
+  if (err == EPI_ERROR_SUCCESS) {
+    for (size_t i = 0; i < k; i++) {
+      weights[i] = fractions[i];
+    }
+    split_people(n, base->n_total, weights, k);
+    split_people(&n[k], base->n_susceptible, weights, k);
+  }
+  for (size_t i = 0; i < k && err == EPI_ERROR_SUCCESS; i++) {
+    err = copy_pop(&ap->strata[i], base);
+    if (err == EPI_ERROR_SUCCESS) {
+      ap->strata[i]->n_total = n[i];
+      ap->strata[i]->n_susceptible = n[k + i];
+      disease_stratum(&ap->diseases[i], dis, i);
+    }
+  }
+
+  free(fractions);
+  free(weights);
+  free(n);
+  if (err != EPI_ERROR_SUCCESS) {
+    free_age_pop(&ap);
+    return err;
+  }
+
+  // Summary has the base population's parameters, but no day bins
+  memcpy(&ap->summary, base, sizeof(Population));
+  ap->summary.n_total_active = NULL;
+  ap->summary.n_asymptomatic = NULL;
+  ap->summary.n_symptomatic = NULL;
+  ap->summary.n_critical = NULL;
+  ap->summary.draw_p_x = NULL;
+  ap->summary.draw_p_y = NULL;
+  ap->summary.draw_n = NULL;
+  ap->summary.draw_nx = NULL;
+  ap->summary.draw_ny = NULL;
+  update_summary(ap);
+
+  // Force the combined contact matrix to be built on the first step
+  for (size_t l = 0; l < N_CONTACT_LAYERS; l++) {
+    ap->layer_scale[l] = -1.f;
+  }
+
+  *out = ap;
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError copy_age_pop(AgePop **out, const AgePop *ap) {
+  if (out == NULL || ap == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  size_t k = ap->n_strata;
+  AgePop *copy = NULL;
+  PASS_ERROR(allocate_age_pop(&copy, k));
+
+  EpiError err = EPI_ERROR_SUCCESS;
+  for (size_t i = 0; i < k && err == EPI_ERROR_SUCCESS; i++) {
+    err = copy_pop(&copy->strata[i], ap->strata[i]);
+  }
+  if (err != EPI_ERROR_SUCCESS) {
+    free_age_pop(&copy);
+    return err;
+  }
+
+  memcpy(copy->diseases, ap->diseases, k * sizeof(Disease));
+  memcpy(copy->contacts, ap->contacts,
+    N_CONTACT_LAYERS * k * k * sizeof(float));
+  memcpy(copy->mixing, ap->mixing, k * ap->mixing_stride * sizeof(float));
+  memcpy(&copy->summary, &ap->summary, sizeof(Population));
+  memcpy(copy->layer_scale, ap->layer_scale, sizeof(ap->layer_scale));
+  copy->contact_norm = ap->contact_norm;
+
+  *out = copy;
+  return EPI_ERROR_SUCCESS;
+}
+
+size_t age_pop_state_size(const AgePop *ap) {
+  size_t size = pop_state_size(&ap->summary);
+  for (size_t i = 0; i < ap->n_strata; i++) {
+    size += pop_state_size(ap->strata[i]);
+  }
+  return size;
+}
+
+size_t save_age_pop_state(uint8 *buf, const AgePop *ap) {
+  size_t size = save_pop_state(buf, &ap->summary);
+  for (size_t i = 0; i < ap->n_strata; i++) {
+    size += save_pop_state(&buf[size], ap->strata[i]);
+  }
+  return size;
+}
+
+size_t load_age_pop_state(AgePop *ap, const uint8 *buf) {
+  size_t size = load_pop_state(&ap->summary, buf);
+  for (size_t i = 0; i < ap->n_strata; i++) {
+    size += load_pop_state(ap->strata[i], &buf[size]);
+  }
+  return size;
+}
+
+static EpiError allocate_age_pop(AgePop **out, size_t k) {
+  AgePop *ap = (AgePop *)calloc(1, sizeof(AgePop));
+  if (ap == NULL) {
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+
+  size_t stride = (k + MIXING_LANES - 1) / MIXING_LANES * MIXING_LANES;
+  ap->n_strata = k;
+  ap->mixing_stride = stride;
+  ap->strata = (Population **)calloc(k, sizeof(Population *));
+  ap->diseases = (Disease *)calloc(k, sizeof(Disease));
+  ap->contacts = (float *)calloc(N_CONTACT_LAYERS * k * k, sizeof(float));
+  ap->mixing = (float *)calloc(k * stride, sizeof(float));
+  ap->pools = (ContactPool *)calloc(k, sizeof(ContactPool));
+  ap->prevalence = (float *)calloc(stride, sizeof(float));
+  ap->force = (float *)calloc(stride, sizeof(float));
+  if (ap->strata == NULL || ap->diseases == NULL || ap->contacts == NULL ||
+    ap->mixing == NULL || ap->pools == NULL || ap->prevalence == NULL ||
+    ap->force == NULL) {
+    free_age_pop(&ap);
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+
+  *out = ap;
+  return EPI_ERROR_SUCCESS;
+}
+
+static EpiError read_age_params(AgePop *ap, float *fractions, DataFile *df) {
+  size_t k = ap->n_strata;
+  PASS_ERROR(read_float_array(fractions, k, df, "AGE_FRACTIONS"));
+
+  double sum = 0.0;
+  for (size_t i = 0; i < k; i++) {
+    sum += fractions[i];
+  }
+  if (!(sum > 0.0)) {
+    return invalid_data(df, "AGE_FRACTIONS", "fractions add up to zero");
+  }
+  for (size_t i = 0; i < k; i++) {
+    fractions[i] = (float)(fractions[i] / sum);
+  }
+
+  double *table = (double *)malloc(k * k * sizeof(double));
+  if (table == NULL) {
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+
+  const char *tokens[N_CONTACT_LAYERS] = {"CONTACTS_HOME", "CONTACTS_SCHOOL",
+    "CONTACTS_WORK", "CONTACTS_OTHER"};
+  EpiError err = EPI_ERROR_SUCCESS;
+  for (size_t l = 0; l < N_CONTACT_LAYERS && err == EPI_ERROR_SUCCESS; l++) {
+    err = read_double_table(table, k, k, df, tokens[l]);
+    for (size_t i = 0; i < k * k && err == EPI_ERROR_SUCCESS; i++) {
+      if (!(table[i] >= 0.0)) {
+        err = invalid_data(df, tokens[l], "negative contacts");
+      }
+      ap->contacts[l * k * k + i] = (float)table[i];
+    }
+  }
+  free(table);
+  PASS_ERROR(err);
+
+  // Average baseline contacts per person, which the disease's transmission
+  // probabilities correspond to
+  double norm = 0.0;
+  for (size_t l = 0; l < N_CONTACT_LAYERS; l++) {
+    for (size_t i = 0; i < k; i++) {
+      for (size_t j = 0; j < k; j++) {
+        norm += fractions[i] * ap->contacts[(l * k + i) * k + j];
+      }
+    }
+  }
+  if (!(norm > 0.0)) {
+    return invalid_data(df, NULL, "no contacts");
+  }
+  ap->contact_norm = (float)norm;
+
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError free_age_pop(AgePop **ap) {
+  if (ap == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  if (*ap == NULL) {
+    return EPI_ERROR_SUCCESS;
+  }
+
+  AgePop *a = *ap;
+  if (a->strata != NULL) {
+    for (size_t i = 0; i < a->n_strata; i++) {
+      free_pop(&a->strata[i]);
+    }
+  }
+  free(a->strata);
+  free(a->diseases);
+  free(a->contacts);
+  free(a->mixing);
+  free(a->pools);
+  free(a->prevalence);
+  free(a->force);
+  free(a);
+  *ap = NULL;
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError infect_age_pop(AgePop *ap, uint64 n_cases) {
+  if (ap == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  size_t k = ap->n_strata;
+  double *weights = (double *)calloc(k, sizeof(double));
+  uint64 *n = (uint64 *)calloc(k, sizeof(uint64));
+  if (weights == NULL || n == NULL) {
+    free(weights);
+    free(n);
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+
+  if (n_cases > ap->summary.n_susceptible) {
+    n_cases = ap->summary.n_susceptible;
+  }
+  for (size_t i = 0; i < k; i++) {
+    weights[i] = (double)ap->strata[i]->n_susceptible;
+  }
+  split_people(n, n_cases, weights, k);
+
+  EpiError err = EPI_ERROR_SUCCESS;
+  for (size_t i = 0; i < k && err == EPI_ERROR_SUCCESS; i++) {
+    err = infect_pop(ap->strata[i], n[i]);
+  }
+  free(weights);
+  free(n);
+
+  update_summary(ap);
+  return err;
+}
+
+EpiError evolve_age_pop(AgePop *ap, bool vaccine, Sampler *smp) {
+  if (ap == NULL || smp == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  size_t k = ap->n_strata;
+  const EpiInput *policy = &ap->summary.policy;
+
+  share_hospital_beds(ap);
+
+  // Disease progression within each stratum
+  for (size_t i = 0; i < k; i++) {
+    memcpy(&ap->strata[i]->policy, policy, sizeof(EpiInput));
+    PASS_ERROR(evolve_pop_transitions(ap->strata[i], &ap->diseases[i],
+      vaccine, smp));
+  }
+  update_summary(ap);
+  share_hospital_beds(ap);
+
+  // Distancing and stay-at-home orders act through the contact settings.
+  // Within each stratum, the policy only changes how much symptomatic and
+  // critical people mix with others.
+  float scale[N_CONTACT_LAYERS];
+  calc_layer_scales(scale, &ap->summary, policy);
+  update_mixing(ap, scale);
+
+  EpiInput within;
+  memset(&within, 0, sizeof(EpiInput));
+  within.dist_home_symp = policy->dist_home_symp || policy->dist_home_all;
+
+  for (size_t i = 0; i < k; i++) {
+    calc_contact_pool_policy(&ap->pools[i], ap->strata[i], &ap->diseases[i],
+      &within);
+    ap->prevalence[i] = ap->pools[i].contacts > 0.0 ?
+      (float)(ap->pools[i].infectious / ap->pools[i].contacts) : 0.f;
+  }
+
+  mixing_matvec(ap->force, ap->mixing, ap->prevalence, k, ap->mixing_stride);
+
+  // New infections in each stratum
+  for (size_t i = 0; i < k; i++) {
+    float p = ap->pools[i].w_susceptible * ap->force[i];
+    if (p > 1.f) {
+      p = 1.f;
+    }
+    PASS_ERROR(infect_pop_draw(ap->strata[i], p, smp));
+  }
+
+  update_summary(ap);
+  return EPI_ERROR_SUCCESS;
+}
+
+static void split_people(uint64 *out, uint64 n, const double *weights,
+  size_t k) {
+  double total = 0.0;
+  for (size_t i = 0; i < k; i++) {
+    total += weights[i];
+  }
+
+  // Round cumulative sums, so that parts add up to n
+  double cumulative = 0.0;
+  uint64 assigned = 0;
+  for (size_t i = 0; i < k; i++) {
+    cumulative += weights[i];
+    uint64 upto = total > 0.0 ?
+      (uint64)((double)n * (cumulative / total) + 0.5) : 0;
+    if (upto > n || i == k - 1) {
+      upto = total > 0.0 ? n : 0;
+    }
+    out[i] = upto > assigned ? upto - assigned : 0;
+    assigned += out[i];
+  }
+}
+
+static void calc_layer_scales(float *scale, const Population *pop,
+  const EpiInput *policy) {
+  // Ratio of contacts when staying at home to normal contacts
+  float r_home = pop->cr_normal > 0.f ? pop->cr_home / pop->cr_normal : 1.f;
+
+  scale[CONTACT_HOME] = 1.f;
+  scale[CONTACT_SCHOOL] = 1.f;
+  scale[CONTACT_WORK] = 1.f;
+  scale[CONTACT_OTHER] = 1.f;
+
+  if (policy->dist_home_all) {
+    // Only people with critical jobs keep going to work
+    scale[CONTACT_SCHOOL] = 0.f;
+    scale[CONTACT_WORK] = pop->f_critical_jobs;
+    scale[CONTACT_OTHER] = r_home;
+  } else if (policy->dist_recommend) {
+    scale[CONTACT_WORK] = 0.5f * (1.f + r_home);
+    scale[CONTACT_OTHER] = 0.5f * (1.f + r_home);
+  }
+
+  if (policy->schools_closed) {
+    scale[CONTACT_SCHOOL] = 0.f;
+  }
+}
+
+static void update_mixing(AgePop *ap, const float *scale) {
+  if (!memcmp(ap->layer_scale, scale, sizeof(ap->layer_scale))) {
+    return;
+  }
+  memcpy(ap->layer_scale, scale, sizeof(ap->layer_scale));
+
+  size_t k = ap->n_strata;
+  for (size_t i = 0; i < k; i++) {
+    float *row = &ap->mixing[i * ap->mixing_stride];
+    for (size_t j = 0; j < k; j++) {
+      float m = 0.f;
+      for (size_t l = 0; l < N_CONTACT_LAYERS; l++) {
+        m += scale[l] * ap->contacts[(l * k + i) * k + j];
+      }
+      row[j] = m / ap->contact_norm;
+    }
+  }
+}
+
+EPI_TARGET_CLONES
+static void mixing_matvec(float *restrict y, const float *restrict m,
+  const float *restrict x, size_t n_rows, size_t stride) {
+  // Each row is summed in MIXING_LANES independent partial sums, which the
+  // compiler maps onto vector lanes without reordering any additions.
+  // For the handful of strata used in practice, x stays in L1 throughout.
+  for (size_t i = 0; i < n_rows; i++) {
+    const float *row = &m[i * stride];
+    float acc[MIXING_LANES] = {0.f};
+    for (size_t j = 0; j < stride; j += MIXING_LANES) {
+      for (size_t l = 0; l < MIXING_LANES; l++) {
+        acc[l] += row[j + l] * x[j + l];
+      }
+    }
+
+    float sum = 0.f;
+    for (size_t l = 0; l < MIXING_LANES; l++) {
+      sum += acc[l];
+    }
+    y[i] = sum;
+  }
+}
+
+static void share_hospital_beds(AgePop *ap) {
+  uint64 n_beds = ap->summary.n_hospital_beds;
+  uint64 n_critical = ap->summary.n_total_critical;
+  for (size_t i = 0; i < ap->n_strata; i++) {
+    Population *pop = ap->strata[i];
+    pop->n_hospital_beds = n_critical > 0 ? (uint64)((double)n_beds *
+      (double)pop->n_total_critical / (double)n_critical) : n_beds;
+  }
+}
+
+static void update_summary(AgePop *ap) {
+  Population *s = &ap->summary;
+  s->n_total = 0;
+  s->n_susceptible = 0;
+  s->n_infected = 0;
+  s->n_total_asymptomatic = 0;
+  s->n_total_symptomatic = 0;
+  s->n_total_critical = 0;
+  s->n_recovered = 0;
+  s->n_vaccinated = 0;
+  s->n_dead_last = 0;
+  s->n_dead = 0;
+
+  for (size_t i = 0; i < ap->n_strata; i++) {
+    const Population *pop = ap->strata[i];
+    s->n_total += pop->n_total;
+    s->n_susceptible += pop->n_susceptible;
+    s->n_infected += pop->n_infected;
+    s->n_total_asymptomatic += pop->n_total_asymptomatic;
+    s->n_total_symptomatic += pop->n_total_symptomatic;
+    s->n_total_critical += pop->n_total_critical;
+    s->n_recovered += pop->n_recovered;
+    s->n_vaccinated += pop->n_vaccinated;
+    s->n_dead_last += pop->n_dead_last;
+    s->n_dead += pop->n_dead;
+  }
+}
@@ -0,0 +1,95 @@
+#ifndef __AGE_POP_H__
+#define __AGE_POP_H__
+// Age-structured population: one population per age stratum, each with its
+// own day bins and severity curves, mixing through contact matrices.
+//
+// Contacts are given as one matrix per setting (home, school, work, other):
+// entry [i][j] is the average number of daily contacts that a person in
+// stratum i has with people in stratum j.  Policies scale each setting,
+// and the force of infection on stratum i is the product of the combined
+// matrix with the infectious fraction of contacts of each stratum.
+
+#include "common.h"
+#include "disease.h"
+#include "population.h"
+#include "sampler.h"
+
+typedef enum {
+  CONTACT_HOME,
+  CONTACT_SCHOOL,
+  CONTACT_WORK,
+  CONTACT_OTHER,
+  N_CONTACT_LAYERS
+} ContactLayer;
+
+// Rows of the combined contact matrix are padded to a multiple of this many
+// entries, so that the matrix-vector product runs in whole vector lanes
+#define MIXING_LANES 8
+
+typedef struct {
+  size_t n_strata;
+  Population **strata;
+
+  // Disease as seen by each stratum, sharing arrays with the model's disease
+  Disease *diseases;
+
+  // Sum of all strata.  Holds the policy in place, the economic parameters
+  // and the hospital beds shared by all strata, but no day bins.
+  Population summary;
+
+  // Contact matrices, one n_strata x n_strata block per setting
+  float *contacts;
+
+  // Average number of baseline contacts per person, over all settings
+  float contact_norm;
+
+  // Combined contact matrix for the current setting scales, relative to
+  // contact_norm, with rows of mixing_stride entries
+  float layer_scale[N_CONTACT_LAYERS];
+  size_t mixing_stride;
+  float *mixing;
+
+  // Per-step work arrays, padded to mixing_stride entries
+  ContactPool *pools;
+  float *prevalence;  // Infectious fraction of each stratum's contacts
+  float *force;       // Force of infection on each stratum
+} AgePop;
+
+// Create an age-structured population from an age structure data file.
+// Each stratum gets the parameters of the base population, and its share
+// of the base population's people.  The disease must either have no age
+// dependence, or one set of severity curves for each stratum.
+// The age structure file has tokens:
+//   $N_AGE_STRATA    number of strata
+//   $AGE_FRACTIONS   fraction of the population in each stratum
+//   $CONTACTS_HOME, $CONTACTS_SCHOOL, $CONTACTS_WORK, $CONTACTS_OTHER
+//                    contact matrix for each setting, one row per line
+EpiError create_age_pop_from_file(AgePop **out, const Population *base,
+  const Disease *dis, const char *fname);
+
+// Create a deep copy of an age-structured population.  The copy's disease
+// views share arrays with the same disease as the original.
+EpiError copy_age_pop(AgePop **out, const AgePop *ap);
+
+// Frees age-structured population and all strata.  Nulls the pointer.
+EpiError free_age_pop(AgePop **ap);
+
+// Size in bytes of the state saved by save_age_pop_state()
+size_t age_pop_state_size(const AgePop *ap);
+
+// Write the mutable state of all strata and the summary to buf.  Returns the
+// number of bytes written.
+size_t save_age_pop_state(uint8 *buf, const AgePop *ap);
+
+// Restore state written by save_age_pop_state() for a population with the
+// same strata.  Returns the number of bytes read.
+size_t load_age_pop_state(AgePop *ap, const uint8 *buf);
+
+// Infect members of the population, spread over strata in proportion to
+// their susceptible people
+EpiError infect_age_pop(AgePop *ap, uint64 n_cases);
+
+// Evolve all strata forward by one day, under the policy in ap->summary
+EpiError evolve_age_pop(AgePop *ap, bool vaccine, Sampler *smp);
+
+#endif
@@ -1,16 +1,21 @@
 #include "approx_binomial.h"
+#include "profile.h"
 
 // Draw a number of events from a Poisson distribution
-static EpiError poisson_draw(uint64 *k, float rate);
+static EpiError poisson_draw(uint64 *k, float rate, EpiRng *rng);
 
 // Generate a normally distributed floating point number
 // with mean = 0 and variance = 1
-static float rand_normal();
+static float rand_normal(EpiRng *rng);
+
+// Smallest uniform deviate used where 0 would lead to division by zero or log(0)
+#define MIN_UNIFORM 1e-7f
 
 EpiError approx_dbin_draw(uint64 *nx, uint64 *ny,
-  float p_x, float p_y, uint64 n) {
+  float p_x, float p_y, uint64 n, EpiRng *rng) {
 
-  if (nx == NULL || ny == NULL || p_x + p_y > 1.f || p_x < 0.f || p_y < 0.f) {
+  if (nx == NULL || ny == NULL || rng == NULL ||
+    p_x + p_y > 1.f || p_x < 0.f || p_y < 0.f) {
     return EPI_ERROR_INVALID_ARGS;
   }
 
@@ -27,7 +32,7 @@ EpiError approx_dbin_draw(uint64 *nx, uint64 *ny,
   uint64 nxy;
 
   int err;
-  err = approx_bin_draw(&nxy, p_xy, n);
+  err = approx_bin_draw(&nxy, p_xy, n, rng);
   if (err != EPI_ERROR_SUCCESS) {
     return err;
   }
@@ -52,7 +57,7 @@ EpiError approx_dbin_draw(uint64 *nx, uint64 *ny,
 
   // Probability of x, given that either x or y occurred
   float p = p_x / (p_x + p_y);
-  err = approx_bin_draw(nx, p, nxy);
+  err = approx_bin_draw(nx, p, nxy, rng);
   if (err) {
     return err;
   }
@@ -68,8 +73,8 @@ EpiError approx_dbin_draw(uint64 *nx, uint64 *ny,
 // distribution as a Gaussian distribution
 #define GAUSSIAN_CUTOFF 0.5
 
-EpiError approx_bin_draw(uint64 *k, float p, uint64 n) {
-  if (k == NULL || p < 0.f || p > 1.f) {
+EpiError approx_bin_draw(uint64 *k, float p, uint64 n, EpiRng *rng) {
+  if (k == NULL || rng == NULL || p < 0.f || p > 1.f) {
     return EPI_ERROR_INVALID_ARGS;
   }
 
@@ -96,11 +101,16 @@ EpiError approx_bin_draw(uint64 *k, float p, uint64 n) {
 
   // p << 1: use Poisson sampling, retry if we end up with k > n (unlikely)
   if (p <= POISSON_CUTOFF) {
-    do {
-      if (poisson_draw(&result, p * n)) {
+    PROFILE_COUNT(n_poisson_draws, 1);
+    for (;;) {
+      if (poisson_draw(&result, p * n, rng)) {
         return EPI_ERROR_UNEXPECTED_STATE;
       }
-    } while (result > n);
+      if (result <= n) {
+        break;
+      }
+      PROFILE_COUNT(n_poisson_retries, 1);
+    }
   } else {
     float ev = p * n;
     float std = (float)sqrt(ev * (1.f - p));
@@ -108,16 +118,17 @@ EpiError approx_bin_draw(uint64 *k, float p, uint64 n) {
     // standard deviation of k << <k>: use Gaussian sampling, retry
     // if we end up with k < 0 or k > n
     if (std <= ev * GAUSSIAN_CUTOFF) {
+      PROFILE_COUNT(n_gaussian_draws, 1);
       float z;
       for(;;) {
-        z = ev + std * rand_normal();
-        if (z < 0.f) {
-          continue;
-        }
-        result = (uint64)z;
-        if (result <= n) {
-          break;
+        z = ev + std * rand_normal(rng);
+        if (z >= 0.f) {
+          result = (uint64)z;
+          if (result <= n) {
+            break;
+          }
         }
+        PROFILE_COUNT(n_gaussian_retries, 1);
       }
     }
     // If we are here, n is reasonably small:
@@ -125,10 +136,10 @@ EpiError approx_bin_draw(uint64 *k, float p, uint64 n) {
     // We could use clever algorithms like BTPE to squeeze out some extra
     // performance, but for now let's just use Monte Carlo
     else {
+      PROFILE_COUNT(n_monte_carlo_draws, 1);
       result = 0;
       for (size_t i = 0; i < n; i++) {
-        float z = (float)rand() / (float)RAND_MAX;
-        if (z < p) {
+        if (rng_uniform(rng) < p) {
           result++;
         }
       }
@@ -142,8 +153,8 @@ EpiError approx_bin_draw(uint64 *k, float p, uint64 n) {
 // Max steps in accept-reject method before we assume there is an error
 #define POISSON_MAX_STEPS 1024
 
-static EpiError poisson_draw(uint64 *k, float rate) {
-  if (k == NULL || rate < 0.f) {
+static EpiError poisson_draw(uint64 *k, float rate, EpiRng *rng) {
+  if (k == NULL || rng == NULL || rate < 0.f) {
     return EPI_ERROR_INVALID_ARGS;
   }
   if (rate == 0.f) {
@@ -160,15 +171,15 @@ static EpiError poisson_draw(uint64 *k, float rate) {
     float z = (float)log(c/b) - rate;
 
     for(size_t i = 0; i < POISSON_MAX_STEPS; i++) {
-      float u = (float)rand() / (float)RAND_MAX;
+      float u = (float)rng_uniform(rng);
       float v = 1.f - u;
 
       // Avoid floating point errors like division by zero or log(0)
       if (u == 0.f) {
-        u = 1.f / (float)RAND_MAX;
+        u = MIN_UNIFORM;
         v -= u;
       } else if (v == 0.f) {
-        v = 1.f / (float)RAND_MAX;
+        v = MIN_UNIFORM;
         u -= v;
       }
 
@@ -181,19 +192,21 @@ static EpiError poisson_draw(uint64 *k, float rate) {
       uint64 n = (uint64)(x + 0.5f);
 
       // Main rejection step
-      float w = (float)rand() / (float)RAND_MAX;
+      float w = (float)rng_uniform(rng);
       if (w == 0.f) {
-        w = 1.f / (float)RAND_MAX;
+        w = MIN_UNIFORM;
       }
       float y = a - b * x;
       float d = 1.f + (float)exp(y);
       d *= d;
       if (y + (float)log(w/d) <=
         z + n*(float)log(rate) - (float)lgamma((float)n + 1.f)) {
+        PROFILE_COUNT(n_poisson_retries, i);
         *k = n;
         return 0;
       }
     }
+    PROFILE_COUNT(n_poisson_retries, POISSON_MAX_STEPS);
   }
 
   // If we got here, either the rate is low, or the accept-reject algorithm
@@ -211,19 +224,18 @@ static EpiError poisson_draw(uint64 *k, float rate) {
   float p = 1.f;
   do {
     n++;
-    float u = (float)rand() / (float)RAND_MAX;
-    p *= u;
+    p *= (float)rng_uniform(rng);
   } while (p > z);
   *k = n - 1;
   return EPI_ERROR_SUCCESS;
 }
 
 // Marsaglia's algorithm for generating normally distributed random numbers
-static float rand_normal() {
+static float rand_normal(EpiRng *rng) {
   float x, y, r2;
   do {
-    x = (float)rand() / (float)RAND_MAX;
-    y = (float)rand() / (float)RAND_MAX;
+    x = (float)rng_uniform(rng);
+    y = (float)rng_uniform(rng);
     x = 2.f * x - 1.f;
     y = 2.f * y - 1.f;
     r2 = x * x + y * y;
@@ -231,3 +243,241 @@ static float rand_normal() {
 
   return x * (float)sqrt(-2.f * log(r2) / r2);
 }
+
+// Number of draws processed together by the batched sampler
+#define BATCH_LANES 64
+
+// Sampling regimes of approx_bin_draw(), after swapping to p <= 0.5
+enum {
+  REGIME_ZERO,        // p * n == 0, no outcomes
+  REGIME_POISSON,
+  REGIME_GAUSSIAN,
+  REGIME_MONTE_CARLO
+};
+
+// Classify draws by sampling regime, and compute the swapped probability,
+// expectation value and standard deviation for each.
+// Written without data-dependent branches, so that it vectorizes: every
+// value is computed in every lane and only selected by the regime.  The
+// lane sizes are converted to float by the caller, since there is no
+// vector conversion from 64-bit integers short of AVX-512DQ.
+EPI_TARGET_CLONES
+static void classify_lanes(unsigned char *restrict regime,
+  unsigned char *restrict swap, float *restrict q, float *restrict ev,
+  float *restrict std, const float *restrict p, const float *restrict nf,
+  size_t m) {
+
+  for (size_t i = 0; i < m; i++) {
+    unsigned char sw = p[i] > 0.5f;
+    float pc = 1.f - p[i];
+    float qi = sw ? pc : p[i];
+    float qc = sw ? p[i] : pc;
+    float e = qi * nf[i];
+    float s = sqrtf(e * qc);
+    float cut = e * (float)GAUSSIAN_CUTOFF;
+
+    unsigned char r = qi <= POISSON_CUTOFF ? REGIME_POISSON :
+      (s <= cut ? REGIME_GAUSSIAN : REGIME_MONTE_CARLO);
+
+    regime[i] = e <= 0.f ? REGIME_ZERO : r;
+    swap[i] = sw;
+    q[i] = qi;
+    ev[i] = e;
+    std[i] = s;
+  }
+}
+
+// Natural logarithm of a positive, normal float, accurate to about 1 ulp.
+// The libm logf() has no vector form outside of -ffast-math, so the batched
+// sampler uses this polynomial (from Cephes) to keep its loops vectorized.
+static EPI_ALWAYS_INLINE float poly_logf(float x) {
+  uint32 bits;
+  memcpy(&bits, &x, sizeof(float));
+
+  // Split x into 2^e * f, with f in [sqrt(1/2), sqrt(2))
+  int32 e = (int32)(bits >> 23) - 126;
+  bits = (bits & 0x007fffffu) | 0x3f000000u;
+  float f;
+  memcpy(&f, &bits, sizeof(float));
+  int32 lo = f < 0.70710678f;
+  e -= lo;
+  f = f - 1.f + (lo ? f : 0.f);
+
+  float z = f * f;
+  float y = 7.0376836292e-2f;
+  y = y * f - 1.1514610310e-1f;
+  y = y * f + 1.1676998740e-1f;
+  y = y * f - 1.2420140846e-1f;
+  y = y * f + 1.4249322787e-1f;
+  y = y * f - 1.6668057665e-1f;
+  y = y * f + 2.0000714765e-1f;
+  y = y * f - 2.4999993993e-1f;
+  y = y * f + 3.3333331174e-1f;
+  y = y * f * z;
+
+  float ef = (float)e;
+  y += -2.12194440e-4f * ef;
+  y += -0.5f * z;
+  return f + y + 0.693359375f * ef;
+}
+
+// Cosine and sine of 2 pi u for u in [0, 1], accurate to about 1 ulp.
+// Polynomials from Cephes, after reducing the angle to [-pi/4, pi/4].
+static EPI_ALWAYS_INLINE void poly_sincos_2pi(float *c, float *s, float u) {
+  int32 j = (int32)(4.f * u + 0.5f);
+  float x = 2.f * (float)M_PI * (u - 0.25f * (float)j);
+  float z = x * x;
+
+  float sx = ((-1.9515295891e-4f * z + 8.3321608736e-3f) * z
+    - 1.6666654611e-1f) * z * x + x;
+  float cx = ((2.443315711809948e-5f * z - 1.388731625493765e-3f) * z
+    + 4.166664568298827e-2f) * z * z - 0.5f * z + 1.f;
+
+  // Rotate by the quadrant j: cos and sin trade places on odd quadrants,
+  // cos is negative in quadrants 1 and 2, and sin in quadrants 2 and 3
+  int32 odd = j & 1;
+  float cq = odd ? sx : cx;
+  float sq = odd ? cx : sx;
+  *c = ((j + 1) & 2) ? -cq : cq;
+  *s = (j & 2) ? -sq : sq;
+}
+
+// Fill z with m standard normal deviates, m even, using the Box-Muller
+// transform.  Uniform deviates in (0, 1] are drawn first, so that the
+// transform runs as a separate loop without branches or libm calls.
+EPI_TARGET_CLONES
+static void box_muller(float *restrict z, const float *restrict u, size_t m) {
+  for (size_t i = 0; i < m; i += 2) {
+    float r = sqrtf(-2.f * poly_logf(u[i]));
+    float c, s;
+    poly_sincos_2pi(&c, &s, u[i+1]);
+    z[i] = r * c;
+    z[i+1] = r * s;
+  }
+}
+
+// Approximate binomial draws for m <= BATCH_LANES lanes
+static EpiError bin_draw_lanes(uint64 *k, const float *p, const uint64 *n,
+  size_t m, EpiRng *rng) {
+
+  unsigned char regime[BATCH_LANES];
+  unsigned char swap[BATCH_LANES];
+  float q[BATCH_LANES];
+  float ev[BATCH_LANES];
+  float std[BATCH_LANES];
+  float nf[BATCH_LANES];
+
+  for (size_t i = 0; i < m; i++) {
+    nf[i] = (float)n[i];
+  }
+  classify_lanes(regime, swap, q, ev, std, p, nf, m);
+
+  // Generate one normal deviate per Gaussian lane, rounded up to a pair
+  size_t n_gauss = 0;
+  for (size_t i = 0; i < m; i++) {
+    n_gauss += regime[i] == REGIME_GAUSSIAN;
+  }
+  n_gauss += n_gauss & 1;
+
+  float u[BATCH_LANES];
+  float z[BATCH_LANES];
+  for (size_t i = 0; i < n_gauss; i++) {
+    u[i] = (float)rng_uniform_pos(rng);
+    if (u[i] == 0.f) {
+      u[i] = MIN_UNIFORM;
+    }
+  }
+  box_muller(z, u, n_gauss);
+
+  size_t j = 0;
+  for (size_t i = 0; i < m; i++) {
+    uint64 result = 0;
+
+    switch (regime[i]) {
+      case REGIME_ZERO:
+        break;
+
+      case REGIME_POISSON:
+        PROFILE_COUNT(n_poisson_draws, 1);
+        for (;;) {
+          if (poisson_draw(&result, ev[i], rng)) {
+            return EPI_ERROR_UNEXPECTED_STATE;
+          }
+          if (result <= n[i]) {
+            break;
+          }
+          PROFILE_COUNT(n_poisson_retries, 1);
+        }
+        break;
+
+      case REGIME_GAUSSIAN: {
+        PROFILE_COUNT(n_gaussian_draws, 1);
+        // Use the pregenerated deviate, and fall back to the scalar
+        // generator only if it lands outside [0, n]
+        float x = ev[i] + std[i] * z[j++];
+        while (x < 0.f || (uint64)x > n[i]) {
+          PROFILE_COUNT(n_gaussian_retries, 1);
+          x = ev[i] + std[i] * rand_normal(rng);
+        }
+        result = (uint64)x;
+        break;
+      }
+
+      case REGIME_MONTE_CARLO:
+        PROFILE_COUNT(n_monte_carlo_draws, 1);
+        for (size_t t = 0; t < n[i]; t++) {
+          if (rng_uniform(rng) < q[i]) {
+            result++;
+          }
+        }
+        break;
+    }
+
+    k[i] = swap[i] ? n[i] - result : result;
+  }
+
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError approx_dbin_draw_batch(uint64 *nx, uint64 *ny, const float *p_x,
+  const float *p_y, const uint64 *n, size_t count, EpiRng *rng) {
+
+  if (nx == NULL || ny == NULL || p_x == NULL || p_y == NULL || n == NULL ||
+    rng == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  for (size_t start = 0; start < count; start += BATCH_LANES) {
+    size_t m = count - start < BATCH_LANES ? count - start : BATCH_LANES;
+    const float *px = &p_x[start];
+    const float *py = &p_y[start];
+
+    // First, number of events x + events y
+    float p[BATCH_LANES];
+    for (size_t i = 0; i < m; i++) {
+      if (px[i] + py[i] > 1.f || px[i] < 0.f || py[i] < 0.f) {
+        return EPI_ERROR_INVALID_ARGS;
+      }
+      p[i] = px[i] + py[i];
+    }
+
+    uint64 nxy[BATCH_LANES];
+    PASS_ERROR(bin_draw_lanes(nxy, p, &n[start], m, rng));
+
+    // Then, number of events x given that either x or y occurred.
+    // Lanes where p_x or p_y is zero get probability 0 or 1 here, which
+    // the sampler resolves without drawing.
+    for (size_t i = 0; i < m; i++) {
+      float pc = p[i] > 0.f ? px[i] / p[i] : 0.f;
+      p[i] = pc > 1.f ? 1.f : pc;
+    }
+
+    PASS_ERROR(bin_draw_lanes(&nx[start], p, nxy, m, rng));
+
+    for (size_t i = 0; i < m; i++) {
+      ny[start + i] = nxy[i] - nx[start + i];
+    }
+  }
+
+  return EPI_ERROR_SUCCESS;
+}
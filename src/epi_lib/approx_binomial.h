@@ -3,6 +3,7 @@
 // Draw from a binomial distribution, using mean + variance approximation
 
 #include "common.h"
+#include "rng.h"
 
 // Approximate double draw from a binomial distribution.
 // Outcomes x and y are mutually exclusive, having probabilities p_x and p_y
@@ -12,11 +13,21 @@
 // ny = number of outcomes y}, with an approximately correct probability.
 // In the disease model, this is used to determine how many patients from a
 // population recover, have their condition worsen, or neither.
-EpiError approx_dbin_draw(uint64 *nx, uint64 *ny, float p_x, float p_y, uint64 n);
+// Random numbers are taken from the given generator.
+EpiError approx_dbin_draw(uint64 *nx, uint64 *ny, float p_x, float p_y, uint64 n,
+  EpiRng *rng);
 
 // Approximate draw from a binomial distribution.
 // Determine the number of outcomes k, having probability per experiment p,
 // from n experiments.
-EpiError approx_bin_draw(uint64 *k, float p, uint64 n);
+EpiError approx_bin_draw(uint64 *k, float p, uint64 n, EpiRng *rng);
+
+// Batched approximate double draw from a binomial distribution.
+// For each i < count, draws {nx[i], ny[i]} with the same distribution as
+// approx_dbin_draw(&nx[i], &ny[i], p_x[i], p_y[i], n[i]).  Lanes are
+// classified by sampling regime and normal deviates are generated in bulk,
+// so that the per-lane work is done in tight loops over arrays.
+EpiError approx_dbin_draw_batch(uint64 *nx, uint64 *ny, const float *p_x,
+  const float *p_y, const uint64 *n, size_t count, EpiRng *rng);
 
 #endif
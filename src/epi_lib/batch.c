@@ -0,0 +1,306 @@
+#include "batch.h"
+#include "files.h"
+#include "thread_pool.h"
+
+// Batch of independent single-population models, stepped together as a
+// vectorized reinforcement learning environment.  Per-model state is kept
+// in parallel arrays indexed by environment.
+
+struct _EpiBatch {
+  size_t n_envs;
+  // Copy of the configuration, with data file names owned by the batch,
+  // since models are constructed from it long after epi_batch_construct()
+  EpiBatchConfig config;
+
+  // Current model of each environment
+  EpiModel *models;
+  // Scenario randomization stream of each environment, so that the episodes
+  // an environment plays do not depend on the other environments
+  EpiRng *rngs;
+
+  // Buffers for the step in progress, shared with pool tasks
+  const uint32 *actions;
+  float *obs;
+  float *rewards;
+  bool *dones;
+
+  ThreadPool *threads;
+};
+
+// Copy of a string, or NULL if s is NULL or out of memory
+static char *copy_string(const char *s);
+
+// Replace model of environment i with a new, randomized episode
+static EpiError reset_env(EpiBatch batch, size_t i);
+
+// Write observations of one model
+static EpiError env_observables(float *obs, float *reward, bool *done,
+  const EpiModel model);
+
+// Pool tasks: reset or step a single environment
+static EpiError reset_env_task(void *ctx, size_t i);
+static EpiError step_env_task(void *ctx, size_t i);
+
+EpiError epi_batch_construct(EpiBatch *out, const EpiBatchConfig *config,
+  size_t n_envs, size_t n_threads, uint64 seed) {
+
+  clear_last_error();
+
+  if (out == NULL || config == NULL || n_envs == 0) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  if (*out != NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  if (!valid_batch_config(config)) {
+    return EPI_ERROR_INVALID_SCENARIO;
+  }
+
+  EpiBatch batch = (EpiBatch)calloc(1, sizeof(struct _EpiBatch));
+  if (batch == NULL) {
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+
+  batch->n_envs = n_envs;
+  batch->config = *config;
+  EpiScenario *sc = &batch->config.scenario;
+  sc->dis_fname = copy_string(config->scenario.dis_fname);
+  sc->pop_fname = copy_string(config->scenario.pop_fname);
+  sc->age_fname = copy_string(config->scenario.age_fname);
+  batch->models = (EpiModel *)calloc(n_envs, sizeof(EpiModel));
+  batch->rngs = (EpiRng *)malloc(n_envs * sizeof(EpiRng));
+  if (batch->models == NULL || batch->rngs == NULL ||
+    sc->dis_fname == NULL || sc->pop_fname == NULL ||
+    (config->scenario.age_fname != NULL && sc->age_fname == NULL)) {
+    epi_batch_free(&batch);
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+
+  // Non-overlapping stream per environment
+  EpiRng rng;
+  rng_seed(&rng, seed);
+  for (size_t i = 0; i < n_envs; i++) {
+    batch->rngs[i] = rng;
+    rng_jump(&rng);
+  }
+
+  EpiError err = create_thread_pool(&batch->threads, n_threads);
+  if (err == EPI_ERROR_SUCCESS) {
+    err = epi_batch_reset(batch);
+  }
+  if (err != EPI_ERROR_SUCCESS) {
+    epi_batch_free(&batch);
+    return err;
+  }
+
+  *out = batch;
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError epi_batch_free(EpiBatch *batch) {
+  if (batch == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  if (*batch == NULL) {
+    return EPI_ERROR_SUCCESS;
+  }
+
+  if ((*batch)->models != NULL) {
+    for (size_t i = 0; i < (*batch)->n_envs; i++) {
+      epi_free_model(&((*batch)->models[i]));
+    }
+  }
+  free((*batch)->models);
+  free((*batch)->rngs);
+  free_thread_pool(&((*batch)->threads));
+  free((*batch)->config.scenario.dis_fname);
+  free((*batch)->config.scenario.pop_fname);
+  free((*batch)->config.scenario.age_fname);
+  free(*batch);
+  *batch = NULL;
+
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError epi_batch_size(size_t *out, const EpiBatch batch) {
+  clear_last_error();
+
+  if (out == NULL || batch == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  *out = batch->n_envs;
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError epi_batch_reset(EpiBatch batch) {
+  clear_last_error();
+
+  if (batch == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  return thread_pool_run(batch->threads, batch->n_envs, reset_env_task,
+    batch);
+}
+
+EpiError epi_batch_step(EpiBatch batch, const uint32 *actions, float *obs,
+  float *rewards, bool *dones) {
+
+  clear_last_error();
+
+  if (batch == NULL || actions == NULL || obs == NULL || rewards == NULL ||
+    dones == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  batch->actions = actions;
+  batch->obs = obs;
+  batch->rewards = rewards;
+  batch->dones = dones;
+  EpiError err = thread_pool_run(batch->threads, batch->n_envs,
+    step_env_task, batch);
+  batch->actions = NULL;
+  batch->obs = NULL;
+  batch->rewards = NULL;
+  batch->dones = NULL;
+
+  return err;
+}
+
+EpiError epi_batch_get_observables(float *obs, const EpiBatch batch) {
+  clear_last_error();
+
+  if (obs == NULL || batch == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  for (size_t i = 0; i < batch->n_envs; i++) {
+    float reward;
+    bool done;
+    PASS_ERROR(env_observables(&obs[i * N_EPI_OBSERVATIONS], &reward, &done,
+      batch->models[i]));
+  }
+
+  return EPI_ERROR_SUCCESS;
+}
+
+void draw_episode(EpiScenario *out, const EpiBatchConfig *config,
+  EpiRng *rng) {
+
+  // Draw every number up front, so that the stream advances by the same
+  // amount for every episode
+  double u_outbreak = rng_uniform(rng);
+  double u_initial = rng_uniform(rng);
+  double u_vaccine = rng_uniform(rng);
+  uint64 seed = rng_next(rng);
+
+  *out = config->scenario;
+  out->seed = seed;
+
+  int t_start;
+  if (u_outbreak < config->p_no_outbreak) {
+    out->t_initial = -1;
+    out->t_max = config->no_outbreak_days;
+    t_start = 0;
+  } else {
+    int span = config->t_initial_max - config->t_initial_min + 1;
+    out->t_initial = config->t_initial_min + (int)(u_initial * span);
+    t_start = out->t_initial;
+  }
+
+  int span = config->vaccine_delay_max - config->vaccine_delay_min + 1;
+  out->t_vaccine = t_start + config->vaccine_delay_min +
+    (int)(u_vaccine * span);
+}
+
+bool valid_batch_config(const EpiBatchConfig *config) {
+  const EpiScenario *s = &config->scenario;
+  if (s->dis_fname == NULL || s->pop_fname == NULL) {
+    return false;
+  }
+  if (!(config->p_no_outbreak >= 0.0f && config->p_no_outbreak <= 1.0f)) {
+    return false;
+  }
+  if (config->p_no_outbreak > 0.0f && config->no_outbreak_days <= 0) {
+    return false;
+  }
+  if (config->t_initial_min < 0 ||
+    config->t_initial_max < config->t_initial_min) {
+    return false;
+  }
+  if (config->vaccine_delay_min < 0 ||
+    config->vaccine_delay_max < config->vaccine_delay_min) {
+    return false;
+  }
+  return true;
+}
+
+static char *copy_string(const char *s) {
+  if (s == NULL) {
+    return NULL;
+  }
+  size_t size = strlen(s) + 1;
+  char *copy = (char *)malloc(size);
+  if (copy != NULL) {
+    memcpy(copy, s, size);
+  }
+  return copy;
+}
+
+static EpiError reset_env(EpiBatch batch, size_t i) {
+  EpiScenario scenario;
+  draw_episode(&scenario, &batch->config, &batch->rngs[i]);
+
+  if (batch->models[i] != NULL) {
+    return epi_reset_model(batch->models[i], &scenario);
+  }
+  return epi_construct_model(&batch->models[i], &scenario);
+}
+
+static EpiError env_observables(float *obs, float *reward, bool *done,
+  const EpiModel model) {
+
+  EpiObservable o;
+  PASS_ERROR(epi_get_observables(&o, model));
+  PASS_ERROR(epi_rl_observation(obs, &o));
+
+  *reward = -o.cost_function;
+  *done = o.finished;
+
+  return EPI_ERROR_SUCCESS;
+}
+
+static EpiError reset_env_task(void *ctx, size_t i) {
+  return reset_env((EpiBatch)ctx, i);
+}
+
+static EpiError step_env_task(void *ctx, size_t i) {
+  EpiBatch batch = (EpiBatch)ctx;
+  uint32 action = batch->actions[i];
+  float *obs = &batch->obs[i * N_EPI_OBSERVATIONS];
+
+  EpiInput input;
+  memset(&input, 0, sizeof(EpiInput));
+  input.dist_recommend = (action & EPI_ACTION_DIST_RECOMMEND) != 0;
+  input.dist_home_symp = (action & EPI_ACTION_DIST_HOME_SYMP) != 0;
+  input.dist_home_all = (action & EPI_ACTION_DIST_HOME_ALL) != 0;
+  input.schools_closed = (action & EPI_ACTION_SCHOOLS_CLOSED) != 0;
+
+  PASS_ERROR(epi_model_step(batch->models[i], &input));
+  PASS_ERROR(env_observables(obs, &batch->rewards[i], &batch->dones[i],
+    batch->models[i]));
+
+  // Start the next episode straight away, and report its first observation
+  if (batch->dones[i]) {
+    float reward;
+    bool done;
+    PASS_ERROR(reset_env(batch, i));
+    PASS_ERROR(env_observables(obs, &reward, &done, batch->models[i]));
+  }
+
+  return EPI_ERROR_SUCCESS;
+}
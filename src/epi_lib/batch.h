@@ -0,0 +1,17 @@
+#ifndef __BATCH_H__
+#define __BATCH_H__
+// Randomized episodes, shared by batches of environments and ensembles
+
+#include "common.h"
+#include "rng.h"
+
+// Draw the scenario of a new episode from config.  Always takes the same
+// number of draws from rng, so that later episodes drawn from the same
+// stream do not depend on the outcome of this one.
+void draw_episode(EpiScenario *out, const EpiBatchConfig *config,
+  EpiRng *rng);
+
+// Check that randomized scenarios are well-formed
+bool valid_batch_config(const EpiBatchConfig *config);
+
+#endif
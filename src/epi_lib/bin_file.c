@@ -0,0 +1,334 @@
+#include "bin_file.h"
+#include "files.h"
+
+// Is this machine little-endian, as binary data files are?
+static bool host_little_endian(void);
+
+// Check the header of a binary data file read into memory
+static EpiError check_bin_header(const uint8 *data, size_t size,
+  BinKind kind, const char *fname);
+
+// Write a whole file under a temporary name, then move it into place
+static EpiError write_file_atomic(const char *fname, const uint8 *data,
+  size_t size);
+
+// Fill out the header of a binary data file
+static void fill_bin_header(BinHeader *header, BinKind kind, size_t size);
+
+EpiError bin_file_kind(BinKind *kind, const char *fname) {
+  if (kind == NULL || fname == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  FILE *fp = fopen(fname, "rb");
+  if (fp == NULL) {
+    set_last_error(EPI_ERROR_FILE_NOT_FOUND, fname, 0, 0,
+      "cannot open file");
+    return EPI_ERROR_FILE_NOT_FOUND;
+  }
+
+  uint8 buf[sizeof(BinHeader)];
+  size_t n = fread(buf, 1, sizeof(buf), fp);
+  fclose(fp);
+
+  *kind = BIN_NONE;
+  if (n < sizeof(BinHeader) || memcmp(buf, "EPIB", 4) != 0) {
+    return EPI_ERROR_SUCCESS;
+  }
+  if (!host_little_endian()) {
+    set_last_error(EPI_ERROR_INVALID_DATA, fname, 0, 0,
+      "binary data files need a little-endian machine");
+    return EPI_ERROR_INVALID_DATA;
+  }
+
+  BinHeader header;
+  memcpy(&header, buf, sizeof(BinHeader));
+  if (header.kind != BIN_DISEASE && header.kind != BIN_POPULATION) {
+    set_last_error(EPI_ERROR_INVALID_DATA, fname, 0, 0,
+      "unknown kind of binary data file");
+    return EPI_ERROR_INVALID_DATA;
+  }
+
+  *kind = (BinKind)header.kind;
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError load_disease_bin(Disease **out, const char *fname) {
+  if (out == NULL || fname == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  const uint8 *data = NULL;
+  size_t size = 0;
+  PASS_ERROR(map_file(&data, &size, fname));
+
+  EpiError err = check_bin_header(data, size, BIN_DISEASE, fname);
+  if (err != EPI_ERROR_SUCCESS) {
+    unmap_file(data, size);
+    return err;
+  }
+
+  const size_t offset = sizeof(BinHeader) + sizeof(BinDisease);
+  BinDisease rec;
+  memcpy(&rec, &data[sizeof(BinHeader)], sizeof(BinDisease));
+
+  // Bound the counts before multiplying them, so that a damaged file can't
+  // overflow the expected size
+  uint64 n = rec.max_duration;
+  uint64 k = rec.n_strata;
+  if (n == 0 || n > UINT32_MAX || k > UINT16_MAX ||
+    size != offset + (N_DISEASE_ARRAY_FIELDS + 2 * k) * n * sizeof(float)) {
+    unmap_file(data, size);
+    set_last_error(EPI_ERROR_INVALID_DATA, fname, 0, 0,
+      "array sizes do not match file size");
+    return EPI_ERROR_INVALID_DATA;
+  }
+
+  Disease *dis = (Disease *)calloc(1, sizeof(Disease));
+  if (dis == NULL) {
+    unmap_file(data, size);
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+  dis->n_refs = 1;
+  dis->map = data;
+  dis->map_size = size;
+
+  dis->max_duration = (size_t)n;
+  dis->asymp_trans_reduction = rec.asymp_trans_reduction;
+  dis->false_neg_reduction = rec.false_neg_reduction;
+  dis->hosp_death_reduction = rec.hosp_death_reduction;
+
+  // Arrays are never written once a disease is loaded, so they can point
+  // straight into the read-only mapping
+  float *ptr = (float *)(uintptr_t)&data[offset];
+  dis->p_transmit = ptr;
+  dis->p_symptoms = &ptr[n];
+  dis->p_negative = &ptr[2*n];
+  dis->p_recovery = &ptr[3*n];
+  dis->p_critical = &ptr[4*n];
+  dis->p_death = &ptr[5*n];
+  if (k > 0) {
+    dis->n_strata = (size_t)k;
+    dis->p_critical_by_age = &ptr[N_DISEASE_ARRAY_FIELDS * n];
+    dis->p_death_by_age = &ptr[(N_DISEASE_ARRAY_FIELDS + k) * n];
+  }
+
+  *out = dis;
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError load_pop_bin(Population *params, const char *fname) {
+  if (params == NULL || fname == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  // The record is small, so it is read rather than mapped.  One byte more
+  // than expected is asked for, to catch files that are too long.
+  FILE *fp = fopen(fname, "rb");
+  if (fp == NULL) {
+    set_last_error(EPI_ERROR_FILE_NOT_FOUND, fname, 0, 0,
+      "cannot open file");
+    return EPI_ERROR_FILE_NOT_FOUND;
+  }
+  uint8 data[sizeof(BinHeader) + sizeof(BinPop) + 1];
+  size_t size = fread(data, 1, sizeof(data), fp);
+  fclose(fp);
+
+  EpiError err = check_bin_header(data, size, BIN_POPULATION, fname);
+  if (err == EPI_ERROR_SUCCESS &&
+    size != sizeof(BinHeader) + sizeof(BinPop)) {
+    set_last_error(EPI_ERROR_INVALID_DATA, fname, 0, 0,
+      "record size does not match file size");
+    err = EPI_ERROR_INVALID_DATA;
+  }
+  PASS_ERROR(err);
+
+  BinPop rec;
+  memcpy(&rec, &data[sizeof(BinHeader)], sizeof(BinPop));
+
+  memset(params, 0, sizeof(Population));
+  params->n_total = rec.n_total;
+  params->n_susceptible = rec.n_susceptible;
+  params->n_hospital_beds = rec.n_hospital_beds;
+  params->cr_normal = rec.cr_normal;
+  params->cr_home = rec.cr_home;
+  params->cr_hospital = rec.cr_hospital;
+  params->daily_production = rec.daily_production;
+  params->f_critical_jobs = rec.f_critical_jobs;
+  params->prod_symp = rec.prod_symp;
+  params->prod_dist = rec.prod_dist;
+  params->prod_home = rec.prod_home;
+  params->daily_vaccination_capacity = rec.daily_vaccination_capacity;
+
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError write_disease_bin(const char *fname, const Disease *dis) {
+  if (fname == NULL || dis == NULL || dis->max_duration == 0) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  if (!host_little_endian()) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  size_t n = dis->max_duration;
+  size_t k = dis->n_strata;
+  size_t n_floats = (N_DISEASE_ARRAY_FIELDS + 2 * k) * n;
+  size_t offset = sizeof(BinHeader) + sizeof(BinDisease);
+  size_t size = offset + n_floats * sizeof(float);
+
+  uint8 *data = (uint8 *)calloc(size, 1);
+  if (data == NULL) {
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+
+  BinHeader header;
+  fill_bin_header(&header, BIN_DISEASE, size);
+  memcpy(data, &header, sizeof(BinHeader));
+
+  BinDisease rec;
+  memset(&rec, 0, sizeof(BinDisease));
+  rec.max_duration = n;
+  rec.n_strata = k;
+  rec.asymp_trans_reduction = dis->asymp_trans_reduction;
+  rec.false_neg_reduction = dis->false_neg_reduction;
+  rec.hosp_death_reduction = dis->hosp_death_reduction;
+  memcpy(&data[sizeof(BinHeader)], &rec, sizeof(BinDisease));
+
+  const float *arrays[N_DISEASE_ARRAY_FIELDS] = {dis->p_transmit,
+    dis->p_symptoms, dis->p_negative, dis->p_recovery, dis->p_critical,
+    dis->p_death};
+  for (size_t a = 0; a < N_DISEASE_ARRAY_FIELDS; a++) {
+    memcpy(&data[offset + a * n * sizeof(float)], arrays[a],
+      n * sizeof(float));
+  }
+  if (k > 0) {
+    offset += N_DISEASE_ARRAY_FIELDS * n * sizeof(float);
+    memcpy(&data[offset], dis->p_critical_by_age, k * n * sizeof(float));
+    memcpy(&data[offset + k * n * sizeof(float)], dis->p_death_by_age,
+      k * n * sizeof(float));
+  }
+
+  EpiError err = write_file_atomic(fname, data, size);
+  free(data);
+  return err;
+}
+
+EpiError write_pop_bin(const char *fname, const Population *params) {
+  if (fname == NULL || params == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  if (!host_little_endian()) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  uint8 data[sizeof(BinHeader) + sizeof(BinPop)];
+
+  BinHeader header;
+  fill_bin_header(&header, BIN_POPULATION, sizeof(data));
+  memcpy(data, &header, sizeof(BinHeader));
+
+  BinPop rec;
+  memset(&rec, 0, sizeof(BinPop));
+  rec.n_total = params->n_total;
+  rec.n_susceptible = params->n_susceptible;
+  rec.n_hospital_beds = params->n_hospital_beds;
+  rec.cr_normal = params->cr_normal;
+  rec.cr_home = params->cr_home;
+  rec.cr_hospital = params->cr_hospital;
+  rec.daily_production = params->daily_production;
+  rec.f_critical_jobs = params->f_critical_jobs;
+  rec.prod_symp = params->prod_symp;
+  rec.prod_dist = params->prod_dist;
+  rec.prod_home = params->prod_home;
+  rec.daily_vaccination_capacity = params->daily_vaccination_capacity;
+  memcpy(&data[sizeof(BinHeader)], &rec, sizeof(BinPop));
+
+  return write_file_atomic(fname, data, sizeof(data));
+}
+
+static bool host_little_endian(void) {
+  uint32 x = 1;
+  uint8 first;
+  memcpy(&first, &x, 1);
+  return first == 1;
+}
+
+static EpiError check_bin_header(const uint8 *data, size_t size,
+  BinKind kind, const char *fname) {
+
+  if (size < sizeof(BinHeader)) {
+    set_last_error(EPI_ERROR_UNEXPECTED_EOF, fname, 0, 0,
+      "file too short for header");
+    return EPI_ERROR_UNEXPECTED_EOF;
+  }
+
+  BinHeader header;
+  memcpy(&header, data, sizeof(BinHeader));
+  const char *problem = NULL;
+  if (header.magic != BIN_FILE_MAGIC) {
+    problem = "not a binary data file";
+  } else if (header.version != BIN_FILE_VERSION) {
+    problem = "binary data file version not supported, convert it again";
+  } else if (header.kind != (uint32)kind) {
+    problem = "binary data file holds a different kind of data";
+  } else if (header.size != size) {
+    problem = "file size does not match header";
+  }
+
+  if (problem != NULL) {
+    set_last_error(EPI_ERROR_INVALID_DATA, fname, 0, 0, problem);
+    return EPI_ERROR_INVALID_DATA;
+  }
+  return EPI_ERROR_SUCCESS;
+}
+
+static EpiError write_file_atomic(const char *fname, const uint8 *data,
+  size_t size) {
+
+  size_t len = strlen(fname);
+  char *tmp_fname = (char *)malloc(len + 5);
+  if (tmp_fname == NULL) {
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+  memcpy(tmp_fname, fname, len);
+  memcpy(&tmp_fname[len], ".tmp", 5);
+
+  FILE *fp = fopen(tmp_fname, "wb");
+  if (fp == NULL) {
+    set_last_error(EPI_ERROR_FILE_NOT_FOUND, tmp_fname, 0, 0,
+      "cannot create file");
+    free(tmp_fname);
+    return EPI_ERROR_FILE_NOT_FOUND;
+  }
+
+  bool ok = fwrite(data, 1, size, fp) == size;
+  ok = (fclose(fp) == 0) && ok;
+
+#ifdef _WIN32
+  // rename() does not replace existing files on Windows
+  if (ok) {
+    remove(fname);
+  }
+#endif
+  if (!ok || rename(tmp_fname, fname) != 0) {
+    remove(tmp_fname);
+    set_last_error(EPI_ERROR_FILE_NOT_FOUND, fname, 0, 0,
+      "cannot write file");
+    free(tmp_fname);
+    return EPI_ERROR_FILE_NOT_FOUND;
+  }
+
+  free(tmp_fname);
+  return EPI_ERROR_SUCCESS;
+}
+
+static void fill_bin_header(BinHeader *header, BinKind kind, size_t size) {
+  memset(header, 0, sizeof(BinHeader));
+  header->magic = BIN_FILE_MAGIC;
+  header->version = BIN_FILE_VERSION;
+  header->kind = (uint32)kind;
+  header->size = size;
+}
@@ -0,0 +1,90 @@
+// Compiled binary data files
+#ifndef __BIN_FILE_H__
+#define __BIN_FILE_H__
+// A binary data file holds the contents of one text data file, already
+// parsed and checked, in the layout used in memory.  Values are stored
+// little-endian.  Disease arrays are used straight from a read-only mapping
+// of the file, so that loading does not copy them, and processes loading
+// the same file share one copy in the page cache.
+//
+// Layout: a BinHeader, then a BinDisease or BinPop record, then for
+// diseases the N_DISEASE_ARRAY_FIELDS day arrays in struct order, followed
+// by p_critical_by_age and p_death_by_age if n_strata > 0.
+
+#include "common.h"
+#include "disease.h"
+#include "population.h"
+
+// "EPIB" read as a little-endian number
+#define BIN_FILE_MAGIC 0x42495045u
+// Changes whenever the layout changes
+#define BIN_FILE_VERSION 1u
+
+typedef enum {
+  // Not a binary data file
+  BIN_NONE,
+  BIN_DISEASE,
+  BIN_POPULATION
+} BinKind;
+
+typedef struct {
+  uint32 magic;
+  uint32 version;
+  uint32 kind;
+  uint32 reserved;
+  // Size of the whole file, in bytes
+  uint64 size;
+  uint64 reserved2;
+} BinHeader;
+
+typedef struct {
+  uint64 max_duration;
+  uint64 n_strata;
+  float asymp_trans_reduction;
+  float false_neg_reduction;
+  float hosp_death_reduction;
+  float reserved;
+} BinDisease;
+
+// Parameters and initial counters of a population, as read by
+// read_pop_file()
+typedef struct {
+  uint64 n_total;
+  uint64 n_susceptible;
+  uint64 n_hospital_beds;
+  float cr_normal;
+  float cr_home;
+  float cr_hospital;
+  float daily_production;
+  float f_critical_jobs;
+  float prod_symp;
+  float prod_dist;
+  float prod_home;
+  float daily_vaccination_capacity;
+  float reserved;
+} BinPop;
+
+// Find out whether a file is a binary data file, and of which kind
+// 0 indicates success.
+EpiError bin_file_kind(BinKind *kind, const char *fname);
+
+// Load a disease from a binary data file.  Free with free_disease().
+// 0 indicates success.
+EpiError load_disease_bin(Disease **out, const char *fname);
+
+// Load population parameters and initial counters from a binary data file,
+// like read_pop_file()
+// 0 indicates success.
+EpiError load_pop_bin(Population *params, const char *fname);
+
+// Write a disease to a binary data file.  The file is replaced atomically,
+// so that processes which have the old version mapped are not disturbed.
+// 0 indicates success.
+EpiError write_disease_bin(const char *fname, const Disease *dis);
+
+// Write population parameters read by read_pop_file() to a binary data
+// file, replacing it atomically
+// 0 indicates success.
+EpiError write_pop_bin(const char *fname, const Population *params);
+
+#endif
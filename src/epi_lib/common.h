@@ -5,6 +5,11 @@
 // libraries instead of standard ones
 #define _CRT_SECURE_NO_WARNINGS
 
+// Expose POSIX interfaces (threads, sysconf) when compiling with -std=c99
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include <assert.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -13,6 +18,7 @@
 
 #include <stdint.h>
 typedef int32_t int32;
+typedef uint8_t uint8;
 typedef uint32_t uint32;
 typedef int64_t int64;
 typedef uint64_t uint64;
@@ -24,6 +30,38 @@ typedef uint64_t uint64;
 
 #include "epi_api.h"
 
+// Compile hot, vectorizable kernels for several instruction sets and pick
+// the best one for the CPU at load time.  Where the toolchain does not
+// support function multiversioning, a single generic version is built.
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && \
+  defined(__linux__)
+#define EPI_TARGET_CLONES \
+  __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define EPI_TARGET_CLONES
+#endif
+
+// Storage class for per-thread state
+#if defined(_MSC_VER)
+#define EPI_THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__)
+#define EPI_THREAD_LOCAL __thread
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define EPI_THREAD_LOCAL _Thread_local
+#else
+#define EPI_THREAD_LOCAL
+#endif
+
+// Force inlining of a kernel body into each specialized copy of it, and
+// promise the compiler that a pointer is aligned to n bytes
+#if defined(__GNUC__)
+#define EPI_ALWAYS_INLINE inline __attribute__((always_inline))
+#define EPI_ASSUME_ALIGNED(ptr, n) __builtin_assume_aligned(ptr, n)
+#else
+#define EPI_ALWAYS_INLINE inline
+#define EPI_ASSUME_ALIGNED(ptr, n) ((void *)(ptr))
+#endif
+
 #define PASS_ERROR(expr) \
   {EpiError __err__ = expr; if(__err__ != EPI_ERROR_SUCCESS) return __err__;}
 
@@ -1,53 +1,72 @@
+#include "bin_file.h"
 #include "disease.h"
 #include "files.h"
 
-static EpiError read_disease_params(Disease *dis, FILE *fp);
+static EpiError read_disease_params(Disease *dis, DataFile *df);
 static EpiError allocate_disease_arrays(Disease *dis);
-static EpiError read_disease_arrays(Disease *dis, FILE *fp);
+static EpiError read_disease_arrays(Disease *dis, DataFile *df);
+static EpiError read_disease_age_arrays(Disease *dis, DataFile *df);
+
+// Atomically add delta, 1 or -1, to a reference count, and return the new
+// count
+static size_t add_disease_refs(size_t *n_refs, int delta);
 
 EpiError create_disease_from_file(Disease **out, const char *filename) {
   if (out == NULL || filename == NULL) {
     return EPI_ERROR_INVALID_ARGS;
   }
 
-  FILE *fp = fopen(filename, "r");
-  if (fp == NULL) {
-    return EPI_ERROR_FILE_NOT_FOUND;
+  BinKind kind;
+  PASS_ERROR(bin_file_kind(&kind, filename));
+  if (kind != BIN_NONE) {
+    return load_disease_bin(out, filename);
   }
 
+  DataFile *df = NULL;
+  PASS_ERROR(open_data_file(&df, filename));
+
   Disease *dis = (Disease *)calloc(1, sizeof(Disease));
   if (dis == NULL) {
-    fclose(fp);
+    free_data_file(&df);
     return EPI_ERROR_OUT_OF_MEMORY;
   }
+  dis->n_refs = 1;
 
-  EpiError err = read_disease_params(dis, fp);
+  EpiError err = read_disease_params(dis, df);
   if (err != EPI_ERROR_SUCCESS) {
-    fclose(fp);
+    free_data_file(&df);
     free(dis);
     return err;
   }
 
   err = allocate_disease_arrays(dis);
   if (err != EPI_ERROR_SUCCESS) {
-    fclose(fp);
+    free_data_file(&df);
     free(dis);
     return err;
   }
 
-  err = read_disease_arrays(dis, fp);
+  err = read_disease_arrays(dis, df);
+  if (err == EPI_ERROR_SUCCESS) {
+    err = read_disease_age_arrays(dis, df);
+  }
   if (err != EPI_ERROR_SUCCESS) {
-    fclose(fp);
+    free_data_file(&df);
     free_disease(&dis);
     return err;
   }
 
-  fclose(fp);
+  free_data_file(&df);
 
   *out = dis;
   return EPI_ERROR_SUCCESS;
 }
 
+Disease *retain_disease(Disease *dis) {
+  add_disease_refs(&dis->n_refs, 1);
+  return dis;
+}
+
 EpiError free_disease(Disease **dis) {
   if (dis == NULL) {
     return EPI_ERROR_INVALID_ARGS;
@@ -58,6 +77,19 @@ EpiError free_disease(Disease **dis) {
     return EPI_ERROR_SUCCESS;
   }
 
+  // Still shared with other models
+  if (add_disease_refs(&(*dis)->n_refs, -1) > 0) {
+    *dis = NULL;
+    return EPI_ERROR_SUCCESS;
+  }
+
+  if ((*dis)->map != NULL) {
+    unmap_file((*dis)->map, (*dis)->map_size);
+    free(*dis);
+    *dis = NULL;
+    return EPI_ERROR_SUCCESS;
+  }
+
   if ((*dis)->p_transmit == NULL) {
     free(*dis);
     *dis = NULL;
@@ -66,19 +98,21 @@ EpiError free_disease(Disease **dis) {
 
   free((*dis)->p_transmit);
   (*dis)->p_transmit = NULL;
+  free((*dis)->p_critical_by_age);
+  (*dis)->p_critical_by_age = NULL;
   free(*dis);
   *dis = NULL;
 
   return EPI_ERROR_SUCCESS;
 }
 
-static EpiError read_disease_params(Disease *dis, FILE *fp) {
-  PASS_ERROR(read_size_token(&(dis->max_duration), fp, "MAX_DURATION"));
-  PASS_ERROR(read_float_token(&(dis->asymp_trans_reduction), fp,
+static EpiError read_disease_params(Disease *dis, DataFile *df) {
+  PASS_ERROR(read_size_token(&(dis->max_duration), df, "MAX_DURATION"));
+  PASS_ERROR(read_float_token(&(dis->asymp_trans_reduction), df,
     "ASYMP_TRANS_REDUCTION"));
-  PASS_ERROR(read_float_token(&(dis->false_neg_reduction), fp,
+  PASS_ERROR(read_float_token(&(dis->false_neg_reduction), df,
     "FALSE_NEG_REDUCTION"));
-  PASS_ERROR(read_float_token(&(dis->hosp_death_reduction), fp,
+  PASS_ERROR(read_float_token(&(dis->hosp_death_reduction), df,
     "HOSP_DEATH_REDUCTION"));
   return EPI_ERROR_SUCCESS;
 }
@@ -105,18 +139,87 @@ static EpiError allocate_disease_arrays(Disease *dis) {
   return EPI_ERROR_SUCCESS;
 }
 
-static EpiError read_disease_arrays(Disease *dis, FILE *fp) {
+static EpiError read_disease_arrays(Disease *dis, DataFile *df) {
   PASS_ERROR(read_float_array(dis->p_transmit,
-    dis->max_duration, fp, "P_TRANSMIT"));
+    dis->max_duration, df, "P_TRANSMIT"));
   PASS_ERROR(read_float_array(dis->p_symptoms,
-    dis->max_duration, fp, "P_SYMPTOMS"));
+    dis->max_duration, df, "P_SYMPTOMS"));
   PASS_ERROR(read_float_array(dis->p_negative,
-    dis->max_duration, fp, "P_NEGATIVE"));
+    dis->max_duration, df, "P_NEGATIVE"));
   PASS_ERROR(read_float_array(dis->p_recovery,
-    dis->max_duration, fp, "P_RECOVERY"));
+    dis->max_duration, df, "P_RECOVERY"));
   PASS_ERROR(read_float_array(dis->p_critical,
-    dis->max_duration, fp, "P_CRITICAL"));
-  PASS_ERROR(read_float_array(dis->p_death, dis->max_duration, fp, "P_DEATH"));
+    dis->max_duration, df, "P_CRITICAL"));
+  PASS_ERROR(read_float_array(dis->p_death, dis->max_duration, df, "P_DEATH"));
 
   return EPI_ERROR_SUCCESS;
 }
+
+static EpiError read_disease_age_arrays(Disease *dis, DataFile *df) {
+  // Age dependence is optional
+  size_t k = 0;
+  EpiError err = read_size_token(&k, df, "N_AGE_STRATA");
+  if (err == EPI_ERROR_MISSING_DATA) {
+    return EPI_ERROR_SUCCESS;
+  }
+  PASS_ERROR(err);
+  if (k == 0) {
+    return invalid_data(df, "N_AGE_STRATA", "need at least one stratum");
+  }
+
+  // Files have one line per day and one column per stratum, stored here
+  // with one row per stratum
+  size_t n = dis->max_duration;
+  double *table = (double *)malloc(n * k * sizeof(double));
+  float *ptr = (float *)malloc(2 * n * k * sizeof(float));
+  if (table == NULL || ptr == NULL) {
+    free(table);
+    free(ptr);
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+
+  const char *tokens[2] = {"P_CRITICAL_BY_AGE", "P_DEATH_BY_AGE"};
+  for (size_t a = 0; a < 2 && err == EPI_ERROR_SUCCESS; a++) {
+    err = read_double_table(table, n, k, df, tokens[a]);
+    for (size_t i = 0; i < n && err == EPI_ERROR_SUCCESS; i++) {
+      for (size_t j = 0; j < k; j++) {
+        double p = table[i * k + j];
+        if (p < 0.0 || p > 1.0) {
+          err = invalid_data(df, tokens[a], "probability out of range");
+          break;
+        }
+        ptr[(a * k + j) * n + i] = (float)p;
+      }
+    }
+  }
+  free(table);
+  if (err != EPI_ERROR_SUCCESS) {
+    free(ptr);
+    return err;
+  }
+
+  dis->n_strata = k;
+  dis->p_critical_by_age = ptr;
+  dis->p_death_by_age = &ptr[k * n];
+  return EPI_ERROR_SUCCESS;
+}
+
+void disease_stratum(Disease *out, const Disease *dis, size_t k) {
+  memcpy(out, dis, sizeof(Disease));
+  if (dis->n_strata > 0 && k < dis->n_strata) {
+    out->p_critical = &dis->p_critical_by_age[k * dis->max_duration];
+    out->p_death = &dis->p_death_by_age[k * dis->max_duration];
+  }
+  out->n_strata = 0;
+  out->p_critical_by_age = NULL;
+  out->p_death_by_age = NULL;
+}
+
+static size_t add_disease_refs(size_t *n_refs, int delta) {
+#if defined(__GNUC__)
+  return delta > 0 ? __atomic_add_fetch(n_refs, 1, __ATOMIC_ACQ_REL) :
+    __atomic_sub_fetch(n_refs, 1, __ATOMIC_ACQ_REL);
+#else
+#error "no atomic operations for disease reference counts on this compiler"
+#endif
+}
@@ -23,6 +23,22 @@ typedef struct {
   float *p_critical;    // Probability of developing a dangerous condition
   float *p_death;       // Probability of death if critical and not hospitalized
 
+  // Optional age dependence of severity.  If n_strata > 0, stratum k uses
+  // p_critical_by_age[k * max_duration + i] and p_death_by_age[...] instead
+  // of p_critical[i] and p_death[i].
+  size_t n_strata;
+  float *p_critical_by_age;
+  float *p_death_by_age;
+
+  // Number of models sharing this disease.  The disease never changes after
+  // it is read, so clones of a model share it instead of copying it.
+  size_t n_refs;
+
+  // Read-only file mapping holding the arrays, if the disease was loaded
+  // from a binary file, or NULL if the arrays were allocated
+  const uint8 *map;
+  size_t map_size;
+
 } Disease;
 
 // Constructs and fills out disease information from a text data file.
@@ -32,9 +48,17 @@ typedef struct {
 // and returns a NULL pointer.
 EpiError create_disease_from_file(Disease **dis, const char *filename);
 
-// Frees disease struct and associated data.  Sets disease pointer to NULL.
-// Returns 1 if disease pointer is NULL, or if its internal data is NULL.
+// Add a reference to a shared disease.  Returns dis.
+Disease *retain_disease(Disease *dis);
+
+// Drops a reference to a disease, and frees disease struct and associated
+// data once no references are left.  Sets disease pointer to NULL.
 EpiError free_disease(Disease **dis);
 
+// Fill out a view of the disease for age stratum k, with the severity
+// curves of that stratum.  The view shares arrays with dis, and must not be
+// freed.  If the disease has no age dependence, the view is a plain copy.
+void disease_stratum(Disease *out, const Disease *dis, size_t k);
+
 
 #endif
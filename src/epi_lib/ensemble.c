@@ -0,0 +1,285 @@
+#include "batch.h"
+#include "files.h"
+#include "stats.h"
+#include "thread_pool.h"
+
+#include <pthread.h>
+
+// Monte Carlo ensembles: many replicates of randomized scenarios, run on a
+// thread pool and summarized day by day.
+//
+// Replicates are grouped into blocks, which workers claim one at a time, in
+// order, from a shared queue, so that slow replicates do not hold up other
+// workers.  Each block is summarized on its own, and block summaries are
+// combined along a fixed binary tree: whichever of two sibling summaries is
+// done last merges the pair, and moves up the tree with the result.  The
+// order of every merge is set by the tree, not by which worker ran which
+// block, and merges happen in parallel.
+
+// Replicates in a block.  Fixed, so that the result is the same for any
+// number of threads.
+#define ENSEMBLE_BLOCK_SIZE 16
+
+// Ensemble in progress, shared with pool tasks
+typedef struct {
+  const EpiBatchConfig *config;
+  const EpiSchedule *schedule;
+  size_t n_days;
+  double compression;
+  size_t n_replicates;
+  size_t n_blocks;
+  uint64 seed;
+
+  // Merge tree: level 0 has one node per block, and node j of level l + 1
+  // combines nodes 2j and 2j + 1 of level l.  Level l starts at
+  // level_start[l] in nodes, and the top level has a single node.
+  size_t n_levels;
+  size_t *level_start;
+  size_t *level_size;
+
+  // Everything below is protected by lock
+  pthread_mutex_t lock;
+  size_t next_block;
+  bool failed;
+  // Summaries waiting for their sibling
+  EpiStats *nodes;
+  EpiStats root;
+} EnsembleRun;
+
+// Set up the merge tree of a run
+static EpiError create_merge_tree(EnsembleRun *run);
+
+// Add the summary of block b to the merge tree, merging it with finished
+// siblings on the way up.  Takes ownership of the summary.
+static EpiError merge_block(EnsembleRun *run, size_t b, EpiStats summary);
+
+// Run the replicates of block b, reusing *model between replicates
+static EpiError run_block(EpiStats summary, EpiModel *model,
+  EpiObservable *trajectory, const EnsembleRun *run, size_t b);
+
+// Pool task: claim and run blocks until none are left
+static EpiError ensemble_worker(void *ctx, size_t i);
+
+EpiError epi_run_ensemble(EpiStats stats, const EpiBatchConfig *config,
+  const EpiSchedule *schedule, size_t n_replicates, size_t n_threads,
+  uint64 seed) {
+
+  clear_last_error();
+
+  if (stats == NULL || config == NULL || schedule == NULL ||
+    n_replicates == 0 ||
+    (schedule->n_entries > 0 && schedule->entries == NULL)) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  if (!valid_batch_config(config)) {
+    return EPI_ERROR_INVALID_SCENARIO;
+  }
+
+  EnsembleRun run;
+  memset(&run, 0, sizeof(EnsembleRun));
+  run.config = config;
+  run.schedule = schedule;
+  run.n_days = stats->n_days;
+  run.compression = stats->compression;
+  run.n_replicates = n_replicates;
+  run.n_blocks = (n_replicates + ENSEMBLE_BLOCK_SIZE - 1) /
+    ENSEMBLE_BLOCK_SIZE;
+  run.seed = seed;
+
+  ThreadPool *pool = NULL;
+  EpiError err = create_merge_tree(&run);
+  if (err == EPI_ERROR_SUCCESS) {
+    err = create_thread_pool(&pool, n_threads);
+  }
+
+  if (err == EPI_ERROR_SUCCESS) {
+    pthread_mutex_init(&run.lock, NULL);
+    // One task per thread, each of them taking blocks from the queue
+    err = thread_pool_run(pool, thread_pool_size(pool), ensemble_worker,
+      &run);
+    pthread_mutex_destroy(&run.lock);
+  }
+
+  if (err == EPI_ERROR_SUCCESS) {
+    err = epi_stats_merge(stats, run.root);
+  }
+
+  // Summaries left over after a failure
+  if (run.nodes != NULL) {
+    size_t n_nodes = run.level_start[run.n_levels - 1] + 1;
+    for (size_t i = 0; i < n_nodes; i++) {
+      epi_stats_free(&run.nodes[i]);
+    }
+  }
+  epi_stats_free(&run.root);
+  free(run.nodes);
+  free(run.level_start);
+  free(run.level_size);
+  free_thread_pool(&pool);
+
+  return err;
+}
+
+static EpiError create_merge_tree(EnsembleRun *run) {
+  run->n_levels = 1;
+  for (size_t n = run->n_blocks; n > 1; n = (n + 1) / 2) {
+    run->n_levels++;
+  }
+
+  run->level_start = (size_t *)malloc(run->n_levels * sizeof(size_t));
+  run->level_size = (size_t *)malloc(run->n_levels * sizeof(size_t));
+  if (run->level_start == NULL || run->level_size == NULL) {
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+
+  size_t n_nodes = 0;
+  size_t n = run->n_blocks;
+  for (size_t l = 0; l < run->n_levels; l++) {
+    run->level_start[l] = n_nodes;
+    run->level_size[l] = n;
+    n_nodes += n;
+    n = (n + 1) / 2;
+  }
+
+  run->nodes = (EpiStats *)calloc(n_nodes, sizeof(EpiStats));
+  if (run->nodes == NULL) {
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+  return EPI_ERROR_SUCCESS;
+}
+
+static EpiError merge_block(EnsembleRun *run, size_t b, EpiStats summary) {
+  size_t j = b;
+  pthread_mutex_lock(&run->lock);
+  for (size_t l = 0; l + 1 < run->n_levels; l++, j /= 2) {
+    size_t sibling = j ^ 1;
+    if (sibling >= run->level_size[l]) {
+      // Last node of an odd level moves up alone
+      continue;
+    }
+
+    EpiStats *slot = &run->nodes[run->level_start[l] + sibling];
+    if (*slot == NULL) {
+      // Sibling still running, it will do the merge
+      run->nodes[run->level_start[l] + j] = summary;
+      pthread_mutex_unlock(&run->lock);
+      return EPI_ERROR_SUCCESS;
+    }
+
+    EpiStats other = *slot;
+    *slot = NULL;
+    pthread_mutex_unlock(&run->lock);
+
+    // Always merge the right node into the left one
+    EpiStats left = j < sibling ? summary : other;
+    EpiStats right = j < sibling ? other : summary;
+    EpiError err = epi_stats_merge(left, right);
+    epi_stats_free(&right);
+    if (err != EPI_ERROR_SUCCESS) {
+      epi_stats_free(&left);
+      return err;
+    }
+    summary = left;
+
+    pthread_mutex_lock(&run->lock);
+  }
+
+  run->root = summary;
+  pthread_mutex_unlock(&run->lock);
+  return EPI_ERROR_SUCCESS;
+}
+
+static EpiError run_block(EpiStats summary, EpiModel *model,
+  EpiObservable *trajectory, const EnsembleRun *run, size_t b) {
+
+  size_t begin = b * ENSEMBLE_BLOCK_SIZE;
+  size_t end = begin + ENSEMBLE_BLOCK_SIZE;
+  if (end > run->n_replicates) {
+    end = run->n_replicates;
+  }
+
+  for (size_t r = begin; r < end; r++) {
+    EpiRng rng;
+    rng_seed(&rng, rng_hash(run->seed, r));
+    EpiScenario scenario;
+    draw_episode(&scenario, run->config, &rng);
+
+    // Replicates share data files, so one model per worker is enough.
+    // Agent models keep the households built from their first seed when
+    // reset, which would tie results to the worker that ran the replicate,
+    // so they are built anew for each replicate.
+    if (*model != NULL && scenario.engine == EPI_ENGINE_AGENT) {
+      PASS_ERROR(epi_free_model(model));
+    }
+    if (*model == NULL) {
+      PASS_ERROR(epi_construct_model(model, &scenario));
+    } else {
+      PASS_ERROR(epi_reset_model(*model, &scenario));
+    }
+
+    size_t n_steps;
+    PASS_ERROR(epi_model_run(trajectory, &n_steps, *model, run->schedule,
+      run->n_days));
+
+    // Finished replicates stay as they ended
+    if (n_steps == 0) {
+      PASS_ERROR(epi_get_observables(&trajectory[0], *model));
+      n_steps = 1;
+    }
+    for (size_t d = 0; d < run->n_days; d++) {
+      const EpiObservable *obs = &trajectory[d < n_steps ? d : n_steps - 1];
+      PASS_ERROR(epi_stats_add(summary, d, obs));
+    }
+  }
+
+  return EPI_ERROR_SUCCESS;
+}
+
+static EpiError ensemble_worker(void *ctx, size_t i) {
+  (void)i;
+  EnsembleRun *run = (EnsembleRun *)ctx;
+
+  EpiObservable *trajectory = (EpiObservable *)malloc(run->n_days *
+    sizeof(EpiObservable));
+  if (trajectory == NULL) {
+    pthread_mutex_lock(&run->lock);
+    run->failed = true;
+    pthread_mutex_unlock(&run->lock);
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+
+  EpiModel model = NULL;
+  EpiError err = EPI_ERROR_SUCCESS;
+  for (;;) {
+    pthread_mutex_lock(&run->lock);
+    if (run->failed || run->next_block >= run->n_blocks) {
+      pthread_mutex_unlock(&run->lock);
+      break;
+    }
+    size_t b = run->next_block++;
+    pthread_mutex_unlock(&run->lock);
+
+    EpiStats summary = NULL;
+    err = epi_stats_create(&summary, run->n_days, run->compression);
+    if (err == EPI_ERROR_SUCCESS) {
+      err = run_block(summary, &model, trajectory, run, b);
+    }
+    if (err == EPI_ERROR_SUCCESS) {
+      err = merge_block(run, b, summary);
+    } else {
+      epi_stats_free(&summary);
+    }
+
+    if (err != EPI_ERROR_SUCCESS) {
+      pthread_mutex_lock(&run->lock);
+      run->failed = true;
+      pthread_mutex_unlock(&run->lock);
+      break;
+    }
+  }
+
+  epi_free_model(&model);
+  free(trajectory);
+  return err;
+}
@@ -1,10 +1,19 @@
+#include "abm.h"
+#include "age_pop.h"
 #include "common.h"
 #include "disease.h"
+#include "files.h"
+#include "mean_field.h"
+#include "metapop.h"
+#include "param_cache.h"
 #include "population.h"
+#include "profile.h"
+#include "recorder.h"
+#include "sampler.h"
+#include "thread_pool.h"
 
 struct _EpiModel {
-  // Single population, for now.
-  // TODO: implement hierarchical model for multiple populations and transport.
+  // Single population.  See _EpiMetaModel for multiple populations.
   size_t day;
   bool started;
   bool finished;
@@ -13,10 +22,120 @@ struct _EpiModel {
   EpiScenario scenario;
   Disease *disease;
   Population *population;
+
+  // Binomial sampling method and random number generator state
+  Sampler sampler;
+
+  // Continuous state for deterministic mean-field mode, NULL otherwise
+  MeanField *mean_field;
+
+  // Age strata, NULL for a homogeneous population.  If present, the
+  // population above is NULL.
+  AgePop *age_pop;
+
+  // Agents, for the agent-based engine.  If present, the population above
+  // is NULL.
+  Abm *abm;
+
+  // Snapshot of the state on construction, for epi_reset_model()
+  uint8 *initial_state;
+  size_t initial_size;
+
+  // Records observables after every step if not NULL.  Not owned.
+  EpiRecorder recorder;
+
+  // Counters and timers, only filled by profiling builds.  Not part of the
+  // model's state, so snapshots and resets leave them alone.
+  Profile profile;
+};
+
+struct _EpiMetaModel {
+  size_t day;
+  bool started;
+  bool finished;
+  bool vaccine_available;
+
+  EpiScenario scenario;
+  Disease *disease;
+  MetaPop *metapop;
 };
 
+// Shape of a model's state, which a snapshot must match to be restored
+typedef struct {
+  uint64 magic;
+  uint64 size;
+  uint64 engine;
+  uint64 mean_field;
+  uint64 n_strata;
+  uint64 n_agents;
+  uint64 max_duration;
+} SnapshotLayout;
+
+// Snapshot header, followed by the state of the model's engine
+typedef struct {
+  SnapshotLayout layout;
+  size_t day;
+  bool started;
+  bool finished;
+  bool vaccine_available;
+  Sampler sampler;
+} SnapshotHeader;
+
+#define EPI_SNAPSHOT_MAGIC 0x31746f6e73697065ull
+
+// Replace scenario times that mean "never" with -1, and check that the
+// scenario has an end
+static EpiError normalize_scenario(EpiScenario *scenario);
+
+// Fill population part of observables
+static void pop_observables(EpiObservable *out, const Population *pop);
+
+// Population of a model, or sum of its age strata
+static Population *model_pop(EpiModel model);
+
+// Step a model by one day, without recording it
+static EpiError model_step(EpiModel model, const EpiInput *input);
+
+// Step a model by one day, and record it if it has a recorder
+static EpiError model_step_recorded(EpiModel model, const EpiInput *input);
+
+// Number of days, up to max_days, that a model can skip with
+// evolve_pop_quiet(): nobody is infected yet, and the outbreak, the
+// vaccine and the end of the scenario are all later
+static size_t quiet_days(const EpiModel model, size_t max_days);
+
+// Is day the scenario time t, which is -1 for never?
+static bool is_scenario_day(size_t day, int t);
+
+// Has day reached scenario time t, which is -1 for never?
+static bool reached_scenario_day(size_t day, int t);
+
+// Days from day until scenario time t, or max_days if t is -1 (never) or
+// further away than that
+static size_t days_until(size_t day, int t, size_t max_days);
+
+// Layout of a snapshot of a model
+static void snapshot_layout(SnapshotLayout *out, const EpiModel model);
+
+// Policy in place on given day
+static void schedule_input(EpiInput *out, const EpiSchedule *schedule,
+  size_t day);
+
+// Models, inputs and outputs of an epi_step_models() call, shared with
+// pool tasks
+typedef struct {
+  EpiObservable *out;
+  EpiModel *models;
+  const EpiInput *inputs;
+} StepModelsCall;
+
+// Pool task: step a single model of an epi_step_models() call
+static EpiError step_models_task(void *ctx, size_t i);
+
 EpiError epi_construct_model(EpiModel *out, const EpiScenario *scenario) {
 
+  clear_last_error();
+
   if (out == NULL || scenario == NULL ||
     scenario->dis_fname == NULL || scenario->pop_fname == NULL) {
     return EPI_ERROR_INVALID_ARGS;
@@ -26,37 +145,37 @@ EpiError epi_construct_model(EpiModel *out, const EpiScenario *scenario) {
   if (model == NULL) {
     return EPI_ERROR_OUT_OF_MEMORY;
   }
+  init_profile(&model->profile);
 
   // Set up scenario
   memcpy(&(model->scenario), scenario, sizeof(EpiScenario));
-  // Outbreak never happens: indicated by t_initial == -1
-  if (model->scenario.t_initial < 0 || model->scenario.n_initial == 0) {
-    model->scenario.t_initial = -1;
-  }
-  // Vaccine never happens: indicated by t_vaccine == -1
-  if (model->scenario.t_vaccine < 0) {
-    model->scenario.t_vaccine = -1;
+  if (normalize_scenario(&(model->scenario)) != EPI_ERROR_SUCCESS) {
+    free(model);
+    return EPI_ERROR_INVALID_SCENARIO;
   }
-  // Do not stop at any particular time, run until no infections remain
-  if (model->scenario.t_max < 0) {
-    // Must have either a start or stop time
-    if (model->scenario.t_initial == -1) {
-      free(model);
-      return EPI_ERROR_INVALID_SCENARIO;
-    }
-    model->scenario.t_max = -1;
+
+  // Mean-field mode is only available for homogeneous populations, and
+  // the agent engine has neither mean-field mode nor age strata
+  if ((scenario->mean_field && scenario->age_fname != NULL) ||
+    (int)scenario->engine < 0 || scenario->engine >= N_EPI_ENGINE ||
+    (scenario->engine == EPI_ENGINE_AGENT &&
+    (scenario->mean_field || scenario->age_fname != NULL)) ||
+    sampler_init(&model->sampler, scenario->sampler, scenario->seed) !=
+    EPI_ERROR_SUCCESS) {
+    free(model);
+    return EPI_ERROR_INVALID_SCENARIO;
   }
 
   // Read disease data file
   EpiError err;
-  err = create_disease_from_file(&(model->disease), scenario->dis_fname);
+  err = cached_disease(&(model->disease), scenario->dis_fname);
   if (err != EPI_ERROR_SUCCESS) {
     free(model);
     return err;
   }
 
   // Read population data file
-  err = create_pop_from_file(&(model->population), scenario->pop_fname,
+  err = cached_pop(&(model->population), scenario->pop_fname,
     model->disease->max_duration);
   if (err != EPI_ERROR_SUCCESS) {
     free_disease(&(model->disease));
@@ -64,10 +183,104 @@ EpiError epi_construct_model(EpiModel *out, const EpiScenario *scenario) {
     return err;
   }
 
+  if (scenario->engine == EPI_ENGINE_AGENT) {
+    err = create_abm(&(model->abm), model->population, model->disease,
+      scenario->pop_fname, scenario->seed, scenario->n_threads);
+    free_pop(&(model->population));
+    if (err != EPI_ERROR_SUCCESS) {
+      free_disease(&(model->disease));
+      free(model);
+      return err;
+    }
+  }
+
+  if (scenario->age_fname != NULL) {
+    err = create_age_pop_from_file(&(model->age_pop), model->population,
+      model->disease, scenario->age_fname);
+    free_pop(&(model->population));
+    if (err != EPI_ERROR_SUCCESS) {
+      free_disease(&(model->disease));
+      free(model);
+      return err;
+    }
+  }
+
+  if (scenario->mean_field) {
+    err = create_mean_field(&(model->mean_field), model->population);
+    if (err != EPI_ERROR_SUCCESS) {
+      free_pop(&(model->population));
+      free_disease(&(model->disease));
+      free(model);
+      return err;
+    }
+  }
+
+  err = epi_snapshot_size(&model->initial_size, model);
+  if (err == EPI_ERROR_SUCCESS) {
+    model->initial_state = (uint8 *)malloc(model->initial_size);
+    err = model->initial_state != NULL ?
+      epi_snapshot(model->initial_state, model->initial_size, model) :
+      EPI_ERROR_OUT_OF_MEMORY;
+  }
+  if (err != EPI_ERROR_SUCCESS) {
+    epi_free_model(&model);
+    return err;
+  }
+
   *out = model;
   return EPI_ERROR_SUCCESS;
 }
 
+EpiError epi_reset_model(EpiModel model, const EpiScenario *scenario) {
+  clear_last_error();
+
+  if (model == NULL || scenario == NULL ||
+    scenario->dis_fname == NULL || scenario->pop_fname == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  // Data files and engine must be those the model was built with
+  const EpiScenario *old = &model->scenario;
+  if (strcmp(scenario->dis_fname, old->dis_fname) ||
+    strcmp(scenario->pop_fname, old->pop_fname) ||
+    (scenario->age_fname == NULL) != (old->age_fname == NULL) ||
+    (scenario->age_fname != NULL &&
+    strcmp(scenario->age_fname, old->age_fname)) ||
+    scenario->mean_field != old->mean_field ||
+    scenario->engine != old->engine) {
+    return EPI_ERROR_INVALID_SCENARIO;
+  }
+
+  EpiScenario sc = *scenario;
+  PASS_ERROR(normalize_scenario(&sc));
+  Sampler sampler;
+  if (sampler_init(&sampler, sc.sampler, sc.seed) != EPI_ERROR_SUCCESS) {
+    return EPI_ERROR_INVALID_SCENARIO;
+  }
+
+  PASS_ERROR(epi_restore(model, model->initial_state, model->initial_size));
+  model->sampler = sampler;
+  if (model->abm != NULL) {
+    reseed_abm(model->abm, sc.seed);
+  }
+  // Keep thread count, which cannot change without new threads, and the
+  // file names the model was constructed with
+  sc.n_threads = old->n_threads;
+  sc.dis_fname = old->dis_fname;
+  sc.pop_fname = old->pop_fname;
+  sc.age_fname = old->age_fname;
+  model->scenario = sc;
+
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError epi_clear_cache(void) {
+  clear_last_error();
+
+  clear_param_cache();
+  return EPI_ERROR_SUCCESS;
+}
+
 EpiError epi_free_model(EpiModel *model) {
   if (model == NULL) {
     return EPI_ERROR_INVALID_ARGS;
@@ -79,6 +292,11 @@ EpiError epi_free_model(EpiModel *model) {
 
   free_disease(&((*model)->disease));
   free_pop(&((*model)->population));
+  free_mean_field(&((*model)->mean_field));
+  free_age_pop(&((*model)->age_pop));
+  free_abm(&((*model)->abm));
+  free((*model)->initial_state);
+  free_profile_trace(&(*model)->profile);
   free(*model);
   *model = NULL;
 
@@ -87,10 +305,579 @@ EpiError epi_free_model(EpiModel *model) {
 
 EpiError epi_model_step(EpiModel model, const EpiInput *input) {
 
+  clear_last_error();
+
   if (model == NULL || input == NULL) {
     return EPI_ERROR_INVALID_ARGS;
   }
 
+#ifdef EPI_PROFILE
+  // Draws and phases on this thread count towards the model until the step
+  // is done
+  Profile *caller = profile_enter(&model->profile, model->day);
+  uint64 start = profile_ticks();
+  EpiError err = model_step_recorded(model, input);
+  profile_phase(&model->profile, EPI_PHASE_STEP, start);
+  model->profile.stats.n_steps++;
+  profile_leave(caller);
+  return err;
+#else
+  return model_step_recorded(model, input);
+#endif
+}
+
+EpiError epi_model_set_recorder(EpiModel model, EpiRecorder rec) {
+  clear_last_error();
+
+  if (model == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  // Day bins are only kept by the compartment engine
+  if (rec != NULL && !recorder_accepts(rec, model->mean_field == NULL ?
+    model->population : NULL)) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  model->recorder = rec;
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError epi_get_observables(EpiObservable *out, const EpiModel model) {
+
+  clear_last_error();
+
+  if(model == NULL || out == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  if (model->age_pop == NULL && model->abm == NULL &&
+    (model->population == NULL ||
+    model->population->n_total_active == NULL)) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+#ifdef EPI_PROFILE
+  uint64 start = profile_ticks();
+#endif
+
+  out->day = model->day;
+
+  out->finished = model->finished;
+  out->vaccine_available = model->vaccine_available;
+
+  pop_observables(out, model_pop(model));
+
+#ifdef EPI_PROFILE
+  profile_phase(&model->profile, EPI_PHASE_OBSERVABLES, start);
+#endif
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError epi_rl_observation(float *out, const EpiObservable *obs) {
+  clear_last_error();
+
+  if (out == NULL || obs == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  float total = (float)(obs->n_susceptible + obs->n_infected +
+    obs->n_recovered + obs->n_vaccinated + obs->n_dead);
+  if (total <= 0.0f) {
+    total = 1.0f;
+  }
+  float capacity = obs->hosp_capacity > 0 ? (float)obs->hosp_capacity : 1.0f;
+
+  out[0] = obs->n_susceptible / total;
+  out[1] = obs->n_infected / total;
+  out[2] = obs->n_dead / total;
+  out[3] = obs->n_critical / capacity;
+  out[4] = obs->vaccine_available ? 1.0f : 0.0f;
+
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError epi_get_rl_observation(float *out, const EpiModel model) {
+  clear_last_error();
+
+  if (out == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  EpiObservable obs;
+  PASS_ERROR(epi_get_observables(&obs, model));
+  return epi_rl_observation(out, &obs);
+}
+
+EpiError epi_get_day_bins(EpiDayBins *out, const EpiModel model) {
+  clear_last_error();
+
+  if (out == NULL || model == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  // Other engines keep no day bins of their own, and mean-field mode keeps
+  // its state elsewhere
+  const Population *pop = model->population;
+  if (pop == NULL || model->mean_field != NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  out->n_bins = pop->max_duration;
+  out->head = pop->head;
+  out->n_total_active = pop->n_total_active;
+  out->n_asymptomatic = pop->n_asymptomatic;
+  out->n_symptomatic = pop->n_symptomatic;
+  out->n_critical = pop->n_critical;
+
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError epi_clone_model(EpiModel *out, const EpiModel model) {
+  clear_last_error();
+
+  if (out == NULL || model == NULL || *out != NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  EpiModel copy = malloc(sizeof(struct _EpiModel));
+  if (copy == NULL) {
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+  memcpy(copy, model, sizeof(struct _EpiModel));
+  copy->disease = NULL;
+  copy->population = NULL;
+  copy->mean_field = NULL;
+  copy->age_pop = NULL;
+  copy->abm = NULL;
+  copy->recorder = NULL;
+  init_profile(&copy->profile);
+  copy->initial_state = (uint8 *)malloc(model->initial_size);
+  if (copy->initial_state == NULL) {
+    free(copy);
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+  memcpy(copy->initial_state, model->initial_state, model->initial_size);
+
+  EpiError err = EPI_ERROR_SUCCESS;
+  if (model->population != NULL) {
+    err = copy_pop(&copy->population, model->population);
+  }
+  if (err == EPI_ERROR_SUCCESS && model->mean_field != NULL) {
+    err = copy_mean_field(&copy->mean_field, model->mean_field);
+  }
+  if (err == EPI_ERROR_SUCCESS && model->age_pop != NULL) {
+    err = copy_age_pop(&copy->age_pop, model->age_pop);
+  }
+  if (err == EPI_ERROR_SUCCESS && model->abm != NULL) {
+    err = copy_abm(&copy->abm, model->abm);
+  }
+  if (err != EPI_ERROR_SUCCESS) {
+    epi_free_model(&copy);
+    return err;
+  }
+
+  copy->disease = retain_disease(model->disease);
+  *out = copy;
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError epi_snapshot_size(size_t *out, const EpiModel model) {
+  clear_last_error();
+
+  if (out == NULL || model == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  SnapshotLayout layout;
+  snapshot_layout(&layout, model);
+  *out = (size_t)layout.size;
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError epi_snapshot(void *buf, size_t size, const EpiModel model) {
+  clear_last_error();
+
+  if (buf == NULL || model == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  SnapshotHeader header;
+  memset(&header, 0, sizeof(SnapshotHeader));
+  snapshot_layout(&header.layout, model);
+  if (size < header.layout.size) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+  header.day = model->day;
+  header.started = model->started;
+  header.finished = model->finished;
+  header.vaccine_available = model->vaccine_available;
+  header.sampler = model->sampler;
+
+  uint8 *b = (uint8 *)buf;
+  memcpy(b, &header, sizeof(SnapshotHeader));
+  size_t pos = sizeof(SnapshotHeader);
+  if (model->abm != NULL) {
+    pos += save_abm_state(&b[pos], model->abm);
+  } else if (model->age_pop != NULL) {
+    pos += save_age_pop_state(&b[pos], model->age_pop);
+  } else {
+    pos += save_pop_state(&b[pos], model->population);
+    if (model->mean_field != NULL) {
+      pos += save_mean_field_state(&b[pos], model->mean_field);
+    }
+  }
+  assert(pos == header.layout.size);
+
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError epi_restore(EpiModel model, const void *buf, size_t size) {
+  clear_last_error();
+
+  if (model == NULL || buf == NULL || size < sizeof(SnapshotHeader)) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  SnapshotHeader header;
+  memcpy(&header, buf, sizeof(SnapshotHeader));
+
+  // Snapshot must come from a model with the same shape
+  SnapshotLayout layout;
+  snapshot_layout(&layout, model);
+  if (memcmp(&layout, &header.layout, sizeof(SnapshotLayout)) ||
+    size < layout.size) {
+    return EPI_ERROR_INVALID_DATA;
+  }
+
+  model->day = header.day;
+  model->started = header.started;
+  model->finished = header.finished;
+  model->vaccine_available = header.vaccine_available;
+  model->sampler = header.sampler;
+
+  const uint8 *b = (const uint8 *)buf;
+  size_t pos = sizeof(SnapshotHeader);
+  if (model->abm != NULL) {
+    pos += load_abm_state(model->abm, &b[pos]);
+  } else if (model->age_pop != NULL) {
+    pos += load_age_pop_state(model->age_pop, &b[pos]);
+  } else {
+    pos += load_pop_state(model->population, &b[pos]);
+    if (model->mean_field != NULL) {
+      pos += load_mean_field_state(model->mean_field, &b[pos]);
+    }
+  }
+  assert(pos == layout.size);
+
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError epi_model_run(EpiObservable *trajectory, size_t *n_steps,
+  EpiModel model, const EpiSchedule *schedule, size_t n_days) {
+
+  clear_last_error();
+
+  if (trajectory == NULL || n_steps == NULL || model == NULL ||
+    schedule == NULL ||
+    (schedule->n_entries > 0 && schedule->entries == NULL)) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  *n_steps = 0;
+  for (size_t i = 0; i < n_days && !model->finished; i++) {
+    EpiInput input;
+    schedule_input(&input, schedule, model->day);
+    PASS_ERROR(epi_model_step(model, &input));
+    PASS_ERROR(epi_get_observables(&trajectory[i], model));
+    *n_steps = i + 1;
+  }
+
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError epi_model_advance_until_event(size_t *n_days, double *cost,
+  EpiModel model, const EpiInput *input, size_t max_days) {
+
+  clear_last_error();
+
+  if (n_days == NULL || cost == NULL || model == NULL || input == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  *n_days = 0;
+  *cost = 0.0;
+  if (model->finished || max_days == 0) {
+    return EPI_ERROR_SUCCESS;
+  }
+
+  // Every quiet day has the same cost, since nobody is ill or dies
+  EpiObservable obs;
+  size_t n_quiet = quiet_days(model, max_days);
+  if (n_quiet > 0) {
+    memcpy(&model->population->policy, input, sizeof(EpiInput));
+    PASS_ERROR(evolve_pop_quiet(model->population, model->vaccine_available,
+      n_quiet));
+    model->day += n_quiet;
+    PASS_ERROR(epi_get_observables(&obs, model));
+    *n_days = n_quiet;
+    *cost = (double)n_quiet * obs.cost_function;
+  }
+
+  // The day that ended the quiet period, or any other day
+  if (*n_days < max_days) {
+    PASS_ERROR(epi_model_step(model, input));
+    PASS_ERROR(epi_get_observables(&obs, model));
+    (*n_days)++;
+    *cost += obs.cost_function;
+  }
+
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError epi_get_profile(EpiProfile *out, const EpiModel model) {
+  clear_last_error();
+
+  if (out == NULL || model == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  get_profile(out, &model->profile);
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError epi_reset_profile(EpiModel model) {
+  clear_last_error();
+
+  if (model == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  free_profile_trace(&model->profile);
+  init_profile(&model->profile);
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError epi_start_trace(EpiModel model, size_t max_events) {
+  clear_last_error();
+
+  if (model == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  return start_profile_trace(&model->profile, max_events);
+}
+
+EpiError epi_write_trace(const EpiModel model, const char *fname) {
+  clear_last_error();
+
+  if (model == NULL || fname == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  return write_profile_trace(fname, &model->profile);
+}
+
+EpiError epi_thread_pool_create(EpiThreadPool *out, size_t n_threads) {
+  clear_last_error();
+
+  if (out == NULL || *out != NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  return create_thread_pool(out, n_threads);
+}
+
+EpiError epi_thread_pool_free(EpiThreadPool *pool) {
+  return free_thread_pool(pool);
+}
+
+EpiError epi_step_models(EpiObservable *out, EpiModel *models,
+  const EpiInput *inputs, size_t n_models, EpiThreadPool pool) {
+
+  clear_last_error();
+
+  if (out == NULL || models == NULL || inputs == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  StepModelsCall call = {out, models, inputs};
+  if (pool == NULL) {
+    for (size_t i = 0; i < n_models; i++) {
+      PASS_ERROR(step_models_task(&call, i));
+    }
+    return EPI_ERROR_SUCCESS;
+  }
+  return thread_pool_run(pool, n_models, step_models_task, &call);
+}
+
+EpiError epi_construct_meta_model(EpiMetaModel *out,
+  const EpiScenario *scenario, const char *region_fname,
+  const char *edge_fname, size_t n_threads) {
+
+  clear_last_error();
+
+  if (out == NULL || scenario == NULL ||
+    scenario->dis_fname == NULL || scenario->pop_fname == NULL ||
+    region_fname == NULL || edge_fname == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  // Mean-field mode, age strata and agents are only available for single
+  // populations
+  if (scenario->mean_field || scenario->age_fname != NULL ||
+    scenario->engine != EPI_ENGINE_COMPARTMENT ||
+    (int)scenario->sampler < 0 ||
+    scenario->sampler >= N_EPI_SAMPLER) {
+    return EPI_ERROR_INVALID_SCENARIO;
+  }
+
+  EpiMetaModel model = calloc(1, sizeof(struct _EpiMetaModel));
+  if (model == NULL) {
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+
+  memcpy(&(model->scenario), scenario, sizeof(EpiScenario));
+  if (normalize_scenario(&(model->scenario)) != EPI_ERROR_SUCCESS) {
+    free(model);
+    return EPI_ERROR_INVALID_SCENARIO;
+  }
+
+  EpiError err;
+  err = cached_disease(&(model->disease), scenario->dis_fname);
+  if (err != EPI_ERROR_SUCCESS) {
+    free(model);
+    return err;
+  }
+
+  err = create_metapop_from_files(&(model->metapop), model->disease,
+    scenario->pop_fname, region_fname, edge_fname, scenario->sampler,
+    scenario->seed, n_threads);
+  if (err != EPI_ERROR_SUCCESS) {
+    free_disease(&(model->disease));
+    free(model);
+    return err;
+  }
+
+  *out = model;
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError epi_free_meta_model(EpiMetaModel *model) {
+  if (model == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  if (*model == NULL) {
+    return EPI_ERROR_SUCCESS;
+  }
+
+  free_metapop(&((*model)->metapop));
+  free_disease(&((*model)->disease));
+  free(*model);
+  *model = NULL;
+
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError epi_meta_model_size(size_t *out, const EpiMetaModel model) {
+  clear_last_error();
+
+  if (out == NULL || model == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  *out = model->metapop->n_regions;
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError epi_meta_model_step(EpiMetaModel model, const EpiInput *inputs) {
+
+  clear_last_error();
+
+  if (model == NULL || inputs == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  if (model->finished) {
+    model->day++;
+    return EPI_ERROR_SUCCESS;
+  }
+
+  MetaPop *mp = model->metapop;
+
+  if (is_scenario_day(model->day, model->scenario.t_initial)) {
+    Population *seed = mp->regions[mp->seed_region];
+    memcpy(&seed->policy, &inputs[mp->seed_region], sizeof(EpiInput));
+    PASS_ERROR(infect_pop(seed, model->scenario.n_initial));
+    model->started = true;
+  }
+
+  if (!model->vaccine_available &&
+    is_scenario_day(model->day, model->scenario.t_vaccine)) {
+    model->vaccine_available = true;
+  }
+
+  // Finished once the disease has been eradicated everywhere
+  uint64 n_infected = 0;
+  for (size_t i = 0; i < mp->n_regions; i++) {
+    n_infected += mp->regions[i]->n_infected;
+  }
+  if ((model->started && n_infected == 0) ||
+    reached_scenario_day(model->day, model->scenario.t_max)) {
+
+    model->day++;
+    model->finished = true;
+    return EPI_ERROR_SUCCESS;
+  }
+
+  PASS_ERROR(evolve_metapop(mp, inputs, model->vaccine_available));
+  model->day++;
+
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError epi_meta_get_observables(EpiObservable *out,
+  const EpiMetaModel model) {
+
+  clear_last_error();
+
+  if (out == NULL || model == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  for (size_t i = 0; i < model->metapop->n_regions; i++) {
+    out[i].day = model->day;
+    out[i].finished = model->finished;
+    out[i].vaccine_available = model->vaccine_available;
+    pop_observables(&out[i], model->metapop->regions[i]);
+  }
+
+  return EPI_ERROR_SUCCESS;
+}
+
+static EpiError normalize_scenario(EpiScenario *scenario) {
+  // Outbreak never happens: indicated by t_initial == -1
+  if (scenario->t_initial < 0 || scenario->n_initial == 0) {
+    scenario->t_initial = -1;
+  }
+  // Vaccine never happens: indicated by t_vaccine == -1
+  if (scenario->t_vaccine < 0) {
+    scenario->t_vaccine = -1;
+  }
+  // Do not stop at any particular time, run until no infections remain
+  if (scenario->t_max < 0) {
+    // Must have either a start or stop time
+    if (scenario->t_initial == -1) {
+      return EPI_ERROR_INVALID_SCENARIO;
+    }
+    scenario->t_max = -1;
+  }
+
+  return EPI_ERROR_SUCCESS;
+}
+
+static EpiError model_step(EpiModel model, const EpiInput *input) {
   // If model has finished, do nothing
   if (model->finished) {
     model->day++;
@@ -98,64 +885,176 @@ EpiError epi_model_step(EpiModel model, const EpiInput *input) {
   }
 
   // Apply input as current policy
-  memcpy(&model->population->policy, input, sizeof(EpiInput));
+  Population *pop = model_pop(model);
+  memcpy(&pop->policy, input, sizeof(EpiInput));
 
   // Check for initial infection date
-  if (model->day == model->scenario.t_initial) {
-    PASS_ERROR(infect_pop(model->population, model->scenario.n_initial));
+  if (is_scenario_day(model->day, model->scenario.t_initial)) {
+    if (model->abm != NULL) {
+      PASS_ERROR(infect_abm(model->abm, model->scenario.n_initial));
+    } else if (model->age_pop != NULL) {
+      PASS_ERROR(infect_age_pop(model->age_pop, model->scenario.n_initial));
+    } else if (model->mean_field != NULL) {
+      PASS_ERROR(mean_field_infect(model->mean_field, model->population,
+        (double)model->scenario.n_initial));
+    } else {
+      PASS_ERROR(infect_pop(model->population, model->scenario.n_initial));
+    }
     model->started = true;
   }
 
   // Check if vaccine has become available
-  if (!model->vaccine_available && model->day == model->scenario.t_vaccine) {
+  if (!model->vaccine_available &&
+    is_scenario_day(model->day, model->scenario.t_vaccine)) {
     model->vaccine_available = true;
   }
 
   // Check if max simulation time has passed or if disease has been eradicated
-  if ((model->started && model->population->n_infected == 0) ||
-    model->day >= model->scenario.t_max) {
+  if ((model->started && pop->n_infected == 0) ||
+    reached_scenario_day(model->day, model->scenario.t_max)) {
 
     model->day++;
     model->finished = true;
     return EPI_ERROR_SUCCESS;
   }
 
-  PASS_ERROR(evolve_pop(model->population, model->disease,
-    model->vaccine_available));
+  if (model->abm != NULL) {
+    PASS_ERROR(evolve_abm(model->abm, model->vaccine_available));
+  } else if (model->age_pop != NULL) {
+    PASS_ERROR(evolve_age_pop(model->age_pop, model->vaccine_available,
+      &model->sampler));
+  } else if (model->mean_field != NULL) {
+    PASS_ERROR(mean_field_evolve(model->mean_field, model->population,
+      model->disease, model->vaccine_available));
+  } else {
+    PASS_ERROR(evolve_pop(model->population, model->disease,
+      model->vaccine_available, &model->sampler));
+  }
   model->day++;
 
   return EPI_ERROR_SUCCESS;
 }
 
-EpiError epi_get_observables(EpiObservable *out, const EpiModel model) {
+static EpiError model_step_recorded(EpiModel model, const EpiInput *input) {
+  // Steps after the model has finished change nothing, and are not recorded
+  bool finished = model->finished;
+  PASS_ERROR(model_step(model, input));
+  if (model->recorder != NULL && !finished) {
+    EpiObservable obs;
+    PASS_ERROR(epi_get_observables(&obs, model));
+    uint64 start = PROFILE_BEGIN();
+    PASS_ERROR(record_step(model->recorder, &obs,
+      model->mean_field == NULL ? model->population : NULL));
+    PROFILE_END(EPI_PHASE_RECORDING, start);
+  }
 
-  if(model == NULL || out == NULL) {
-    return EPI_ERROR_INVALID_ARGS;
+  return EPI_ERROR_SUCCESS;
+}
+
+static size_t quiet_days(const EpiModel model, size_t max_days) {
+  // Only the compartment engine skips days, and only when nothing needs to
+  // be recorded for them
+  if (model->population == NULL || model->mean_field != NULL ||
+    model->recorder != NULL || model->started || model->finished) {
+    return 0;
   }
 
-  if(model->population == NULL || model->population->n_total_active == NULL) {
-    return EPI_ERROR_INVALID_ARGS;
+  // With no susceptible people left, or a vaccine that can reach all of
+  // them in a day, steps can leave the quiet state in ways it does not model
+  const Population *pop = model->population;
+  if (pop->n_infected > 0 || pop->n_susceptible == 0 ||
+    pop->daily_vaccination_capacity >= 1.f) {
+    return 0;
   }
 
-  out->day = model->day;
+  // The step on day t_max is the first that finishes the model
+  size_t n = days_until(model->day, model->scenario.t_initial, max_days);
+  if (!model->vaccine_available) {
+    n = days_until(model->day, model->scenario.t_vaccine, n);
+  }
+  return days_until(model->day, model->scenario.t_max, n);
+}
 
-  out->finished = model->finished;
-  out->vaccine_available = model->vaccine_available;
+static bool is_scenario_day(size_t day, int t) {
+  return t >= 0 && day == (size_t)t;
+}
+
+static bool reached_scenario_day(size_t day, int t) {
+  return t >= 0 && day >= (size_t)t;
+}
 
-  out->hosp_capacity = model->population->n_hospital_beds;
+static size_t days_until(size_t day, int t, size_t max_days) {
+  if (t < 0) {
+    return max_days;
+  }
+  if ((size_t)t <= day) {
+    return 0;
+  }
+  return (size_t)t - day < max_days ? (size_t)t - day : max_days;
+}
+
+static Population *model_pop(EpiModel model) {
+  if (model->abm != NULL) {
+    return &model->abm->summary;
+  }
+  return model->age_pop != NULL ? &model->age_pop->summary :
+    model->population;
+}
 
-  out->n_susceptible = model->population->n_susceptible;
-  out->n_infected = model->population->n_infected;
-  out->n_critical = model->population->n_total_critical;
-  out->n_recovered = model->population->n_recovered;
-  out->n_vaccinated = model->population->n_vaccinated;
-  out->n_dead = model->population->n_dead;
+static void pop_observables(EpiObservable *out, const Population *pop) {
+  out->hosp_capacity = pop->n_hospital_beds;
+
+  out->n_susceptible = pop->n_susceptible;
+  out->n_infected = pop->n_infected;
+  out->n_critical = pop->n_total_critical;
+  out->n_recovered = pop->n_recovered;
+  out->n_vaccinated = pop->n_vaccinated;
+  out->n_dead = pop->n_dead;
 
   //TODO: 8 million, or 0.008 billion is the estimated cost of one death,
   //in dollars.
   //Replace this magic number with scenario parameter.
-  out->cost_function = productivity_loss(model->population) * 1e-9f +
-    0.008 * (model->population->n_dead - model->population->n_dead_last);
+  out->cost_function = productivity_loss(pop) * 1e-9f +
+    0.008 * (pop->n_dead - pop->n_dead_last);
+}
 
-  return EPI_ERROR_SUCCESS;
+static void schedule_input(EpiInput *out, const EpiSchedule *schedule,
+  size_t day) {
+  memset(out, 0, sizeof(EpiInput));
+  for (size_t i = schedule->n_entries; i > 0; i--) {
+    const EpiScheduleEntry *entry = &schedule->entries[i - 1];
+    if (day >= entry->t_start && day < entry->t_end) {
+      *out = entry->input;
+      return;
+    }
+  }
+}
+
+static void snapshot_layout(SnapshotLayout *out, const EpiModel model) {
+  memset(out, 0, sizeof(SnapshotLayout));
+  out->magic = EPI_SNAPSHOT_MAGIC;
+  out->engine = model->scenario.engine;
+  out->mean_field = model->mean_field != NULL;
+  out->max_duration = model->disease->max_duration;
+
+  size_t size = sizeof(SnapshotHeader);
+  if (model->abm != NULL) {
+    out->n_agents = model->abm->n_agents;
+    size += abm_state_size(model->abm);
+  } else if (model->age_pop != NULL) {
+    out->n_strata = model->age_pop->n_strata;
+    size += age_pop_state_size(model->age_pop);
+  } else {
+    size += pop_state_size(model->population);
+    if (model->mean_field != NULL) {
+      size += mean_field_state_size(model->mean_field);
+    }
+  }
+  out->size = size;
+}
+
+static EpiError step_models_task(void *ctx, size_t i) {
+  StepModelsCall *call = (StepModelsCall *)ctx;
+  PASS_ERROR(epi_model_step(call->models[i], &call->inputs[i]));
+  return epi_get_observables(&call->out[i], call->models[i]);
 }
@@ -23,9 +23,55 @@ typedef enum {
   N_EPI_ERROR
 } EpiError;
 
-// Opaque handle for model
+// Details of an error, see epi_last_error()
+#define EPI_ERROR_TEXT_SIZE 256
+typedef struct {
+  EpiError err;
+  // Data file where the error was found, empty if none
+  char fname[EPI_ERROR_TEXT_SIZE];
+  // Line and column in the data file, counting from 1, or 0 if the error is
+  // not tied to a position, such as a missing token
+  size_t line;
+  size_t column;
+  // Description of the problem
+  char message[EPI_ERROR_TEXT_SIZE];
+} EpiErrorInfo;
+
+// Method used for binomial and multinomial draws
+typedef enum {
+  // Poisson / Gaussian approximations, with Monte Carlo for small n
+  EPI_SAMPLER_APPROX,
+  // Exact draws: inversion for small n * p, BTRS rejection otherwise
+  EPI_SAMPLER_EXACT,
+  N_EPI_SAMPLER
+} EpiSampler;
+
+// Simulation engine behind a model
+typedef enum {
+  // Population compartments, binned by day of disease
+  EPI_ENGINE_COMPARTMENT,
+  // Individual agents in households and workplaces, for populations of up
+  // to a few million people
+  EPI_ENGINE_AGENT,
+  N_EPI_ENGINE
+} EpiEngine;
+
+// Opaque handle for model.  The library keeps no global model state, so
+// different models may be used from different threads at the same time,
+// but a single model must not be.
 typedef struct _EpiModel* EpiModel;
 
+// Opaque handle for metapopulation model: many regions coupled by travel
+typedef struct _EpiMetaModel* EpiMetaModel;
+
+// Opaque handle for a batch of independent models, stepped together as a
+// vectorized environment for reinforcement learning
+typedef struct _EpiBatch* EpiBatch;
+
+// Opaque handle for a pool of worker threads, for stepping many separate
+// models at once
+typedef struct ThreadPool* EpiThreadPool;
+
 // Scenario description
 typedef struct {
   // Day of initial infection, -1 = never
@@ -36,10 +82,26 @@ typedef struct {
   int t_vaccine;
   // How long to run the scenario, -1 = to eradication
   int t_max;
-  // Name of disease data file
+  // Name of disease data file, text or compiled by tools/dat2bin
   char *dis_fname;
-  // Name of population data file
+  // Name of population data file, text or compiled by tools/dat2bin
   char *pop_fname;
+  // Name of age structure data file, NULL = homogeneous population
+  char *age_fname;
+  // Random number generator seed.  Runs with the same scenario and seed
+  // produce identical results.
+  uint64 seed;
+  // Sampling method for random draws
+  EpiSampler sampler;
+  // Deterministic mean-field mode: every random draw is replaced by its
+  // expectation value, and the seed and sampler are ignored
+  bool mean_field;
+  // Simulation engine.  The agent engine ignores the sampler, and does not
+  // support mean-field mode or age strata.
+  EpiEngine engine;
+  // Number of threads for engines that step in parallel, 0 = one per CPU.
+  // Results do not depend on the number of threads.
+  size_t n_threads;
 } EpiScenario;
 
 // Epidemic control strategies currently in place.
@@ -52,6 +114,12 @@ typedef struct {
   bool dist_home_symp;
   // Are stay-at-home orders active for everyone?
   bool dist_home_all;
+  // Are schools closed?
+  // Only has an effect in age-structured models.
+  bool schools_closed;
+  // Is travel to and from other regions restricted?
+  // Only has an effect in metapopulation models.
+  bool travel_restrict;
   // TODO: measures below not yet implemented
   // Are field hospitals and improvised capacity expansion measures in place?
   //bool temp_hospitals;
@@ -85,10 +153,173 @@ typedef struct {
   float cost_function;
 } EpiObservable;
 
+// Policy in place over a range of days, t_start <= day < t_end
+typedef struct {
+  size_t t_start;
+  size_t t_end;
+  EpiInput input;
+} EpiScheduleEntry;
+
+// Policy schedule for running a model over many days.  On days covered by
+// several entries, the last of them applies.  On days not covered by any
+// entry, no control measures are in place.
+typedef struct {
+  size_t n_entries;
+  const EpiScheduleEntry *entries;
+} EpiSchedule;
+
+// Batched environments take one action per model, encoded as bit flags
+#define EPI_ACTION_DIST_RECOMMEND 0x1
+#define EPI_ACTION_DIST_HOME_SYMP 0x2
+#define EPI_ACTION_DIST_HOME_ALL 0x4
+#define EPI_ACTION_SCHOOLS_CLOSED 0x8
+#define N_EPI_ACTIONS 16
+
+// Observations written by batched environments, per model:
+//   susceptible / total, infected / total, dead / total,
+//   critical / hospital capacity, vaccine availability
+#define N_EPI_OBSERVATIONS 5
+
+// Day bins of a model's population.  Bin i holds the people on day of
+// disease d, where i = (head + d) % n_bins, so that aging the bins by a day
+// only moves head.
+typedef struct {
+  size_t n_bins;
+  size_t head;
+  // Arrays of n_bins bins, owned by the model.  They stay in place for as
+  // long as the model exists, and change as it steps.
+  const uint64 *n_total_active;
+  const uint64 *n_asymptomatic;
+  const uint64 *n_symptomatic;
+  const uint64 *n_critical;
+} EpiDayBins;
+
+// Scenario randomization for batched environments.  Every episode draws
+// its outbreak day, vaccine delay and random seed afresh.
+typedef struct {
+  // Template for all episodes: data files, engine, sampler and t_max.
+  // Its t_initial, t_vaccine and seed are replaced for each episode.
+  EpiScenario scenario;
+  // Probability that an episode has no outbreak at all.  Such episodes run
+  // for no_outbreak_days days.
+  float p_no_outbreak;
+  int no_outbreak_days;
+  // Range of outbreak days, inclusive
+  int t_initial_min;
+  int t_initial_max;
+  // Range of days from outbreak to vaccine availability, inclusive
+  int vaccine_delay_min;
+  int vaccine_delay_max;
+} EpiBatchConfig;
+
+// Default compression of quantile sketches.  Larger is more accurate, and
+// uses more memory.
+#define EPI_STATS_COMPRESSION 50.0
+
+// Observables summarized by statistics over many runs
+typedef enum {
+  EPI_FIELD_SUSCEPTIBLE,
+  EPI_FIELD_INFECTED,
+  EPI_FIELD_CRITICAL,
+  EPI_FIELD_RECOVERED,
+  EPI_FIELD_VACCINATED,
+  EPI_FIELD_DEAD,
+  EPI_FIELD_COST,
+  N_EPI_FIELDS
+} EpiField;
+
+// Distribution of one observable on one day, over many runs
+typedef struct {
+  double mean;
+  // Sample variance, 0 for a single run
+  double var;
+  double min;
+  double max;
+} EpiFieldStats;
+
+// Statistics of all observables on one day
+typedef struct {
+  // Number of observables recorded for the day
+  uint64 n;
+  // How many of them were from models that had not finished
+  uint64 n_running;
+  EpiFieldStats fields[N_EPI_FIELDS];
+} EpiStatsDay;
+
+// Phases of a model step, timed separately by profiling builds of the
+// library (see EpiProfile)
+typedef enum {
+  // All of epi_model_step
+  EPI_PHASE_STEP,
+  // Vaccination of susceptible people
+  EPI_PHASE_VACCINATION,
+  // Aging of day bins, and recoveries, worsening and deaths
+  EPI_PHASE_TRANSITIONS,
+  // Expected number of new infections
+  EPI_PHASE_INFECTION_RATE,
+  // Draw of new infections
+  EPI_PHASE_INFECTION,
+  // epi_get_observables
+  EPI_PHASE_OBSERVABLES,
+  // Writing a row to the model's recorder
+  EPI_PHASE_RECORDING,
+  N_EPI_PHASES
+} EpiPhase;
+
+// Work done by a model since construction or epi_reset_profile().  Only
+// collected if the library is built with EPI_PROFILE defined; otherwise,
+// enabled is false and everything else is 0.
+typedef struct {
+  bool enabled;
+  uint64 n_steps;
+  // Approximate binomial draws, by sampling method
+  uint64 n_poisson_draws;
+  uint64 n_gaussian_draws;
+  uint64 n_monte_carlo_draws;
+  // Rejected candidates of Poisson draws: accept-reject steps, and draws
+  // above the number of trials
+  uint64 n_poisson_retries;
+  // Rejected Gaussian deviates, outside 0 to the number of trials
+  uint64 n_gaussian_retries;
+  // Time spent in each phase in timer ticks (CPU cycles on x86), and the
+  // number of times the phase ran.  Phases may be nested in others.
+  uint64 phase_ticks[N_EPI_PHASES];
+  uint64 phase_calls[N_EPI_PHASES];
+  // Measured rate of the timer
+  double ticks_per_second;
+} EpiProfile;
+
+// Opaque handle for a recorder, which writes observables of every step to a
+// trajectory file (see recorder.h for the format)
+typedef struct _EpiRecorder* EpiRecorder;
+
+// Opaque handle for streaming statistics of observables from many runs,
+// day by day
+typedef struct _EpiStats* EpiStats;
+
 // Create a single-population model from scenario description,
-// a disease data file and a population data file
+// a disease data file and a population data file.  Disease and population
+// files are parsed once per process and version of the file, and shared by
+// all models that use them.
 EpiError epi_construct_model(EpiModel *out, const EpiScenario *scenario);
 
+// Return a model to its state on construction, for a new scenario with the
+// same data files, engine and mean-field mode, without reading any files or
+// allocating memory.  Gives the same results as constructing a new model,
+// except that agent models keep their households and workplaces.  The
+// number of threads does not change.
+EpiError epi_reset_model(EpiModel model, const EpiScenario *scenario);
+
+// Drop all cached data files.  Models in use are not affected.
+EpiError epi_clear_cache(void);
+
+// Details of the last error from reading a data file on the calling thread.
+// Every other API function except the ones that free objects clears it on
+// entry, so out->err is EPI_ERROR_SUCCESS if the last call failed without
+// details, or the details are from another thread (such as a worker of a
+// thread pool).
+EpiError epi_last_error(EpiErrorInfo *out);
+
 // Free resources associated with a model.  Sets model pointer to NULL.
 EpiError epi_free_model(EpiModel *out);
 
@@ -98,4 +329,215 @@ EpiError epi_model_step(EpiModel model, const EpiInput *input);
 // Get observable output from model
 EpiError epi_get_observables(EpiObservable *out, const EpiModel model);
 
+// Write the N_EPI_OBSERVATIONS observations of batched environments for
+// the given observables to out
+EpiError epi_rl_observation(float *out, const EpiObservable *obs);
+
+// Write the N_EPI_OBSERVATIONS observations of batched environments for
+// the current state of a model to out
+EpiError epi_get_rl_observation(float *out, const EpiModel model);
+
+// Get the day bins of a model, which point into the model itself.  Only
+// for the compartment engine without mean-field mode or age strata.
+EpiError epi_get_day_bins(EpiDayBins *out, const EpiModel model);
+
+// Create an independent copy of a model in its current state.  The copy
+// shares the model's disease data, which never changes, and continues with
+// the same random number state, so both give identical results for the
+// same inputs.
+EpiError epi_clone_model(EpiModel *out, const EpiModel model);
+
+// Size in bytes of a snapshot of a model's state
+EpiError epi_snapshot_size(size_t *out, const EpiModel model);
+
+// Write a snapshot of a model's state to buf, which has room for size bytes.
+// The snapshot holds counters, day bins, policy and random number state, but
+// no parameters or disease data, and is valid for this model, its clones,
+// and any model constructed from the same scenario.
+EpiError epi_snapshot(void *buf, size_t size, const EpiModel model);
+
+// Return a model to the state saved in a snapshot
+EpiError epi_restore(EpiModel model, const void *buf, size_t size);
+
+// Step model forward by up to n_days days, following schedule, and stop
+// early once the model has finished.  Writes observables after each step to
+// trajectory, which must have room for n_days entries, and the number of
+// steps taken to n_steps.
+EpiError epi_model_run(EpiObservable *trajectory, size_t *n_steps,
+  EpiModel model, const EpiSchedule *schedule, size_t n_days);
+
+// Step model forward with the same input through days on which nothing
+// happens, and then one more day, stopping after at most max_days days.
+// Days are quiet until the outbreak starts, the vaccine becomes available
+// or the scenario ends, and the compartment engine skips them all at once
+// (vaccinating as it would day by day).  Same as n_days calls to
+// epi_model_step(); the cost_function observables of those days are summed
+// into cost.  Does nothing once the model has finished.
+EpiError epi_model_advance_until_event(size_t *n_days, double *cost,
+  EpiModel model, const EpiInput *input, size_t max_days);
+
+// Create a recorder writing to a new trajectory file, replacing any file
+// of that name.  Rows are buffered, and written buffer_rows at a time,
+// 0 = a default of a few thousand.  Verbose recorders also record the day
+// bins of the population, and all models they record must have the same
+// disease duration.  A recorder must not be used by several threads at
+// once.
+EpiError epi_recorder_create(EpiRecorder *out, const char *fname,
+  bool verbose, size_t buffer_rows);
+
+// Write any buffered rows, close the file and free the recorder.  Sets
+// recorder pointer to NULL.
+EpiError epi_recorder_free(EpiRecorder *rec);
+
+// Write buffered rows to the file now
+EpiError epi_recorder_flush(EpiRecorder rec);
+
+// Record one row of observables.  Only for recorders that are not verbose.
+EpiError epi_recorder_append(EpiRecorder rec, const EpiObservable *obs);
+
+// Record the observables of a model after each step it takes, until the
+// recorder is replaced, or set to NULL.  The model does not own the
+// recorder, which must outlive its use.  Verbose recording needs the
+// compartment engine without mean-field mode or age strata.
+EpiError epi_model_set_recorder(EpiModel model, EpiRecorder rec);
+
+// Get the profile of a model.  Clones and models restored from snapshots
+// keep profiles of their own.
+EpiError epi_get_profile(EpiProfile *out, const EpiModel model);
+
+// Set the counters and timers of a model's profile to 0, and drop any
+// trace events
+EpiError epi_reset_profile(EpiModel model);
+
+// Start a trace of the phases of a model, keeping the first max_events
+// timed phases from now on, or stop tracing if max_events is 0.  Needs a
+// profiling build.
+EpiError epi_start_trace(EpiModel model, size_t max_events);
+
+// Write the trace of a model as Chrome trace-event JSON, for trace viewers
+// such as chrome://tracing or Perfetto
+EpiError epi_write_trace(const EpiModel model, const char *fname);
+
+// Create a pool of n_threads threads, including the calling thread, for
+// epi_step_models().  n_threads == 0 means one thread per CPU.
+EpiError epi_thread_pool_create(EpiThreadPool *out, size_t n_threads);
+
+// Stop the threads of a pool and free it.  Sets pool pointer to NULL.
+EpiError epi_thread_pool_free(EpiThreadPool *pool);
+
+// Step n_models models forward by one day, model i with inputs[i], spread
+// over the threads of pool, and write the observables of model i to out[i].
+// The models must all be different.  With a NULL pool, models are stepped
+// on the calling thread.  Every model has its own random number state, so
+// results do not depend on the number of threads.
+EpiError epi_step_models(EpiObservable *out, EpiModel *models,
+  const EpiInput *inputs, size_t n_models, EpiThreadPool pool);
+
+// Create a metapopulation model from scenario description, a region table
+// and a travel edge list (see metapop.h for file formats).  Every region
+// uses the disease and population parameters named in the scenario, and
+// the initial infection happens in the seed region of the region table.
+// Regions are stepped on n_threads threads, 0 = one per CPU.  Results do
+// not depend on the number of threads.
+EpiError epi_construct_meta_model(EpiMetaModel *out,
+  const EpiScenario *scenario, const char *region_fname,
+  const char *edge_fname, size_t n_threads);
+
+// Free resources associated with a metapopulation model.
+// Sets model pointer to NULL.
+EpiError epi_free_meta_model(EpiMetaModel *model);
+
+// Number of regions in a metapopulation model
+EpiError epi_meta_model_size(size_t *out, const EpiMetaModel model);
+
+// Step metapopulation model forward by one day, with one input per region
+EpiError epi_meta_model_step(EpiMetaModel model, const EpiInput *inputs);
+
+// Get observable output, one per region
+EpiError epi_meta_get_observables(EpiObservable *out,
+  const EpiMetaModel model);
+
+
+// Create a batch of n_envs models with randomized scenarios.  Models are
+// stepped on n_threads threads, 0 = one per CPU.  Episodes are drawn from
+// random streams derived from seed, so results do not depend on the number
+// of threads.  config is copied, file names included.
+EpiError epi_batch_construct(EpiBatch *out, const EpiBatchConfig *config,
+  size_t n_envs, size_t n_threads, uint64 seed);
+
+// Free a batch and all of its models.  Sets batch pointer to NULL.
+EpiError epi_batch_free(EpiBatch *batch);
+
+// Number of models in a batch
+EpiError epi_batch_size(size_t *out, const EpiBatch batch);
+
+// Start a new episode in every model
+EpiError epi_batch_reset(EpiBatch batch);
+
+// Step every model forward by one day, with actions[i] applied to model i.
+// Writes n_envs * N_EPI_OBSERVATIONS observations, n_envs rewards (the
+// negative cost function) and n_envs done flags.  Models whose episode has
+// finished are reset to a new episode, and their observations are those of
+// the new episode.
+EpiError epi_batch_step(EpiBatch batch, const uint32_t *actions, float *obs,
+  float *rewards, bool *dones);
+
+// Write current observations of every model, n_envs * N_EPI_OBSERVATIONS
+EpiError epi_batch_get_observables(float *obs, const EpiBatch batch);
+
+// Create statistics for n_days days.  For each day and field, they keep
+// mean and variance (Welford), extremes, and a merging t-digest quantile
+// sketch with the given compression, 0 = EPI_STATS_COMPRESSION.  Memory use
+// depends only on n_days and compression, not on the number of runs.
+// Statistics are not thread-safe: calls on the same statistics, including
+// queries, must not overlap.
+EpiError epi_stats_create(EpiStats *out, size_t n_days, double compression);
+
+// Free statistics.  Sets stats pointer to NULL.
+EpiError epi_stats_free(EpiStats *stats);
+
+// Number of days covered by statistics
+EpiError epi_stats_days(size_t *out, const EpiStats stats);
+
+// Record the observables of one run on one day
+EpiError epi_stats_add(EpiStats stats, size_t day, const EpiObservable *obs);
+
+// Add everything recorded in other to stats.  Both must have the same
+// number of days and compression.  The result depends on the order of
+// merges, but not on which thread makes them.
+EpiError epi_stats_merge(EpiStats stats, EpiStats other);
+
+// Get count, mean, variance and extremes of every field on one day
+EpiError epi_stats_get(EpiStatsDay *out, const EpiStats stats, size_t day);
+
+// Estimate the q-quantile, 0 <= q <= 1, of a field on one day.  Compresses
+// the values buffered for the sketch first, so it changes stats.
+EpiError epi_stats_quantile(double *out, EpiStats stats, size_t day,
+  EpiField field, double q);
+
+// Size in bytes of serialized statistics.  Compresses buffered values,
+// like epi_stats_quantile().
+EpiError epi_stats_serialized_size(size_t *out, EpiStats stats);
+
+// Write statistics to buf, which has room for size bytes, to be merged
+// with statistics from other processes.  Values are stored in the byte
+// order of the machine.
+EpiError epi_stats_serialize(void *buf, size_t size, EpiStats stats);
+
+// Create statistics from a buffer written by epi_stats_serialize()
+EpiError epi_stats_deserialize(EpiStats *out, const void *buf, size_t size);
+
+// Run n_replicates replicates of scenarios drawn from config, following
+// schedule, for as many days as stats covers, on n_threads threads
+// (0 = one per CPU), and add their observables to stats.  Replicates that
+// finish early keep their final observables on later days, so every day
+// covers every replicate.  Replicate i draws its scenario and seed from a
+// random stream of its own, derived from seed and i, and replicates are
+// combined in a fixed order, so results are identical for any number of
+// threads.  For a fixed scenario, set p_no_outbreak = 0, and make the
+// ranges of outbreak day and vaccine delay a single day each.
+EpiError epi_run_ensemble(EpiStats stats, const EpiBatchConfig *config,
+  const EpiSchedule *schedule, size_t n_replicates, size_t n_threads,
+  uint64 seed);
+
 #endif
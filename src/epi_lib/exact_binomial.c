@@ -0,0 +1,129 @@
+#include "exact_binomial.h"
+
+// Expected number of outcomes below which inversion is used instead of BTRS
+#define INVERSION_CUTOFF 10.0
+
+// Draw by sequential search of the cumulative distribution, for n * p small
+static uint64 inversion_draw(double p, uint64 n, EpiRng *rng);
+
+// Draw by transformed rejection with squeeze, for n * p large.
+// Hormann, W. (1993), "The generation of binomial random variates",
+// Journal of Statistical Computation and Simulation 46, 101-110.
+static uint64 btrs_draw(double p, uint64 n, EpiRng *rng);
+
+EpiError exact_bin_draw(uint64 *k, double p, uint64 n, EpiRng *rng) {
+  if (k == NULL || rng == NULL || p < 0.0 || p > 1.0) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  // Edge cases, p == 0, p == 1 or n == 0
+  if (p == 0.0 || n == 0) {
+    *k = 0;
+    return EPI_ERROR_SUCCESS;
+  }
+  if (p == 1.0) {
+    *k = n;
+    return EPI_ERROR_SUCCESS;
+  }
+
+  // Work with smaller probability
+  bool swap = p > 0.5;
+  if (swap) {
+    p = 1.0 - p;
+  }
+
+  uint64 result;
+  if ((double)n * p < INVERSION_CUTOFF) {
+    result = inversion_draw(p, n, rng);
+  } else {
+    result = btrs_draw(p, n, rng);
+  }
+
+  *k = swap ? n - result : result;
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError exact_dbin_draw(uint64 *nx, uint64 *ny,
+  float p_x, float p_y, uint64 n, EpiRng *rng) {
+
+  if (nx == NULL || ny == NULL || rng == NULL ||
+    p_x + p_y > 1.f || p_x < 0.f || p_y < 0.f) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  PASS_ERROR(exact_bin_draw(nx, p_x, n, rng));
+
+  // Probability of y, given that x did not occur
+  uint64 rest = n - *nx;
+  if (rest == 0 || p_y == 0.f) {
+    *ny = 0;
+    return EPI_ERROR_SUCCESS;
+  }
+  double p = (double)p_y / (1.0 - (double)p_x);
+  if (p > 1.0) {
+    p = 1.0;
+  }
+  return exact_bin_draw(ny, p, rest, rng);
+}
+
+static uint64 inversion_draw(double p, uint64 n, EpiRng *rng) {
+  double q = 1.0 - p;
+  double s = p / q;
+  double a = ((double)n + 1.0) * s;
+  double r0 = exp((double)n * log1p(-p));
+
+  // Restart in the rare case that rounding leaves probability mass
+  // unaccounted for at the end of the search
+  for (;;) {
+    double r = r0;
+    double u = rng_uniform(rng);
+    uint64 x = 0;
+    while (u > r) {
+      u -= r;
+      x++;
+      if (x > n) {
+        break;
+      }
+      r *= a / (double)x - s;
+    }
+    if (x <= n) {
+      return x;
+    }
+  }
+}
+
+static uint64 btrs_draw(double p, uint64 n, EpiRng *rng) {
+  double q = 1.0 - p;
+  double nd = (double)n;
+  double spq = sqrt(nd * p * q);
+
+  double b = 1.15 + 2.53 * spq;
+  double a = -0.0873 + 0.0248 * b + 0.01 * p;
+  double c = nd * p + 0.5;
+  double v_r = 0.92 - 4.2 / b;
+  double alpha = (2.83 + 5.1 / b) * spq;
+  double lpq = log(p / q);
+  double m = floor((nd + 1.0) * p);
+  double h = lgamma(m + 1.0) + lgamma(nd - m + 1.0);
+
+  for (;;) {
+    double u = rng_uniform(rng) - 0.5;
+    double v = rng_uniform_pos(rng);
+    double us = 0.5 - fabs(u);
+    double k = floor((2.0 * a / us + b) * u + c);
+
+    if (k < 0.0 || k > nd) {
+      continue;
+    }
+
+    // Squeeze: accept without evaluating the density
+    if (us >= 0.07 && v <= v_r) {
+      return (uint64)k;
+    }
+
+    v = log(v * alpha / (a / (us * us) + b));
+    if (v <= h - lgamma(k + 1.0) - lgamma(nd - k + 1.0) + (k - m) * lpq) {
+      return (uint64)k;
+    }
+  }
+}
@@ -0,0 +1,24 @@
+#ifndef __EXACT_BINOMIAL_H__
+#define __EXACT_BINOMIAL_H__
+// Exact draws from binomial and trinomial distributions, with O(1) expected
+// cost for any n and p.
+
+#include "common.h"
+#include "rng.h"
+
+// Exact draw from a binomial distribution.
+// Determine the number of outcomes k, having probability per experiment p,
+// from n experiments.
+// Uses inversion when n * min(p, 1-p) is small, and the BTRS
+// transformed rejection algorithm otherwise.
+EpiError exact_bin_draw(uint64 *k, double p, uint64 n, EpiRng *rng);
+
+// Exact double draw from a binomial distribution, with the same meaning
+// of arguments as approx_dbin_draw().
+// The pair {nx, ny} is drawn from the multinomial distribution with
+// probabilities {p_x, p_y, 1 - p_x - p_y}, as nx ~ B(n, p_x) followed by
+// ny ~ B(n - nx, p_y / (1 - p_x)).
+EpiError exact_dbin_draw(uint64 *nx, uint64 *ny, float p_x, float p_y, uint64 n,
+  EpiRng *rng);
+
+#endif
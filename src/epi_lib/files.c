@@ -1,65 +1,213 @@
 #include "files.h"
 
-EpiError read_size_token(size_t *s, FILE *fp, const char *token_name) {
-  if (s == NULL || fp == NULL || token_name == NULL) {
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Index entry for a token: name and first value line
+typedef struct {
+  uint64 hash;
+  const char *name;     // Points into file text, not NUL-terminated
+  size_t name_len;
+  const char *values;   // Start of line after the token line
+  size_t line;          // Line number of the token line, from 1
+} TokenEntry;
+
+struct DataFile {
+  char *fname;
+  char *text;           // Whole file, NUL-terminated
+  size_t size;
+
+  // Open addressing hash table of tokens, n_slots is a power of 2
+  size_t n_slots;
+  TokenEntry *slots;
+};
+
+// Position while reading the values of a token
+typedef struct {
+  const DataFile *df;
+  const char *line_start;   // Current line
+  const char *next;         // Start of next line
+  size_t line;              // Line number of current line
+} ValueCursor;
+
+// Last error on each thread
+static EPI_THREAD_LOCAL EpiErrorInfo last_error;
+
+// Hash of a token name
+static uint64 token_hash(const char *name, size_t len);
+
+// Build token index of a file read into memory
+static EpiError index_tokens(DataFile *df);
+
+// Find a token, and set cursor to its line
+static EpiError find_token(ValueCursor *cur, DataFile *df,
+  const char *token_name);
+
+// Move cursor to the next line.  Returns false at end of file.
+static bool next_value_line(ValueCursor *cur);
+
+// Record an error at character c of the cursor's line, or at the start of
+// the line if c is NULL, and return err
+static EpiError value_error(const ValueCursor *cur, EpiError err,
+  const char *c, const char *what);
+
+// Parse a decimal number, independent of locale, after optional blanks.
+// Sets *end to the first character after the number, or to s if there is
+// none.
+static double parse_number(const char *s, const char **end);
+
+// True if c ends a number: whitespace or end of line
+static bool ends_number(char c);
+
+EpiError open_data_file(DataFile **out, const char *fname) {
+  if (out == NULL || fname == NULL) {
     return EPI_ERROR_INVALID_ARGS;
   }
 
-  PASS_ERROR(find_token_in_file(fp, token_name));
+  FILE *fp = fopen(fname, "rb");
+  if (fp == NULL) {
+    set_last_error(EPI_ERROR_FILE_NOT_FOUND, fname, 0, 0,
+      "cannot open file");
+    return EPI_ERROR_FILE_NOT_FOUND;
+  }
 
-  char buf[MAX_LINE_SIZE];
-  if (fgets(buf, MAX_LINE_SIZE, fp) == NULL) {
-    return EPI_ERROR_UNEXPECTED_EOF;
+  DataFile *df = (DataFile *)calloc(1, sizeof(DataFile));
+  if (df == NULL) {
+    fclose(fp);
+    return EPI_ERROR_OUT_OF_MEMORY;
   }
 
-  char *c;
-  unsigned long long result = strtoull(buf, &c, 10);
-  if (c == buf) {
-    return EPI_ERROR_INVALID_DATA;
+  // Read whole file, growing the buffer as needed
+  size_t capacity = 4096;
+  df->text = (char *)malloc(capacity);
+  df->fname = (char *)malloc(strlen(fname) + 1);
+  EpiError err = EPI_ERROR_SUCCESS;
+  if (df->text == NULL || df->fname == NULL) {
+    err = EPI_ERROR_OUT_OF_MEMORY;
+  } else {
+    strcpy(df->fname, fname);
   }
+  while (err == EPI_ERROR_SUCCESS) {
+    if (df->size + 1 == capacity) {
+      char *text = (char *)realloc(df->text, 2 * capacity);
+      if (text == NULL) {
+        err = EPI_ERROR_OUT_OF_MEMORY;
+        break;
+      }
+      df->text = text;
+      capacity *= 2;
+    }
+    size_t n = fread(&df->text[df->size], 1, capacity - 1 - df->size, fp);
+    df->size += n;
+    if (n == 0) {
+      if (ferror(fp)) {
+        err = EPI_ERROR_UNEXPECTED_EOF;
+      }
+      break;
+    }
+  }
+  fclose(fp);
 
-  *s = (size_t)result;
+  if (err == EPI_ERROR_SUCCESS) {
+    df->text[df->size] = '\0';
+    err = index_tokens(df);
+  }
+  if (err != EPI_ERROR_SUCCESS) {
+    free_data_file(&df);
+    return err;
+  }
+
+  *out = df;
   return EPI_ERROR_SUCCESS;
 }
 
-EpiError read_float_token(float *f, FILE *fp, const char *token_name) {
-  if (f == NULL || fp == NULL || token_name == NULL) {
+EpiError free_data_file(DataFile **df) {
+  if (df == NULL) {
     return EPI_ERROR_INVALID_ARGS;
   }
 
-  PASS_ERROR(find_token_in_file(fp, token_name));
+  if (*df == NULL) {
+    return EPI_ERROR_SUCCESS;
+  }
 
-  char buf[MAX_LINE_SIZE];
-  if (fgets(buf, MAX_LINE_SIZE, fp) == NULL) {
-    return EPI_ERROR_UNEXPECTED_EOF;
+  free((*df)->fname);
+  free((*df)->text);
+  free((*df)->slots);
+  free(*df);
+  *df = NULL;
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError read_size_token(size_t *s, DataFile *df, const char *token_name) {
+  if (s == NULL || df == NULL || token_name == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
   }
 
-  double result = atof(buf);
-  if ((result == 0.0 && buf[0] != '0' && buf[0] != '.') || result < 0.0) {
-    return EPI_ERROR_INVALID_DATA;
+  ValueCursor cur;
+  PASS_ERROR(find_token(&cur, df, token_name));
+  if (!next_value_line(&cur)) {
+    return value_error(&cur, EPI_ERROR_UNEXPECTED_EOF, NULL, "no value");
   }
 
-  *f = (float)result;
+  const char *c = cur.line_start;
+  while (*c == ' ' || *c == '\t') {
+    c++;
+  }
+  if (*c < '0' || *c > '9') {
+    return value_error(&cur, EPI_ERROR_INVALID_DATA, c,
+      "expected natural number");
+  }
+
+  uint64 result = 0;
+  const char *start = c;
+  for (; *c >= '0' && *c <= '9'; c++) {
+    if (result > ((uint64)SIZE_MAX - 9) / 10) {
+      return value_error(&cur, EPI_ERROR_INVALID_DATA, start,
+        "number too large");
+    }
+    result = result * 10 + (uint64)(*c - '0');
+  }
+  if (!ends_number(*c)) {
+    return value_error(&cur, EPI_ERROR_INVALID_DATA, c,
+      "expected natural number");
+  }
+
+  *s = (size_t)result;
   return EPI_ERROR_SUCCESS;
 }
 
-EpiError read_float_array(float *f, size_t size, FILE *fp,
+EpiError read_float_token(float *f, DataFile *df, const char *token_name) {
+  return read_float_array(f, 1, df, token_name);
+}
+
+EpiError read_float_array(float *f, size_t size, DataFile *df,
   const char *token_name) {
-  if (f == NULL || size == 0 || fp == NULL || token_name == NULL) {
+  if (f == NULL || size == 0 || df == NULL || token_name == NULL) {
     return EPI_ERROR_INVALID_ARGS;
   }
 
-  PASS_ERROR(find_token_in_file(fp, token_name));
+  ValueCursor cur;
+  PASS_ERROR(find_token(&cur, df, token_name));
 
-  char buf[MAX_LINE_SIZE];
   for (size_t i = 0; i < size; i++) {
-    if (fgets(buf, MAX_LINE_SIZE, fp) == NULL) {
-      return EPI_ERROR_UNEXPECTED_EOF;
+    if (!next_value_line(&cur)) {
+      return value_error(&cur, EPI_ERROR_UNEXPECTED_EOF, NULL,
+        "not enough values");
     }
 
-    double result = atof(buf);
-    if ((result == 0.0 && buf[0] != '0' && buf[0] != '.') || result < 0.0) {
-      return EPI_ERROR_INVALID_DATA;
+    const char *end;
+    double result = parse_number(cur.line_start, &end);
+    if (end == cur.line_start || !ends_number(*end)) {
+      return value_error(&cur, EPI_ERROR_INVALID_DATA, end,
+        "expected number");
+    }
+    if (result < 0.0) {
+      return value_error(&cur, EPI_ERROR_INVALID_DATA, NULL,
+        "negative value");
     }
 
     f[i] = (float)result;
@@ -68,21 +216,394 @@ EpiError read_float_array(float *f, size_t size, FILE *fp,
   return EPI_ERROR_SUCCESS;
 }
 
-EpiError find_token_in_file(FILE *fp, const char *token_name) {
-  if (fp == NULL || token_name == NULL) {
+EpiError read_double_table(double *d, size_t n_rows, size_t n_cols,
+  DataFile *df, const char *token_name) {
+  if (d == NULL || n_cols == 0 || df == NULL || token_name == NULL) {
     return EPI_ERROR_INVALID_ARGS;
   }
 
-  char buf[MAX_LINE_SIZE];
-  char tok[MAX_LINE_SIZE];
-  sprintf(tok, "$%s\n", token_name);
+  ValueCursor cur;
+  PASS_ERROR(find_token(&cur, df, token_name));
+
+  for (size_t i = 0; i < n_rows; i++) {
+    if (!next_value_line(&cur)) {
+      return value_error(&cur, EPI_ERROR_UNEXPECTED_EOF, NULL,
+        "not enough rows");
+    }
+
+    const char *c = cur.line_start;
+    for (size_t j = 0; j < n_cols; j++) {
+      const char *end;
+      double result = parse_number(c, &end);
+      if (end == c || !ends_number(*end)) {
+        return value_error(&cur, EPI_ERROR_INVALID_DATA, end,
+          "expected number");
+      }
+      d[i * n_cols + j] = result;
+      c = end;
+    }
+  }
+
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError invalid_data(const DataFile *df, const char *token_name,
+  const char *message) {
+  size_t line = 0;
+  if (token_name != NULL) {
+    ValueCursor cur;
+    if (find_token(&cur, (DataFile *)df, token_name) == EPI_ERROR_SUCCESS) {
+      line = cur.line;
+    }
+  }
+  set_last_error(EPI_ERROR_INVALID_DATA, df->fname, line, line > 0 ? 1 : 0,
+    message);
+  return EPI_ERROR_INVALID_DATA;
+}
+
+EpiError hash_file(uint64 *hash, const char *fname) {
+  if (hash == NULL || fname == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  FILE *fp = fopen(fname, "rb");
+  if (fp == NULL) {
+    set_last_error(EPI_ERROR_FILE_NOT_FOUND, fname, 0, 0,
+      "cannot open file");
+    return EPI_ERROR_FILE_NOT_FOUND;
+  }
+
+  // 64-bit FNV-1a
+  uint64 h = 0xcbf29ce484222325ull;
+  unsigned char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+    for (size_t i = 0; i < n; i++) {
+      h = (h ^ buf[i]) * 0x100000001b3ull;
+    }
+  }
+
+  EpiError err = ferror(fp) ? EPI_ERROR_UNEXPECTED_EOF : EPI_ERROR_SUCCESS;
+  fclose(fp);
+  *hash = h;
+  return err;
+}
+
+#ifndef _WIN32
+
+EpiError map_file(const uint8 **data, size_t *size, const char *fname) {
+  if (data == NULL || size == NULL || fname == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  int fd = open(fname, O_RDONLY);
+  if (fd < 0) {
+    set_last_error(EPI_ERROR_FILE_NOT_FOUND, fname, 0, 0,
+      "cannot open file");
+    return EPI_ERROR_FILE_NOT_FOUND;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+    close(fd);
+    set_last_error(EPI_ERROR_UNEXPECTED_EOF, fname, 0, 0, "empty file");
+    return EPI_ERROR_UNEXPECTED_EOF;
+  }
+
+  // The mapping stays valid after the descriptor is closed
+  void *ptr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (ptr == MAP_FAILED) {
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+
+  *data = (const uint8 *)ptr;
+  *size = (size_t)st.st_size;
+  return EPI_ERROR_SUCCESS;
+}
+
+void unmap_file(const uint8 *data, size_t size) {
+  if (data != NULL) {
+    munmap((void *)data, size);
+  }
+}
 
-  fseek(fp, 0, SEEK_SET);
-  while (fgets(buf, MAX_LINE_SIZE, fp) != NULL) {
-    if (!strcmp(buf, tok)) {
+#else
+
+EpiError map_file(const uint8 **data, size_t *size, const char *fname) {
+  if (data == NULL || size == NULL || fname == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  FILE *fp = fopen(fname, "rb");
+  if (fp == NULL) {
+    set_last_error(EPI_ERROR_FILE_NOT_FOUND, fname, 0, 0,
+      "cannot open file");
+    return EPI_ERROR_FILE_NOT_FOUND;
+  }
+
+  long n = -1;
+  if (fseek(fp, 0, SEEK_END) == 0) {
+    n = ftell(fp);
+  }
+  rewind(fp);
+  if (n <= 0) {
+    fclose(fp);
+    set_last_error(EPI_ERROR_UNEXPECTED_EOF, fname, 0, 0, "empty file");
+    return EPI_ERROR_UNEXPECTED_EOF;
+  }
+
+  uint8 *buf = (uint8 *)malloc((size_t)n);
+  if (buf == NULL) {
+    fclose(fp);
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+  size_t n_read = fread(buf, 1, (size_t)n, fp);
+  fclose(fp);
+  if (n_read != (size_t)n) {
+    free(buf);
+    set_last_error(EPI_ERROR_UNEXPECTED_EOF, fname, 0, 0, "read failed");
+    return EPI_ERROR_UNEXPECTED_EOF;
+  }
+
+  *data = buf;
+  *size = (size_t)n;
+  return EPI_ERROR_SUCCESS;
+}
+
+void unmap_file(const uint8 *data, size_t size) {
+  (void)size;
+  free((void *)data);
+}
+
+#endif
+
+void set_last_error(EpiError err, const char *fname, size_t line,
+  size_t column, const char *message) {
+  last_error.err = err;
+  last_error.line = line;
+  last_error.column = column;
+  snprintf(last_error.fname, sizeof(last_error.fname), "%s",
+    fname != NULL ? fname : "");
+  snprintf(last_error.message, sizeof(last_error.message), "%s",
+    message != NULL ? message : "");
+}
+
+void clear_last_error(void) {
+  last_error.err = EPI_ERROR_SUCCESS;
+  last_error.fname[0] = '\0';
+  last_error.line = 0;
+  last_error.column = 0;
+  last_error.message[0] = '\0';
+}
+
+EpiError epi_last_error(EpiErrorInfo *out) {
+  if (out == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  *out = last_error;
+  return EPI_ERROR_SUCCESS;
+}
+
+static uint64 token_hash(const char *name, size_t len) {
+  uint64 h = 0xcbf29ce484222325ull;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ (unsigned char)name[i]) * 0x100000001b3ull;
+  }
+  return h;
+}
+
+static EpiError index_tokens(DataFile *df) {
+  // Count token lines, to keep the table at most half full
+  size_t n_tokens = 0;
+  bool at_line_start = true;
+  for (size_t i = 0; i < df->size; i++) {
+    if (at_line_start && df->text[i] == '$') {
+      n_tokens++;
+    }
+    at_line_start = df->text[i] == '\n';
+  }
+
+  df->n_slots = 16;
+  while (df->n_slots < 2 * n_tokens) {
+    df->n_slots *= 2;
+  }
+  df->slots = (TokenEntry *)calloc(df->n_slots, sizeof(TokenEntry));
+  if (df->slots == NULL) {
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+
+  const char *c = df->text;
+  const char *text_end = df->text + df->size;
+  for (size_t line = 1; c < text_end; line++) {
+    const char *eol = (const char *)memchr(c, '\n', (size_t)(text_end - c));
+    if (eol == NULL) {
+      eol = text_end;
+    }
+
+    if (*c == '$') {
+      // Name runs to end of line, less any trailing whitespace
+      const char *name_end = eol;
+      while (name_end > c + 1 && (name_end[-1] == '\r' ||
+        name_end[-1] == ' ' || name_end[-1] == '\t')) {
+        name_end--;
+      }
+      size_t len = (size_t)(name_end - (c + 1));
+      uint64 h = token_hash(c + 1, len);
+
+      // If a token appears more than once, the first one counts
+      size_t mask = df->n_slots - 1;
+      for (size_t k = (size_t)h & mask; ; k = (k + 1) & mask) {
+        TokenEntry *e = &df->slots[k];
+        if (e->name == NULL) {
+          e->hash = h;
+          e->name = c + 1;
+          e->name_len = len;
+          e->values = eol < text_end ? eol + 1 : text_end;
+          e->line = line;
+          break;
+        }
+        if (e->hash == h && e->name_len == len &&
+          !memcmp(e->name, c + 1, len)) {
+          break;
+        }
+      }
+    }
+
+    c = eol + 1;
+  }
+
+  return EPI_ERROR_SUCCESS;
+}
+
+static EpiError find_token(ValueCursor *cur, DataFile *df,
+  const char *token_name) {
+  size_t len = strlen(token_name);
+  uint64 h = token_hash(token_name, len);
+  size_t mask = df->n_slots - 1;
+  for (size_t k = (size_t)h & mask; df->slots[k].name != NULL;
+    k = (k + 1) & mask) {
+    const TokenEntry *e = &df->slots[k];
+    if (e->hash == h && e->name_len == len &&
+      !memcmp(e->name, token_name, len)) {
+      cur->df = df;
+      cur->line_start = e->name - 1;
+      cur->next = e->values;
+      cur->line = e->line;
       return EPI_ERROR_SUCCESS;
     }
   }
 
+  char message[128];
+  snprintf(message, sizeof(message), "missing token $%.100s", token_name);
+  set_last_error(EPI_ERROR_MISSING_DATA, df->fname, 0, 0, message);
   return EPI_ERROR_MISSING_DATA;
 }
+
+static bool next_value_line(ValueCursor *cur) {
+  const char *text_end = cur->df->text + cur->df->size;
+  if (cur->next >= text_end) {
+    return false;
+  }
+
+  cur->line_start = cur->next;
+  cur->line++;
+  const char *eol = (const char *)memchr(cur->next, '\n',
+    (size_t)(text_end - cur->next));
+  cur->next = eol != NULL ? eol + 1 : text_end;
+  return true;
+}
+
+static EpiError value_error(const ValueCursor *cur, EpiError err,
+  const char *c, const char *what) {
+  size_t column = c != NULL ? (size_t)(c - cur->line_start) + 1 : 1;
+  set_last_error(err, cur->df->fname, cur->line, column, what);
+  return err;
+}
+
+static double parse_number(const char *s, const char **end) {
+  // Exact powers of ten, for the correctly rounded fast path
+  static const double pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7,
+    1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19,
+    1e20, 1e21, 1e22};
+
+  const char *c = s;
+  while (*c == ' ' || *c == '\t') {
+    c++;
+  }
+
+  bool negative = false;
+  if (*c == '+' || *c == '-') {
+    negative = *c == '-';
+    c++;
+  }
+
+  // Up to 19 significant digits fit in the mantissa, the rest only scale it
+  uint64 mantissa = 0;
+  int n_digits = 0;
+  int exp10 = 0;
+  bool any_digits = false;
+  for (; *c >= '0' && *c <= '9'; c++) {
+    any_digits = true;
+    if (n_digits < 19) {
+      mantissa = mantissa * 10 + (uint64)(*c - '0');
+      n_digits += mantissa > 0;
+    } else {
+      exp10++;
+    }
+  }
+  if (*c == '.') {
+    c++;
+    for (; *c >= '0' && *c <= '9'; c++) {
+      any_digits = true;
+      if (n_digits < 19) {
+        mantissa = mantissa * 10 + (uint64)(*c - '0');
+        n_digits += mantissa > 0;
+        exp10--;
+      }
+    }
+  }
+  if (!any_digits) {
+    *end = s;
+    return 0.0;
+  }
+
+  if (*c == 'e' || *c == 'E') {
+    const char *e = c + 1;
+    bool exp_negative = false;
+    if (*e == '+' || *e == '-') {
+      exp_negative = *e == '-';
+      e++;
+    }
+    if (*e >= '0' && *e <= '9') {
+      int exp = 0;
+      for (; *e >= '0' && *e <= '9'; e++) {
+        if (exp < 10000) {
+          exp = exp * 10 + (*e - '0');
+        }
+      }
+      exp10 += exp_negative ? -exp : exp;
+      c = e;
+    }
+  }
+  *end = c;
+
+  // Exact when the mantissa and the power of ten are both exact doubles
+  double result = (double)mantissa;
+  if (mantissa == 0) {
+    result = 0.0;
+  } else if (exp10 >= 0 && exp10 <= 22 && mantissa < (1ull << 53)) {
+    result *= pow10[exp10];
+  } else if (exp10 < 0 && exp10 >= -22 && mantissa < (1ull << 53)) {
+    result /= pow10[-exp10];
+  } else {
+    result *= pow(10.0, exp10);
+  }
+
+  return negative ? -result : result;
+}
+
+static bool ends_number(char c) {
+  return c == '\0' || c == '\n' || c == '\r' || c == ' ' || c == '\t';
+}
@@ -1,26 +1,73 @@
 // Common data file IO stuff
 #ifndef __FILES_H__
 #define __FILES_H__
+// Data files are text, with values following token lines.  A token line
+// starts with '$' followed by the token name.  Value(s) follow on the lines
+// after it, one number per line for single values and arrays, or one row per
+// line for tables.  Other lines are comments.
+//
+// A data file is read into memory once, and indexed by token name, so that
+// tokens can be read in any order in constant time.  When reading fails, the
+// position of the problem is recorded, see epi_last_error().
 
 #include "common.h"
 
-#define MAX_LINE_SIZE 256
+typedef struct DataFile DataFile;
 
-// Find a token in a data file.  The token name is a set of characters
-// between '$' and end of line.  Value(s) follow on following lines.
+// Read and index a data file.
 // 0 indicates success.
-EpiError find_token_in_file(FILE *fp, const char *token_name);
+EpiError open_data_file(DataFile **out, const char *fname);
+
+// Free a data file.  Nulls the pointer.
+EpiError free_data_file(DataFile **df);
 
 // Read natural number on line following a token name.
 // 0 indicates success.
-EpiError read_size_token(size_t *s, FILE *fp, const char *token_name);
+EpiError read_size_token(size_t *s, DataFile *df, const char *token_name);
+
+// Read nonnegative floating point number on line following a token name.
+// 0 indicates success.
+EpiError read_float_token(float *f, DataFile *df, const char *token_name);
 
-// Read floating point number on line following a token name.
+// Read an array of nonnegative floating point numbers on lines following a
+// token name.
 // 0 indicates success.
-EpiError read_float_token(float *f, FILE *fp, const char *token_name);
+EpiError read_float_array(float *f, size_t size, DataFile *df,
+  const char *token_name);
+
+// Read a table of numbers on lines following a token name, one row per line
+// with n_cols numbers separated by whitespace.  Output is in row-major order.
+// 0 indicates success.
+EpiError read_double_table(double *d, size_t n_rows, size_t n_cols,
+  DataFile *df, const char *token_name);
+
+// Record an invalid value in a data file, at the line of the given token,
+// or for the whole file if token_name is NULL.  Returns
+// EPI_ERROR_INVALID_DATA.
+EpiError invalid_data(const DataFile *df, const char *token_name,
+  const char *message);
 
-// Read an array of floating point numbers on lines following a token name.
+// Hash the contents of a file, for telling apart versions of a data file.
 // 0 indicates success.
-EpiError read_float_array(float *f, size_t size, FILE *fp, const char *token_name);
+EpiError hash_file(uint64 *hash, const char *fname);
+
+// Map a whole file into memory read-only, so that processes reading the
+// same file share one copy of it.  Where mapping is not supported, the file
+// is read into memory instead.  Free with unmap_file().
+// 0 indicates success.
+EpiError map_file(const uint8 **data, size_t *size, const char *fname);
+
+// Release a file mapped by map_file()
+void unmap_file(const uint8 *data, size_t size);
+
+// Record an error for epi_last_error(), at a line and column of a file, or
+// 0 if not known
+void set_last_error(EpiError err, const char *fname, size_t line,
+  size_t column, const char *message);
+
+// Forget the last error.  Called on entry to every API function except
+// epi_last_error() and the ones that free objects, which run while
+// cleaning up after errors.
+void clear_last_error(void);
 
 #endif
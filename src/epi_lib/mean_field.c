@@ -0,0 +1,264 @@
+#include "mean_field.h"
+
+// Copy mean-field state into the population's integer counters, day bins,
+// running totals and infectious pressure
+static void sync_pop(const MeanField *mf, Population *pop, const Disease *dis);
+
+// Round a nonnegative number of people to the nearest integer
+static uint64 round_people(double x);
+
+EpiError create_mean_field(MeanField **out, const Population *pop) {
+  if (out == NULL || pop == NULL || pop->n_total_active == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  MeanField *mf = (MeanField *)calloc(1, sizeof(MeanField));
+  if (mf == NULL) {
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+
+  size_t n = pop->max_duration;
+  double *ptr = (double *)calloc(3 * n, sizeof(double));
+  if (ptr == NULL) {
+    free(mf);
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+
+  mf->max_duration = n;
+  mf->n_asymptomatic = ptr;
+  mf->n_symptomatic = &ptr[n];
+  mf->n_critical = &ptr[2*n];
+
+  mf->n_susceptible = (double)pop->n_susceptible;
+  mf->n_infected = (double)pop->n_infected;
+  mf->n_recovered = (double)pop->n_recovered;
+  mf->n_vaccinated = (double)pop->n_vaccinated;
+  mf->n_dead = (double)pop->n_dead;
+
+  for (size_t d = 0; d < n; d++) {
+    size_t k = pop_bin_index(pop, d);
+    mf->n_asymptomatic[d] = (double)pop->n_asymptomatic[k];
+    mf->n_symptomatic[d] = (double)pop->n_symptomatic[k];
+    mf->n_critical[d] = (double)pop->n_critical[k];
+  }
+
+  *out = mf;
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError copy_mean_field(MeanField **out, const MeanField *mf) {
+  if (out == NULL || mf == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  MeanField *copy = (MeanField *)malloc(sizeof(MeanField));
+  if (copy == NULL) {
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+
+  size_t n = mf->max_duration;
+  double *ptr = (double *)malloc(3 * n * sizeof(double));
+  if (ptr == NULL) {
+    free(copy);
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+
+  memcpy(copy, mf, sizeof(MeanField));
+  memcpy(ptr, mf->n_asymptomatic, 3 * n * sizeof(double));
+  copy->n_asymptomatic = ptr;
+  copy->n_symptomatic = &ptr[n];
+  copy->n_critical = &ptr[2*n];
+
+  *out = copy;
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError free_mean_field(MeanField **mf) {
+  if (mf == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  if (*mf == NULL) {
+    return EPI_ERROR_SUCCESS;
+  }
+
+  free((*mf)->n_asymptomatic);
+  free(*mf);
+  *mf = NULL;
+  return EPI_ERROR_SUCCESS;
+}
+
+size_t mean_field_state_size(const MeanField *mf) {
+  return sizeof(MeanField) + 3 * mf->max_duration * sizeof(double);
+}
+
+size_t save_mean_field_state(uint8 *buf, const MeanField *mf) {
+  size_t n = 3 * mf->max_duration * sizeof(double);
+  memcpy(buf, mf, sizeof(MeanField));
+  memcpy(&buf[sizeof(MeanField)], mf->n_asymptomatic, n);
+  return sizeof(MeanField) + n;
+}
+
+size_t load_mean_field_state(MeanField *mf, const uint8 *buf) {
+  MeanField arrays = *mf;
+  size_t n = 3 * mf->max_duration * sizeof(double);
+  memcpy(mf, buf, sizeof(MeanField));
+  mf->max_duration = arrays.max_duration;
+  mf->n_asymptomatic = arrays.n_asymptomatic;
+  mf->n_symptomatic = arrays.n_symptomatic;
+  mf->n_critical = arrays.n_critical;
+  memcpy(mf->n_asymptomatic, &buf[sizeof(MeanField)], n);
+  return sizeof(MeanField) + n;
+}
+
+EpiError mean_field_infect(MeanField *mf, Population *pop, double n_cases) {
+  if (mf == NULL || pop == NULL || n_cases < 0.0) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  if (n_cases > mf->n_susceptible) {
+    n_cases = mf->n_susceptible;
+  }
+
+  mf->n_susceptible -= n_cases;
+  mf->n_infected += n_cases;
+  mf->n_asymptomatic[0] += n_cases;
+
+  // Day 0 carries no infectious pressure yet, only counters need updating
+  sync_pop(mf, pop, NULL);
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError mean_field_evolve(MeanField *mf, Population *pop, const Disease *dis,
+  bool vaccine) {
+
+  if (mf == NULL || pop == NULL || pop->n_total_active == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  if (dis == NULL || dis->p_transmit == NULL ||
+    dis->max_duration != mf->max_duration) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  if (vaccine) {
+    double dv = pop->daily_vaccination_capacity * mf->n_susceptible;
+    if (dv > mf->n_susceptible) {
+      dv = mf->n_susceptible;
+    }
+    mf->n_susceptible -= dv;
+    mf->n_vaccinated += dv;
+  }
+
+  // Death rate modifier based on availability of hospital beds
+  float hr = calc_hosp_rate(pop);
+  double hosp_death_reduction = (1.0 - hr) + hr * dis->hosp_death_reduction;
+
+  // Retire the last day bin: for now, everyone who reaches max_duration
+  // recovers
+  size_t n = mf->max_duration;
+  double n_last = mf->n_asymptomatic[n-1] + mf->n_symptomatic[n-1]
+    + mf->n_critical[n-1];
+  mf->n_recovered += n_last;
+  mf->n_infected -= n_last;
+
+  // Advance disease time, applying expected recoveries, state transitions
+  // and deaths for the day of disease each bin is leaving
+  for (size_t i = n - 1; i > 0; i--) {
+    double n_a = mf->n_asymptomatic[i-1];
+    double n_s = mf->n_symptomatic[i-1];
+    double n_c = mf->n_critical[i-1];
+
+    double p_r = dis->p_recovery[i-1];
+    double p_s = dis->p_symptoms[i-1];
+    double p_c = dis->p_critical[i-1];
+    double p_d = dis->p_death[i-1] * hosp_death_reduction;
+
+    // Expected number of recovered
+    double r_a = p_r * n_a;
+    double r_s = p_r * n_s;
+    double r_c = p_r * n_c;
+
+    // Expected number of worsened cases
+    double w_a = p_s * n_a;
+    double w_s = p_c * n_s;
+    double w_c = p_d * n_c;
+
+    mf->n_asymptomatic[i] = n_a - r_a - w_a;
+    mf->n_symptomatic[i] = n_s + w_a - r_s - w_s;
+    mf->n_critical[i] = n_c + w_s - r_c - w_c;
+
+    mf->n_dead += w_c;
+    mf->n_recovered += r_a + r_s + r_c;
+    mf->n_infected -= r_a + r_s + r_c + w_c;
+  }
+
+  mf->n_asymptomatic[0] = 0.0;
+  mf->n_symptomatic[0] = 0.0;
+  mf->n_critical[0] = 0.0;
+
+  // The expected number of new infections comes from the same calculation
+  // as in the stochastic model, once the population reflects this state
+  pop->n_dead_last = pop->n_dead;
+  sync_pop(mf, pop, dis);
+
+  double n_new = calc_inf_rate(pop, dis);
+  if (!(n_new > 0.0)) {
+    n_new = 0.0;
+  }
+  return mean_field_infect(mf, pop, n_new);
+}
+
+static void sync_pop(const MeanField *mf, Population *pop, const Disease *dis) {
+  pop->n_susceptible = round_people(mf->n_susceptible);
+  pop->n_recovered = round_people(mf->n_recovered);
+  pop->n_vaccinated = round_people(mf->n_vaccinated);
+  pop->n_dead = round_people(mf->n_dead);
+
+  // Day bins are written in order, starting from the beginning of the
+  // ring buffer.  Totals are sums of the rounded bins, so that the
+  // population is considered free of disease once every bin rounds to 0.
+  pop->head = 0;
+  pop->occupied = 0;
+  pop->n_infected = 0;
+  pop->n_total_asymptomatic = 0;
+  pop->n_total_symptomatic = 0;
+  pop->n_total_critical = 0;
+
+  for (size_t d = 0; d < mf->max_duration; d++) {
+    uint64 n_a = round_people(mf->n_asymptomatic[d]);
+    uint64 n_s = round_people(mf->n_symptomatic[d]);
+    uint64 n_c = round_people(mf->n_critical[d]);
+
+    pop->n_asymptomatic[d] = n_a;
+    pop->n_symptomatic[d] = n_s;
+    pop->n_critical[d] = n_c;
+    pop->n_total_active[d] = n_a + n_s + n_c;
+    if (pop->n_total_active[d] > 0) {
+      pop->occupied |= (uint64)1 << d;
+    }
+
+    pop->n_infected += pop->n_total_active[d];
+    pop->n_total_asymptomatic += n_a;
+    pop->n_total_symptomatic += n_s;
+    pop->n_total_critical += n_c;
+  }
+
+  // Infectious pressure is kept continuous, so that small numbers of
+  // infectious people still spread the disease
+  if (dis != NULL) {
+    pop->pressure_asymptomatic = 0.0;
+    pop->pressure_symptomatic = 0.0;
+    pop->pressure_critical = 0.0;
+    for (size_t d = 0; d < mf->max_duration; d++) {
+      double p_t = dis->p_transmit[d];
+      pop->pressure_asymptomatic += p_t * mf->n_asymptomatic[d];
+      pop->pressure_symptomatic += p_t * mf->n_symptomatic[d];
+      pop->pressure_critical += p_t * mf->n_critical[d];
+    }
+  }
+}
+
+static uint64 round_people(double x) {
+  return x > 0.0 ? (uint64)(x + 0.5) : 0;
+}
@@ -0,0 +1,55 @@
+#ifndef __MEAN_FIELD_H__
+#define __MEAN_FIELD_H__
+// Deterministic mean-field version of the population model.
+// Every random draw in evolve_pop is replaced by its expectation value, and
+// compartments are continuous.  The integer counters of the corresponding
+// Population are kept in sync (rounded to the nearest person), so that
+// observables, costs and policies work the same way as for the stochastic
+// model.
+
+#include "common.h"
+#include "disease.h"
+#include "population.h"
+
+typedef struct {
+  double n_susceptible;
+  double n_infected;
+  double n_recovered;
+  double n_vaccinated;
+  double n_dead;
+
+  // Active disease phases binned by day post infection, day 0 first
+  size_t max_duration;
+  double *n_asymptomatic;
+  double *n_symptomatic;
+  double *n_critical;
+} MeanField;
+
+// Create mean-field state, starting from the current state of a population
+EpiError create_mean_field(MeanField **out, const Population *pop);
+
+// Create a deep copy of mean-field state
+EpiError copy_mean_field(MeanField **out, const MeanField *mf);
+
+// Frees mean-field state and associated data.  Nulls the pointer.
+EpiError free_mean_field(MeanField **mf);
+
+// Size in bytes of the state saved by save_mean_field_state()
+size_t mean_field_state_size(const MeanField *mf);
+
+// Write mean-field state to buf.  Returns the number of bytes written.
+size_t save_mean_field_state(uint8 *buf, const MeanField *mf);
+
+// Restore state written by save_mean_field_state() for mean-field state
+// with the same number of day bins.  Returns the number of bytes read.
+size_t load_mean_field_state(MeanField *mf, const uint8 *buf);
+
+// Infect members of the population, as infect_pop()
+EpiError mean_field_infect(MeanField *mf, Population *pop, double n_cases);
+
+// Evolve the population forward by one day, as evolve_pop(), using
+// expectation values instead of random draws
+EpiError mean_field_evolve(MeanField *mf, Population *pop, const Disease *dis,
+  bool vaccine);
+
+#endif
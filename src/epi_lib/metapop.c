@@ -0,0 +1,409 @@
+#include "files.h"
+#include "metapop.h"
+#include "param_cache.h"
+
+// Parallel stages of evolve_metapop(), one task per region
+static EpiError metapop_transitions_task(void *ctx, size_t i);
+static EpiError metapop_gather_task(void *ctx, size_t j);
+static EpiError metapop_infect_task(void *ctx, size_t i);
+
+// Fraction of travel between regions i and j allowed by current policies
+static float travel_scale(const MetaPop *mp, size_t i, size_t j);
+
+EpiError create_metapop(MetaPop **out, const Disease *dis,
+  const Population *base, size_t n_regions, const uint64 *n_total,
+  const uint64 *n_hospital_beds, size_t n_edges, const size_t *from,
+  const size_t *to, const float *fraction, EpiSampler method, uint64 seed,
+  size_t n_threads) {
+
+  if (out == NULL || dis == NULL || base == NULL || n_regions == 0 ||
+    n_total == NULL || n_hospital_beds == NULL ||
+    (n_edges > 0 && (from == NULL || to == NULL || fraction == NULL))) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  // Check edges, and count entries in each row and column
+  size_t *row_start = (size_t *)calloc(n_regions + 1, sizeof(size_t));
+  size_t *t_row_start = (size_t *)calloc(n_regions + 1, sizeof(size_t));
+  float *row_sum = (float *)calloc(n_regions, sizeof(float));
+  if (row_start == NULL || t_row_start == NULL || row_sum == NULL) {
+    free(row_start);
+    free(t_row_start);
+    free(row_sum);
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+
+  for (size_t e = 0; e < n_edges; e++) {
+    if (from[e] >= n_regions || to[e] >= n_regions || from[e] == to[e] ||
+      !(fraction[e] >= 0.f)) {
+      free(row_start);
+      free(t_row_start);
+      free(row_sum);
+      return EPI_ERROR_INVALID_DATA;
+    }
+    row_start[from[e] + 1]++;
+    t_row_start[to[e] + 1]++;
+    row_sum[from[e]] += fraction[e];
+  }
+
+  for (size_t i = 0; i < n_regions; i++) {
+    if (row_sum[i] > 1.f) {
+      free(row_start);
+      free(t_row_start);
+      free(row_sum);
+      return EPI_ERROR_INVALID_DATA;
+    }
+    row_start[i + 1] += row_start[i];
+    t_row_start[i + 1] += t_row_start[i];
+  }
+  free(row_sum);
+
+  MetaPop *mp = (MetaPop *)calloc(1, sizeof(MetaPop));
+  if (mp == NULL) {
+    free(row_start);
+    free(t_row_start);
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+  mp->n_regions = n_regions;
+  mp->disease = dis;
+  mp->n_edges = n_edges;
+  mp->row_start = row_start;
+  mp->t_row_start = t_row_start;
+
+  mp->regions = (Population **)calloc(n_regions, sizeof(Population *));
+  mp->samplers = (Sampler *)calloc(n_regions, sizeof(Sampler));
+  mp->col = (size_t *)malloc((n_edges + 1) * sizeof(size_t));
+  mp->fraction = (float *)malloc((n_edges + 1) * sizeof(float));
+  mp->t_col = (size_t *)malloc((n_edges + 1) * sizeof(size_t));
+  mp->t_edge = (size_t *)malloc((n_edges + 1) * sizeof(size_t));
+  mp->self_weight = (float *)calloc(n_regions, sizeof(float));
+  mp->pools = (ContactPool *)calloc(n_regions, sizeof(ContactPool));
+  mp->loc_contacts = (double *)calloc(n_regions, sizeof(double));
+  mp->loc_infectious = (double *)calloc(n_regions, sizeof(double));
+  if (mp->regions == NULL || mp->samplers == NULL || mp->col == NULL ||
+    mp->fraction == NULL || mp->t_col == NULL || mp->t_edge == NULL ||
+    mp->self_weight == NULL || mp->pools == NULL ||
+    mp->loc_contacts == NULL || mp->loc_infectious == NULL) {
+    free_metapop(&mp);
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+
+  // Fill rows in edge order, then the transpose in row order, so that the
+  // layout only depends on the edge list
+  size_t *fill = (size_t *)malloc(n_regions * sizeof(size_t));
+  if (fill == NULL) {
+    free_metapop(&mp);
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+  memcpy(fill, row_start, n_regions * sizeof(size_t));
+  for (size_t e = 0; e < n_edges; e++) {
+    size_t k = fill[from[e]]++;
+    mp->col[k] = to[e];
+    mp->fraction[k] = fraction[e];
+  }
+  memcpy(fill, t_row_start, n_regions * sizeof(size_t));
+  for (size_t i = 0; i < n_regions; i++) {
+    for (size_t e = row_start[i]; e < row_start[i + 1]; e++) {
+      size_t k = fill[mp->col[e]]++;
+      mp->t_col[k] = i;
+      mp->t_edge[k] = e;
+    }
+  }
+  free(fill);
+
+  // Regions, with independent random streams
+  EpiError err = sampler_init(&mp->samplers[0], method, seed);
+  for (size_t i = 0; i < n_regions && err == EPI_ERROR_SUCCESS; i++) {
+    if (i > 0) {
+      mp->samplers[i] = mp->samplers[i - 1];
+      rng_jump(&mp->samplers[i].rng);
+    }
+
+    err = copy_pop(&mp->regions[i], base);
+    if (err != EPI_ERROR_SUCCESS) {
+      break;
+    }
+
+    Population *pop = mp->regions[i];
+    double f_susceptible = base->n_total > 0 ?
+      (double)base->n_susceptible / (double)base->n_total : 1.0;
+    pop->n_total = n_total[i];
+    pop->n_susceptible = (uint64)(f_susceptible * (double)n_total[i]);
+    pop->n_hospital_beds = n_hospital_beds[i];
+  }
+  if (err != EPI_ERROR_SUCCESS) {
+    free_metapop(&mp);
+    return err;
+  }
+
+  err = create_thread_pool(&mp->threads, n_threads);
+  if (err != EPI_ERROR_SUCCESS) {
+    free_metapop(&mp);
+    return err;
+  }
+
+  *out = mp;
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError create_metapop_from_files(MetaPop **out, const Disease *dis,
+  const char *pop_fname, const char *region_fname, const char *edge_fname,
+  EpiSampler method, uint64 seed, size_t n_threads) {
+
+  if (out == NULL || dis == NULL || pop_fname == NULL ||
+    region_fname == NULL || edge_fname == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  // Read region table
+  DataFile *df = NULL;
+  PASS_ERROR(open_data_file(&df, region_fname));
+
+  size_t n_regions = 0;
+  size_t seed_region = 0;
+  EpiError err = read_size_token(&n_regions, df, "N_REGIONS");
+  if (err == EPI_ERROR_SUCCESS && n_regions == 0) {
+    err = invalid_data(df, "N_REGIONS", "need at least one region");
+  }
+  if (err == EPI_ERROR_SUCCESS) {
+    // Seed region is optional
+    err = read_size_token(&seed_region, df, "SEED_REGION");
+    if (err == EPI_ERROR_MISSING_DATA) {
+      err = EPI_ERROR_SUCCESS;
+    }
+  }
+  if (err == EPI_ERROR_SUCCESS && seed_region >= n_regions) {
+    err = invalid_data(df, "SEED_REGION", "no such region");
+  }
+
+  double *table = NULL;
+  if (err == EPI_ERROR_SUCCESS) {
+    table = (double *)malloc(2 * n_regions * sizeof(double));
+    err = table == NULL ? EPI_ERROR_OUT_OF_MEMORY :
+      read_double_table(table, n_regions, 2, df, "REGIONS");
+  }
+  free_data_file(&df);
+  if (err != EPI_ERROR_SUCCESS) {
+    free(table);
+    return err;
+  }
+
+  // Read edge list
+  err = open_data_file(&df, edge_fname);
+  if (err != EPI_ERROR_SUCCESS) {
+    free(table);
+    return err;
+  }
+
+  size_t n_edges = 0;
+  double *edges = NULL;
+  err = read_size_token(&n_edges, df, "N_EDGES");
+  if (err == EPI_ERROR_SUCCESS && n_edges > 0) {
+    edges = (double *)malloc(3 * n_edges * sizeof(double));
+    err = edges == NULL ? EPI_ERROR_OUT_OF_MEMORY :
+      read_double_table(edges, n_edges, 3, df, "EDGES");
+  }
+  free_data_file(&df);
+  if (err != EPI_ERROR_SUCCESS) {
+    free(table);
+    free(edges);
+    return err;
+  }
+
+  // Convert to model input
+  uint64 *n_total = (uint64 *)malloc(2 * n_regions * sizeof(uint64));
+  size_t *from = (size_t *)malloc((2 * n_edges + 1) * sizeof(size_t));
+  float *fraction = (float *)malloc((n_edges + 1) * sizeof(float));
+  Population *base = NULL;
+  if (n_total == NULL || from == NULL || fraction == NULL) {
+    err = EPI_ERROR_OUT_OF_MEMORY;
+  }
+
+  uint64 *n_beds = n_total == NULL ? NULL : &n_total[n_regions];
+  size_t *to = from == NULL ? NULL : &from[n_edges];
+  for (size_t i = 0; i < n_regions && err == EPI_ERROR_SUCCESS; i++) {
+    if (table[2*i] < 0.0 || table[2*i + 1] < 0.0) {
+      set_last_error(EPI_ERROR_INVALID_DATA, region_fname, 0, 0,
+        "negative people or beds");
+      err = EPI_ERROR_INVALID_DATA;
+      break;
+    }
+    n_total[i] = (uint64)table[2*i];
+    n_beds[i] = (uint64)table[2*i + 1];
+  }
+  for (size_t e = 0; e < n_edges && err == EPI_ERROR_SUCCESS; e++) {
+    if (edges[3*e] < 0.0 || edges[3*e + 1] < 0.0) {
+      set_last_error(EPI_ERROR_INVALID_DATA, edge_fname, 0, 0,
+        "negative region index");
+      err = EPI_ERROR_INVALID_DATA;
+      break;
+    }
+    // Indices are read as doubles, and must be whole region numbers
+    if (edges[3*e] != floor(edges[3*e]) ||
+      edges[3*e + 1] != floor(edges[3*e + 1])) {
+      set_last_error(EPI_ERROR_INVALID_DATA, edge_fname, 0, 0,
+        "region index is not an integer");
+      err = EPI_ERROR_INVALID_DATA;
+      break;
+    }
+    if (edges[3*e] >= (double)n_regions ||
+      edges[3*e + 1] >= (double)n_regions) {
+      set_last_error(EPI_ERROR_INVALID_DATA, edge_fname, 0, 0,
+        "region index out of range");
+      err = EPI_ERROR_INVALID_DATA;
+      break;
+    }
+    from[e] = (size_t)edges[3*e];
+    to[e] = (size_t)edges[3*e + 1];
+    fraction[e] = (float)edges[3*e + 2];
+  }
+
+  if (err == EPI_ERROR_SUCCESS) {
+    err = cached_pop(&base, pop_fname, dis->max_duration);
+  }
+  if (err == EPI_ERROR_SUCCESS) {
+    err = create_metapop(out, dis, base, n_regions, n_total, n_beds, n_edges,
+      from, to, fraction, method, seed, n_threads);
+  }
+  if (err == EPI_ERROR_SUCCESS) {
+    (*out)->seed_region = seed_region;
+  }
+
+  free_pop(&base);
+  free(table);
+  free(edges);
+  free(n_total);
+  free(from);
+  free(fraction);
+  return err;
+}
+
+EpiError free_metapop(MetaPop **mp) {
+  if (mp == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  if (*mp == NULL) {
+    return EPI_ERROR_SUCCESS;
+  }
+
+  MetaPop *m = *mp;
+  free_thread_pool(&m->threads);
+  if (m->regions != NULL) {
+    for (size_t i = 0; i < m->n_regions; i++) {
+      free_pop(&m->regions[i]);
+    }
+  }
+  free(m->regions);
+  free(m->samplers);
+  free(m->row_start);
+  free(m->col);
+  free(m->fraction);
+  free(m->t_row_start);
+  free(m->t_col);
+  free(m->t_edge);
+  free(m->self_weight);
+  free(m->pools);
+  free(m->loc_contacts);
+  free(m->loc_infectious);
+  free(m);
+  *mp = NULL;
+  return EPI_ERROR_SUCCESS;
+}
+
+// Vaccine availability for the current step
+typedef struct {
+  MetaPop *mp;
+  bool vaccine;
+} MetaPopStep;
+
+EpiError evolve_metapop(MetaPop *mp, const EpiInput *policies, bool vaccine) {
+  if (mp == NULL || policies == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  mp->policies = policies;
+  MetaPopStep step = {mp, vaccine};
+
+  // Disease progression within each region
+  PASS_ERROR(thread_pool_run(mp->threads, mp->n_regions,
+    metapop_transitions_task, &step));
+
+  // Contacts present at each location, from residents and visitors
+  PASS_ERROR(thread_pool_run(mp->threads, mp->n_regions,
+    metapop_gather_task, &step));
+
+  // New infections among residents of each region
+  PASS_ERROR(thread_pool_run(mp->threads, mp->n_regions,
+    metapop_infect_task, &step));
+
+  mp->policies = NULL;
+  return EPI_ERROR_SUCCESS;
+}
+
+static float travel_scale(const MetaPop *mp, size_t i, size_t j) {
+  if (mp->policies[i].travel_restrict || mp->policies[j].travel_restrict) {
+    return TRAVEL_RESTRICTION_FACTOR;
+  }
+  return 1.f;
+}
+
+static EpiError metapop_transitions_task(void *ctx, size_t i) {
+  MetaPopStep *step = (MetaPopStep *)ctx;
+  MetaPop *mp = step->mp;
+  Population *pop = mp->regions[i];
+
+  memcpy(&pop->policy, &mp->policies[i], sizeof(EpiInput));
+  PASS_ERROR(evolve_pop_transitions(pop, mp->disease, step->vaccine,
+    &mp->samplers[i]));
+  calc_contact_pool(&mp->pools[i], pop, mp->disease);
+
+  float away = 0.f;
+  for (size_t e = mp->row_start[i]; e < mp->row_start[i + 1]; e++) {
+    away += travel_scale(mp, i, mp->col[e]) * mp->fraction[e];
+  }
+  mp->self_weight[i] = away < 1.f ? 1.f - away : 0.f;
+
+  return EPI_ERROR_SUCCESS;
+}
+
+static EpiError metapop_gather_task(void *ctx, size_t j) {
+  MetaPop *mp = ((MetaPopStep *)ctx)->mp;
+
+  double contacts = mp->self_weight[j] * mp->pools[j].contacts;
+  double infectious = mp->self_weight[j] * mp->pools[j].infectious;
+  for (size_t k = mp->t_row_start[j]; k < mp->t_row_start[j + 1]; k++) {
+    size_t i = mp->t_col[k];
+    double w = travel_scale(mp, i, j) * mp->fraction[mp->t_edge[k]];
+    contacts += w * mp->pools[i].contacts;
+    infectious += w * mp->pools[i].infectious;
+  }
+
+  mp->loc_contacts[j] = contacts;
+  mp->loc_infectious[j] = infectious;
+  return EPI_ERROR_SUCCESS;
+}
+
+static EpiError metapop_infect_task(void *ctx, size_t i) {
+  MetaPop *mp = ((MetaPopStep *)ctx)->mp;
+
+  // Probability that a contact is infectious, averaged over the locations
+  // where residents of region i make their contacts
+  double force = 0.0;
+  if (mp->loc_contacts[i] > 0.0) {
+    force = mp->self_weight[i] * mp->loc_infectious[i] / mp->loc_contacts[i];
+  }
+  for (size_t e = mp->row_start[i]; e < mp->row_start[i + 1]; e++) {
+    size_t j = mp->col[e];
+    if (mp->loc_contacts[j] > 0.0) {
+      force += travel_scale(mp, i, j) * mp->fraction[e] *
+        mp->loc_infectious[j] / mp->loc_contacts[j];
+    }
+  }
+
+  double p = mp->pools[i].w_susceptible * force;
+  if (p > 1.0) {
+    p = 1.0;
+  }
+  return infect_pop_draw(mp->regions[i], (float)p, &mp->samplers[i]);
+}
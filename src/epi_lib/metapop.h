@@ -0,0 +1,93 @@
+#ifndef __METAPOP_H__
+#define __METAPOP_H__
+// Metapopulation model: many populations (counties, cities) sharing one
+// disease, coupled through travel between them.
+//
+// Travel is described by a sparse matrix of fractions: f[i][j] is the
+// fraction of contacts that residents of region i make in region j != i,
+// and the rest of their contacts are made at home.  Each day, the contacts
+// present at every location are gathered from residents and visitors, and
+// the susceptible residents of each region are infected according to the
+// infectious fraction of contacts at every location they visit.
+//
+// Regions are stepped in parallel.  Each region draws from its own random
+// number stream, and all sums are taken in a fixed order, so results do
+// not depend on the number of threads.
+
+#include "common.h"
+#include "disease.h"
+#include "population.h"
+#include "sampler.h"
+#include "thread_pool.h"
+
+// Fraction of travel that continues between regions when either of them
+// has travel restrictions in place
+#define TRAVEL_RESTRICTION_FACTOR 0.1f
+
+typedef struct {
+  size_t n_regions;
+  const Disease *disease;
+  Population **regions;
+  Sampler *samplers;
+
+  // Region where the initial infection happens
+  size_t seed_region;
+
+  // Travel fractions in compressed sparse row form: row i holds entries
+  // row_start[i] to row_start[i+1] - 1, with destination col[e] and
+  // fraction fraction[e]
+  size_t n_edges;
+  size_t *row_start;
+  size_t *col;
+  float *fraction;
+
+  // Transpose of the travel matrix, row j listing the regions i that send
+  // visitors to j.  t_edge[e] is the index of the same entry in the
+  // original matrix.
+  size_t *t_row_start;
+  size_t *t_col;
+  size_t *t_edge;
+
+  // Per-step work arrays
+  const EpiInput *policies;
+  float *self_weight;         // Fraction of contacts made at home
+  ContactPool *pools;         // Contacts of each region's residents
+  double *loc_contacts;       // Contacts present at each location
+  double *loc_infectious;     // Infectious contacts present at each location
+
+  ThreadPool *threads;
+} MetaPop;
+
+// Create a metapopulation model.  Every region gets the parameters of the
+// base population, with its own total size and hospital capacity.  The
+// susceptible fraction of the base population is kept.
+// Travel is given as an edge list: fraction[e] of contacts of residents of
+// region from[e] are made in region to[e].
+// Region r draws from the random stream obtained by jumping the stream
+// seeded with seed r times.
+EpiError create_metapop(MetaPop **out, const Disease *dis,
+  const Population *base, size_t n_regions, const uint64 *n_total,
+  const uint64 *n_hospital_beds, size_t n_edges, const size_t *from,
+  const size_t *to, const float *fraction, EpiSampler method, uint64 seed,
+  size_t n_threads);
+
+// Create a metapopulation model from data files.
+// The region table has tokens:
+//   $N_REGIONS    number of regions
+//   $REGIONS      one line per region: total population, hospital beds
+//   $SEED_REGION  optional, region of initial infection (default 0)
+// The edge list has tokens:
+//   $N_EDGES      number of edges
+//   $EDGES        one line per edge: from region, to region, fraction
+EpiError create_metapop_from_files(MetaPop **out, const Disease *dis,
+  const char *pop_fname, const char *region_fname, const char *edge_fname,
+  EpiSampler method, uint64 seed, size_t n_threads);
+
+// Frees metapopulation and all regions.  Nulls the pointer.
+// The disease is not freed.
+EpiError free_metapop(MetaPop **mp);
+
+// Evolve all regions forward by one day, with one policy per region
+EpiError evolve_metapop(MetaPop *mp, const EpiInput *policies, bool vaccine);
+
+#endif
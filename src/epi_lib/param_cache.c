@@ -0,0 +1,154 @@
+#include "files.h"
+#include "param_cache.h"
+
+#include <pthread.h>
+
+typedef struct {
+  char *fname;
+  uint64 hash;
+  // One of these is set, depending on the type of file
+  Disease *disease;
+  Population *pop_params;
+} CacheEntry;
+
+// Cache entries, protected by cache_lock
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static CacheEntry *cache_entries = NULL;
+static size_t cache_size = 0;
+static size_t cache_capacity = 0;
+
+// Find entry of the given kind for a file version.  Call with lock held.
+static CacheEntry *find_cache_entry(const char *fname, uint64 hash,
+  bool disease);
+
+// Add an entry for a file version, taking ownership of the parsed data.
+// Call with lock held.
+static EpiError add_cache_entry(const char *fname, uint64 hash,
+  Disease *disease, Population *pop_params);
+
+EpiError cached_disease(Disease **out, const char *fname) {
+  if (out == NULL || fname == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  uint64 hash;
+  PASS_ERROR(hash_file(&hash, fname));
+
+  pthread_mutex_lock(&cache_lock);
+  CacheEntry *entry = find_cache_entry(fname, hash, true);
+  if (entry != NULL) {
+    *out = retain_disease(entry->disease);
+    pthread_mutex_unlock(&cache_lock);
+    return EPI_ERROR_SUCCESS;
+  }
+  pthread_mutex_unlock(&cache_lock);
+
+  // Parse outside the lock.  If another thread parses the same file at the
+  // same time, both copies are valid, and the first one is kept.
+  Disease *dis = NULL;
+  PASS_ERROR(create_disease_from_file(&dis, fname));
+
+  pthread_mutex_lock(&cache_lock);
+  entry = find_cache_entry(fname, hash, true);
+  if (entry != NULL) {
+    free_disease(&dis);
+    dis = retain_disease(entry->disease);
+  } else if (add_cache_entry(fname, hash, dis, NULL) == EPI_ERROR_SUCCESS) {
+    retain_disease(dis);
+  }
+  pthread_mutex_unlock(&cache_lock);
+
+  *out = dis;
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError cached_pop(Population **out, const char *fname,
+  size_t disease_duration) {
+
+  if (out == NULL || fname == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  uint64 hash;
+  PASS_ERROR(hash_file(&hash, fname));
+
+  Population params;
+  pthread_mutex_lock(&cache_lock);
+  CacheEntry *entry = find_cache_entry(fname, hash, false);
+  if (entry != NULL) {
+    params = *entry->pop_params;
+  }
+  pthread_mutex_unlock(&cache_lock);
+
+  if (entry == NULL) {
+    PASS_ERROR(read_pop_file(&params, fname));
+
+    Population *copy = (Population *)malloc(sizeof(Population));
+    if (copy != NULL) {
+      *copy = params;
+      pthread_mutex_lock(&cache_lock);
+      if (find_cache_entry(fname, hash, false) != NULL ||
+        add_cache_entry(fname, hash, NULL, copy) != EPI_ERROR_SUCCESS) {
+        free(copy);
+      }
+      pthread_mutex_unlock(&cache_lock);
+    }
+  }
+
+  return create_pop(out, &params, disease_duration);
+}
+
+void clear_param_cache(void) {
+  pthread_mutex_lock(&cache_lock);
+  for (size_t i = 0; i < cache_size; i++) {
+    free(cache_entries[i].fname);
+    free_disease(&cache_entries[i].disease);
+    free(cache_entries[i].pop_params);
+  }
+  free(cache_entries);
+  cache_entries = NULL;
+  cache_size = 0;
+  cache_capacity = 0;
+  pthread_mutex_unlock(&cache_lock);
+}
+
+static CacheEntry *find_cache_entry(const char *fname, uint64 hash,
+  bool disease) {
+
+  for (size_t i = 0; i < cache_size; i++) {
+    CacheEntry *entry = &cache_entries[i];
+    if (entry->hash == hash && (entry->disease != NULL) == disease &&
+      !strcmp(entry->fname, fname)) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+static EpiError add_cache_entry(const char *fname, uint64 hash,
+  Disease *disease, Population *pop_params) {
+
+  if (cache_size == cache_capacity) {
+    size_t capacity = cache_capacity > 0 ? 2 * cache_capacity : 8;
+    CacheEntry *entries = (CacheEntry *)realloc(cache_entries,
+      capacity * sizeof(CacheEntry));
+    if (entries == NULL) {
+      return EPI_ERROR_OUT_OF_MEMORY;
+    }
+    cache_entries = entries;
+    cache_capacity = capacity;
+  }
+
+  char *name = (char *)malloc(strlen(fname) + 1);
+  if (name == NULL) {
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+  strcpy(name, fname);
+
+  CacheEntry *entry = &cache_entries[cache_size++];
+  entry->fname = name;
+  entry->hash = hash;
+  entry->disease = disease;
+  entry->pop_params = pop_params;
+  return EPI_ERROR_SUCCESS;
+}
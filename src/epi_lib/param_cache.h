@@ -0,0 +1,25 @@
+#ifndef __PARAM_CACHE_H__
+#define __PARAM_CACHE_H__
+// Process-wide cache of parsed data files.  Files are identified by path
+// and a hash of their contents, so each version of a file is parsed once,
+// and editing a file between runs still takes effect.  The cache may be
+// used from several threads at once.
+
+#include "common.h"
+#include "disease.h"
+#include "population.h"
+
+// Disease read from a data file, shared read-only with every other user of
+// the same file.  Free with free_disease().
+EpiError cached_disease(Disease **out, const char *fname);
+
+// Population with parameters and initial counters read from a data file,
+// and its own empty day bins for the disease duration
+EpiError cached_pop(Population **out, const char *fname,
+  size_t disease_duration);
+
+// Drop all cached files.  Diseases still in use by models stay valid until
+// the models are freed.
+void clear_param_cache(void);
+
+#endif
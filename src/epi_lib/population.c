@@ -1,15 +1,45 @@
-#include "approx_binomial.h"
+#include "bin_file.h"
 #include "files.h"
 #include "population.h"
+#include "profile.h"
 
-// Calculate average infection rate
-static float calc_inf_rate(const Population *pop, const Disease *dis);
+// Read population parameters
+static EpiError read_pop_params(Population *pop, DataFile *df);
 
-// Calculate fraction of critical cases that can be hospitalized
-static float calc_hosp_rate(const Population *pop);
+// Allocate day bin arrays and scratch space for a new population
+static EpiError allocate_pop_arrays(Population *pop, size_t duration);
 
-// Read population parameters
-static EpiError read_pop_params(Population *pop, FILE *fp);
+// Index of lowest set bit in a nonzero mask
+static int lowest_bit_index(uint64 m);
+
+// Point population at the day bins and scratch space of another
+static void use_pop_arrays(Population *pop, const Population *arrays);
+
+// calloc() and free() for blocks aligned to POP_ALIGNMENT
+static void *pop_aligned_calloc(size_t size);
+static void pop_aligned_free(void *ptr);
+
+// Number of elements of the given size in an array of n of them, padded to
+// a multiple of POP_ALIGNMENT bytes
+static size_t pop_aligned_count(size_t n, size_t size);
+
+// Vaccinate the day's share of susceptible people
+static void vaccinate_pop(Population *pop);
+
+// Kernel that advances the day bins of a disease with the given duration
+static PopBinKernel select_bin_kernel(size_t duration);
+
+// Body of the day bin kernels, inlined into each of them so that the
+// duration is a compile-time constant in the specialized ones
+static EPI_ALWAYS_INLINE EpiError advance_bins(Population *pop,
+  const Disease *dis, float hosp_death_reduction, Sampler *smp,
+  size_t duration);
+
+// Draw and apply transitions for nd occupied day bins, given by their days.
+// If dense, the bins are days 1 to nd in order, and day is not used.
+static EPI_ALWAYS_INLINE EpiError advance_bin_lanes(Population *pop,
+  const Disease *dis, float hosp_death_reduction, Sampler *smp,
+  size_t duration, bool dense, const size_t *day, size_t nd);
 
 EpiError create_pop_from_file(Population **out, const char *fname,
   size_t disease_duration) {
@@ -18,64 +48,197 @@ EpiError create_pop_from_file(Population **out, const char *fname,
     return EPI_ERROR_INVALID_ARGS;
   }
 
-  FILE *fp = fopen(fname, "r");
-  if (fp == NULL) {
-    return EPI_ERROR_FILE_NOT_FOUND;
+  Population params;
+  PASS_ERROR(read_pop_file(&params, fname));
+  return create_pop(out, &params, disease_duration);
+}
+
+EpiError read_pop_file(Population *params, const char *fname) {
+  if (params == NULL || fname == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
   }
 
-  Population *pop = (Population *)calloc(1, sizeof(Population));
+  BinKind kind;
+  PASS_ERROR(bin_file_kind(&kind, fname));
+  if (kind != BIN_NONE) {
+    return load_pop_bin(params, fname);
+  }
+
+  DataFile *df = NULL;
+  PASS_ERROR(open_data_file(&df, fname));
+
+  memset(params, 0, sizeof(Population));
+  EpiError err = read_pop_params(params, df);
+  free_data_file(&df);
+  return err;
+}
+
+EpiError create_pop(Population **out, const Population *params,
+  size_t disease_duration) {
+
+  if (out == NULL || params == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  if (disease_duration == 0 || disease_duration > MAX_POP_DURATION) {
+    return EPI_ERROR_INVALID_DATA;
+  }
+
+  Population *pop = (Population *)malloc(sizeof(Population));
   if (pop == NULL) {
-    fclose(fp);
     return EPI_ERROR_OUT_OF_MEMORY;
   }
+  memcpy(pop, params, sizeof(Population));
 
-  EpiError err = read_pop_params(pop, fp);
+  EpiError err = allocate_pop_arrays(pop, disease_duration);
   if (err != EPI_ERROR_SUCCESS) {
-    fclose(fp);
     free(pop);
     return err;
   }
 
-  uint64 *ptr =
-    (uint64 *)calloc(N_POP_ARRAY_FIELDS * disease_duration, sizeof(uint64));
+  *out = pop;
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError copy_pop(Population **out, const Population *pop) {
+  if (out == NULL || pop == NULL || pop->n_total_active == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  Population *copy = (Population *)malloc(sizeof(Population));
+  if (copy == NULL) {
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+  memcpy(copy, pop, sizeof(Population));
+
+  EpiError err = allocate_pop_arrays(copy, pop->max_duration);
+  if (err != EPI_ERROR_SUCCESS) {
+    free(copy);
+    return err;
+  }
+
+  size_t n = pop->max_duration * sizeof(uint64);
+  memcpy(copy->n_total_active, pop->n_total_active, n);
+  memcpy(copy->n_asymptomatic, pop->n_asymptomatic, n);
+  memcpy(copy->n_symptomatic, pop->n_symptomatic, n);
+  memcpy(copy->n_critical, pop->n_critical, n);
+
+  *out = copy;
+  return EPI_ERROR_SUCCESS;
+}
+
+size_t pop_state_size(const Population *pop) {
+  size_t n = pop->n_total_active != NULL ? pop->max_duration : 0;
+  return sizeof(Population) + N_POP_ARRAY_FIELDS * n * sizeof(uint64);
+}
+
+size_t save_pop_state(uint8 *buf, const Population *pop) {
+  memcpy(buf, pop, sizeof(Population));
+  if (pop->n_total_active == NULL) {
+    return sizeof(Population);
+  }
+
+  // Fields are padded apart in memory, but saved back to back
+  size_t n = pop->max_duration * sizeof(uint64);
+  uint8 *out = &buf[sizeof(Population)];
+  memcpy(out, pop->n_total_active, n);
+  memcpy(&out[n], pop->n_asymptomatic, n);
+  memcpy(&out[2*n], pop->n_symptomatic, n);
+  memcpy(&out[3*n], pop->n_critical, n);
+  return sizeof(Population) + N_POP_ARRAY_FIELDS * n;
+}
+
+size_t load_pop_state(Population *pop, const uint8 *buf) {
+  Population arrays = *pop;
+  memcpy(pop, buf, sizeof(Population));
+  use_pop_arrays(pop, &arrays);
+  if (pop->n_total_active == NULL) {
+    return sizeof(Population);
+  }
+
+  size_t n = pop->max_duration * sizeof(uint64);
+  const uint8 *in = &buf[sizeof(Population)];
+  memcpy(pop->n_total_active, in, n);
+  memcpy(pop->n_asymptomatic, &in[n], n);
+  memcpy(pop->n_symptomatic, &in[2*n], n);
+  memcpy(pop->n_critical, &in[3*n], n);
+  return sizeof(Population) + N_POP_ARRAY_FIELDS * n;
+}
+
+static void use_pop_arrays(Population *pop, const Population *arrays) {
+  pop->max_duration = arrays->max_duration;
+  pop->advance_bins = arrays->advance_bins;
+  pop->n_total_active = arrays->n_total_active;
+  pop->n_asymptomatic = arrays->n_asymptomatic;
+  pop->n_symptomatic = arrays->n_symptomatic;
+  pop->n_critical = arrays->n_critical;
+  pop->draw_p_x = arrays->draw_p_x;
+  pop->draw_p_y = arrays->draw_p_y;
+  pop->draw_n = arrays->draw_n;
+  pop->draw_nx = arrays->draw_nx;
+  pop->draw_ny = arrays->draw_ny;
+}
+
+static EpiError allocate_pop_arrays(Population *pop, size_t duration) {
+  // Every array starts on its own cache line: the day bin fields, then the
+  // integer and float lanes of the transition draws
+  size_t n_bins = pop_aligned_count(duration, sizeof(uint64));
+  size_t n_lanes = N_POP_DRAW_STATES * duration;
+  size_t n_int_lanes = pop_aligned_count(n_lanes, sizeof(uint64));
+  size_t n_float_lanes = pop_aligned_count(n_lanes, sizeof(float));
+  size_t n_ints = N_POP_ARRAY_FIELDS * n_bins + 3 * n_int_lanes;
+
+  uint64 *ptr = (uint64 *)pop_aligned_calloc(
+    n_ints * sizeof(uint64) + 2 * n_float_lanes * sizeof(float));
   if (ptr == NULL) {
     return EPI_ERROR_OUT_OF_MEMORY;
   }
 
-  pop->max_duration = disease_duration;
+  pop->max_duration = duration;
+  pop->advance_bins = select_bin_kernel(duration);
   pop->n_total_active = ptr;
-  pop->n_asymptomatic = &ptr[disease_duration];
-  pop->n_symptomatic = &ptr[2*disease_duration];
-  pop->n_critical = &ptr[3*disease_duration];
+  pop->n_asymptomatic = &ptr[n_bins];
+  pop->n_symptomatic = &ptr[2*n_bins];
+  pop->n_critical = &ptr[3*n_bins];
+
+  uint64 *draw = &ptr[N_POP_ARRAY_FIELDS * n_bins];
+  pop->draw_n = draw;
+  pop->draw_nx = &draw[n_int_lanes];
+  pop->draw_ny = &draw[2*n_int_lanes];
+
+  float *fptr = (float *)&ptr[n_ints];
+  pop->draw_p_x = fptr;
+  pop->draw_p_y = &fptr[n_float_lanes];
 
-  *out = pop;
   return EPI_ERROR_SUCCESS;
 }
 
-static EpiError read_pop_params(Population *pop, FILE *fp) {
-  PASS_ERROR(read_size_token(&(pop->n_total), fp, "N_TOTAL"));
+static EpiError read_pop_params(Population *pop, DataFile *df) {
+  PASS_ERROR(read_size_token(&(pop->n_total), df, "N_TOTAL"));
 
   // Susceptible population token is optional.
   // If not found, set n_susceptible = n_total.
-  EpiError err = read_size_token(&(pop->n_susceptible), fp, "N_SUSCEPTIBLE");
+  EpiError err = read_size_token(&(pop->n_susceptible), df, "N_SUSCEPTIBLE");
   if (err == EPI_ERROR_MISSING_DATA) {
     pop->n_susceptible = pop->n_total;
   } else if (err != EPI_ERROR_SUCCESS) {
     return err;
   }
 
-  PASS_ERROR(read_float_token(&(pop->cr_normal), fp, "CR_NORMAL"));
-  PASS_ERROR(read_float_token(&(pop->cr_home), fp, "CR_HOME"));
-  PASS_ERROR(read_float_token(&(pop->cr_hospital), fp, "CR_HOSPITAL"));
+  PASS_ERROR(read_float_token(&(pop->cr_normal), df, "CR_NORMAL"));
+  PASS_ERROR(read_float_token(&(pop->cr_home), df, "CR_HOME"));
+  PASS_ERROR(read_float_token(&(pop->cr_hospital), df, "CR_HOSPITAL"));
 
-  PASS_ERROR(read_float_token(&(pop->daily_production),fp,"DAILY_PRODUCTION"));
-  PASS_ERROR(read_float_token(&(pop->f_critical_jobs), fp, "F_CRITICAL_JOBS"));
-  PASS_ERROR(read_float_token(&(pop->prod_symp), fp, "PROD_SYMP"));
-  PASS_ERROR(read_float_token(&(pop->prod_dist), fp, "PROD_DIST"));
-  PASS_ERROR(read_float_token(&(pop->prod_home), fp, "PROD_HOME"));
-  PASS_ERROR(read_float_token(&(pop->n_hospital_beds), fp, "N_HOSPITAL_BEDS"));
+  PASS_ERROR(read_float_token(&(pop->daily_production),df,"DAILY_PRODUCTION"));
+  PASS_ERROR(read_float_token(&(pop->f_critical_jobs), df, "F_CRITICAL_JOBS"));
+  PASS_ERROR(read_float_token(&(pop->prod_symp), df, "PROD_SYMP"));
+  PASS_ERROR(read_float_token(&(pop->prod_dist), df, "PROD_DIST"));
+  PASS_ERROR(read_float_token(&(pop->prod_home), df, "PROD_HOME"));
+  size_t n_beds;
+  PASS_ERROR(read_size_token(&n_beds, df, "N_HOSPITAL_BEDS"));
+  pop->n_hospital_beds = n_beds;
 
-  PASS_ERROR(read_float_token(&(pop->daily_vaccination_capacity), fp,
+  PASS_ERROR(read_float_token(&(pop->daily_vaccination_capacity), df,
     "DAILY_VACCINATION_CAPACITY"));
 
   return EPI_ERROR_SUCCESS;
@@ -96,7 +259,7 @@ EpiError free_pop(Population **pop) {
     return EPI_ERROR_SUCCESS;
   }
 
-  free((*pop)->n_total_active);
+  pop_aligned_free((*pop)->n_total_active);
   (*pop)->n_total_active = NULL;
   free(*pop);
   *pop = NULL;
@@ -114,13 +277,35 @@ EpiError infect_pop(Population *pop, uint64 n_cases) {
 
   pop->n_susceptible -= n_cases;
   pop->n_infected += n_cases;
-  pop->n_total_active[0] += n_cases;
-  pop->n_asymptomatic[0] += n_cases;
+  pop->n_total_asymptomatic += n_cases;
+  pop->n_total_active[pop->head] += n_cases;
+  pop->n_asymptomatic[pop->head] += n_cases;
+  if (n_cases > 0) {
+    pop->occupied |= 1;
+  }
   return EPI_ERROR_SUCCESS;
 }
 
-EpiError evolve_pop(Population *pop, const Disease *dis, bool vaccine) {
-  if (pop == NULL || pop->n_total_active == NULL) {
+EpiError evolve_pop(Population *pop, const Disease *dis, bool vaccine,
+  Sampler *smp) {
+  PASS_ERROR(evolve_pop_transitions(pop, dis, vaccine, smp));
+
+  // Day 0 bin: calculate number of newly infected
+  // TODO: impact of control measures
+  uint64 start = PROFILE_BEGIN();
+  float infection_rate = calc_inf_rate(pop, dis);
+  PROFILE_END(EPI_PHASE_INFECTION_RATE, start);
+
+  start = PROFILE_BEGIN();
+  PASS_ERROR(infect_pop_draw(pop, infection_rate / (float)pop->n_susceptible,
+    smp));
+  PROFILE_END(EPI_PHASE_INFECTION, start);
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError evolve_pop_transitions(Population *pop, const Disease *dis,
+  bool vaccine, Sampler *smp) {
+  if (pop == NULL || pop->n_total_active == NULL || smp == NULL) {
     return EPI_ERROR_INVALID_ARGS;
   }
 
@@ -128,14 +313,13 @@ EpiError evolve_pop(Population *pop, const Disease *dis, bool vaccine) {
     return EPI_ERROR_INVALID_ARGS;
   }
 
+  uint64 start = PROFILE_BEGIN();
   if (vaccine) {
-    size_t dv = (size_t)(pop->daily_vaccination_capacity * pop->n_susceptible);
-    if (dv > pop->n_susceptible) {
-      dv = pop->n_susceptible;
-    }
-    pop->n_susceptible -= dv;
-    pop->n_vaccinated += dv;
+    vaccinate_pop(pop);
   }
+  PROFILE_END(EPI_PHASE_VACCINATION, start);
+
+  start = PROFILE_BEGIN();
 
   // Death rate modifier based on availability of hospital beds
   float hr = calc_hosp_rate(pop);
@@ -144,69 +328,76 @@ EpiError evolve_pop(Population *pop, const Disease *dis, bool vaccine) {
   // Update conditions and advance disease stages
   // For now, assume that everyone who reaches max_duration recovers
   pop->n_dead_last = pop->n_dead;
+  PASS_ERROR(pop->advance_bins(pop, dis, hosp_death_reduction, smp));
+  PROFILE_END(EPI_PHASE_TRANSITIONS, start);
 
-  pop->n_recovered += pop->n_total_active[pop->max_duration - 1];
-  pop->n_infected -= pop->n_total_active[pop->max_duration - 1];
-  pop->n_total_critical -= pop->n_critical[pop->max_duration - 1];
-
-  // Advance disease time and change population states
-  if (pop->n_infected > 0) {
-    for (size_t i = pop->max_duration - 1; i > 0; i--) {
-      uint64 n_t = pop->n_total_active[i-1];
-      uint64 n_a = pop->n_asymptomatic[i-1];
-      uint64 n_s = pop->n_symptomatic[i-1];
-      uint64 n_c = pop->n_critical[i-1];
-
-      // Recoveries, state transitions and deaths
-      float p_r = dis->p_recovery[i-1];
-      float p_s = dis->p_symptoms[i-1];
-      float p_c = dis->p_critical[i-1];
-      float p_d = dis->p_death[i-1] * hosp_death_reduction;
-
-      // Number of recovered
-      uint64 r_a = 0;
-      uint64 r_s = 0;
-      uint64 r_c = 0;
-
-      // Number of worsened cases
-      uint64 w_a = 0;   // Asymptomatic becomes symptomatic
-      uint64 w_s = 0;   // Symptomatic becomes critical
-      uint64 w_c = 0;   // Critical dies
-
-      // Estimate # of transitions by drawing from a double binomial
-      // distribution
-      PASS_ERROR(approx_dbin_draw(&r_a, &w_a, p_r, p_s, n_a));
-      PASS_ERROR(approx_dbin_draw(&r_s, &w_s, p_r, p_c, n_s));
-      PASS_ERROR(approx_dbin_draw(&r_c, &w_c, p_r, p_d, n_c));
-
-      // Update number of people in different categories, for this infection day
-      pop->n_total_active[i] = n_t - r_a - r_s - r_c - w_c;
-      pop->n_asymptomatic[i] = n_a - r_a - w_a;
-      pop->n_symptomatic[i] = n_s + w_a - r_s - w_s;
-      pop->n_critical[i] = n_c + w_s - r_c - w_c;
-
-      pop->n_dead += w_c;
-      pop->n_total_critical += w_s - w_c - r_c;
-      pop->n_recovered += r_a + r_s + r_c;
-      pop->n_infected -= r_a + r_s + r_c + w_c;
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError evolve_pop_quiet(Population *pop, bool vaccine, size_t n_days) {
+  if (pop == NULL || pop->n_total_active == NULL || pop->n_infected > 0) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  if (n_days == 0) {
+    return EPI_ERROR_SUCCESS;
+  }
+
+  // Vaccination truncates to whole people every day, so it is repeated day
+  // by day to match evolve_pop() exactly, until the daily share drops to 0
+  if (vaccine) {
+    uint64 n_vaccinated = pop->n_vaccinated;
+    for (size_t i = 0; i < n_days; i++) {
+      vaccinate_pop(pop);
+      if (pop->n_vaccinated == n_vaccinated) {
+        break;
+      }
+      n_vaccinated = pop->n_vaccinated;
     }
-  } // If pop(n_infected > 0)
+  }
 
-  // Day 0 bin: calculate number of newly infected
-  // TODO: impact of control measures
-  pop->n_total_active[0] = 0;
-  pop->n_asymptomatic[0] = 0;
-  pop->n_symptomatic[0] = 0;
-  pop->n_critical[0] = 0;
+  // Nobody dies, and the empty day bins only move around the ring buffer
+  pop->n_dead_last = pop->n_dead;
+  size_t shift = n_days % pop->max_duration;
+  pop->head = (pop->head + pop->max_duration - shift) % pop->max_duration;
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError infect_pop_draw(Population *pop, float p, Sampler *smp) {
+  if (pop == NULL || smp == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
 
-  float infection_rate = calc_inf_rate(pop, dis);
   uint64 n_infected;
-  PASS_ERROR(approx_bin_draw(&n_infected,
-                        infection_rate / (float)pop->n_susceptible,
-                        pop->n_susceptible));
-  PASS_ERROR(infect_pop(pop, n_infected));
+  PASS_ERROR(sample_bin(smp, &n_infected, p, pop->n_susceptible));
+  return infect_pop(pop, n_infected);
+}
 
-  return EPI_ERROR_SUCCESS;
+static void vaccinate_pop(Population *pop) {
+  size_t dv = (size_t)(pop->daily_vaccination_capacity * pop->n_susceptible);
+  if (dv > pop->n_susceptible) {
+    dv = pop->n_susceptible;
+  }
+  pop->n_susceptible -= dv;
+  pop->n_vaccinated += dv;
+}
+
+size_t pop_bin_index(const Population *pop, size_t day) {
+  size_t k = pop->head + day;
+  return k < pop->max_duration ? k : k - pop->max_duration;
+}
+
+static int lowest_bit_index(uint64 m) {
+#if defined(__GNUC__)
+  return __builtin_ctzll(m);
+#else
+  int i = 0;
+  while (!(m & 1)) {
+    m >>= 1;
+    i++;
+  }
+  return i;
+#endif
 }
 
 EpiError add_hosp_capacity(Population *pop, uint64 n_beds) {
@@ -217,7 +408,13 @@ EpiError add_hosp_capacity(Population *pop, uint64 n_beds) {
   return EPI_ERROR_SUCCESS;
 }
 
-static float calc_inf_rate(const Population *pop, const Disease *dis) {
+void calc_contact_pool(ContactPool *out, const Population *pop,
+  const Disease *dis) {
+  calc_contact_pool_policy(out, pop, dis, &pop->policy);
+}
+
+void calc_contact_pool_policy(ContactPool *out, const Population *pop,
+  const Disease *dis, const EpiInput *policy) {
 
   // Weights for how often asymptomatic, symptomatic and critical people come
   // into contact with each other.  These are affected by the population's
@@ -236,7 +433,7 @@ static float calc_inf_rate(const Population *pop, const Disease *dis) {
 
   float fcj = pop->f_critical_jobs;
 
-  if (pop->policy.dist_home_all) {
+  if (policy->dist_home_all) {
     // People without critical jobs stay at home, and even those with
     // critical jobs spend more time at home than usual
     wa = pop->cr_home * (1.f - fcj)
@@ -244,10 +441,10 @@ static float calc_inf_rate(const Population *pop, const Disease *dis) {
     ws = pop->cr_home;
   }
   else {
-    if (pop->policy.dist_home_symp) {
+    if (policy->dist_home_symp) {
       ws = pop->cr_home;
     }
-    if (pop->policy.dist_recommend) {
+    if (policy->dist_recommend) {
       wa = 0.5f * (pop->cr_normal + pop->cr_home);
     }
   }
@@ -260,30 +457,28 @@ static float calc_inf_rate(const Population *pop, const Disease *dis) {
 
   // Estimated contact rate for entire population, where 1 is a baseline
   // amount of a single person's contacts per day
-  float cr = wa * pop->n_susceptible + wa * pop->n_recovered;
-
-  for (size_t i = 0; i < pop->max_duration; i++) {
-    cr += wa * pop->n_asymptomatic[i] + ws * pop->n_symptomatic[i]
-        + wc * pop->n_critical[i];
-  }
-
-  // Fraction of contacts that are susceptible
-  float fs = wa * pop->n_susceptible / cr;
+  out->w_susceptible = wa;
+  out->contacts = (double)wa * pop->n_susceptible
+    + (double)wa * pop->n_recovered + (double)wa * pop->n_total_asymptomatic
+    + (double)ws * pop->n_total_symptomatic + (double)wc * pop->n_total_critical;
+
+  // Number of contacts by infectious people, weighted by the probability
+  // of transmission on their day of disease
+  out->infectious = wa * dis->asymp_trans_reduction *
+    pop->pressure_asymptomatic + ws * pop->pressure_symptomatic
+    + wc * pop->pressure_critical;
+}
 
-  float inf_rate = 0.f;
-  for (size_t i = 0; i < pop->max_duration; i++) {
-    // Number of contacts by people on day i of disease
-    float ci = wa * dis->asymp_trans_reduction * pop->n_asymptomatic[i]
-      + ws * pop->n_symptomatic[i] + wc * pop->n_critical[i];
+float calc_inf_rate(const Population *pop, const Disease *dis) {
+  ContactPool pool;
+  calc_contact_pool(&pool, pop, dis);
 
-    inf_rate += dis->p_transmit[i] * ci;
-  }
-  inf_rate *= fs;
-
-  return inf_rate;
+  // Susceptible contacts, times probability that a contact is infectious
+  return (float)(pool.w_susceptible * pop->n_susceptible *
+    pool.infectious / pool.contacts);
 }
 
-static float calc_hosp_rate(const Population *pop) {
+float calc_hosp_rate(const Population *pop) {
   if (!pop->n_hospital_beds) {
     return 0.f;
   }
@@ -300,28 +495,17 @@ static float calc_hosp_rate(const Population *pop) {
 }
 
 float hospital_load(const Population *pop) {
-  uint64 n_crit = 0;
-  for (size_t i = 0; i < pop->max_duration; i++) {
-    n_crit += pop->n_critical[i];
-  }
-
-  return (float)n_crit / (float)pop->n_hospital_beds;
+  return (float)pop->n_total_critical / (float)pop->n_hospital_beds;
 }
 
 float productivity_loss(const Population *pop) {
   // People who are dead or in critical condition lose all production
-  uint64 n_incap = pop->n_dead;
-  for (size_t i = 0; i < pop->max_duration; i++) {
-    n_incap += pop->n_critical[i];
-  }
+  uint64 n_incap = pop->n_dead + pop->n_total_critical;
   float result = (float)n_incap;
 
   // People who are symptomatic but not critical lose some of their production,
   // depending on policy
-  uint64 n_symp = 0;
-  for (size_t i = 0; i < pop->max_duration; i++) {
-    n_symp += pop->n_symptomatic[i];
-  }
+  uint64 n_symp = pop->n_total_symptomatic;
   float ps;
   if (pop->policy.dist_home_symp) {
     ps = pop->prod_home * pop->prod_symp;
@@ -347,3 +531,223 @@ float productivity_loss(const Population *pop) {
 
   return result * pop->daily_production;
 }
+
+static void *pop_aligned_calloc(size_t size) {
+  // Room to align the block, and to keep the pointer returned by calloc()
+  // just before it
+  uint8 *raw = (uint8 *)calloc(size + POP_ALIGNMENT + sizeof(void *), 1);
+  if (raw == NULL) {
+    return NULL;
+  }
+
+  uintptr_t addr = (uintptr_t)(raw + sizeof(void *));
+  addr = (addr + POP_ALIGNMENT - 1) & ~(uintptr_t)(POP_ALIGNMENT - 1);
+  void **block = (void **)addr;
+  block[-1] = raw;
+  return block;
+}
+
+static void pop_aligned_free(void *ptr) {
+  if (ptr != NULL) {
+    free(((void **)ptr)[-1]);
+  }
+}
+
+static size_t pop_aligned_count(size_t n, size_t size) {
+  size_t per_line = POP_ALIGNMENT / size;
+  return (n + per_line - 1) / per_line * per_line;
+}
+
+// Day bin kernels for common disease durations, with every loop bound and
+// ring buffer index computed from a constant, and a generic one for the rest
+#define DEFINE_BIN_KERNEL(d) \
+  static EpiError advance_bins_##d(Population *pop, const Disease *dis, \
+    float hosp_death_reduction, Sampler *smp) { \
+    return advance_bins(pop, dis, hosp_death_reduction, smp, d); \
+  }
+
+DEFINE_BIN_KERNEL(14)
+DEFINE_BIN_KERNEL(21)
+DEFINE_BIN_KERNEL(28)
+DEFINE_BIN_KERNEL(42)
+
+static EpiError advance_bins_generic(Population *pop, const Disease *dis,
+  float hosp_death_reduction, Sampler *smp) {
+  return advance_bins(pop, dis, hosp_death_reduction, smp, pop->max_duration);
+}
+
+static PopBinKernel select_bin_kernel(size_t duration) {
+  switch (duration) {
+    case 14: return advance_bins_14;
+    case 21: return advance_bins_21;
+    case 28: return advance_bins_28;
+    case 42: return advance_bins_42;
+    default: return advance_bins_generic;
+  }
+}
+
+static EPI_ALWAYS_INLINE EpiError advance_bins(Population *pop,
+  const Disease *dis, float hosp_death_reduction, Sampler *smp,
+  size_t duration) {
+
+  uint64 *n_total_active = EPI_ASSUME_ALIGNED(pop->n_total_active,
+    POP_ALIGNMENT);
+  uint64 *n_asymptomatic = EPI_ASSUME_ALIGNED(pop->n_asymptomatic,
+    POP_ALIGNMENT);
+  uint64 *n_symptomatic = EPI_ASSUME_ALIGNED(pop->n_symptomatic,
+    POP_ALIGNMENT);
+  uint64 *n_critical = EPI_ASSUME_ALIGNED(pop->n_critical, POP_ALIGNMENT);
+
+  // Retire the last day bin, then age every other bin by one day by moving
+  // the ring buffer head back onto the retired slot, which becomes day 0
+  size_t last = pop->head + duration - 1;
+  if (last >= duration) {
+    last -= duration;
+  }
+  pop->n_recovered += n_total_active[last];
+  pop->n_infected -= n_total_active[last];
+
+  n_total_active[last] = 0;
+  n_asymptomatic[last] = 0;
+  n_symptomatic[last] = 0;
+  n_critical[last] = 0;
+
+  pop->head = last;
+  pop->occupied = (pop->occupied & ~((uint64)1 << (duration - 1))) << 1;
+
+  // Running totals are rebuilt from the new day bins in the same pass that
+  // advances them.  If nobody is infected, every bin is empty.
+  pop->n_total_asymptomatic = 0;
+  pop->n_total_symptomatic = 0;
+  pop->n_total_critical = 0;
+  pop->pressure_asymptomatic = 0.0;
+  pop->pressure_symptomatic = 0.0;
+  pop->pressure_critical = 0.0;
+
+  if (pop->n_infected == 0) {
+    return EPI_ERROR_SUCCESS;
+  }
+
+  // For most of an outbreak, every bin but day 0 is occupied.  The lanes
+  // then have a fixed count and need no gathering.
+  uint64 all_days = (~(uint64)0 >> (64 - duration)) & ~(uint64)1;
+  if (pop->occupied == all_days) {
+    return advance_bin_lanes(pop, dis, hosp_death_reduction, smp, duration,
+      true, NULL, duration - 1);
+  }
+
+  size_t day[MAX_POP_DURATION];
+  size_t nd = 0;
+  for (uint64 m = pop->occupied; m != 0; m &= m - 1) {
+    day[nd++] = (size_t)lowest_bit_index(m);
+  }
+  return advance_bin_lanes(pop, dis, hosp_death_reduction, smp, duration,
+    false, day, nd);
+}
+
+static EPI_ALWAYS_INLINE EpiError advance_bin_lanes(Population *pop,
+  const Disease *dis, float hosp_death_reduction, Sampler *smp,
+  size_t duration, bool dense, const size_t *day, size_t nd) {
+
+  uint64 *restrict n_total_active = EPI_ASSUME_ALIGNED(pop->n_total_active,
+    POP_ALIGNMENT);
+  uint64 *restrict n_asymptomatic = EPI_ASSUME_ALIGNED(pop->n_asymptomatic,
+    POP_ALIGNMENT);
+  uint64 *restrict n_symptomatic = EPI_ASSUME_ALIGNED(pop->n_symptomatic,
+    POP_ALIGNMENT);
+  uint64 *restrict n_critical = EPI_ASSUME_ALIGNED(pop->n_critical,
+    POP_ALIGNMENT);
+  float *restrict p_x = EPI_ASSUME_ALIGNED(pop->draw_p_x, POP_ALIGNMENT);
+  float *restrict p_y = EPI_ASSUME_ALIGNED(pop->draw_p_y, POP_ALIGNMENT);
+  uint64 *restrict draw_n = EPI_ASSUME_ALIGNED(pop->draw_n, POP_ALIGNMENT);
+  uint64 *restrict nx = EPI_ASSUME_ALIGNED(pop->draw_nx, POP_ALIGNMENT);
+  uint64 *restrict ny = EPI_ASSUME_ALIGNED(pop->draw_ny, POP_ALIGNMENT);
+
+  // Gather transitions for every state and occupied day bin into lanes,
+  // and draw them all in one batch.  Lane g * nd + j holds state g in the
+  // j-th occupied bin.  Recoveries, state transitions and deaths use the
+  // probabilities for the day of disease before this one.
+  size_t head = pop->head;
+  for (size_t j = 0; j < nd; j++) {
+    size_t d = dense ? j + 1 : day[j];
+    size_t k = head + d < duration ? head + d : head + d - duration;
+    size_t i = d - 1;
+    p_x[j] = dis->p_recovery[i];
+    p_x[nd + j] = dis->p_recovery[i];
+    p_x[2*nd + j] = dis->p_recovery[i];
+    p_y[j] = dis->p_symptoms[i];
+    p_y[nd + j] = dis->p_critical[i];
+    p_y[2*nd + j] = dis->p_death[i] * hosp_death_reduction;
+    draw_n[j] = n_asymptomatic[k];
+    draw_n[nd + j] = n_symptomatic[k];
+    draw_n[2*nd + j] = n_critical[k];
+  }
+
+  // Estimate # of transitions by drawing from a double binomial
+  // distribution.  x = recovered, y = worsened.  The draw lanes are only
+  // accessed through the restrict pointers above, here too.
+  PASS_ERROR(sample_dbin_batch(smp, nx, ny, p_x, p_y, draw_n,
+    N_POP_DRAW_STATES * nd));
+
+  // Counters are kept in locals, which stores to the day bins cannot alias
+  uint64 occupied = pop->occupied;
+  uint64 n_dead = pop->n_dead;
+  uint64 n_recovered = pop->n_recovered;
+  uint64 n_infected = pop->n_infected;
+  uint64 n_total_asymptomatic = 0;
+  uint64 n_total_symptomatic = 0;
+  uint64 n_total_critical = 0;
+  double pressure_asymptomatic = 0.0;
+  double pressure_symptomatic = 0.0;
+  double pressure_critical = 0.0;
+
+  for (size_t j = 0; j < nd; j++) {
+    size_t d = dense ? j + 1 : day[j];
+    size_t k = head + d < duration ? head + d : head + d - duration;
+
+    // Number of recovered
+    uint64 r_a = nx[j];
+    uint64 r_s = nx[nd + j];
+    uint64 r_c = nx[2*nd + j];
+
+    // Number of worsened cases
+    uint64 w_a = ny[j];         // Asymptomatic becomes symptomatic
+    uint64 w_s = ny[nd + j];    // Symptomatic becomes critical
+    uint64 w_c = ny[2*nd + j];  // Critical dies
+
+    // Update number of people in different categories, for this infection day
+    n_total_active[k] -= r_a + r_s + r_c + w_c;
+    n_asymptomatic[k] -= r_a + w_a;
+    n_symptomatic[k] += w_a - r_s - w_s;
+    n_critical[k] += w_s - r_c - w_c;
+
+    if (n_total_active[k] == 0) {
+      occupied &= ~((uint64)1 << d);
+    }
+
+    n_dead += w_c;
+    n_recovered += r_a + r_s + r_c;
+    n_infected -= r_a + r_s + r_c + w_c;
+
+    n_total_asymptomatic += n_asymptomatic[k];
+    n_total_symptomatic += n_symptomatic[k];
+    n_total_critical += n_critical[k];
+
+    double p_t = dis->p_transmit[d];
+    pressure_asymptomatic += p_t * (double)n_asymptomatic[k];
+    pressure_symptomatic += p_t * (double)n_symptomatic[k];
+    pressure_critical += p_t * (double)n_critical[k];
+  }
+
+  pop->occupied = occupied;
+  pop->n_dead = n_dead;
+  pop->n_recovered = n_recovered;
+  pop->n_infected = n_infected;
+  pop->n_total_asymptomatic = n_total_asymptomatic;
+  pop->n_total_symptomatic = n_total_symptomatic;
+  pop->n_total_critical = n_total_critical;
+  pop->pressure_asymptomatic = pressure_asymptomatic;
+  pop->pressure_symptomatic = pressure_symptomatic;
+  pop->pressure_critical = pressure_critical;
+  return EPI_ERROR_SUCCESS;
+}
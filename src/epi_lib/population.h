@@ -3,10 +3,28 @@
 
 #include "common.h"
 #include "disease.h"
+#include "sampler.h"
 
 // Population structure
 #define N_POP_ARRAY_FIELDS 4
-typedef struct {
+#define N_POP_DRAW_STATES 3
+
+// Largest number of day bins, limited by the width of the occupancy mask
+#define MAX_POP_DURATION 64
+
+// Alignment in bytes of each day bin and scratch array, one cache line
+#define POP_ALIGNMENT 64
+
+struct Population;
+
+// Day-bin stage of evolve_pop_transitions(): retires the last bin, ages
+// the others and draws their transitions, given the death rate modifier
+// for hospital availability.  Selected for the disease duration when the
+// day bins are allocated, see select_bin_kernel() in population.c.
+typedef EpiError (*PopBinKernel)(struct Population *pop, const Disease *dis,
+  float hosp_death_reduction, Sampler *smp);
+
+typedef struct Population {
   // Disease control policy in place for this population
   EpiInput policy;
 
@@ -35,6 +53,8 @@ typedef struct {
   uint64 n_total;
   uint64 n_susceptible;
   uint64 n_infected;
+  uint64 n_total_asymptomatic;
+  uint64 n_total_symptomatic;
   uint64 n_total_critical;
   uint64 n_recovered;
   uint64 n_vaccinated;
@@ -44,14 +64,41 @@ typedef struct {
   // Fraction of population that can be vaccinated each day
   float daily_vaccination_capacity;
 
-  // Active disease phases are binned by day post infection
+  // Transmission-weighted number of infectious people in each state,
+  // sum over day bins i of p_transmit[i] * n[i].  Updated in the same pass
+  // that advances the day bins, before new infections are added to day 0.
+  double pressure_asymptomatic;
+  double pressure_symptomatic;
+  double pressure_critical;
+
+  // Active disease phases are binned by day post infection.
+  // The bins form a ring buffer: day d is stored at index
+  // pop_bin_index(pop, d) = (head + d) % max_duration, so that aging all
+  // bins by one day only moves the head.
   size_t max_duration;
+  size_t head;
+
+  // Bit d is set if the bin for day d has anyone in it
+  uint64 occupied;
 
+  // Kernel that advances the day bins, specialized for max_duration
+  PopBinKernel advance_bins;
+
+  // Day bins and scratch space share one allocation, and each array starts
+  // on a POP_ALIGNMENT boundary
   uint64 *n_total_active;
   uint64 *n_asymptomatic;
   uint64 *n_symptomatic;
   uint64 *n_critical;
 
+  // Scratch space for batched transition draws, with one lane for each
+  // disease state (asymptomatic, symptomatic, critical) and day bin
+  float *draw_p_x;
+  float *draw_p_y;
+  uint64 *draw_n;
+  uint64 *draw_nx;
+  uint64 *draw_ny;
+
   // TODO: hospital and monitoring model
   uint64 n_hospital_beds;   // Reserve hospital capacity
 
@@ -62,22 +109,80 @@ typedef struct {
 
 } Population;
 
+// Contacts within a population, given its current state and policy.
+// Contact weights are relative to the baseline amount of a single person's
+// contacts per day.
+typedef struct {
+  // Contact weight of a susceptible person
+  float w_susceptible;
+  // Total contact weight of everyone in the population
+  double contacts;
+  // Contact weight of infectious people, weighted by the probability of
+  // transmission on their day of disease
+  double infectious;
+} ContactPool;
+
 // Create population from data file
 EpiError create_pop_from_file(Population **out, const char *fname,
   size_t disease_duration);
 
+// Read population parameters and initial counters from data file, without
+// allocating any day bins
+EpiError read_pop_file(Population *params, const char *fname);
+
+// Create population with the parameters and initial counters read by
+// read_pop_file(), and empty day bins for the disease duration
+EpiError create_pop(Population **out, const Population *params,
+  size_t disease_duration);
+
+// Create a deep copy of a population, including its day bins
+EpiError copy_pop(Population **out, const Population *pop);
+
 // Frees population struct and associated data.  Nulls population pointer.
 EpiError free_pop(Population **pop);
 
+// Size in bytes of the state saved by save_pop_state()
+size_t pop_state_size(const Population *pop);
+
+// Write the mutable state of a population to buf: counters, policy,
+// hospital capacity and day bins.  Returns the number of bytes written,
+// pop_state_size(pop).
+size_t save_pop_state(uint8 *buf, const Population *pop);
+
+// Restore population state written by save_pop_state() for a population
+// with the same number of day bins.  Returns the number of bytes read.
+size_t load_pop_state(Population *pop, const uint8 *buf);
+
 // Infect members of the population.  If requested number of infected exceeds
 // the total susceptible population, then the entire susceptible population
 // becomes infected.
 EpiError infect_pop(Population *pop, uint64 n_cases);
 
-// Evolve the population forward by one day
+// Evolve the population forward by one day, using the given sampler for
+// random draws
 // TODO: add an argument that encodes government policies to control
 // the disease
-EpiError evolve_pop(Population *pop, const Disease *dis, bool vaccine);
+EpiError evolve_pop(Population *pop, const Disease *dis, bool vaccine,
+  Sampler *smp);
+
+// First stage of evolve_pop(): vaccination, disease progression and aging
+// of the day bins, leaving the day 0 bin empty.  Running totals and
+// infectious pressure are up to date afterwards.
+EpiError evolve_pop_transitions(Population *pop, const Disease *dis,
+  bool vaccine, Sampler *smp);
+
+// Evolve a population with nobody infected forward by n_days days, with the
+// same effect as n_days calls to evolve_pop(), but without drawing random
+// numbers, in O(1) time without vaccine.  With the vaccine, takes at most
+// one pass per day until the daily share of susceptible people rounds to 0.
+EpiError evolve_pop_quiet(Population *pop, bool vaccine, size_t n_days);
+
+// Second stage of evolve_pop(): infect each susceptible person with
+// probability p
+EpiError infect_pop_draw(Population *pop, float p, Sampler *smp);
+
+// Index into the day bin arrays of the bin for day of disease d
+size_t pop_bin_index(const Population *pop, size_t day);
 
 // Control measure: add hospital beds to population
 EpiError add_hosp_capacity(Population *pop, uint64 n_beds);
@@ -85,11 +190,28 @@ EpiError add_hosp_capacity(Population *pop, uint64 n_beds);
 // Print info, for debug purposes
 EpiError print_pop_info(size_t t, const Population *pop);
 
-// Calculate ratio of critical cases to hospital capacity
+// Calculate contact pool of a population, from the running totals and
+// infectious pressure
+void calc_contact_pool(ContactPool *out, const Population *pop,
+  const Disease *dis);
+
+// Same as calc_contact_pool(), under the given policy instead of the
+// population's own
+void calc_contact_pool_policy(ContactPool *out, const Population *pop,
+  const Disease *dis, const EpiInput *policy);
+
+// Calculate expected number of new infections per day, from the running
+// totals and infectious pressure
+float calc_inf_rate(const Population *pop, const Disease *dis);
+
+// Calculate fraction of critical cases that can be hospitalized
+float calc_hosp_rate(const Population *pop);
+
+// Calculate ratio of critical cases to hospital capacity, in O(1) time
 float hospital_load(const Population *pop);
 
 // TODO: move to different file
-// Calculate productivity impact per day
+// Calculate productivity impact per day, in O(1) time
 float productivity_loss(const Population *pop);
 
 #endif
@@ -0,0 +1,163 @@
+#include "profile.h"
+
+#include <time.h>
+
+// Names of phases in traces
+static const char *phase_names[N_EPI_PHASES] = {"step", "vaccination",
+  "transitions", "infection_rate", "infection", "observables", "recording"};
+
+// Profile of the model stepping on each thread, NULL if none
+static EPI_THREAD_LOCAL Profile *active_profile;
+
+// Monotonic clock in ns
+static uint64 clock_ns(void);
+
+// Timer ticks per second, measured since profiling started
+static double ticks_per_second(const Profile *prof);
+
+void init_profile(Profile *prof) {
+  memset(prof, 0, sizeof(Profile));
+  prof->ticks0 = profile_ticks();
+  prof->ns0 = clock_ns();
+}
+
+void free_profile_trace(Profile *prof) {
+  free(prof->events);
+  prof->events = NULL;
+  prof->n_events = 0;
+  prof->max_events = 0;
+}
+
+uint64 profile_ticks(void) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  return (uint64)__builtin_ia32_rdtsc();
+#else
+  return clock_ns();
+#endif
+}
+
+Profile *profile_enter(Profile *prof, size_t day) {
+  Profile *prev = active_profile;
+  prof->day = day;
+  active_profile = prof;
+  return prev;
+}
+
+void profile_leave(Profile *prev) {
+  active_profile = prev;
+}
+
+Profile *current_profile(void) {
+  return active_profile;
+}
+
+void profile_phase(Profile *prof, EpiPhase phase, uint64 start) {
+  if (prof == NULL) {
+    return;
+  }
+
+  uint64 ticks = profile_ticks() - start;
+  prof->stats.phase_ticks[phase] += ticks;
+  prof->stats.phase_calls[phase]++;
+
+  if (prof->n_events < prof->max_events) {
+    ProfileEvent *ev = &prof->events[prof->n_events++];
+    ev->phase = (uint32)phase;
+    ev->day = (uint32)prof->day;
+    ev->start = start;
+    ev->ticks = ticks;
+  }
+}
+
+void get_profile(EpiProfile *out, const Profile *prof) {
+#ifdef EPI_PROFILE
+  *out = prof->stats;
+  out->enabled = true;
+  out->ticks_per_second = ticks_per_second(prof);
+#else
+  (void)prof;
+  memset(out, 0, sizeof(EpiProfile));
+#endif
+}
+
+EpiError start_profile_trace(Profile *prof, size_t max_events) {
+#ifndef EPI_PROFILE
+  if (max_events > 0) {
+    set_last_error(EPI_ERROR_INVALID_ARGS, "", 0, 0,
+      "library built without EPI_PROFILE");
+    return EPI_ERROR_INVALID_ARGS;
+  }
+#endif
+
+  free_profile_trace(prof);
+  if (max_events == 0) {
+    return EPI_ERROR_SUCCESS;
+  }
+
+  prof->events = (ProfileEvent *)malloc(max_events * sizeof(ProfileEvent));
+  if (prof->events == NULL) {
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+  prof->max_events = max_events;
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError write_profile_trace(const char *fname, const Profile *prof) {
+  FILE *file = fopen(fname, "w");
+  if (file == NULL) {
+    set_last_error(EPI_ERROR_FILE_NOT_FOUND, fname, 0, 0,
+      "cannot create file");
+    return EPI_ERROR_FILE_NOT_FOUND;
+  }
+
+  // Complete events, with times in microseconds since profiling started
+  double us_per_tick = 1e6 / ticks_per_second(prof);
+  fprintf(file, "{\"traceEvents\":[\n");
+  for (size_t i = 0; i < prof->n_events; i++) {
+    const ProfileEvent *ev = &prof->events[i];
+    fprintf(file, "{\"name\":\"%s\",\"cat\":\"epi\",\"ph\":\"X\","
+      "\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f,"
+      "\"args\":{\"day\":%lu}},\n", phase_names[ev->phase],
+      (double)(ev->start - prof->ticks0) * us_per_tick,
+      (double)ev->ticks * us_per_tick, (unsigned long)ev->day);
+  }
+  fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+    "\"args\":{\"name\":\"epi_model\"}}\n");
+
+  // Totals, shown as metadata by trace viewers
+  const EpiProfile *s = &prof->stats;
+  fprintf(file, "],\n\"otherData\":{\"n_steps\":%llu,"
+    "\"n_poisson_draws\":%llu,\"n_gaussian_draws\":%llu,"
+    "\"n_monte_carlo_draws\":%llu,\"n_poisson_retries\":%llu,"
+    "\"n_gaussian_retries\":%llu}}\n",
+    (unsigned long long)s->n_steps, (unsigned long long)s->n_poisson_draws,
+    (unsigned long long)s->n_gaussian_draws,
+    (unsigned long long)s->n_monte_carlo_draws,
+    (unsigned long long)s->n_poisson_retries,
+    (unsigned long long)s->n_gaussian_retries);
+
+  bool failed = ferror(file) != 0;
+  if (fclose(file) != 0 || failed) {
+    set_last_error(EPI_ERROR_FILE_NOT_FOUND, fname, 0, 0,
+      "cannot write file");
+    return EPI_ERROR_FILE_NOT_FOUND;
+  }
+  return EPI_ERROR_SUCCESS;
+}
+
+static uint64 clock_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64)ts.tv_sec * 1000000000u + (uint64)ts.tv_nsec;
+}
+
+static double ticks_per_second(const Profile *prof) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  uint64 ns = clock_ns() - prof->ns0;
+  uint64 ticks = profile_ticks() - prof->ticks0;
+  return ns > 0 ? 1e9 * (double)ticks / (double)ns : 1e9;
+#else
+  (void)prof;
+  return 1e9;
+#endif
+}
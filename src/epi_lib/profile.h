@@ -0,0 +1,81 @@
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+// Counters and timers for the hot paths of a model step.  They are only
+// compiled in if EPI_PROFILE is defined; otherwise the PROFILE_ macros
+// below expand to nothing, and cost nothing.
+//
+// A model makes its profile the current one of the calling thread while it
+// steps, so that code deep inside the step, such as the binomial samplers,
+// counts towards the right model without being handed its profile.
+
+#include "common.h"
+#include "files.h"
+
+// Timed phase, kept for traces
+typedef struct {
+  uint32 phase;
+  uint32 day;
+  uint64 start;
+  uint64 ticks;
+} ProfileEvent;
+
+typedef struct {
+  EpiProfile stats;
+  // Day being stepped, for trace events
+  size_t day;
+  // Timer reading and monotonic clock in ns when profiling started, to
+  // measure the rate of the timer
+  uint64 ticks0;
+  uint64 ns0;
+  // Trace of the first max_events timed phases, NULL if not tracing
+  ProfileEvent *events;
+  size_t n_events;
+  size_t max_events;
+} Profile;
+
+// Start a profile from scratch, without a trace
+void init_profile(Profile *prof);
+
+// Drop the trace of a profile
+void free_profile_trace(Profile *prof);
+
+// Current reading of the timer: CPU cycles on x86, ns elsewhere
+uint64 profile_ticks(void);
+
+// Make prof the current profile of the calling thread, for a step on the
+// given day.  Returns the profile it replaces, for profile_leave().
+Profile *profile_enter(Profile *prof, size_t day);
+
+// Restore the profile replaced by profile_enter()
+void profile_leave(Profile *prev);
+
+// Current profile of the calling thread, NULL if none
+Profile *current_profile(void);
+
+// Add the time since start to a phase of prof, which may be NULL
+void profile_phase(Profile *prof, EpiPhase phase, uint64 start);
+
+// Public view of a profile
+void get_profile(EpiProfile *out, const Profile *prof);
+
+// Keep the first max_events timed phases from now on, replacing any
+// earlier trace.  0 stops tracing.
+EpiError start_profile_trace(Profile *prof, size_t max_events);
+
+// Write the trace of a profile as Chrome trace-event JSON
+EpiError write_profile_trace(const char *fname, const Profile *prof);
+
+#ifdef EPI_PROFILE
+#define PROFILE_BEGIN() (current_profile() != NULL ? profile_ticks() : 0)
+#define PROFILE_END(phase, start) \
+  profile_phase(current_profile(), phase, start)
+#define PROFILE_COUNT(field, n) \
+  {Profile *__prof__ = current_profile(); \
+  if (__prof__ != NULL) __prof__->stats.field += (n);}
+#else
+#define PROFILE_BEGIN() ((uint64)0)
+#define PROFILE_END(phase, start) ((void)(start))
+#define PROFILE_COUNT(field, n) ((void)0)
+#endif
+
+#endif
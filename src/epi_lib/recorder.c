@@ -0,0 +1,324 @@
+#include "files.h"
+#include "recorder.h"
+
+// Columns of a trajectory file, in order.  The day bin columns are only
+// present in verbose files.
+typedef enum {
+  TRAJ_DAY,
+  TRAJ_FINISHED,
+  TRAJ_VACCINE_AVAILABLE,
+  TRAJ_HOSP_CAPACITY,
+  TRAJ_SUSCEPTIBLE,
+  TRAJ_INFECTED,
+  TRAJ_CRITICAL,
+  TRAJ_RECOVERED,
+  TRAJ_VACCINATED,
+  TRAJ_DEAD,
+  TRAJ_COST,
+  N_TRAJ_SCALAR_COLUMNS,
+  TRAJ_BINS_TOTAL_ACTIVE = N_TRAJ_SCALAR_COLUMNS,
+  TRAJ_BINS_ASYMPTOMATIC,
+  TRAJ_BINS_SYMPTOMATIC,
+  TRAJ_BINS_CRITICAL,
+  N_TRAJ_COLUMNS
+} TrajColumnId;
+
+static const char *traj_column_names[N_TRAJ_COLUMNS] = {"day", "finished",
+  "vaccine_available", "hosp_capacity", "n_susceptible", "n_infected",
+  "n_critical", "n_recovered", "n_vaccinated", "n_dead", "cost_function",
+  "bins_total_active", "bins_asymptomatic", "bins_symptomatic",
+  "bins_critical"};
+
+struct _EpiRecorder {
+  FILE *file;
+  char *fname;
+  bool verbose;
+  // Columns are set up from the first row, and the file header written
+  bool started;
+  size_t n_bins;
+  size_t n_columns;
+  TrajColumn columns[N_TRAJ_COLUMNS];
+
+  // Rows held in memory until the next segment is written.  Column c
+  // takes buffer_rows * width * size bytes at column_offset[c].
+  size_t buffer_rows;
+  size_t n_rows;
+  uint8 *buffer;
+  size_t column_offset[N_TRAJ_COLUMNS];
+};
+
+// Set up columns for n_bins day bins, allocate the buffer and write the
+// file header
+static EpiError start_recording(EpiRecorder rec, size_t n_bins);
+
+// Describe the columns of a recorder
+static void describe_columns(EpiRecorder rec);
+
+// Write buffered rows to the file as a segment
+static EpiError write_segment(EpiRecorder rec);
+
+// Write size bytes to the file of a recorder, and record any failure
+static EpiError recorder_write(EpiRecorder rec, const void *data,
+  size_t size);
+
+// Record a failed write, and return its error
+static EpiError write_error(EpiRecorder rec);
+
+// Element of a column in the buffer
+static void *column_cell(EpiRecorder rec, TrajColumnId c, size_t row);
+
+// Bytes of a column padded to a multiple of 8
+static size_t padded_size(size_t size);
+
+EpiError epi_recorder_create(EpiRecorder *out, const char *fname,
+  bool verbose, size_t buffer_rows) {
+
+  clear_last_error();
+
+  if (out == NULL || *out != NULL || fname == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  EpiRecorder rec = (EpiRecorder)calloc(1, sizeof(struct _EpiRecorder));
+  if (rec == NULL) {
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+  rec->verbose = verbose;
+  rec->buffer_rows = buffer_rows > 0 ? buffer_rows : TRAJ_BUFFER_ROWS;
+
+  size_t len = strlen(fname);
+  rec->fname = (char *)malloc(len + 1);
+  if (rec->fname == NULL) {
+    free(rec);
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+  memcpy(rec->fname, fname, len + 1);
+
+  rec->file = fopen(fname, "wb");
+  if (rec->file == NULL) {
+    set_last_error(EPI_ERROR_FILE_NOT_FOUND, fname, 0, 0,
+      "cannot create file");
+    epi_recorder_free(&rec);
+    return EPI_ERROR_FILE_NOT_FOUND;
+  }
+
+  *out = rec;
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError epi_recorder_free(EpiRecorder *rec) {
+  if (rec == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  if (*rec == NULL) {
+    return EPI_ERROR_SUCCESS;
+  }
+
+  EpiError err = EPI_ERROR_SUCCESS;
+  if ((*rec)->file != NULL) {
+    // A file without rows still gets a header
+    err = (*rec)->started ? EPI_ERROR_SUCCESS : start_recording(*rec, 0);
+    if (err == EPI_ERROR_SUCCESS) {
+      err = write_segment(*rec);
+    }
+    if (fclose((*rec)->file) != 0 && err == EPI_ERROR_SUCCESS) {
+      err = write_error(*rec);
+    }
+  }
+  free((*rec)->buffer);
+  free((*rec)->fname);
+  free(*rec);
+  *rec = NULL;
+
+  return err;
+}
+
+EpiError epi_recorder_flush(EpiRecorder rec) {
+  clear_last_error();
+
+  if (rec == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+  return rec->started ? write_segment(rec) : EPI_ERROR_SUCCESS;
+}
+
+EpiError epi_recorder_append(EpiRecorder rec, const EpiObservable *obs) {
+  clear_last_error();
+
+  if (rec == NULL || obs == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+  return record_step(rec, obs, NULL);
+}
+
+EpiError record_step(EpiRecorder rec, const EpiObservable *obs,
+  const Population *pop) {
+
+  if (rec->verbose && (pop == NULL || pop->max_duration == 0 ||
+    pop->max_duration > MAX_POP_DURATION ||
+    (rec->started && pop->max_duration != rec->n_bins))) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+  if (!rec->started) {
+    PASS_ERROR(start_recording(rec, rec->verbose ? pop->max_duration : 0));
+  }
+
+  // Buffer still full if writing it failed before
+  if (rec->n_rows == rec->buffer_rows) {
+    PASS_ERROR(write_segment(rec));
+  }
+
+  size_t row = rec->n_rows;
+  *(uint64 *)column_cell(rec, TRAJ_DAY, row) = obs->day;
+  *(uint8 *)column_cell(rec, TRAJ_FINISHED, row) = obs->finished;
+  *(uint8 *)column_cell(rec, TRAJ_VACCINE_AVAILABLE, row) =
+    obs->vaccine_available;
+  *(uint64 *)column_cell(rec, TRAJ_HOSP_CAPACITY, row) = obs->hosp_capacity;
+  *(uint64 *)column_cell(rec, TRAJ_SUSCEPTIBLE, row) = obs->n_susceptible;
+  *(uint64 *)column_cell(rec, TRAJ_INFECTED, row) = obs->n_infected;
+  *(uint64 *)column_cell(rec, TRAJ_CRITICAL, row) = obs->n_critical;
+  *(uint64 *)column_cell(rec, TRAJ_RECOVERED, row) = obs->n_recovered;
+  *(uint64 *)column_cell(rec, TRAJ_VACCINATED, row) = obs->n_vaccinated;
+  *(uint64 *)column_cell(rec, TRAJ_DEAD, row) = obs->n_dead;
+  *(float *)column_cell(rec, TRAJ_COST, row) = obs->cost_function;
+
+  if (rec->n_bins > 0) {
+    uint64 *bins[4] = {
+      (uint64 *)column_cell(rec, TRAJ_BINS_TOTAL_ACTIVE, row),
+      (uint64 *)column_cell(rec, TRAJ_BINS_ASYMPTOMATIC, row),
+      (uint64 *)column_cell(rec, TRAJ_BINS_SYMPTOMATIC, row),
+      (uint64 *)column_cell(rec, TRAJ_BINS_CRITICAL, row)};
+    for (size_t d = 0; d < rec->n_bins; d++) {
+      size_t i = pop_bin_index(pop, d);
+      bins[0][d] = pop->n_total_active[i];
+      bins[1][d] = pop->n_asymptomatic[i];
+      bins[2][d] = pop->n_symptomatic[i];
+      bins[3][d] = pop->n_critical[i];
+    }
+  }
+
+  rec->n_rows++;
+  if (rec->n_rows == rec->buffer_rows) {
+    PASS_ERROR(write_segment(rec));
+  }
+  return EPI_ERROR_SUCCESS;
+}
+
+bool recorder_accepts(const EpiRecorder rec, const Population *pop) {
+  if (!rec->verbose) {
+    return true;
+  }
+  return pop != NULL && (!rec->started || pop->max_duration == rec->n_bins);
+}
+
+static EpiError start_recording(EpiRecorder rec, size_t n_bins) {
+  rec->n_bins = n_bins;
+  rec->n_columns = n_bins > 0 ? N_TRAJ_COLUMNS : N_TRAJ_SCALAR_COLUMNS;
+  describe_columns(rec);
+
+  size_t buffer_size = 0;
+  for (size_t c = 0; c < rec->n_columns; c++) {
+    rec->column_offset[c] = buffer_size;
+    buffer_size += padded_size(rec->buffer_rows * rec->columns[c].width *
+      rec->columns[c].size);
+  }
+  rec->buffer = (uint8 *)malloc(buffer_size);
+  if (rec->buffer == NULL) {
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+  rec->started = true;
+
+  TrajFileHeader header;
+  memset(&header, 0, sizeof(TrajFileHeader));
+  header.magic = TRAJ_FILE_MAGIC;
+  header.version = TRAJ_FILE_VERSION;
+  header.n_columns = (uint32)rec->n_columns;
+  header.n_bins = (uint32)n_bins;
+  PASS_ERROR(recorder_write(rec, &header, sizeof(TrajFileHeader)));
+  PASS_ERROR(recorder_write(rec, rec->columns,
+    rec->n_columns * sizeof(TrajColumn)));
+  if (fflush(rec->file) != 0) {
+    return write_error(rec);
+  }
+  return EPI_ERROR_SUCCESS;
+}
+
+static void describe_columns(EpiRecorder rec) {
+  memset(rec->columns, 0, sizeof(rec->columns));
+  for (size_t c = 0; c < rec->n_columns; c++) {
+    TrajColumn *col = &rec->columns[c];
+    strncpy(col->name, traj_column_names[c], TRAJ_COLUMN_NAME_SIZE - 1);
+    col->kind = 'u';
+    col->size = sizeof(uint64);
+    col->width = 1;
+  }
+
+  rec->columns[TRAJ_FINISHED].kind = 'b';
+  rec->columns[TRAJ_FINISHED].size = 1;
+  rec->columns[TRAJ_VACCINE_AVAILABLE].kind = 'b';
+  rec->columns[TRAJ_VACCINE_AVAILABLE].size = 1;
+  rec->columns[TRAJ_COST].kind = 'f';
+  rec->columns[TRAJ_COST].size = sizeof(float);
+  for (size_t c = N_TRAJ_SCALAR_COLUMNS; c < rec->n_columns; c++) {
+    rec->columns[c].width = (uint32)rec->n_bins;
+  }
+}
+
+static EpiError write_segment(EpiRecorder rec) {
+  if (rec->n_rows == 0) {
+    return EPI_ERROR_SUCCESS;
+  }
+
+  TrajSegmentHeader header;
+  memset(&header, 0, sizeof(TrajSegmentHeader));
+  header.magic = TRAJ_SEGMENT_MAGIC;
+  header.n_rows = rec->n_rows;
+  PASS_ERROR(recorder_write(rec, &header, sizeof(TrajSegmentHeader)));
+
+  static const uint8 zeros[8] = {0};
+  for (size_t c = 0; c < rec->n_columns; c++) {
+    size_t size = rec->n_rows * rec->columns[c].width * rec->columns[c].size;
+    PASS_ERROR(recorder_write(rec, &rec->buffer[rec->column_offset[c]],
+      size));
+    PASS_ERROR(recorder_write(rec, zeros, padded_size(size) - size));
+  }
+  rec->n_rows = 0;
+
+  // Hand the segment to the OS before returning.  This does not publish it
+  // atomically: stdio may already have written part of it, so readers
+  // running at the same time can see a partial last segment, which they
+  // skip as truncated.
+  if (fflush(rec->file) != 0) {
+    return write_error(rec);
+  }
+  return EPI_ERROR_SUCCESS;
+}
+
+static EpiError recorder_write(EpiRecorder rec, const void *data,
+  size_t size) {
+
+  if (size == 0) {
+    return EPI_ERROR_SUCCESS;
+  }
+  if (fwrite(data, 1, size, rec->file) != size) {
+    return write_error(rec);
+  }
+  return EPI_ERROR_SUCCESS;
+}
+
+static EpiError write_error(EpiRecorder rec) {
+  set_last_error(EPI_ERROR_FILE_NOT_FOUND, rec->fname, 0, 0,
+    "cannot write file");
+  return EPI_ERROR_FILE_NOT_FOUND;
+}
+
+static void *column_cell(EpiRecorder rec, TrajColumnId c, size_t row) {
+  const TrajColumn *col = &rec->columns[c];
+  return &rec->buffer[rec->column_offset[c] +
+    row * col->width * col->size];
+}
+
+static size_t padded_size(size_t size) {
+  return (size + 7) & ~(size_t)7;
+}
@@ -0,0 +1,72 @@
+// Trajectory files
+#ifndef __RECORDER_H__
+#define __RECORDER_H__
+// A trajectory file holds observables of many steps, stored by column, so
+// that readers can map the file and use each column in place.  Recorders
+// keep rows in memory, and append them to the file in segments of up to
+// buffer_rows rows, one write per column.  A file is never rewritten, so a
+// reader may map it while it is still being recorded, and a recorder that
+// stops early leaves every segment before the last one intact.
+//
+// Layout: a TrajFileHeader, then n_columns TrajColumn descriptors, then
+// segments.  A segment is a TrajSegmentHeader followed by the data of every
+// column in descriptor order: n_rows rows of width elements each, padded
+// to a multiple of 8 bytes.  Values are stored in the byte order of the
+// machine.
+//
+// Columns are the fields of EpiObservable, in struct order.  Verbose files
+// add the day bins of the population after each step, ordered by day of
+// disease, in columns of width n_bins: bins_total_active,
+// bins_asymptomatic, bins_symptomatic and bins_critical.
+
+#include "common.h"
+#include "population.h"
+
+// "EPIT" and "EPIS" read as little-endian numbers
+#define TRAJ_FILE_MAGIC 0x54495045u
+#define TRAJ_SEGMENT_MAGIC 0x53495045u
+// Changes whenever the layout changes
+#define TRAJ_FILE_VERSION 1u
+
+#define TRAJ_COLUMN_NAME_SIZE 24
+
+// Rows buffered by default before a segment is written
+#define TRAJ_BUFFER_ROWS 4096
+
+typedef struct {
+  uint32 magic;
+  uint32 version;
+  uint32 n_columns;
+  // Day bins per row, 0 unless verbose
+  uint32 n_bins;
+} TrajFileHeader;
+
+typedef struct {
+  // Null-terminated
+  char name[TRAJ_COLUMN_NAME_SIZE];
+  // 'u' for unsigned integers, 'f' for floating point, 'b' for booleans
+  char kind;
+  // Bytes per element
+  uint8 size;
+  uint8 reserved[2];
+  // Elements per row
+  uint32 width;
+} TrajColumn;
+
+typedef struct {
+  uint32 magic;
+  uint32 reserved;
+  uint64 n_rows;
+} TrajSegmentHeader;
+
+// Append one row: observables, and for verbose recorders the day bins of
+// pop, which may only be NULL if the recorder is not verbose.  The first
+// row sets the number of day bins of a verbose file.
+EpiError record_step(EpiRecorder rec, const EpiObservable *obs,
+  const Population *pop);
+
+// Can the recorder take rows with the day bins of pop, which is NULL for
+// models without day bins?
+bool recorder_accepts(const EpiRecorder rec, const Population *pop);
+
+#endif
@@ -0,0 +1,82 @@
+#include "rng.h"
+
+static uint64 rotl(uint64 x, int k) {
+  return (x << k) | (x >> (64 - k));
+}
+
+// splitmix64 output function, a bijective mix of all 64 bits
+static uint64 mix64(uint64 z) {
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+// splitmix64, used to spread a single seed over the full xoshiro state
+static uint64 splitmix64(uint64 *x) {
+  return mix64(*x += 0x9E3779B97F4A7C15ULL);
+}
+
+void rng_seed(EpiRng *rng, uint64 seed) {
+  uint64 x = seed;
+  for (size_t i = 0; i < 4; i++) {
+    rng->s[i] = splitmix64(&x);
+  }
+}
+
+uint64 rng_next(EpiRng *rng) {
+  uint64 *s = rng->s;
+  uint64 result = rotl(s[1] * 5, 7) * 9;
+  uint64 t = s[1] << 17;
+
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+
+  s[2] ^= t;
+  s[3] = rotl(s[3], 45);
+
+  return result;
+}
+
+void rng_jump(EpiRng *rng) {
+  static const uint64 JUMP[] = {
+    0x180EC6D33CFD0ABAULL, 0xD5A61266F0C9392CULL,
+    0xA9582618E03FC9AAULL, 0x39ABDC4529B1661CULL
+  };
+
+  uint64 s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+  for (size_t i = 0; i < 4; i++) {
+    for (int b = 0; b < 64; b++) {
+      if (JUMP[i] & ((uint64)1 << b)) {
+        s0 ^= rng->s[0];
+        s1 ^= rng->s[1];
+        s2 ^= rng->s[2];
+        s3 ^= rng->s[3];
+      }
+      rng_next(rng);
+    }
+  }
+
+  rng->s[0] = s0;
+  rng->s[1] = s1;
+  rng->s[2] = s2;
+  rng->s[3] = s3;
+}
+
+double rng_uniform(EpiRng *rng) {
+  return (double)(rng_next(rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+double rng_uniform_pos(EpiRng *rng) {
+  return ((double)(rng_next(rng) >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+}
+
+uint64 rng_hash(uint64 key, uint64 counter) {
+  return mix64(key ^ mix64(counter + 0x9E3779B97F4A7C15ULL));
+}
+
+double rng_hash_uniform(uint64 key, uint64 counter) {
+  return (double)(rng_hash(key, counter) >> 11) *
+    (1.0 / 9007199254740992.0);
+}
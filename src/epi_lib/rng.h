@@ -0,0 +1,40 @@
+#ifndef __RNG_H__
+#define __RNG_H__
+// Per-model pseudorandom number generator.
+// Uses xoshiro256** (Blackman and Vigna, 2018), seeded through splitmix64.
+// Each model carries its own state, so independent models never contend for
+// a global lock or share a sequence, and a run is reproducible from its seed.
+
+#include "common.h"
+
+typedef struct {
+  uint64 s[4];
+} EpiRng;
+
+// Initialize generator state from a 64-bit seed.  Any seed, including 0,
+// gives a valid state.
+void rng_seed(EpiRng *rng, uint64 seed);
+
+// Next 64 random bits
+uint64 rng_next(EpiRng *rng);
+
+// Advance the generator by 2^128 draws.  Calling this repeatedly on a copy
+// of a seeded generator yields non-overlapping streams, e.g. one per thread
+// or per replicate.
+void rng_jump(EpiRng *rng);
+
+// Uniformly distributed number in [0, 1), with 53 bits of precision
+double rng_uniform(EpiRng *rng);
+
+// Uniformly distributed number in (0, 1), safe to pass to log()
+double rng_uniform_pos(EpiRng *rng);
+
+// Counter-based random bits: a fixed function of key and counter, with no
+// state.  Draws can be made in any order and on any thread, and still give
+// identical results.
+uint64 rng_hash(uint64 key, uint64 counter);
+
+// Uniformly distributed number in [0, 1), from rng_hash()
+double rng_hash_uniform(uint64 key, uint64 counter);
+
+#endif
@@ -0,0 +1,66 @@
+#include "approx_binomial.h"
+#include "exact_binomial.h"
+#include "sampler.h"
+
+EpiError sampler_init(Sampler *smp, EpiSampler method, uint64 seed) {
+  if (smp == NULL || (int)method < 0 || method >= N_EPI_SAMPLER) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  smp->method = method;
+  rng_seed(&smp->rng, seed);
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError sample_bin(Sampler *smp, uint64 *k, float p, uint64 n) {
+  if (smp == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  switch (smp->method) {
+    case EPI_SAMPLER_APPROX:
+      return approx_bin_draw(k, p, n, &smp->rng);
+    case EPI_SAMPLER_EXACT:
+      return exact_bin_draw(k, p, n, &smp->rng);
+    default:
+      return EPI_ERROR_UNEXPECTED_STATE;
+  }
+}
+
+EpiError sample_dbin(Sampler *smp, uint64 *nx, uint64 *ny,
+  float p_x, float p_y, uint64 n) {
+  if (smp == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  switch (smp->method) {
+    case EPI_SAMPLER_APPROX:
+      return approx_dbin_draw(nx, ny, p_x, p_y, n, &smp->rng);
+    case EPI_SAMPLER_EXACT:
+      return exact_dbin_draw(nx, ny, p_x, p_y, n, &smp->rng);
+    default:
+      return EPI_ERROR_UNEXPECTED_STATE;
+  }
+}
+
+EpiError sample_dbin_batch(Sampler *smp, uint64 *nx, uint64 *ny,
+  const float *p_x, const float *p_y, const uint64 *n, size_t count) {
+  if (smp == NULL || nx == NULL || ny == NULL ||
+    p_x == NULL || p_y == NULL || n == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  switch (smp->method) {
+    case EPI_SAMPLER_APPROX:
+      return approx_dbin_draw_batch(nx, ny, p_x, p_y, n, count, &smp->rng);
+    case EPI_SAMPLER_EXACT:
+      // BTRS is a rejection method with no batched form, draw one at a time
+      for (size_t i = 0; i < count; i++) {
+        PASS_ERROR(exact_dbin_draw(&nx[i], &ny[i], p_x[i], p_y[i], n[i],
+          &smp->rng));
+      }
+      return EPI_ERROR_SUCCESS;
+    default:
+      return EPI_ERROR_UNEXPECTED_STATE;
+  }
+}
@@ -0,0 +1,29 @@
+#ifndef __SAMPLER_H__
+#define __SAMPLER_H__
+// Random draws used by the disease model, dispatched to the binomial
+// sampling method selected for the model.
+
+#include "common.h"
+#include "rng.h"
+
+typedef struct {
+  EpiRng rng;
+  EpiSampler method;
+} Sampler;
+
+// Set sampling method and seed random number generator
+EpiError sampler_init(Sampler *smp, EpiSampler method, uint64 seed);
+
+// Draw from a binomial distribution, see approx_bin_draw()
+EpiError sample_bin(Sampler *smp, uint64 *k, float p, uint64 n);
+
+// Double draw from a binomial distribution, see approx_dbin_draw()
+EpiError sample_dbin(Sampler *smp, uint64 *nx, uint64 *ny,
+  float p_x, float p_y, uint64 n);
+
+// Batched double draws from a binomial distribution.  For each i < count,
+// equivalent to sample_dbin(smp, &nx[i], &ny[i], p_x[i], p_y[i], n[i]).
+EpiError sample_dbin_batch(Sampler *smp, uint64 *nx, uint64 *ny,
+  const float *p_x, const float *p_y, const uint64 *n, size_t count);
+
+#endif
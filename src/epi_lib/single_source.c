@@ -1,8 +1,23 @@
 // Single source version of code, to get around some platform-dependent
 // cython issues
 
+#include "abm.c"
+#include "age_pop.c"
 #include "approx_binomial.c"
+#include "batch.c"
+#include "bin_file.c"
 #include "disease.c"
+#include "ensemble.c"
 #include "epi_api.c"
+#include "exact_binomial.c"
 #include "files.c"
+#include "mean_field.c"
+#include "metapop.c"
+#include "param_cache.c"
 #include "population.c"
+#include "profile.c"
+#include "recorder.c"
+#include "rng.c"
+#include "sampler.c"
+#include "stats.c"
+#include "thread_pool.c"
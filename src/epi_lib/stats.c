@@ -0,0 +1,538 @@
+#include "files.h"
+#include "stats.h"
+
+// Streaming statistics of observables, by day and field.
+//
+// Mean and variance are kept with Welford's method, and merged with the
+// pairwise update of Chan et al.  Quantiles come from a merging t-digest
+// (Dunning and Ertl, 2019) with the k1 scale function: values are added to
+// a small buffer, and when it fills, the buffer is sorted and merged into a
+// sorted list of weighted centroids, whose size is bounded by the
+// compression.  Centroids near the tails are kept small, so that extreme
+// quantiles stay accurate.
+
+// Serialized statistics start with a StatsHeader, then hold for each day
+// its n and n_running, and for each day and field its StatsCell and
+// centroids.
+#define EPI_STATS_MAGIC 0x7374617473697065ull
+#define EPI_STATS_VERSION 1
+
+// Largest compression accepted, to bound memory use
+#define MAX_STATS_COMPRESSION 10000.0
+
+typedef struct {
+  uint64 magic;
+  uint64 version;
+  uint64 n_days;
+  double compression;
+} StatsHeader;
+
+// Storage of a cell's centroids, followed by its buffer
+static Centroid *cell_centroids(EpiStats stats, size_t cell);
+
+// Merge buffered values of a cell into its centroids
+static void flush_cell(EpiStats stats, size_t cell);
+
+// Merge buffered values and centroids of all cells
+static void flush_stats(EpiStats stats);
+
+// Sorted centroids and buffered values of a cell, written to out, using
+// tmp for sorting.  Returns their number.
+static size_t sorted_cell(Centroid *out, Centroid *tmp,
+  const StatsCell *cell, const Centroid *centroids, size_t buffer_offset);
+
+// Merge two lists sorted by mean into out.  Returns the total number.
+static size_t merge_sorted(Centroid *out, const Centroid *a, size_t n_a,
+  const Centroid *b, size_t n_b);
+
+// Combine sorted centroids of total weight w into at most max_centroids
+// centroids, written to out.  Returns their number.
+static size_t compress_centroids(Centroid *out, const Centroid *in,
+  size_t n_in, double w, double compression);
+
+// Largest quantile that a centroid starting at quantile q may reach
+static double k1_limit(double q, double compression);
+
+// Value of a field in an observable
+static double stats_field(const EpiObservable *obs, size_t field);
+
+// Order of centroids, for qsort()
+static int compare_centroids(const void *a, const void *b);
+
+EpiError epi_stats_create(EpiStats *out, size_t n_days, double compression) {
+  clear_last_error();
+
+  if (out == NULL || *out != NULL || n_days == 0) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  if (compression == 0.0) {
+    compression = EPI_STATS_COMPRESSION;
+  }
+  if (!(compression >= 1.0 && compression <= MAX_STATS_COMPRESSION)) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  EpiStats stats = calloc(1, sizeof(struct _EpiStats));
+  if (stats == NULL) {
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+
+  // With the k1 scale, every pair of neighboring centroids spans more than
+  // one unit of the scale, which has a range of compression / 2
+  stats->n_days = n_days;
+  stats->compression = compression;
+  stats->max_centroids = (size_t)ceil(compression) + 2;
+  stats->buffer_size = (size_t)ceil(compression);
+
+  size_t n_cells = n_days * N_EPI_FIELDS;
+  size_t cell_size = stats->max_centroids + stats->buffer_size;
+  stats->n = (uint64 *)calloc(n_days, sizeof(uint64));
+  stats->n_running = (uint64 *)calloc(n_days, sizeof(uint64));
+  stats->cells = (StatsCell *)calloc(n_cells, sizeof(StatsCell));
+  stats->centroids = (Centroid *)malloc(n_cells * cell_size *
+    sizeof(Centroid));
+  stats->scratch = (Centroid *)malloc(5 * cell_size * sizeof(Centroid));
+  if (stats->n == NULL || stats->n_running == NULL || stats->cells == NULL ||
+    stats->centroids == NULL || stats->scratch == NULL) {
+    epi_stats_free(&stats);
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+
+  *out = stats;
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError epi_stats_free(EpiStats *stats) {
+  if (stats == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  if (*stats == NULL) {
+    return EPI_ERROR_SUCCESS;
+  }
+
+  free((*stats)->n);
+  free((*stats)->n_running);
+  free((*stats)->cells);
+  free((*stats)->centroids);
+  free((*stats)->scratch);
+  free(*stats);
+  *stats = NULL;
+
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError epi_stats_days(size_t *out, const EpiStats stats) {
+  clear_last_error();
+
+  if (out == NULL || stats == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  *out = stats->n_days;
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError epi_stats_add(EpiStats stats, size_t day, const EpiObservable *obs) {
+  clear_last_error();
+
+  if (stats == NULL || obs == NULL || day >= stats->n_days) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  uint64 n = ++stats->n[day];
+  if (!obs->finished) {
+    stats->n_running[day]++;
+  }
+
+  for (size_t f = 0; f < N_EPI_FIELDS; f++) {
+    size_t c = day * N_EPI_FIELDS + f;
+    StatsCell *cell = &stats->cells[c];
+    double x = stats_field(obs, f);
+
+    if (n == 1) {
+      cell->mean = x;
+      cell->m2 = 0.0;
+      cell->min = x;
+      cell->max = x;
+    } else {
+      double delta = x - cell->mean;
+      cell->mean += delta / (double)n;
+      cell->m2 += delta * (x - cell->mean);
+      cell->min = x < cell->min ? x : cell->min;
+      cell->max = x > cell->max ? x : cell->max;
+    }
+
+    if (cell->n_buffered == stats->buffer_size) {
+      flush_cell(stats, c);
+    }
+    Centroid *buffer = &cell_centroids(stats, c)[stats->max_centroids];
+    buffer[cell->n_buffered].mean = x;
+    buffer[cell->n_buffered].weight = 1.0;
+    cell->n_buffered++;
+  }
+
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError epi_stats_merge(EpiStats stats, EpiStats other) {
+  clear_last_error();
+
+  if (stats == NULL || other == NULL || stats == other ||
+    stats->n_days != other->n_days ||
+    stats->compression != other->compression) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  size_t cell_size = stats->max_centroids + stats->buffer_size;
+  Centroid *run_a = stats->scratch;
+  Centroid *run_b = &run_a[cell_size];
+  Centroid *merged = &run_b[cell_size];
+  Centroid *tmp = &merged[2 * cell_size];
+
+  for (size_t d = 0; d < stats->n_days; d++) {
+    uint64 n_a = stats->n[d];
+    uint64 n_b = other->n[d];
+    if (n_b == 0) {
+      continue;
+    }
+    stats->n[d] += n_b;
+    stats->n_running[d] += other->n_running[d];
+
+    for (size_t f = 0; f < N_EPI_FIELDS; f++) {
+      size_t c = d * N_EPI_FIELDS + f;
+      StatsCell *a = &stats->cells[c];
+      const StatsCell *b = &other->cells[c];
+
+      if (n_a == 0) {
+        a->mean = b->mean;
+        a->m2 = b->m2;
+        a->min = b->min;
+        a->max = b->max;
+      } else {
+        double wa = (double)n_a;
+        double wb = (double)n_b;
+        double w = wa + wb;
+        double delta = b->mean - a->mean;
+        a->mean += delta * wb / w;
+        a->m2 += b->m2 + delta * delta * wa * wb / w;
+        a->min = b->min < a->min ? b->min : a->min;
+        a->max = b->max > a->max ? b->max : a->max;
+      }
+
+      size_t len_a = sorted_cell(run_a, tmp, a, cell_centroids(stats, c),
+        stats->max_centroids);
+      size_t len_b = sorted_cell(run_b, tmp, b, cell_centroids(other, c),
+        other->max_centroids);
+      size_t len = merge_sorted(merged, run_a, len_a, run_b, len_b);
+      a->n_centroids = compress_centroids(cell_centroids(stats, c), merged,
+        len, (double)stats->n[d], stats->compression);
+      a->n_buffered = 0;
+    }
+  }
+
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError epi_stats_get(EpiStatsDay *out, const EpiStats stats, size_t day) {
+  clear_last_error();
+
+  if (out == NULL || stats == NULL || day >= stats->n_days) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  uint64 n = stats->n[day];
+  out->n = n;
+  out->n_running = stats->n_running[day];
+  for (size_t f = 0; f < N_EPI_FIELDS; f++) {
+    const StatsCell *cell = &stats->cells[day * N_EPI_FIELDS + f];
+    EpiFieldStats *field = &out->fields[f];
+    if (n == 0) {
+      memset(field, 0, sizeof(EpiFieldStats));
+      continue;
+    }
+    field->mean = cell->mean;
+    field->var = n > 1 ? cell->m2 / (double)(n - 1) : 0.0;
+    field->min = cell->min;
+    field->max = cell->max;
+  }
+
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError epi_stats_quantile(double *out, EpiStats stats, size_t day,
+  EpiField field, double q) {
+
+  clear_last_error();
+
+  if (out == NULL || stats == NULL || day >= stats->n_days ||
+    (int)field < 0 || field >= N_EPI_FIELDS || !(q >= 0.0 && q <= 1.0)) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  size_t c = day * N_EPI_FIELDS + field;
+  const StatsCell *cell = &stats->cells[c];
+  double n = (double)stats->n[day];
+  if (n == 0.0) {
+    *out = 0.0;
+    return EPI_ERROR_SUCCESS;
+  }
+
+  flush_cell(stats, c);
+  const Centroid *cen = cell_centroids(stats, c);
+  size_t m = cell->n_centroids;
+
+  // Each centroid stands for its mean at the middle of its weight.  Below
+  // the first and above the last, interpolate towards the extremes.
+  double index = q * n;
+  double left = 0.0;
+  double prev_center = 0.0;
+  double prev_mean = cell->min;
+  for (size_t i = 0; i < m; i++) {
+    double center = left + 0.5 * cen[i].weight;
+    if (index < center) {
+      double span = center - prev_center;
+      double t = span > 0.0 ? (index - prev_center) / span : 1.0;
+      *out = prev_mean + t * (cen[i].mean - prev_mean);
+      return EPI_ERROR_SUCCESS;
+    }
+    left += cen[i].weight;
+    prev_center = center;
+    prev_mean = cen[i].mean;
+  }
+
+  double span = n - prev_center;
+  double t = span > 0.0 ? (index - prev_center) / span : 1.0;
+  *out = prev_mean + t * (cell->max - prev_mean);
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError epi_stats_serialized_size(size_t *out, EpiStats stats) {
+  clear_last_error();
+
+  if (out == NULL || stats == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  flush_stats(stats);
+  size_t size = sizeof(StatsHeader) + 2 * stats->n_days * sizeof(uint64);
+  for (size_t c = 0; c < stats->n_days * N_EPI_FIELDS; c++) {
+    size += sizeof(StatsCell) +
+      stats->cells[c].n_centroids * sizeof(Centroid);
+  }
+
+  *out = size;
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError epi_stats_serialize(void *buf, size_t size, EpiStats stats) {
+  clear_last_error();
+
+  size_t needed;
+  if (buf == NULL || stats == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+  PASS_ERROR(epi_stats_serialized_size(&needed, stats));
+  if (size < needed) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  uint8 *p = (uint8 *)buf;
+  StatsHeader header = {EPI_STATS_MAGIC, EPI_STATS_VERSION, stats->n_days,
+    stats->compression};
+  memcpy(p, &header, sizeof(StatsHeader));
+  p += sizeof(StatsHeader);
+  memcpy(p, stats->n, stats->n_days * sizeof(uint64));
+  p += stats->n_days * sizeof(uint64);
+  memcpy(p, stats->n_running, stats->n_days * sizeof(uint64));
+  p += stats->n_days * sizeof(uint64);
+
+  for (size_t c = 0; c < stats->n_days * N_EPI_FIELDS; c++) {
+    const StatsCell *cell = &stats->cells[c];
+    memcpy(p, cell, sizeof(StatsCell));
+    p += sizeof(StatsCell);
+    memcpy(p, cell_centroids(stats, c), cell->n_centroids * sizeof(Centroid));
+    p += cell->n_centroids * sizeof(Centroid);
+  }
+
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError epi_stats_deserialize(EpiStats *out, const void *buf, size_t size) {
+  clear_last_error();
+
+  if (out == NULL || *out != NULL || buf == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  const uint8 *p = (const uint8 *)buf;
+  const uint8 *end = p + size;
+  StatsHeader header;
+  if (size < sizeof(StatsHeader)) {
+    return EPI_ERROR_INVALID_DATA;
+  }
+  memcpy(&header, p, sizeof(StatsHeader));
+  p += sizeof(StatsHeader);
+  if (header.magic != EPI_STATS_MAGIC || header.version != EPI_STATS_VERSION ||
+    header.n_days == 0 ||
+    header.n_days > (size_t)(end - p) / (2 * sizeof(uint64)) ||
+    !(header.compression >= 1.0 &&
+    header.compression <= MAX_STATS_COMPRESSION)) {
+    return EPI_ERROR_INVALID_DATA;
+  }
+
+  EpiStats stats = NULL;
+  PASS_ERROR(epi_stats_create(&stats, (size_t)header.n_days,
+    header.compression));
+
+  memcpy(stats->n, p, stats->n_days * sizeof(uint64));
+  p += stats->n_days * sizeof(uint64);
+  memcpy(stats->n_running, p, stats->n_days * sizeof(uint64));
+  p += stats->n_days * sizeof(uint64);
+
+  for (size_t c = 0; c < stats->n_days * N_EPI_FIELDS; c++) {
+    StatsCell *cell = &stats->cells[c];
+    if ((size_t)(end - p) < sizeof(StatsCell)) {
+      epi_stats_free(&stats);
+      return EPI_ERROR_INVALID_DATA;
+    }
+    memcpy(cell, p, sizeof(StatsCell));
+    p += sizeof(StatsCell);
+    if (cell->n_buffered != 0 || cell->n_centroids > stats->max_centroids ||
+      cell->n_centroids * sizeof(Centroid) > (size_t)(end - p)) {
+      epi_stats_free(&stats);
+      return EPI_ERROR_INVALID_DATA;
+    }
+    memcpy(cell_centroids(stats, c), p, cell->n_centroids * sizeof(Centroid));
+    p += cell->n_centroids * sizeof(Centroid);
+  }
+
+  *out = stats;
+  return EPI_ERROR_SUCCESS;
+}
+
+static Centroid *cell_centroids(EpiStats stats, size_t cell) {
+  return &stats->centroids[cell *
+    (stats->max_centroids + stats->buffer_size)];
+}
+
+static void flush_cell(EpiStats stats, size_t c) {
+  StatsCell *cell = &stats->cells[c];
+  if (cell->n_buffered == 0) {
+    return;
+  }
+
+  size_t cell_size = stats->max_centroids + stats->buffer_size;
+  Centroid *run = stats->scratch;
+  Centroid *tmp = &run[cell_size];
+  Centroid *cen = cell_centroids(stats, c);
+  size_t len = sorted_cell(run, tmp, cell, cen, stats->max_centroids);
+
+  double w = 0.0;
+  for (size_t i = 0; i < len; i++) {
+    w += run[i].weight;
+  }
+  cell->n_centroids = compress_centroids(cen, run, len, w,
+    stats->compression);
+  cell->n_buffered = 0;
+}
+
+static void flush_stats(EpiStats stats) {
+  for (size_t c = 0; c < stats->n_days * N_EPI_FIELDS; c++) {
+    flush_cell(stats, c);
+  }
+}
+
+static size_t sorted_cell(Centroid *out, Centroid *tmp,
+  const StatsCell *cell, const Centroid *centroids, size_t buffer_offset) {
+
+  size_t n_buffered = (size_t)cell->n_buffered;
+  memcpy(tmp, &centroids[buffer_offset], n_buffered * sizeof(Centroid));
+  qsort(tmp, n_buffered, sizeof(Centroid), compare_centroids);
+  return merge_sorted(out, centroids, (size_t)cell->n_centroids, tmp,
+    n_buffered);
+}
+
+static size_t merge_sorted(Centroid *out, const Centroid *a, size_t n_a,
+  const Centroid *b, size_t n_b) {
+
+  size_t i = 0, j = 0, k = 0;
+  while (i < n_a && j < n_b) {
+    // Ties go to a, so that merges are stable
+    if (b[j].mean < a[i].mean) {
+      out[k++] = b[j++];
+    } else {
+      out[k++] = a[i++];
+    }
+  }
+  while (i < n_a) {
+    out[k++] = a[i++];
+  }
+  while (j < n_b) {
+    out[k++] = b[j++];
+  }
+  return k;
+}
+
+static size_t compress_centroids(Centroid *out, const Centroid *in,
+  size_t n_in, double w, double compression) {
+
+  if (n_in == 0) {
+    return 0;
+  }
+
+  size_t n_out = 0;
+  Centroid cur = in[0];
+  double w_before = 0.0;
+  double q_limit = k1_limit(0.0, compression);
+  for (size_t i = 1; i < n_in; i++) {
+    double q = (w_before + cur.weight + in[i].weight) / w;
+    if (q <= q_limit) {
+      cur.weight += in[i].weight;
+      cur.mean += (in[i].mean - cur.mean) * in[i].weight / cur.weight;
+    } else {
+      out[n_out++] = cur;
+      w_before += cur.weight;
+      q_limit = k1_limit(w_before / w, compression);
+      cur = in[i];
+    }
+  }
+  out[n_out++] = cur;
+
+  return n_out;
+}
+
+static double k1_limit(double q, double compression) {
+  // k1(q) = compression / (2 pi) * asin(2q - 1), advanced by one unit
+  double k = compression / (2.0 * M_PI) * asin(2.0 * q - 1.0) + 1.0;
+  if (k >= 0.25 * compression) {
+    return 1.0;
+  }
+  return 0.5 * (sin(2.0 * M_PI * k / compression) + 1.0);
+}
+
+static double stats_field(const EpiObservable *obs, size_t field) {
+  switch (field) {
+    case EPI_FIELD_SUSCEPTIBLE:
+      return (double)obs->n_susceptible;
+    case EPI_FIELD_INFECTED:
+      return (double)obs->n_infected;
+    case EPI_FIELD_CRITICAL:
+      return (double)obs->n_critical;
+    case EPI_FIELD_RECOVERED:
+      return (double)obs->n_recovered;
+    case EPI_FIELD_VACCINATED:
+      return (double)obs->n_vaccinated;
+    case EPI_FIELD_DEAD:
+      return (double)obs->n_dead;
+    default:
+      return (double)obs->cost_function;
+  }
+}
+
+static int compare_centroids(const void *a, const void *b) {
+  double x = ((const Centroid *)a)->mean;
+  double y = ((const Centroid *)b)->mean;
+  return (x > y) - (x < y);
+}
@@ -0,0 +1,43 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+// Streaming statistics of observables, by day and field
+
+#include "common.h"
+
+typedef struct {
+  double mean;
+  double weight;
+} Centroid;
+
+// Statistics of one field on one day
+typedef struct {
+  double mean;
+  double m2;
+  double min;
+  double max;
+  uint64 n_centroids;
+  uint64 n_buffered;
+} StatsCell;
+
+struct _EpiStats {
+  size_t n_days;
+  double compression;
+  // Centroids kept after merging, and values buffered before it
+  size_t max_centroids;
+  size_t buffer_size;
+
+  // Per day
+  uint64 *n;
+  uint64 *n_running;
+
+  // Per day and field, cells[day * N_EPI_FIELDS + field].  Each cell owns
+  // max_centroids + buffer_size entries of the centroid array: first its
+  // centroids, in order of mean, then its buffered values, unsorted.
+  StatsCell *cells;
+  Centroid *centroids;
+
+  // Work space for merging
+  Centroid *scratch;
+};
+
+#endif
@@ -0,0 +1,230 @@
+#include "thread_pool.h"
+
+#include <pthread.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+struct ThreadPool {
+  size_t n_threads;
+  pthread_t *workers;
+
+  pthread_mutex_t lock;
+  pthread_cond_t work_ready;
+  pthread_cond_t work_done;
+
+  // Current parallel loop, protected by lock
+  size_t generation;
+  bool shutdown;
+  PoolTask task;
+  void *ctx;
+  size_t n_tasks;
+  size_t next_task;
+  size_t chunk;
+  size_t n_busy;
+
+  // Lowest failed task index and its error
+  size_t err_index;
+  EpiError err;
+};
+
+// Take chunks of tasks from the current loop until none are left
+static void pool_work(ThreadPool *pool);
+
+// Worker thread main loop
+static void *pool_worker(void *arg);
+
+size_t available_cpus(void) {
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors > 0 ? (size_t)info.dwNumberOfProcessors : 1;
+#else
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (size_t)n : 1;
+#endif
+}
+
+EpiError create_thread_pool(ThreadPool **out, size_t n_threads) {
+  if (out == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  if (n_threads == 0) {
+    n_threads = available_cpus();
+  }
+
+  ThreadPool *pool = (ThreadPool *)calloc(1, sizeof(ThreadPool));
+  if (pool == NULL) {
+    return EPI_ERROR_OUT_OF_MEMORY;
+  }
+  pool->n_threads = n_threads;
+
+  if (n_threads > 1) {
+    pool->workers = (pthread_t *)calloc(n_threads - 1, sizeof(pthread_t));
+    if (pool->workers == NULL) {
+      free(pool);
+      return EPI_ERROR_OUT_OF_MEMORY;
+    }
+  }
+
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work_ready, NULL);
+  pthread_cond_init(&pool->work_done, NULL);
+
+  for (size_t i = 0; i + 1 < n_threads; i++) {
+    if (pthread_create(&pool->workers[i], NULL, pool_worker, pool) != 0) {
+      // Run with the threads we managed to start
+      pool->n_threads = i + 1;
+      break;
+    }
+  }
+
+  *out = pool;
+  return EPI_ERROR_SUCCESS;
+}
+
+EpiError free_thread_pool(ThreadPool **pool) {
+  if (pool == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  if (*pool == NULL) {
+    return EPI_ERROR_SUCCESS;
+  }
+
+  ThreadPool *p = *pool;
+  pthread_mutex_lock(&p->lock);
+  p->shutdown = true;
+  pthread_cond_broadcast(&p->work_ready);
+  pthread_mutex_unlock(&p->lock);
+
+  for (size_t i = 0; i + 1 < p->n_threads; i++) {
+    pthread_join(p->workers[i], NULL);
+  }
+
+  pthread_cond_destroy(&p->work_done);
+  pthread_cond_destroy(&p->work_ready);
+  pthread_mutex_destroy(&p->lock);
+  free(p->workers);
+  free(p);
+  *pool = NULL;
+  return EPI_ERROR_SUCCESS;
+}
+
+size_t thread_pool_size(const ThreadPool *pool) {
+  return pool == NULL ? 1 : pool->n_threads;
+}
+
+EpiError thread_pool_run(ThreadPool *pool, size_t n_tasks, PoolTask task,
+  void *ctx) {
+
+  if (pool == NULL || task == NULL) {
+    return EPI_ERROR_INVALID_ARGS;
+  }
+
+  // Nothing to share: run inline
+  if (pool->n_threads == 1 || n_tasks <= 1) {
+    for (size_t i = 0; i < n_tasks; i++) {
+      PASS_ERROR(task(ctx, i));
+    }
+    return EPI_ERROR_SUCCESS;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->task = task;
+  pool->ctx = ctx;
+  pool->n_tasks = n_tasks;
+  pool->next_task = 0;
+  // Several chunks per thread, to even out tasks of different cost
+  pool->chunk = n_tasks / (8 * pool->n_threads);
+  if (pool->chunk == 0) {
+    pool->chunk = 1;
+  }
+  pool->n_busy = pool->n_threads;
+  pool->err_index = n_tasks;
+  pool->err = EPI_ERROR_SUCCESS;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->work_ready);
+  pthread_mutex_unlock(&pool->lock);
+
+  pool_work(pool);
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->n_busy > 0) {
+    pthread_cond_wait(&pool->work_done, &pool->lock);
+  }
+  EpiError err = pool->err;
+  pool->task = NULL;
+  pthread_mutex_unlock(&pool->lock);
+
+  return err;
+}
+
+static void pool_work(ThreadPool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  PoolTask task = pool->task;
+  void *ctx = pool->ctx;
+
+  for (;;) {
+    size_t begin = pool->next_task;
+    if (begin >= pool->n_tasks) {
+      break;
+    }
+    size_t end = begin + pool->chunk;
+    if (end > pool->n_tasks) {
+      end = pool->n_tasks;
+    }
+    pool->next_task = end;
+    pthread_mutex_unlock(&pool->lock);
+
+    size_t err_index = end;
+    EpiError err = EPI_ERROR_SUCCESS;
+    for (size_t i = begin; i < end; i++) {
+      err = task(ctx, i);
+      if (err != EPI_ERROR_SUCCESS) {
+        err_index = i;
+        break;
+      }
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (err != EPI_ERROR_SUCCESS && err_index < pool->err_index) {
+      pool->err_index = err_index;
+      pool->err = err;
+    }
+  }
+
+  pool->n_busy--;
+  if (pool->n_busy == 0) {
+    pthread_cond_signal(&pool->work_done);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static void *pool_worker(void *arg) {
+  ThreadPool *pool = (ThreadPool *)arg;
+  size_t seen = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (!pool->shutdown && pool->generation == seen) {
+      pthread_cond_wait(&pool->work_ready, &pool->lock);
+    }
+    if (pool->shutdown) {
+      break;
+    }
+    seen = pool->generation;
+    pthread_mutex_unlock(&pool->lock);
+
+    pool_work(pool);
+
+    pthread_mutex_lock(&pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  return NULL;
+}
@@ -0,0 +1,35 @@
+#ifndef __THREAD_POOL_H__
+#define __THREAD_POOL_H__
+// Fixed-size pool of worker threads for data-parallel loops.
+// The calling thread takes part in the work, so a pool of size 1 runs
+// everything inline without creating any threads.
+
+#include "common.h"
+
+// Task run by the pool for one index of a parallel loop.  Tasks for
+// different indices must not write to shared state.
+typedef EpiError (*PoolTask)(void *ctx, size_t i);
+
+typedef struct ThreadPool ThreadPool;
+
+// Create a pool of n_threads threads, including the calling thread.
+// n_threads == 0 means one thread per available CPU.
+EpiError create_thread_pool(ThreadPool **out, size_t n_threads);
+
+// Stop worker threads and free the pool.  Nulls the pool pointer.
+EpiError free_thread_pool(ThreadPool **pool);
+
+// Number of threads in the pool, including the calling thread
+size_t thread_pool_size(const ThreadPool *pool);
+
+// Run task(ctx, i) for every i in [0, n_tasks), spread over the pool, and
+// wait for all of them to finish.  If any tasks fail, returns the error
+// from the failed task with the lowest index, so that the result does not
+// depend on the number of threads.
+EpiError thread_pool_run(ThreadPool *pool, size_t n_tasks, PoolTask task,
+  void *ctx);
+
+// Number of CPUs available to this process
+size_t available_cpus(void);
+
+#endif
@@ -10,14 +10,41 @@ cdef extern from "stdbool.h":
     ctypedef bint bool
 
 cimport cepi_model
+from cpython.buffer cimport PyBUF_FORMAT, PyBUF_WRITABLE
+from libc.stdlib cimport malloc, free
+
+import mmap
+import os
+import random
+import threading
+
+import numpy as np
 
 def HandleError(cepi_model.EpiError err):
     if err is cepi_model.EpiError.EPI_ERROR_SUCCESS:
         return
     if err is cepi_model.EpiError.EPI_ERROR_OUT_OF_MEMORY:
         raise MemoryError()
-    # TODO: add remaining error handling cases
-    raise ValueError()
+    cdef cepi_model.EpiErrorInfo info
+    cepi_model.epi_last_error(&info)
+    if info.err != err:
+        # TODO: add remaining error handling cases
+        raise ValueError()
+    where = info.fname.decode(errors="replace")
+    if info.line > 0:
+        where += ":%d:%d" % (info.line, info.column)
+    message = "%s: %s" % (where, info.message.decode(errors="replace"))
+    if err is cepi_model.EpiError.EPI_ERROR_FILE_NOT_FOUND:
+        raise FileNotFoundError(message)
+    raise ValueError(message)
+
+# Binomial sampling methods
+SAMPLER_APPROX = cepi_model.EPI_SAMPLER_APPROX
+SAMPLER_EXACT = cepi_model.EPI_SAMPLER_EXACT
+
+# Simulation engines
+ENGINE_COMPARTMENT = cepi_model.EPI_ENGINE_COMPARTMENT
+ENGINE_AGENT = cepi_model.EPI_ENGINE_AGENT
 
 class EpiScenario:
     t_initial = 0
@@ -26,11 +53,103 @@ class EpiScenario:
     t_max = -1
     dis_fname = b"./dat/disease.dat"
     pop_fname = b"./dat/population.dat"
+    # Age structure data file, None = homogeneous population.  Use together
+    # with dis_fname = b"./dat/disease_age.dat" for age-dependent severity.
+    age_fname = None
+    # Random number generator seed, None = pick one at random
+    seed = None
+    # Sampling method for random draws
+    sampler = SAMPLER_APPROX
+    # Deterministic mean-field mode: replace random draws by expectation values
+    mean_field = False
+    # Simulation engine.  The agent engine simulates every person, and is
+    # meant for small populations such as pop_fname = b"./dat/town.dat".
+    engine = ENGINE_COMPARTMENT
+    # Number of threads for engines that step in parallel, 0 = one per CPU
+    n_threads = 1
+
+# Action bit flags for EpiVecEnv.step
+ACTION_DIST_RECOMMEND = cepi_model.EPI_ACTION_DIST_RECOMMEND
+ACTION_DIST_HOME_SYMP = cepi_model.EPI_ACTION_DIST_HOME_SYMP
+ACTION_DIST_HOME_ALL = cepi_model.EPI_ACTION_DIST_HOME_ALL
+ACTION_SCHOOLS_CLOSED = cepi_model.EPI_ACTION_SCHOOLS_CLOSED
+N_ACTIONS = cepi_model.N_EPI_ACTIONS
+# Observations per model from EpiVecEnv: fractions susceptible, infected and
+# dead, critical cases per hospital bed, and vaccine availability
+N_OBSERVATIONS = cepi_model.N_EPI_OBSERVATIONS
+
+# Phases of a model step, in the order of EpiPhase, as named in the dicts of
+# EpiModel.profile() and in traces
+PHASE_NAMES = ("step", "vaccination", "transitions", "infection_rate",
+    "infection", "observables", "recording")
 
 class EpiInput:
     dist_recommend = False
     dist_home_symp = False
     dist_home_all = False
+    schools_closed = False
+    travel_restrict = False
+
+cdef fill_input(cepi_model.EpiInput *inp, input):
+    inp.dist_recommend = input.dist_recommend
+    inp.dist_home_symp = input.dist_home_symp
+    inp.dist_home_all = input.dist_home_all
+    inp.schools_closed = input.schools_closed
+    inp.travel_restrict = input.travel_restrict
+
+cdef fill_schedule(cepi_model.EpiScheduleEntry *entries, schedule):
+    # Entries from a sequence of (t_start, t_end, EpiInput) tuples
+    for i, (t_start, t_end, input) in enumerate(schedule):
+        entries[i].t_start = t_start
+        entries[i].t_end = t_end
+        fill_input(&entries[i].input, input)
+
+cdef fill_batch_config(cepi_model.EpiBatchConfig *config, scenario,
+        p_no_outbreak, no_outbreak_days, start_day, vaccine_delay):
+    # Episodes drawn at random around a template scenario
+    config.scenario.t_initial = 0
+    config.scenario.n_initial = scenario.n_initial
+    config.scenario.t_vaccine = 0
+    config.scenario.t_max = scenario.t_max
+    config.scenario.dis_fname = scenario.dis_fname
+    config.scenario.pop_fname = scenario.pop_fname
+    if scenario.age_fname is None:
+        config.scenario.age_fname = NULL
+    else:
+        config.scenario.age_fname = scenario.age_fname
+    config.scenario.seed = 0
+    config.scenario.sampler = scenario.sampler
+    config.scenario.mean_field = scenario.mean_field
+    config.scenario.engine = scenario.engine
+    config.scenario.n_threads = scenario.n_threads
+    config.p_no_outbreak = p_no_outbreak
+    config.no_outbreak_days = no_outbreak_days
+    config.t_initial_min = start_day[0]
+    config.t_initial_max = start_day[1]
+    config.vaccine_delay_min = vaccine_delay[0]
+    config.vaccine_delay_max = vaccine_delay[1]
+
+cdef fill_scenario(cepi_model.EpiScenario *sc, scenario):
+    # File names point into the scenario's bytes objects, which must be kept
+    # alive for as long as the model uses them
+    sc.t_initial = scenario.t_initial
+    sc.n_initial = scenario.n_initial
+    sc.t_vaccine = scenario.t_vaccine
+    sc.t_max = scenario.t_max
+    sc.dis_fname = scenario.dis_fname
+    sc.pop_fname = scenario.pop_fname
+    if scenario.age_fname is None:
+        sc.age_fname = NULL
+    else:
+        sc.age_fname = scenario.age_fname
+    if scenario.seed is None:
+        sc.seed = random.getrandbits(64)
+    else:
+        sc.seed = scenario.seed
+    sc.sampler = scenario.sampler
+    sc.mean_field = scenario.mean_field
+    sc.engine = scenario.engine
+    sc.n_threads = scenario.n_threads
 
 class EpiObservables:
     day = 0
@@ -59,43 +178,879 @@ class EpiObservables:
         self.n_dead = obs.n_dead
         self.cost_function = obs.cost_function
 
+# NumPy layout of the C observables struct, for EpiModel.observables
+OBSERVABLE_DTYPE = np.dtype([("day", np.uintp), ("finished", np.bool_),
+    ("vaccine_available", np.bool_), ("hosp_capacity", np.uint64),
+    ("n_susceptible", np.uint64), ("n_infected", np.uint64),
+    ("n_critical", np.uint64), ("n_recovered", np.uint64),
+    ("n_vaccinated", np.uint64), ("n_dead", np.uint64),
+    ("cost_function", np.float32)], align=True)
+
+cdef check_observable_dtype():
+    cdef cepi_model.EpiObservable o
+    cdef char *base = <char *>&o
+    offsets = (<char *>&o.day - base, <char *>&o.finished - base,
+        <char *>&o.vaccine_available - base, <char *>&o.hosp_capacity - base,
+        <char *>&o.n_susceptible - base, <char *>&o.n_infected - base,
+        <char *>&o.n_critical - base, <char *>&o.n_recovered - base,
+        <char *>&o.n_vaccinated - base, <char *>&o.n_dead - base,
+        <char *>&o.cost_function - base)
+    if (OBSERVABLE_DTYPE.itemsize != sizeof(cepi_model.EpiObservable) or
+            offsets != tuple(OBSERVABLE_DTYPE.fields[name][1]
+            for name in OBSERVABLE_DTYPE.names)):
+        raise ImportError("OBSERVABLE_DTYPE does not match EpiObservable")
+
+check_observable_dtype()
+
+cdef class _ObservableBuffer:
+    # Observables of a model, exported read-only to NumPy views
+    cdef cepi_model.EpiObservable obs
+    cdef Py_ssize_t size
+
+    def __cinit__(self):
+        self.size = sizeof(cepi_model.EpiObservable)
+
+    def __getbuffer__(self, Py_buffer *buffer, int flags):
+        if flags & PyBUF_WRITABLE:
+            raise BufferError("observables are read-only")
+        buffer.buf = &self.obs
+        buffer.obj = self
+        buffer.len = self.size
+        buffer.readonly = 1
+        buffer.itemsize = 1
+        buffer.format = NULL
+        if flags & PyBUF_FORMAT:
+            buffer.format = "B"
+        buffer.ndim = 1
+        buffer.shape = &self.size
+        buffer.strides = &buffer.itemsize
+        buffer.suboffsets = NULL
+        buffer.internal = NULL
+
+    def __releasebuffer__(self, Py_buffer *buffer):
+        pass
+
+cdef class _BinBuffer:
+    # Day bin array of a model, exported read-only to NumPy views.  Keeps
+    # the model alive for as long as views exist.
+    cdef object model
+    cdef const cepi_model.uint64 *data
+    cdef Py_ssize_t n_bins
+
+    def __getbuffer__(self, Py_buffer *buffer, int flags):
+        if flags & PyBUF_WRITABLE:
+            raise BufferError("day bins are read-only")
+        buffer.buf = <void *>self.data
+        buffer.obj = self
+        buffer.len = self.n_bins * sizeof(cepi_model.uint64)
+        buffer.readonly = 1
+        buffer.itemsize = sizeof(cepi_model.uint64)
+        buffer.format = NULL
+        if flags & PyBUF_FORMAT:
+            buffer.format = "Q"
+        buffer.ndim = 1
+        buffer.shape = &self.n_bins
+        buffer.strides = &buffer.itemsize
+        buffer.suboffsets = NULL
+        buffer.internal = NULL
+
+    def __releasebuffer__(self, Py_buffer *buffer):
+        pass
+
+cdef bin_view(model, const cepi_model.uint64 *data, size_t n_bins):
+    cdef _BinBuffer buf = _BinBuffer()
+    buf.model = model
+    buf.data = data
+    buf.n_bins = n_bins
+    return np.frombuffer(buf, np.uint64)
+
+cdef fill_observable(cepi_model.EpiObservable *out, obs):
+    out.day = obs.day
+    out.finished = obs.finished
+    out.vaccine_available = obs.vaccine_available
+    out.hosp_capacity = obs.hosp_capacity
+    out.n_susceptible = obs.n_susceptible
+    out.n_infected = obs.n_infected
+    out.n_critical = obs.n_critical
+    out.n_recovered = obs.n_recovered
+    out.n_vaccinated = obs.n_vaccinated
+    out.n_dead = obs.n_dead
+    out.cost_function = obs.cost_function
+
+def clear_cache():
+    # Drop data files cached by the model library, e.g. to free memory
+    HandleError(cepi_model.epi_clear_cache())
+
+# Scenario fields kept by models, for pickling
+SCENARIO_FIELDS = ("t_initial", "n_initial", "t_vaccine", "t_max",
+    "dis_fname", "pop_fname", "age_fname", "seed", "sampler", "mean_field",
+    "engine", "n_threads")
+
+def _scenario_from_fields(fields):
+    scenario = EpiScenario()
+    for name, value in fields.items():
+        setattr(scenario, name, value)
+    return scenario
+
+def _rebuild_model(fields, reset_fields, snapshot):
+    # Unpickle a model: construct it from its scenario, repeat the last
+    # reset, if any, then restore state
+    model = EpiModel(_scenario_from_fields(fields))
+    if reset_fields is not None:
+        model.reset(_scenario_from_fields(reset_fields))
+    model.restore(snapshot)
+    return model
+
+cdef class Recorder:
+    # Writes the observables of every step of a model to a trajectory file,
+    # for TrajectoryFile.  Verbose recorders also write the day bins of the
+    # population.  Rows are written buffer_rows at a time, 0 for the
+    # default.  Attach to a model with EpiModel.record().
+    cdef cepi_model.EpiRecorder _c_rec
+    # Attached to a model
+    cdef bint _in_use
+
+    def __cinit__(self, fname, verbose=False, buffer_rows=0):
+        HandleError(cepi_model.epi_recorder_create(&self._c_rec,
+            os.fsencode(fname), verbose, buffer_rows))
+
+    def __dealloc__(self):
+        cepi_model.epi_recorder_free(&self._c_rec)
+
+    def append(self, obs):
+        # Write the EpiObservables of one step, for recorders that are not
+        # verbose
+        cdef cepi_model.EpiObservable c_obs
+        fill_observable(&c_obs, obs)
+        HandleError(cepi_model.epi_recorder_append(self._c_rec, &c_obs))
+
+    def flush(self):
+        # Write buffered rows now, so that readers see them
+        HandleError(cepi_model.epi_recorder_flush(self._c_rec))
+
+    def close(self):
+        if self._in_use:
+            raise ValueError("recorder is attached to a model")
+        HandleError(cepi_model.epi_recorder_free(&self._c_rec))
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+# NumPy types of trajectory file columns, by kind and size
+_TRAJ_DTYPES = {(b"u", 8): np.uint64, (b"f", 4): np.float32,
+    (b"b", 1): np.bool_}
+_TRAJ_HEADER = np.dtype([("magic", "u4"), ("version", "u4"),
+    ("n_columns", "u4"), ("n_bins", "u4")])
+_TRAJ_COLUMN = np.dtype([("name", "S24"), ("kind", "S1"), ("size", "u1"),
+    ("reserved", "u1", 2), ("width", "u4")])
+_TRAJ_SEGMENT = np.dtype([("magic", "u4"), ("reserved", "u4"),
+    ("n_rows", "u8")])
+
+class TrajectoryFile:
+    # Trajectory file written by a Recorder, mapped into memory.  Columns
+    # are NumPy arrays that use the mapping in place, without copying: one
+    # element per step, or for the day bins of verbose files, one row of
+    # n_bins bins per step.  A file may be read while it is being recorded,
+    # and shows the rows written up to when it was opened.
+    def __init__(self, fname):
+        with open(fname, "rb") as f:
+            size = f.seek(0, 2)
+            if size < _TRAJ_HEADER.itemsize:
+                raise ValueError(fname + ": not a trajectory file")
+            self._map = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+
+        header = np.frombuffer(self._map, _TRAJ_HEADER, 1)[0]
+        if header["magic"] != 0x54495045 or header["version"] != 1:
+            raise ValueError(fname + ": not a trajectory file")
+        self.n_bins = int(header["n_bins"])
+        offset = _TRAJ_HEADER.itemsize
+        columns = np.frombuffer(self._map, _TRAJ_COLUMN,
+            header["n_columns"], offset)
+        offset += columns.nbytes
+        layout = [(c["name"].decode(), _TRAJ_DTYPES[c["kind"], c["size"]],
+            int(c["width"]), int(c["size"])) for c in columns]
+        self.columns = tuple(name for name, _, _, _ in layout)
+        self._dtypes = {name: dtype for name, dtype, _, _ in layout}
+
+        # Each segment is a dict of columns.  A segment cut short while
+        # being written ends the file.
+        self.segments = []
+        while offset + _TRAJ_SEGMENT.itemsize <= size:
+            seg = np.frombuffer(self._map, _TRAJ_SEGMENT, 1, offset)[0]
+            n_rows = int(seg["n_rows"])
+            end = offset + _TRAJ_SEGMENT.itemsize
+            for _, _, width, item in layout:
+                end += (n_rows * width * item + 7) & ~7
+            if seg["magic"] != 0x53495045 or end > size:
+                break
+
+            offset += _TRAJ_SEGMENT.itemsize
+            segment = {}
+            for name, dtype, width, item in layout:
+                column = np.frombuffer(self._map, dtype, n_rows * width,
+                    offset)
+                if name.startswith("bins_"):
+                    column = column.reshape(n_rows, width)
+                segment[name] = column
+                offset += (n_rows * width * item + 7) & ~7
+            self.segments.append(segment)
+
+    def __len__(self):
+        return sum(len(seg["day"]) for seg in self.segments)
+
+    def __getitem__(self, name):
+        # Whole column.  Files of more than one segment are joined, which
+        # copies them; use segments to avoid that.
+        if name not in self.columns:
+            raise KeyError(name)
+        if len(self.segments) == 1:
+            return self.segments[0][name]
+        if len(self.segments) == 0:
+            shape = (0, self.n_bins) if name.startswith("bins_") else 0
+            return np.empty(shape, self._dtypes[name])
+        return np.concatenate([seg[name] for seg in self.segments])
+
 cdef class EpiModel:
     cdef cepi_model.EpiModel _c_model
+    # Scenario fields on construction and on the last reset, with the seeds
+    # that were actually used
+    cdef dict _fields
+    cdef object _reset_fields
+    cdef Recorder _recorder
+    # Observables filled in by observe() and step_observe(), and a NumPy
+    # view of them
+    cdef _ObservableBuffer _obs
+    cdef readonly object observables
+
+    def __cinit__(self, scenario=None):
+        self._obs = _ObservableBuffer()
+        self.observables = np.frombuffer(self._obs,
+            OBSERVABLE_DTYPE).reshape(())
+        if scenario is None:
+            # Empty model, filled in by clone()
+            return
 
-    def __cinit__(self, scenario):
         cdef cepi_model.EpiScenario sc
+        fill_scenario(&sc, scenario)
 
-        sc.t_initial = scenario.t_initial
-        sc.n_initial = scenario.n_initial
-        sc.t_vaccine = scenario.t_vaccine
-        sc.t_max = scenario.t_max
-        sc.dis_fname = scenario.dis_fname
-        sc.pop_fname = scenario.pop_fname
+        cdef cepi_model.EpiError err
+        with nogil:
+            err = cepi_model.epi_construct_model(&self._c_model, &sc)
+        HandleError(err)
+
+        self._fields = {name: getattr(scenario, name)
+            for name in SCENARIO_FIELDS}
+        self._fields["seed"] = sc.seed
 
+    def reset(self, scenario):
+        # Start over with a new scenario for the same data files and engine,
+        # without reading any files.  Faster than constructing a new model.
+        cdef cepi_model.EpiScenario sc
         cdef cepi_model.EpiError err
-        err = cepi_model.epi_construct_model(&self._c_model, &sc)
+        fill_scenario(&sc, scenario)
+        with nogil:
+            err = cepi_model.epi_reset_model(self._c_model, &sc)
         HandleError(err)
 
+        self._reset_fields = {name: getattr(scenario, name)
+            for name in SCENARIO_FIELDS}
+        self._reset_fields["seed"] = sc.seed
+
     def __dealloc__(self):
         cepi_model.epi_free_model(&self._c_model)
+        if self._recorder is not None:
+            self._recorder._in_use = False
+
+    def record(self, Recorder recorder):
+        # Write observables after every step to recorder, until it is
+        # replaced, or set to None.  A recorder records one model at a time.
+        # Verbose recording needs the compartment engine without mean-field
+        # mode or age strata.
+        cdef cepi_model.EpiRecorder c_rec = NULL
+        if recorder is not None:
+            if recorder._c_rec == NULL:
+                raise ValueError("recorder is closed")
+            if recorder._in_use and recorder is not self._recorder:
+                raise ValueError("recorder is attached to another model")
+            c_rec = recorder._c_rec
+        HandleError(cepi_model.epi_model_set_recorder(self._c_model, c_rec))
+
+        if self._recorder is not None:
+            self._recorder._in_use = False
+        self._recorder = recorder
+        if recorder is not None:
+            recorder._in_use = True
 
     def step(self, input):
+        # Runs without the GIL, so that other Python threads can step other
+        # models at the same time.  A model must not be used from two
+        # threads at once.
         cdef cepi_model.EpiInput inp
 
-        inp.dist_recommend = input.dist_recommend
-        inp.dist_home_symp = input.dist_home_symp
-        inp.dist_home_all = input.dist_home_all
+        fill_input(&inp, input)
+
+        cdef cepi_model.EpiError err
+        with nogil:
+            err = cepi_model.epi_model_step(self._c_model, &inp)
+        HandleError(err)
+
+    def observe(self, float[::1] out=None):
+        # Update observables, a read-only NumPy view with fields named as
+        # in EpiObservables, and return it.  With out, also write the
+        # N_OBSERVATIONS observations of EpiVecEnv to it.  Allocates
+        # nothing, so the view and out change with every call.
+        cdef float *c_out = NULL
+        cdef cepi_model.EpiError err
+        if out is not None:
+            if out.shape[0] < N_OBSERVATIONS:
+                raise ValueError("out has room for too few observations")
+            c_out = &out[0]
+        with nogil:
+            err = cepi_model.epi_get_observables(&self._obs.obs,
+                self._c_model)
+            if err == cepi_model.EPI_ERROR_SUCCESS and c_out != NULL:
+                err = cepi_model.epi_rl_observation(c_out, &self._obs.obs)
+        HandleError(err)
+        return self.observables
 
+    def step_observe(self, input, float[::1] out=None):
+        # step(input), then observe(out), in a single call
+        cdef cepi_model.EpiInput inp
+        cdef float *c_out = NULL
+        cdef cepi_model.EpiError err
+        fill_input(&inp, input)
+        if out is not None:
+            if out.shape[0] < N_OBSERVATIONS:
+                raise ValueError("out has room for too few observations")
+            c_out = &out[0]
+        with nogil:
+            err = cepi_model.epi_model_step(self._c_model, &inp)
+            if err == cepi_model.EPI_ERROR_SUCCESS:
+                err = cepi_model.epi_get_observables(&self._obs.obs,
+                    self._c_model)
+            if err == cepi_model.EPI_ERROR_SUCCESS and c_out != NULL:
+                err = cepi_model.epi_rl_observation(c_out, &self._obs.obs)
+        HandleError(err)
+        return self.observables
+
+    def advance_until_event(self, input, max_days=1000000):
+        # Step with the same input through days on which nothing happens
+        # (before the outbreak, the vaccine or the end of the scenario), and
+        # then one more day, up to max_days days in all.  Quiet days are
+        # skipped at once by the compartment engine.  Returns the number of
+        # days stepped and the sum of their cost_function observables.
+        cdef cepi_model.EpiInput inp
+        cdef size_t c_max_days = max_days
+        cdef size_t n_days = 0
+        cdef double cost = 0.0
         cdef cepi_model.EpiError err
-        err = cepi_model.epi_model_step(self._c_model, &inp)
+        fill_input(&inp, input)
+        with nogil:
+            err = cepi_model.epi_model_advance_until_event(&n_days, &cost,
+                self._c_model, &inp, c_max_days)
         HandleError(err)
+        return n_days, cost
+
+    def day_bins(self):
+        # Read-only NumPy views of the day bins of the population, by name,
+        # which follow the model as it steps.  Bins are a ring buffer: day
+        # of disease d is in bin (bin_head + d) % len(bins).  Only for the
+        # compartment engine without mean-field mode or age strata.
+        cdef cepi_model.EpiDayBins bins
+        HandleError(cepi_model.epi_get_day_bins(&bins, self._c_model))
+        return {"n_total_active": bin_view(self, bins.n_total_active,
+                bins.n_bins),
+            "n_asymptomatic": bin_view(self, bins.n_asymptomatic, bins.n_bins),
+            "n_symptomatic": bin_view(self, bins.n_symptomatic, bins.n_bins),
+            "n_critical": bin_view(self, bins.n_critical, bins.n_bins)}
+
+    @property
+    def bin_head(self):
+        # Bin of day of disease 0 in the views of day_bins()
+        cdef cepi_model.EpiDayBins bins
+        HandleError(cepi_model.epi_get_day_bins(&bins, self._c_model))
+        return bins.head
+
+    def profile(self):
+        # Draws by sampling method, rejection retries, and time spent in
+        # each phase of a step since construction or reset_profile().  Only
+        # collected if the library is built with EPI_PROFILE defined, e.g.
+        # CFLAGS=-DEPI_PROFILE python setup.py build_ext -i; otherwise,
+        # "enabled" is False and everything else is 0.
+        cdef cepi_model.EpiProfile prof
+        HandleError(cepi_model.epi_get_profile(&prof, self._c_model))
+        seconds = {}
+        for i, name in enumerate(PHASE_NAMES):
+            seconds[name] = (prof.phase_ticks[i] / prof.ticks_per_second
+                if prof.ticks_per_second > 0 else 0.0)
+        return {"enabled": prof.enabled,
+            "n_steps": prof.n_steps,
+            "n_poisson_draws": prof.n_poisson_draws,
+            "n_gaussian_draws": prof.n_gaussian_draws,
+            "n_monte_carlo_draws": prof.n_monte_carlo_draws,
+            "n_poisson_retries": prof.n_poisson_retries,
+            "n_gaussian_retries": prof.n_gaussian_retries,
+            "phase_seconds": seconds,
+            "phase_calls": {name: prof.phase_calls[i]
+                for i, name in enumerate(PHASE_NAMES)},
+            "phase_ticks": {name: prof.phase_ticks[i]
+                for i, name in enumerate(PHASE_NAMES)},
+            "ticks_per_second": prof.ticks_per_second}
+
+    def reset_profile(self):
+        # Set profile counters and timers to 0, and drop any trace
+        HandleError(cepi_model.epi_reset_profile(self._c_model))
+
+    def start_trace(self, max_events=1000000):
+        # Keep the first max_events timed phases from now on, for
+        # write_trace(), or stop tracing if max_events is 0.  Needs a
+        # profiling build.
+        HandleError(cepi_model.epi_start_trace(self._c_model, max_events))
+
+    def write_trace(self, fname):
+        # Write the trace as Chrome trace-event JSON, for chrome://tracing
+        # or Perfetto
+        HandleError(cepi_model.epi_write_trace(self._c_model,
+            os.fsencode(fname)))
 
     def get_observables(self):
         cdef cepi_model.EpiError err
         cdef cepi_model.EpiObservable output
-        err = cepi_model.epi_get_observables(&output, self._c_model)
+        with nogil:
+            err = cepi_model.epi_get_observables(&output, self._c_model)
         HandleError(err)
 
         out = EpiObservables(output)
 
         return out
+
+    def clone(self):
+        # Independent copy of the model in its current state.  Both give
+        # identical results for the same inputs.
+        cdef EpiModel copy = EpiModel()
+        cdef cepi_model.EpiError err
+        with nogil:
+            err = cepi_model.epi_clone_model(&copy._c_model, self._c_model)
+        HandleError(err)
+        copy._fields = dict(self._fields)
+        copy._reset_fields = self._reset_fields
+        return copy
+
+    def snapshot(self):
+        # Model state as bytes, for restore() on this model or its clones
+        cdef size_t size
+        HandleError(cepi_model.epi_snapshot_size(&size, self._c_model))
+        buf = bytearray(size)
+        cdef unsigned char[::1] view = buf
+        HandleError(cepi_model.epi_snapshot(&view[0], size, self._c_model))
+        return bytes(buf)
+
+    def restore(self, snapshot):
+        # Return to the state saved by snapshot()
+        cdef const unsigned char[::1] view = snapshot
+        HandleError(cepi_model.epi_restore(self._c_model, &view[0],
+            view.shape[0]))
+
+    def __reduce__(self):
+        return (_rebuild_model,
+            (self._fields, self._reset_fields, self.snapshot()))
+
+    def run(self, schedule=(), n_days=None, chunk_days=1024):
+        # Step forward for n_days days, or until the model finishes if
+        # n_days is None, following a schedule of (t_start, t_end, EpiInput)
+        # entries.  Returns a dict of NumPy arrays, one entry per observable
+        # field, with one element per day stepped.
+        cdef size_t n_entries = len(schedule)
+        cdef cepi_model.EpiSchedule sched
+        cdef cepi_model.EpiScheduleEntry *entries = NULL
+        cdef cepi_model.EpiObservable *trajectory = NULL
+        cdef size_t n_steps, n_chunk, i
+        cdef cepi_model.EpiError err
+
+        if n_entries > 0:
+            entries = <cepi_model.EpiScheduleEntry *>malloc(
+                n_entries * sizeof(cepi_model.EpiScheduleEntry))
+        n_chunk = chunk_days if n_days is None else n_days
+        trajectory = <cepi_model.EpiObservable *>malloc(
+            max(n_chunk, 1) * sizeof(cepi_model.EpiObservable))
+        if (n_entries > 0 and entries == NULL) or trajectory == NULL:
+            free(entries)
+            free(trajectory)
+            raise MemoryError()
+
+        fields = ("day", "finished", "vaccine_available", "hosp_capacity",
+            "n_susceptible", "n_infected", "n_critical", "n_recovered",
+            "n_vaccinated", "n_dead", "cost_function")
+        chunks = {f: [] for f in fields}
+        try:
+            fill_schedule(entries, schedule)
+            sched.n_entries = n_entries
+            sched.entries = entries
+
+            while True:
+                with nogil:
+                    err = cepi_model.epi_model_run(trajectory, &n_steps,
+                        self._c_model, &sched, n_chunk)
+                HandleError(err)
+
+                day = np.empty(n_steps, dtype=np.uint64)
+                finished = np.empty(n_steps, dtype=np.bool_)
+                vaccine = np.empty(n_steps, dtype=np.bool_)
+                counts = np.empty((7, n_steps), dtype=np.uint64)
+                cost = np.empty(n_steps, dtype=np.float32)
+                for i in range(n_steps):
+                    day[i] = trajectory[i].day
+                    finished[i] = trajectory[i].finished
+                    vaccine[i] = trajectory[i].vaccine_available
+                    counts[0, i] = trajectory[i].hosp_capacity
+                    counts[1, i] = trajectory[i].n_susceptible
+                    counts[2, i] = trajectory[i].n_infected
+                    counts[3, i] = trajectory[i].n_critical
+                    counts[4, i] = trajectory[i].n_recovered
+                    counts[5, i] = trajectory[i].n_vaccinated
+                    counts[6, i] = trajectory[i].n_dead
+                    cost[i] = trajectory[i].cost_function
+                chunks["day"].append(day)
+                chunks["finished"].append(finished)
+                chunks["vaccine_available"].append(vaccine)
+                for j, f in enumerate(fields[3:10]):
+                    chunks[f].append(counts[j])
+                chunks["cost_function"].append(cost)
+
+                if n_days is not None or n_steps < n_chunk:
+                    break
+        finally:
+            free(entries)
+            free(trajectory)
+
+        return {f: np.concatenate(chunks[f]) for f in fields}
+
+cdef class EpiVecEnv:
+    # Many models stepped together in C, with one action per model.  Each
+    # episode draws its outbreak day, vaccine delay and seed at random, and
+    # finished episodes are restarted automatically.
+    cdef cepi_model.EpiBatch _c_batch
+    cdef readonly size_t n_envs
+
+    def __cinit__(self, n_envs, scenario=None, p_no_outbreak=0.5,
+            no_outbreak_days=1000, start_day=(0, 300),
+            vaccine_delay=(400, 700), n_threads=0, seed=None):
+        if scenario is None:
+            scenario = EpiScenario()
+
+        cdef cepi_model.EpiBatchConfig config
+        fill_batch_config(&config, scenario, p_no_outbreak, no_outbreak_days,
+            start_day, vaccine_delay)
+
+        if seed is None:
+            seed = random.getrandbits(64)
+
+        cdef cepi_model.EpiError err
+        err = cepi_model.epi_batch_construct(&self._c_batch, &config, n_envs,
+            n_threads, seed)
+        HandleError(err)
+        self.n_envs = n_envs
+
+    def __dealloc__(self):
+        cepi_model.epi_batch_free(&self._c_batch)
+
+    def reset(self):
+        # Start a new episode everywhere, returns observations
+        cdef cepi_model.EpiError err
+        with nogil:
+            err = cepi_model.epi_batch_reset(self._c_batch)
+        HandleError(err)
+        return self.observations()
+
+    def observations(self):
+        # Current observations, array of shape (n_envs, N_OBSERVATIONS)
+        obs = np.empty((self.n_envs, N_OBSERVATIONS), dtype=np.float32)
+        cdef float[:, ::1] obs_view = obs
+        HandleError(cepi_model.epi_batch_get_observables(&obs_view[0, 0],
+            self._c_batch))
+        return obs
+
+    def step(self, actions):
+        # Apply one action per model, a combination of ACTION_* flags.
+        # Returns observations, rewards and done flags.  Where an episode has
+        # finished, the observations are those of the next episode.
+        actions = np.ascontiguousarray(actions, dtype=np.uint32)
+        if actions.shape != (self.n_envs,):
+            raise ValueError()
+        obs = np.empty((self.n_envs, N_OBSERVATIONS), dtype=np.float32)
+        rewards = np.empty(self.n_envs, dtype=np.float32)
+        dones = np.empty(self.n_envs, dtype=np.uint8)
+
+        cdef cepi_model.uint32_t[::1] actions_view = actions
+        cdef float[:, ::1] obs_view = obs
+        cdef float[::1] rewards_view = rewards
+        cdef unsigned char[::1] dones_view = dones
+
+        cdef cepi_model.EpiError err
+        with nogil:
+            err = cepi_model.epi_batch_step(self._c_batch, &actions_view[0],
+                &obs_view[0, 0], &rewards_view[0], <bool *>&dones_view[0])
+        HandleError(err)
+
+        return obs, rewards, dones.view(np.bool_)
+
+cdef class ThreadPool:
+    # Worker threads for run_many(), n_threads = 0 for one per CPU.  Calls
+    # from several Python threads take turns.
+    cdef cepi_model.EpiThreadPool _c_pool
+    cdef object _lock
+
+    def __cinit__(self, n_threads=0):
+        HandleError(cepi_model.epi_thread_pool_create(&self._c_pool,
+            n_threads))
+        self._lock = threading.Lock()
+
+    def __dealloc__(self):
+        cepi_model.epi_thread_pool_free(&self._c_pool)
+
+_default_pool = None
+
+def run_many(models, inputs, ThreadPool pool=None):
+    # Step every model by one day, models[i] with inputs[i], on the threads
+    # of pool (by default, one per CPU) without holding the GIL.  The models
+    # must all be different.  Returns a list of EpiObservables.
+    global _default_pool
+    cdef size_t n_models = len(models)
+    cdef size_t i
+    cdef EpiModel model
+    cdef cepi_model.EpiModel *c_models = NULL
+    cdef cepi_model.EpiInput *c_inputs = NULL
+    cdef cepi_model.EpiObservable *out = NULL
+    cdef cepi_model.EpiError err
+
+    if len(inputs) != n_models:
+        raise ValueError("need one input per model")
+    if len(set(map(id, models))) != n_models:
+        raise ValueError("models must all be different")
+    if n_models == 0:
+        return []
+    if pool is None:
+        if _default_pool is None:
+            _default_pool = ThreadPool()
+        pool = _default_pool
+
+    c_models = <cepi_model.EpiModel *>malloc(
+        n_models * sizeof(cepi_model.EpiModel))
+    c_inputs = <cepi_model.EpiInput *>malloc(
+        n_models * sizeof(cepi_model.EpiInput))
+    out = <cepi_model.EpiObservable *>malloc(
+        n_models * sizeof(cepi_model.EpiObservable))
+    try:
+        if c_models == NULL or c_inputs == NULL or out == NULL:
+            raise MemoryError()
+        for i in range(n_models):
+            model = models[i]
+            c_models[i] = model._c_model
+            fill_input(&c_inputs[i], inputs[i])
+
+        with pool._lock:
+            with nogil:
+                err = cepi_model.epi_step_models(out, c_models, c_inputs,
+                    n_models, pool._c_pool)
+        HandleError(err)
+
+        return [EpiObservables(out[i]) for i in range(n_models)]
+    finally:
+        free(c_models)
+        free(c_inputs)
+        free(out)
+
+# Observables summarized by EpiStats, in order
+ENSEMBLE_FIELDS = ("n_susceptible", "n_infected", "n_critical",
+    "n_recovered", "n_vaccinated", "n_dead", "cost_function")
+
+def _stats_from_bytes(data):
+    return EpiStats.deserialize(data)
+
+cdef class EpiStats:
+    # Streaming statistics of observables from many runs, day by day: mean,
+    # variance, extremes and quantile estimates of every field in
+    # ENSEMBLE_FIELDS.  Memory use does not grow with the number of runs.
+    # Statistics from other threads or processes combine with merge(), and
+    # serialize() turns them into bytes, for pickling or for files.
+    # Even quantile queries change the C statistics, by compressing values
+    # buffered for the sketch, so every call takes the lock, and calls from
+    # several Python threads take turns.
+    cdef cepi_model.EpiStats _c_stats
+    cdef object _lock
+
+    def __cinit__(self, n_days=None, compression=0.0):
+        # n_days is None only for deserialize()
+        self._lock = threading.RLock()
+        if n_days is not None:
+            HandleError(cepi_model.epi_stats_create(&self._c_stats, n_days,
+                compression))
+
+    def __dealloc__(self):
+        cepi_model.epi_stats_free(&self._c_stats)
+
+    @property
+    def n_days(self):
+        cdef size_t n_days
+        HandleError(cepi_model.epi_stats_days(&n_days, self._c_stats))
+        return n_days
+
+    def add(self, day, obs):
+        # Record the EpiObservables of one run on one day
+        cdef cepi_model.EpiObservable c_obs
+        fill_observable(&c_obs, obs)
+        with self._lock:
+            HandleError(cepi_model.epi_stats_add(self._c_stats, day, &c_obs))
+
+    def add_trajectory(self, trajectory):
+        # Record the EpiObservables of one run on days 0, 1, ...
+        for day, obs in enumerate(trajectory):
+            self.add(day, obs)
+
+    def merge(self, EpiStats other):
+        # Add everything recorded in other, which must cover the same days
+        # with the same compression.  Locks are taken in a fixed order, so
+        # that a.merge(b) and b.merge(a) on two threads cannot deadlock.
+        cdef cepi_model.EpiError err = cepi_model.EPI_ERROR_SUCCESS
+        first, second = (self, other) if id(self) < id(other) else \
+            (other, self)
+        with first._lock, second._lock:
+            with nogil:
+                err = cepi_model.epi_stats_merge(self._c_stats,
+                    other._c_stats)
+        HandleError(err)
+
+    def quantile(self, field, q):
+        # Estimated q-quantile of a field in ENSEMBLE_FIELDS, as a NumPy
+        # array with one element per day
+        cdef size_t f = ENSEMBLE_FIELDS.index(field)
+        cdef size_t d, days = self.n_days
+        cdef double value
+        out = np.empty(days, dtype=np.float64)
+        cdef double[::1] out_view = out
+        with self._lock:
+            for d in range(days):
+                HandleError(cepi_model.epi_stats_quantile(&value,
+                    self._c_stats, d, <cepi_model.EpiField>f, q))
+                out_view[d] = value
+        return out
+
+    def summary(self, quantiles=()):
+        # Dict of NumPy arrays with one element per day: "n", the number of
+        # runs recorded, "n_running", how many of them had not finished, and
+        # for each field in ENSEMBLE_FIELDS, a dict of "mean", "var", "min",
+        # "max", and the estimated quantile for each q in quantiles.
+        cdef size_t d, f, days = self.n_days
+        cdef cepi_model.EpiStatsDay day
+
+        n = np.empty(days, dtype=np.uint64)
+        n_running = np.empty(days, dtype=np.uint64)
+        stats = np.empty((len(ENSEMBLE_FIELDS), 4, days), dtype=np.float64)
+        cdef double[:, :, ::1] stats_view = stats
+        with self._lock:
+            for d in range(days):
+                HandleError(cepi_model.epi_stats_get(&day, self._c_stats, d))
+                n[d] = day.n
+                n_running[d] = day.n_running
+                for f in range(len(ENSEMBLE_FIELDS)):
+                    stats_view[f, 0, d] = day.fields[f].mean
+                    stats_view[f, 1, d] = day.fields[f].var
+                    stats_view[f, 2, d] = day.fields[f].min
+                    stats_view[f, 3, d] = day.fields[f].max
+
+            result = {"n": n, "n_running": n_running}
+            for f, name in enumerate(ENSEMBLE_FIELDS):
+                result[name] = {"mean": stats[f, 0], "var": stats[f, 1],
+                    "min": stats[f, 2], "max": stats[f, 3]}
+                for q in quantiles:
+                    result[name][q] = self.quantile(name, q)
+        return result
+
+    def serialize(self):
+        # Statistics as bytes, for deserialize() on a machine of the same
+        # byte order
+        cdef size_t size
+        cdef unsigned char[::1] view
+        with self._lock:
+            HandleError(cepi_model.epi_stats_serialized_size(&size,
+                self._c_stats))
+            buf = bytearray(size)
+            view = buf
+            HandleError(cepi_model.epi_stats_serialize(&view[0], size,
+                self._c_stats))
+        return bytes(buf)
+
+    @staticmethod
+    def deserialize(data):
+        # Statistics written by serialize()
+        cdef const unsigned char[::1] view = data
+        cdef EpiStats stats = EpiStats()
+        if view.shape[0] == 0:
+            raise ValueError("empty statistics")
+        HandleError(cepi_model.epi_stats_deserialize(&stats._c_stats,
+            &view[0], view.shape[0]))
+        return stats
+
+    def __reduce__(self):
+        return (_stats_from_bytes, (self.serialize(),))
+
+def run_ensemble(n_replicates, n_days, scenario=None, schedule=(),
+        p_no_outbreak=0.0, no_outbreak_days=1000, start_day=None,
+        vaccine_delay=None, n_threads=0, seed=None, quantiles=(),
+        EpiStats stats=None):
+    # Run n_replicates stochastic replicates for n_days days each, following
+    # a schedule of (t_start, t_end, EpiInput) entries, on native threads.
+    # Outbreak day and vaccine delay are drawn from the inclusive ranges
+    # start_day and vaccine_delay, which default to the fixed days of
+    # scenario.  Results do not depend on n_threads.
+    # Observables are added to stats, if given, which must cover n_days
+    # days, so that runs with different seeds accumulate.  Returns
+    # stats.summary(quantiles) of the run, or of everything in stats.
+    if scenario is None:
+        scenario = EpiScenario()
+    if start_day is None:
+        start_day = (scenario.t_initial, scenario.t_initial)
+    if vaccine_delay is None:
+        delay = scenario.t_vaccine - scenario.t_initial
+        vaccine_delay = (delay, delay)
+    if seed is None:
+        seed = random.getrandbits(64)
+    if stats is None:
+        stats = EpiStats(n_days)
+    elif stats.n_days != n_days:
+        raise ValueError("stats must cover n_days days")
+
+    cdef cepi_model.EpiBatchConfig config
+    fill_batch_config(&config, scenario, p_no_outbreak, no_outbreak_days,
+        start_day, vaccine_delay)
+
+    cdef size_t n_entries = len(schedule)
+    cdef size_t replicates = n_replicates
+    cdef size_t threads = n_threads
+    cdef cepi_model.uint64 c_seed = seed
+    cdef cepi_model.EpiSchedule sched
+    cdef cepi_model.EpiScheduleEntry *entries = NULL
+    cdef cepi_model.EpiError err
+
+    if n_entries > 0:
+        entries = <cepi_model.EpiScheduleEntry *>malloc(
+            n_entries * sizeof(cepi_model.EpiScheduleEntry))
+    try:
+        if n_entries > 0 and entries == NULL:
+            raise MemoryError()
+        fill_schedule(entries, schedule)
+        sched.n_entries = n_entries
+        sched.entries = entries
+
+        with stats._lock:
+            with nogil:
+                err = cepi_model.epi_run_ensemble(stats._c_stats, &config,
+                    &sched, replicates, threads, c_seed)
+        HandleError(err)
+    finally:
+        free(entries)
+
+    return stats.summary(quantiles)
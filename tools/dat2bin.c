@@ -0,0 +1,77 @@
+// Data file converter.
+//
+// Compiles a text disease or population data file into the binary format
+// of src/epi_lib/bin_file.h, which loads without parsing.  The kind of file
+// is recognized by its tokens.  Scenarios take the binary file in place of
+// the text one, in dis_fname or pop_fname.  Binary population files keep
+// only what read_pop_file() reads, not the household and workplace keys of
+// the agent-based engine, which needs the text file.
+//
+// Build from the repository root with:
+//   gcc -std=c99 -O2 -pthread -o dat2bin tools/dat2bin.c -lm
+// Usage:
+//   dat2bin input.dat output.bin
+
+#include "../src/epi_lib/single_source.c"
+
+// Print the position of the last error, and return 1
+static int report_error(EpiError err) {
+  EpiErrorInfo info;
+  epi_last_error(&info);
+  if (info.err != err) {
+    fprintf(stderr, "dat2bin: error %d\n", (int)err);
+  } else if (info.line > 0) {
+    fprintf(stderr, "%s:%zu:%zu: %s\n", info.fname, info.line, info.column,
+      info.message);
+  } else {
+    fprintf(stderr, "%s: %s\n", info.fname, info.message);
+  }
+  return 1;
+}
+
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    fprintf(stderr, "usage: dat2bin input.dat output.bin\n");
+    return 1;
+  }
+  const char *in_fname = argv[1];
+  const char *out_fname = argv[2];
+
+  // Disease files give a duration, population files a head count
+  DataFile *df = NULL;
+  EpiError err = open_data_file(&df, in_fname);
+  if (err != EPI_ERROR_SUCCESS) {
+    return report_error(err);
+  }
+  size_t value;
+  bool is_disease = read_size_token(&value, df, "MAX_DURATION") ==
+    EPI_ERROR_SUCCESS;
+  bool is_pop = read_size_token(&value, df, "N_TOTAL") == EPI_ERROR_SUCCESS;
+  free_data_file(&df);
+
+  if (is_disease) {
+    Disease *dis = NULL;
+    err = create_disease_from_file(&dis, in_fname);
+    if (err == EPI_ERROR_SUCCESS) {
+      err = write_disease_bin(out_fname, dis);
+    }
+    free_disease(&dis);
+  } else if (is_pop) {
+    Population params;
+    err = read_pop_file(&params, in_fname);
+    if (err == EPI_ERROR_SUCCESS) {
+      err = write_pop_bin(out_fname, &params);
+    }
+  } else {
+    fprintf(stderr, "%s: not a disease or population data file\n",
+      in_fname);
+    return 1;
+  }
+
+  if (err != EPI_ERROR_SUCCESS) {
+    return report_error(err);
+  }
+  printf("%s -> %s (%s)\n", in_fname, out_fname,
+    is_disease ? "disease" : "population");
+  return 0;
+}